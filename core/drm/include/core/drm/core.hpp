@@ -2,9 +2,12 @@
 #ifndef CORE_DRM_CORE_HPP
 #define CORE_DRM_CORE_HPP
 
+#include <functional>
+#include <memory>
 #include <queue>
 #include <map>
 #include <unordered_map>
+#include <vector>
 #include <optional>
 
 #include <arch/mem_space.hpp>
@@ -12,6 +15,7 @@
 #include <async/doorbell.hpp>
 #include <async/mutex.hpp>
 #include <async/result.hpp>
+#include <cofiber.hpp>
 #include <helix/memory.hpp>
 
 #include "id-allocator.hpp"
@@ -310,10 +314,89 @@ private:
 	uint32_t _connectorType;
 };
 
+// A region of a framebuffer. x2 and y2 are exclusive (as in drm_clip_rect).
+struct Rect {
+	uint32_t x1;
+	uint32_t y1;
+	uint32_t x2;
+	uint32_t y2;
+
+	bool empty() const {
+		return x1 >= x2 || y1 >= y2;
+	}
+
+	uint32_t width() const {
+		return x2 - x1;
+	}
+
+	uint32_t height() const {
+		return y2 - y1;
+	}
+};
+
+// Damage that accumulated since the last screen update. Overlapping and adjacent
+// rectangles are merged. If there are too many rectangles, only their bounding box is kept.
+struct Damage {
+	static constexpr size_t maxRects = 8;
+
+	bool empty() {
+		return _rects.empty();
+	}
+
+	void add(Rect rect);
+
+	// Returns the accumulated rectangles and resets the damage.
+	std::vector<Rect> take() {
+		return std::move(_rects);
+	}
+
+private:
+	std::vector<Rect> _rects;
+};
+
+// Coalesces the damage of a framebuffer and passes it to the driver at most once per
+// refresh interval, i.e., screen updates are paced like vblanks. While the driver updates
+// the screen, new damage is accumulated for the next update.
+struct DamageScheduler {
+	// 60 Hz.
+	static constexpr uint64_t defaultInterval = 16'666'667;
+
+	using UpdateFunction = std::function<async::result<void>(std::vector<Rect>)>;
+
+	DamageScheduler(uint32_t width, uint32_t height, UpdateFunction update,
+			uint64_t interval = defaultInterval);
+
+	DamageScheduler(const DamageScheduler &) = delete;
+
+	~DamageScheduler();
+
+	DamageScheduler &operator= (const DamageScheduler &) = delete;
+
+	// Rectangles are clipped to the framebuffer. An empty vector damages everything.
+	void add(const std::vector<Rect> &rects);
+
+private:
+	// Shared with _run() such that the scheduler can be destructed while it waits.
+	struct State {
+		UpdateFunction update;
+		uint64_t interval;
+		bool destructed = false;
+		Damage damage;
+		async::doorbell doorbell;
+	};
+
+	static cofiber::no_future _run(std::shared_ptr<State> state);
+
+	uint32_t _width;
+	uint32_t _height;
+	std::shared_ptr<State> _state;
+};
+
 struct FrameBuffer : ModeObject {
 	FrameBuffer(uint32_t id);
 
-	virtual void notifyDirty() = 0;
+	// Called for DRM_IOCTL_MODE_DIRTYFB. An empty vector damages the whole framebuffer.
+	virtual void notifyDirty(std::vector<Rect> rects) = 0;
 };
 
 struct Plane : ModeObject {
@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
 #include <deque>
 #include <experimental/optional>
 #include <optional>
@@ -19,6 +20,8 @@
 #include <frigg/atomic.hpp>
 #include <frigg/arch_x86/machine.hpp>
 #include <frigg/memory.hpp>
+#include <hel.h>
+#include <hel-syscalls.h>
 #include <helix/ipc.hpp>
 #include <helix/await.hpp>
 #include <protocols/fs/defs.hpp>
@@ -336,6 +339,107 @@ drm_core::FrameBuffer::FrameBuffer(uint32_t id)
 	:drm_core::ModeObject { ObjectType::frameBuffer, id } {
 }
 
+// ----------------------------------------------------------------
+// Damage
+// ----------------------------------------------------------------
+
+namespace {
+	// Also true for rectangles that touch each other.
+	bool overlapsOrTouches(const drm_core::Rect &a, const drm_core::Rect &b) {
+		return a.x1 <= b.x2 && b.x1 <= a.x2 && a.y1 <= b.y2 && b.y1 <= a.y2;
+	}
+
+	drm_core::Rect boundingBox(const drm_core::Rect &a, const drm_core::Rect &b) {
+		return drm_core::Rect{std::min(a.x1, b.x1), std::min(a.y1, b.y1),
+				std::max(a.x2, b.x2), std::max(a.y2, b.y2)};
+	}
+}
+
+void drm_core::Damage::add(Rect rect) {
+	if(rect.empty())
+		return;
+
+	// Merging can create new overlaps; hence, repeat until nothing changes.
+	bool merged;
+	do {
+		merged = false;
+		for(auto it = _rects.begin(); it != _rects.end(); ++it) {
+			if(!overlapsOrTouches(*it, rect))
+				continue;
+			rect = boundingBox(*it, rect);
+			_rects.erase(it);
+			merged = true;
+			break;
+		}
+	} while(merged);
+	_rects.push_back(rect);
+
+	if(_rects.size() > maxRects) {
+		auto box = _rects.front();
+		for(auto &other : _rects)
+			box = boundingBox(box, other);
+		_rects.clear();
+		_rects.push_back(box);
+	}
+}
+
+// ----------------------------------------------------------------
+// DamageScheduler
+// ----------------------------------------------------------------
+
+drm_core::DamageScheduler::DamageScheduler(uint32_t width, uint32_t height,
+		UpdateFunction update, uint64_t interval)
+: _width{width}, _height{height}, _state{std::make_shared<State>()} {
+	_state->update = std::move(update);
+	_state->interval = interval;
+	_run(_state);
+}
+
+drm_core::DamageScheduler::~DamageScheduler() {
+	_state->destructed = true;
+	_state->doorbell.ring();
+}
+
+void drm_core::DamageScheduler::add(const std::vector<Rect> &rects) {
+	if(rects.empty()) {
+		_state->damage.add(Rect{0, 0, _width, _height});
+	}else{
+		for(auto rect : rects) {
+			rect.x2 = std::min(rect.x2, _width);
+			rect.y2 = std::min(rect.y2, _height);
+			_state->damage.add(rect);
+		}
+	}
+	_state->doorbell.ring();
+}
+
+COFIBER_ROUTINE(cofiber::no_future, drm_core::DamageScheduler::_run(std::shared_ptr<State> state),
+		([state = std::move(state)] {
+	uint64_t last_update = 0;
+	while(!state->destructed) {
+		if(state->damage.empty()) {
+			COFIBER_AWAIT state->doorbell.async_wait();
+			continue;
+		}
+
+		// The first update after an idle period is not delayed.
+		uint64_t now;
+		HEL_CHECK(helGetClock(&now));
+		if(last_update && now < last_update + state->interval) {
+			helix::AwaitClock await_clock;
+			auto &&submit = helix::submitAwaitClock(&await_clock, last_update + state->interval,
+					helix::Dispatcher::global());
+			COFIBER_AWAIT submit.async_wait();
+			HEL_CHECK(await_clock.error());
+			if(state->destructed)
+				break;
+		}
+
+		HEL_CHECK(helGetClock(&last_update));
+		COFIBER_AWAIT state->update(state->damage.take());
+	}
+}))
+
 // ----------------------------------------------------------------
 // Plane
 // ----------------------------------------------------------------
@@ -864,7 +968,16 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 		assert(obj);
 		auto fb = obj->asFrameBuffer();
 		assert(fb);
-		fb->notifyDirty();
+
+		std::vector<drm_core::Rect> rects;
+		for(auto &clip : req.drm_clips()) {
+			auto clamp = [] (int32_t value) {
+				return static_cast<uint32_t>(std::max(value, 0));
+			};
+			rects.push_back(drm_core::Rect{clamp(clip.x1()), clamp(clip.y1()),
+					clamp(clip.x2()), clamp(clip.y2())});
+		}
+		fb->notifyDirty(std::move(rects));
 
 		resp.set_error(managarm::fs::Errors::SUCCESS);
 		auto ser = resp.SerializeAsString();
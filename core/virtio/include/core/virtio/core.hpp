@@ -66,11 +66,23 @@ enum {
 	// Bits of the spec::Descriptor::flags field.
 	VIRTQ_DESC_F_NEXT = 1, // descriptor is part of a chain
 	VIRTQ_DESC_F_WRITE = 2, // buffer is written by device
+	VIRTQ_DESC_F_INDIRECT = 4, // buffer contains an indirect descriptor table
+
+	// Bits of the spec::AvailableRing::flags field.
+	VIRTQ_AVAIL_F_NO_INTERRUPT = 1, // no need to send interrupts
 
 	// Bits of the spec::UsedRing::flags field.
 	VIRTQ_USED_F_NO_NOTIFY = 1 // no need to notify the device
 };
 
+// Device-independent feature bits.
+enum {
+	VIRTIO_F_ANY_LAYOUT = 27,
+	VIRTIO_RING_F_INDIRECT_DESC = 28,
+	VIRTIO_RING_F_EVENT_IDX = 29,
+	VIRTIO_F_VERSION_1 = 32
+};
+
 namespace spec {
 	struct Descriptor {
 		arch::scalar_variable<uint64_t> address;
@@ -134,6 +146,8 @@ struct QueueInfo {
  * 
  * Usual initialization works as follows:
  * - Call discover() to obtain a transport.
+ * - Optionally, call Transport::checkDeviceFeature() and
+ *   Transport::acknowledgeDriverFeature() to negotiate device specific features.
  * - Call Transport::finalizeFeatures().
  * - Call Transport::claimQueues().
  * - Call Transport::setupQueue() for each virtq.
@@ -146,6 +160,8 @@ struct Transport {
 
 	virtual uint32_t loadConfig(arch::scalar_register<uint32_t> offset) = 0;
 
+	virtual bool checkDeviceFeature(unsigned int feature) = 0;
+	virtual void acknowledgeDriverFeature(unsigned int feature) = 0;
 	virtual void finalizeFeatures() = 0;
 
 	virtual void claimQueues(unsigned int max_index) = 0;
@@ -215,6 +231,10 @@ struct Handle {
 
 	void setupLink(Handle other);
 
+	// Makes this descriptor refer to an indirect descriptor table.
+	// Requires VIRTIO_RING_F_INDIRECT_DESC; see IndirectTable.
+	void setupIndirect(arch::dma_buffer_view table);
+
 private:
 	Queue *_queue;
 	size_t _tableIndex;
@@ -255,6 +275,37 @@ private:
 	Handle _back;
 };
 
+// Helper class to fill indirect descriptor tables.
+// The table itself has to be contiguous in physical memory.
+struct IndirectTable {
+	IndirectTable(spec::Descriptor *table, size_t capacity)
+	: _table{table}, _capacity{capacity}, _size{0} { }
+
+	IndirectTable(const IndirectTable &) = delete;
+
+	IndirectTable &operator= (const IndirectTable &) = delete;
+
+	size_t size() {
+		return _size;
+	}
+
+	// Note the remarks on Handle::setupBuffer().
+	void append(HostToDeviceType, arch::dma_buffer_view view);
+	void append(DeviceToHostType, arch::dma_buffer_view view);
+
+	// Returns the part of the table that is in use. Pass this to Handle::setupIndirect().
+	arch::dma_buffer_view view() {
+		return arch::dma_buffer_view{nullptr, _table, _size * sizeof(spec::Descriptor)};
+	}
+
+private:
+	void _append(arch::dma_buffer_view view, uint16_t flags);
+
+	spec::Descriptor *_table;
+	size_t _capacity;
+	size_t _size;
+};
+
 // Helper functions that obtain descriptor from a queue as needed.
 async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
 		arch::dma_buffer_view view);
@@ -263,6 +314,9 @@ async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
 
 struct Request {
 	void (*complete)(Request *);
+
+	// Number of bytes that the device wrote into the descriptor chain.
+	size_t bytesWritten;
 };
 
 // Represents a single virtq.
@@ -292,6 +346,15 @@ struct Queue {
 	// Notifies the device that new descriptors have been posted.
 	void notify();
 
+	// Must be called before the queue is used if VIRTIO_RING_F_EVENT_IDX was negotiated.
+	// Notifications and interrupts are then suppressed via the event index fields.
+	void enableEventIndex();
+
+	// Asks the device not to send interrupts for this virtq. Useful for queues
+	// whose completions are reaped by calling processInterrupt() directly.
+	// Interrupts are still requested while obtainDescriptor() waits for descriptors.
+	void disableInterrupts();
+
 	// Processes interrupts for this virtq.
 	// Calls retrieveDescriptor() to complete individual requests.
 	void processInterrupt();
@@ -300,6 +363,10 @@ protected:
 	virtual void notifyTransport() = 0;
 
 private:
+	// Requests an interrupt once the device used the descriptor with the given index.
+	void _requestInterrupt(uint16_t used_index);
+	void _suppressInterrupts();
+
 	// Index of this queue as part of its owning device.
 	unsigned int _queueIndex;
 
@@ -320,6 +387,15 @@ private:
 
 	std::vector<Request *> _activeRequests;
 
+	// Set if descriptors were posted since the last notify().
+	bool _notifyPending;
+
+	bool _useEventIndex;
+	bool _interruptsDisabled;
+
+	// Value of the available ring's head index when we last notified the device.
+	uint16_t _notifyHead;
+
 	// Keeps track of which entries in the used ring have already been processed.
 	uint16_t _progressHead;
 };
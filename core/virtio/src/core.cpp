@@ -86,6 +86,8 @@ struct LegacyPciTransport : Transport {
 
 	uint32_t loadConfig(arch::scalar_register<uint32_t> offset) override;
 
+	bool checkDeviceFeature(unsigned int feature) override;
+	void acknowledgeDriverFeature(unsigned int feature) override;
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
@@ -100,6 +102,9 @@ private:
 	arch::io_space _legacySpace;
 	helix::UniqueDescriptor _irq;
 
+	// Legacy devices only support the lower 32 feature bits.
+	uint32_t _driverFeatures;
+
 	std::vector<std::unique_ptr<LegacyPciQueue>> _queues;
 };
 
@@ -118,14 +123,26 @@ private:
 LegacyPciTransport::LegacyPciTransport(protocols::hw::Device hw_device,
 		arch::io_space legacy_space, helix::UniqueDescriptor irq)
 : _hwDevice{std::move(hw_device)}, _legacySpace{legacy_space},
-		_irq{std::move(irq)} { }
+		_irq{std::move(irq)}, _driverFeatures{0} { }
 
 uint32_t LegacyPciTransport::loadConfig(arch::scalar_register<uint32_t> r) {
 	return _legacySpace.subspace(20).load(r);
 }
 
+bool LegacyPciTransport::checkDeviceFeature(unsigned int feature) {
+	if(feature >= 32)
+		return false;
+	return _legacySpace.load(PCI_L_DEVICE_FEATURES) & (uint32_t(1) << feature);
+}
+
+void LegacyPciTransport::acknowledgeDriverFeature(unsigned int feature) {
+	assert(feature < 32);
+	_driverFeatures |= uint32_t(1) << feature;
+}
+
 void LegacyPciTransport::finalizeFeatures() {
-	// Does nothing for now.
+	// Legacy devices do not have a FEATURES_OK bit; they just accept our features.
+	_legacySpace.store(PCI_L_DRIVER_FEATURES, _driverFeatures);
 }
 
 void LegacyPciTransport::claimQueues(unsigned int max_index) {
@@ -181,13 +198,6 @@ Queue *LegacyPciTransport::setupQueue(unsigned int queue_index) {
 }
 
 void LegacyPciTransport::runDevice() {
-	// Negotiate features that we want to use.
-	uint32_t negotiated = 0;
-	uint32_t offered = _legacySpace.load(PCI_L_DEVICE_FEATURES);
-	printf("Features %x\n", offered);
-
-	_legacySpace.store(PCI_L_DRIVER_FEATURES, negotiated);
-
 	// Finally set the DRIVER_OK bit to finish the configuration.
 	_legacySpace.store(PCI_L_DEVICE_STATUS, _legacySpace.load(PCI_L_DEVICE_STATUS) | DRIVER_OK);
 
@@ -223,9 +233,11 @@ COFIBER_ROUTINE(cofiber::no_future, LegacyPciTransport::_processIrqs(), ([=] {
 			auto status = _legacySpace.load(PCI_L_DEVICE_STATUS);
 			assert(!(status & DEVICE_NEEDS_RESET));
 		}
+		// Drivers do not necessarily set up all queues (e.g. virtio-net with VIRTIO_NET_F_MQ).
 		if(isr & 1)
 			for(auto &queue : _queues)
-				queue->processInterrupt();
+				if(queue)
+					queue->processInterrupt();
 	}
 }))
 
@@ -262,8 +274,8 @@ struct StandardPciTransport : Transport {
 	
 	uint32_t loadConfig(arch::scalar_register<uint32_t> offset) override;
 
-	bool checkDeviceFeature(unsigned int feature);
-	void acknowledgeDriverFeature(unsigned int feature);
+	bool checkDeviceFeature(unsigned int feature) override;
+	void acknowledgeDriverFeature(unsigned int feature) override;
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
@@ -330,8 +342,8 @@ void StandardPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 }
 
 void StandardPciTransport::finalizeFeatures() {
-	assert(checkDeviceFeature(32));
-	acknowledgeDriverFeature(32);
+	assert(checkDeviceFeature(VIRTIO_F_VERSION_1));
+	acknowledgeDriverFeature(VIRTIO_F_VERSION_1);
 
 	_commonSpace().store(PCI_DEVICE_STATUS, _commonSpace().load(PCI_DEVICE_STATUS) | FEATURES_OK);
 	auto confirm = _commonSpace().load(PCI_DEVICE_STATUS);
@@ -476,7 +488,8 @@ COFIBER_ROUTINE(cofiber::no_future, StandardPciTransport::_processIrqs(), ([=] {
 
 		if(await.bitset() & 1)
 			for(auto &queue : _queues)
-				queue->processInterrupt();
+				if(queue)
+					queue->processInterrupt();
 	}
 }))
 
@@ -623,6 +636,53 @@ void Handle::setupLink(Handle other) {
 	descriptor->flags.store(descriptor->flags.load() | VIRTQ_DESC_F_NEXT);
 }
 
+void Handle::setupIndirect(arch::dma_buffer_view table) {
+	assert(table.size());
+	assert(!(table.size() % sizeof(spec::Descriptor)));
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(table.data(), &physical));
+
+	auto descriptor = _queue->_table + _tableIndex;
+	descriptor->address.store(physical);
+	descriptor->length.store(table.size());
+	descriptor->flags.store(descriptor->flags.load() | VIRTQ_DESC_F_INDIRECT);
+}
+
+// --------------------------------------------------------
+// IndirectTable
+// --------------------------------------------------------
+
+void IndirectTable::append(HostToDeviceType, arch::dma_buffer_view view) {
+	_append(view, 0);
+}
+
+void IndirectTable::append(DeviceToHostType, arch::dma_buffer_view view) {
+	_append(view, VIRTQ_DESC_F_WRITE);
+}
+
+void IndirectTable::_append(arch::dma_buffer_view view, uint16_t flags) {
+	assert(view.size());
+	assert(_size < _capacity);
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(view.data(), &physical));
+
+	// Link the previous descriptor to the new one.
+	if(_size) {
+		auto previous = _table + _size - 1;
+		previous->next.store(_size);
+		previous->flags.store(previous->flags.load() | VIRTQ_DESC_F_NEXT);
+	}
+
+	auto descriptor = _table + _size;
+	descriptor->address.store(physical);
+	descriptor->length.store(view.size());
+	descriptor->flags.store(flags);
+	descriptor->next.store(0);
+	_size++;
+}
+
 COFIBER_ROUTINE(async::result<void>, scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
 		arch::dma_buffer_view view), ([chain = &chain, queue, view] {
 	constexpr size_t page_size = 0x1000;
@@ -657,7 +717,8 @@ COFIBER_ROUTINE(async::result<void>, scatterGather(DeviceToHostType, Chain &chai
 
 Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
 		spec::AvailableRing *available, spec::UsedRing *used)
-: _queueIndex{queue_index}, _queueSize{queue_size}, _progressHead{0} {
+: _queueIndex{queue_index}, _queueSize{queue_size}, _notifyPending{false},
+		_useEventIndex{false}, _interruptsDisabled{false}, _notifyHead{0}, _progressHead{0} {
 	// Construct the hardware state.
 	_table = new (table) spec::Descriptor[_queueSize];
 	_availableRing = new (available) spec::AvailableRing;
@@ -689,6 +750,27 @@ Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *tabl
 COFIBER_ROUTINE(async::result<Handle>, Queue::obtainDescriptor(), ([=] {
 	while(true) {
 		if(_descriptorStack.empty()) {
+			// Descriptors are only returned once the device has seen them.
+			if(_notifyPending)
+				notify();
+
+			if(_interruptsDisabled) {
+				// Ask for an interrupt once most of the outstanding requests completed
+				// (instead of one interrupt per request), then check again to avoid races.
+				// Note that requests can span multiple descriptors; hence, the threshold
+				// must be derived from the requests that are actually in flight.
+				uint16_t outstanding = _availableRing->headIndex.load() - _progressHead;
+				_requestInterrupt(_progressHead + std::max(1, outstanding * 3 / 4));
+				processInterrupt();
+				if(!_descriptorStack.empty()) {
+					_suppressInterrupts();
+					continue;
+				}
+				COFIBER_AWAIT _descriptorDoorbell.async_wait();
+				_suppressInterrupts();
+				continue;
+			}
+
 			COFIBER_AWAIT _descriptorDoorbell.async_wait();
 			continue;
 		}
@@ -719,19 +801,60 @@ void Queue::postDescriptor(Handle handle, Request *request,
 
 	asm volatile ( "" : : : "memory" );
 	_availableRing->headIndex.store(enqueue_head + 1);
+	_notifyPending = true;
 }
 
 void Queue::notify() {
-	asm volatile ( "" : : : "memory" );
-	if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY))
-		notifyTransport();
+	_notifyPending = false;
+	// The device must see the new head index before we read its event index.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(_useEventIndex) {
+		// Notify iff the device's event index is among the entries posted since the last
+		// notification (see vring_need_event() in the specification).
+		uint16_t head = _availableRing->headIndex.load();
+		uint16_t event = _usedExtra->eventIndex.load();
+		if(uint16_t(head - event - 1) < uint16_t(head - _notifyHead))
+			notifyTransport();
+		_notifyHead = head;
+	}else{
+		if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY))
+			notifyTransport();
+	}
+}
+
+void Queue::enableEventIndex() {
+	_useEventIndex = true;
+	_notifyHead = _availableRing->headIndex.load();
+	_requestInterrupt(_progressHead);
+}
+
+void Queue::disableInterrupts() {
+	_interruptsDisabled = true;
+	_suppressInterrupts();
+}
+
+void Queue::_requestInterrupt(uint16_t used_index) {
+	if(_useEventIndex) {
+		_availableExtra->eventIndex.store(used_index);
+	}else{
+		_availableRing->flags.store(0);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void Queue::_suppressInterrupts() {
+	// With event indices, the device only interrupts when it reaches the event index.
+	// As we stop advancing the index, interrupts stop after the current one.
+	if(!_useEventIndex)
+		_availableRing->flags.store(VIRTQ_AVAIL_F_NO_INTERRUPT);
 }
 
 void Queue::processInterrupt() {
 	while(true) {
 		auto used_head = _usedRing->headIndex.load();
-		// TODO: I think this assertion is incorrect once we issue more than 2^16 requests.
-		assert(_progressHead <= used_head);
+		// Both indices wrap around at 2^16. The device can be at most one ring ahead.
+		assert(uint16_t(used_head - _progressHead) <= _queueSize);
 		if(_progressHead == used_head)
 			break;
 		
@@ -757,10 +880,21 @@ void Queue::processInterrupt() {
 		_descriptorDoorbell.ring();
 
 		// Call the completion handler.
+		request->bytesWritten = _usedRing->elements[ring_index].written.load();
 		request->complete(request);
 
 		_progressHead++;
 	}
+
+	// Ask for an interrupt as soon as the device uses the next descriptor.
+	// As we only do this after processing the used ring, interrupts are naturally
+	// coalesced while we are busy.
+	if(_useEventIndex && !_interruptsDisabled) {
+		_requestInterrupt(_progressHead);
+		// Pick up entries that were used before the device saw the new event index.
+		if(_usedRing->headIndex.load() != _progressHead)
+			processInterrupt();
+	}
 }
 
 } // namespace virtio_core
@@ -0,0 +1,173 @@
+
+#ifndef AHCI_AHCI_HPP
+#define AHCI_AHCI_HPP
+
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include <arch/dma_pool.hpp>
+#include <arch/dma_structs.hpp>
+#include <arch/mem_space.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+#include <cofiber.hpp>
+#include <helix/ipc.hpp>
+#include <helix/memory.hpp>
+#include <protocols/hw/client.hpp>
+
+#include "spec.hpp"
+
+struct Controller;
+
+// ----------------------------------------------------------------
+// Port.
+// ----------------------------------------------------------------
+
+struct Port : blockfs::BlockDevice {
+	Port(Controller *controller, unsigned int index, arch::mem_space space);
+
+	unsigned int index() {
+		return _index;
+	}
+
+	// Starts the port and identifies the attached device.
+	// Returns false if there is no usable disk.
+	async::result<bool> initialize();
+
+	// Allows the port to route command completion interrupts through the
+	// controller's command completion coalescing (CCC) logic under load.
+	void allowCoalescing();
+
+	// Called by the controller when an interrupt for this port arrives.
+	void handleIrq();
+
+	async::result<blockfs::IoError> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<blockfs::IoError> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<blockfs::IoError> flush() override;
+
+private:
+	enum class RequestType {
+		identify,
+		read,
+		write,
+		flush
+	};
+
+	struct Request {
+		Request(RequestType type, uint64_t sector, void *buffer, size_t num_sectors);
+
+		RequestType type;
+		uint64_t sector;
+		void *buffer;
+		size_t numSectors;
+
+		async::promise<blockfs::IoError> promise;
+	};
+
+	// Splits a transfer into requests and waits until all of them complete.
+	async::result<blockfs::IoError> _transfer(RequestType type, uint64_t sector,
+			void *buffer, size_t num_sectors);
+
+	// Issues pending requests as long as there are free command slots.
+	void _submitPending();
+
+	void _issueCommand(unsigned int slot, Request *request);
+
+	// Fills the PRD table of a command. Returns the number of entries.
+	size_t _buildPrds(CommandTable *table, void *buffer, size_t size);
+
+	// Retires all commands that the device has completed.
+	void _retireCommands();
+
+	// Fails the outstanding commands and restarts the port after an error.
+	void _recoverFromError();
+
+	// Issues a COMRESET. Used if the device does not leave the BSY/DRQ state.
+	void _resetLink();
+
+	// Enables CCC if enough commands are in flight to fill a batch.
+	void _updateCoalescing();
+
+	Controller *_controller;
+	unsigned int _index;
+	arch::mem_space _space;
+
+	arch::dma_object<CommandList> _commandList;
+	arch::dma_object<ReceivedFis> _receivedFis;
+	std::vector<arch::dma_object<CommandTable>> _commandTables;
+
+	uint64_t _numSectors;
+	bool _useNcq;
+	unsigned int _queueDepth;
+
+	// Maximal number of sectors per command.
+	size_t _maxSectors;
+
+	bool _coalescingAllowed;
+	bool _coalescing;
+
+	// Bitmask of command slots that are in use.
+	uint32_t _activeSlots;
+	Request *_slotRequests[32];
+
+	std::queue<Request *> _pendingQueue;
+};
+
+// ----------------------------------------------------------------
+// Controller.
+// ----------------------------------------------------------------
+
+struct Controller {
+	Controller(protocols::hw::Device hw_device, helix::Mapping mapping,
+			helix::UniqueDescriptor mmio, helix::UniqueDescriptor irq);
+
+	cofiber::no_future run();
+
+	arch::dma_pool *dmaPool() {
+		return &_dmaPool;
+	}
+
+	unsigned int numSlots() {
+		return _numSlots;
+	}
+
+	bool supportsNcq() {
+		return _space.load(regs::cap) & cap_bits::ncqSupported;
+	}
+
+	bool supports64Bit() {
+		return _space.load(regs::cap) & cap_bits::addressing64;
+	}
+
+	// Turns command completion coalescing on or off. It has to be set up before.
+	void setCoalescing(bool enable);
+
+private:
+	cofiber::no_future _handleIrqs();
+
+	// Enables command completion coalescing for the given ports.
+	void _setupCoalescing(uint32_t port_mask);
+
+	protocols::hw::Device _hwDevice;
+	helix::Mapping _mapping;
+	helix::UniqueDescriptor _mmio;
+	helix::UniqueDescriptor _irq;
+	arch::mem_space _space;
+
+	arch::contiguous_pool _dmaPool;
+
+	unsigned int _numSlots;
+
+	// Bit in the IS register that is used for coalesced completions (or zero).
+	uint32_t _cccIrqBit;
+	uint32_t _coalescedPorts;
+
+	std::unique_ptr<Port> _ports[32];
+};
+
+#endif // AHCI_AHCI_HPP
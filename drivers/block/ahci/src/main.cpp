@@ -0,0 +1,640 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+#include <helix/await.hpp>
+#include <protocols/mbus/client.hpp>
+
+#include "ahci.hpp"
+
+namespace {
+	constexpr bool logCommands = false;
+
+	constexpr size_t pageSize = 0x1000;
+
+	// Parameters of command completion coalescing: an IRQ is raised after
+	// this many completions or once the timeout (in ms) expires.
+	// Coalescing is only enabled while at least that many commands are in flight;
+	// otherwise, completions would wait for the timeout.
+	constexpr uint32_t coalescingCompletions = 8;
+	constexpr uint32_t coalescingTimeout = 1;
+
+	// Timeout (in ms) for the port to stop and for the link to come up after a reset.
+	constexpr int recoveryTimeout = 500;
+}
+
+// ----------------------------------------------------------------
+// Port.
+// ----------------------------------------------------------------
+
+Port::Request::Request(RequestType type_, uint64_t sector_, void *buffer_,
+		size_t num_sectors_)
+: type{type_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_} { }
+
+Port::Port(Controller *controller, unsigned int index, arch::mem_space space)
+: BlockDevice{512}, _controller{controller}, _index{index}, _space{space},
+		_numSectors{0}, _useNcq{false}, _queueDepth{1}, _maxSectors{0},
+		_coalescingAllowed{false}, _coalescing{false}, _activeSlots{0}, _slotRequests{} {
+	// In the worst case, an unaligned buffer touches one additional page.
+	_maxSectors = std::min(size_t(65536), (numPrdEntries - 1) * (pageSize / 512));
+}
+
+COFIBER_ROUTINE(async::result<bool>, Port::initialize(), ([=] {
+	auto ssts = _space.load(port_regs::ssts);
+	if((ssts & ssts_bits::detectionMask) != ssts_bits::devicePresent)
+		COFIBER_RETURN(false);
+
+	auto signature = _space.load(port_regs::sig);
+	if(signature != sataSignature) {
+		std::cout << "ahci: Ignoring port " << _index << " with signature 0x"
+				<< std::hex << signature << std::dec << std::endl;
+		COFIBER_RETURN(false);
+	}
+
+	// Stop the port before reprogramming it.
+	auto cmd = _space.load(port_regs::cmd);
+	_space.store(port_regs::cmd, cmd & ~(pcmd_bits::start | pcmd_bits::fisReceiveEnable));
+	while(_space.load(port_regs::cmd) & (pcmd_bits::commandListRunning
+			| pcmd_bits::fisReceiveRunning))
+		usleep(1000);
+
+	// Allocate the command list, the received FIS area and one table per slot.
+	_commandList = arch::dma_object<CommandList>{_controller->dmaPool()};
+	_receivedFis = arch::dma_object<ReceivedFis>{_controller->dmaPool()};
+	for(unsigned int i = 0; i < _controller->numSlots(); i++)
+		_commandTables.push_back(arch::dma_object<CommandTable>{_controller->dmaPool()});
+
+	uintptr_t list_physical, fis_physical;
+	HEL_CHECK(helPointerPhysical(_commandList.data(), &list_physical));
+	HEL_CHECK(helPointerPhysical(_receivedFis.data(), &fis_physical));
+	_space.store(port_regs::clb, list_physical);
+	_space.store(port_regs::clbu, list_physical >> 32);
+	_space.store(port_regs::fb, fis_physical);
+	_space.store(port_regs::fbu, fis_physical >> 32);
+
+	for(unsigned int i = 0; i < _controller->numSlots(); i++) {
+		uintptr_t table_physical;
+		HEL_CHECK(helPointerPhysical(_commandTables[i].data(), &table_physical));
+		assert(_controller->supports64Bit() || !(table_physical >> 32));
+		_commandList->slots[i].tableBase = table_physical;
+		_commandList->slots[i].tableBaseUpper = table_physical >> 32;
+	}
+
+	_space.store(port_regs::cmd, _space.load(port_regs::cmd) | pcmd_bits::fisReceiveEnable
+			| pcmd_bits::powerOn | pcmd_bits::spinUp);
+
+	// Clear stale errors and interrupts, then enable the interrupts that we handle.
+	_space.store(port_regs::serr, 0xFFFFFFFF);
+	_space.store(port_regs::is, 0xFFFFFFFF);
+	_space.store(port_regs::ie, pis_bits::completion | pis_bits::errors);
+
+	while(_space.load(port_regs::tfd) & (tfd_bits::bsy | tfd_bits::drq))
+		usleep(1000);
+	_space.store(port_regs::cmd, _space.load(port_regs::cmd) | pcmd_bits::start);
+
+	// Identify the device.
+	arch::dma_buffer identify{_controller->dmaPool(), 512};
+	if(COFIBER_AWAIT _transfer(RequestType::identify, 0, identify.data(), 1)
+			!= blockfs::IoError::none) {
+		std::cout << "\e[31m" "ahci: Could not identify the device at port " << _index
+				<< "\e[39m" << std::endl;
+		COFIBER_RETURN(false);
+	}
+
+	auto words = reinterpret_cast<uint16_t *>(identify.data());
+	if(!(words[83] & (1 << 10))) {
+		std::cout << "ahci: Device at port " << _index
+				<< " does not support 48-bit LBA" << std::endl;
+		COFIBER_RETURN(false);
+	}
+	_numSectors = static_cast<uint64_t>(words[100])
+			| (static_cast<uint64_t>(words[101]) << 16)
+			| (static_cast<uint64_t>(words[102]) << 32)
+			| (static_cast<uint64_t>(words[103]) << 48);
+
+	if((words[76] & (1 << 8)) && _controller->supportsNcq()) {
+		_useNcq = true;
+		_queueDepth = std::min(_controller->numSlots(),
+				static_cast<unsigned int>(words[75] & 0x1F) + 1);
+	}
+
+	// The model string is stored as byte-swapped words.
+	char model[41];
+	for(int i = 0; i < 20; i++) {
+		model[2 * i] = words[27 + i] >> 8;
+		model[2 * i + 1] = words[27 + i] & 0xFF;
+	}
+	model[40] = 0;
+
+	std::cout << "ahci: Port " << _index << ": " << model << ", "
+			<< _numSectors << " sectors, ";
+	if(_useNcq) {
+		std::cout << "NCQ with " << _queueDepth << " slots" << std::endl;
+	}else{
+		std::cout << "no NCQ" << std::endl;
+	}
+
+	COFIBER_RETURN(true);
+}))
+
+void Port::allowCoalescing() {
+	_coalescingAllowed = true;
+	_updateCoalescing();
+}
+
+void Port::handleIrq() {
+	auto is = _space.load(port_regs::is);
+	_space.store(port_regs::is, is);
+
+	if(is & pis_bits::errors) {
+		std::cout << "\e[31m" "ahci: Error on port " << _index << ", IS: 0x" << std::hex << is
+				<< ", TFD: 0x" << _space.load(port_regs::tfd)
+				<< ", SERR: 0x" << _space.load(port_regs::serr) << std::dec
+				<< "\e[39m" << std::endl;
+		_recoverFromError();
+		return;
+	}
+
+	_retireCommands();
+}
+
+async::result<blockfs::IoError> Port::readSectors(uint64_t sector, void *buffer, size_t num_sectors) {
+	return _transfer(RequestType::read, sector, buffer, num_sectors);
+}
+
+async::result<blockfs::IoError> Port::writeSectors(uint64_t sector, const void *buffer,
+		size_t num_sectors) {
+	// The device only reads from the buffer.
+	return _transfer(RequestType::write, sector, const_cast<void *>(buffer), num_sectors);
+}
+
+COFIBER_ROUTINE(async::result<blockfs::IoError>, Port::flush(), ([=] {
+	Request request{RequestType::flush, 0, nullptr, 0};
+	_pendingQueue.push(&request);
+	_submitPending();
+	_updateCoalescing();
+	COFIBER_RETURN(COFIBER_AWAIT request.promise.async_get());
+}))
+
+COFIBER_ROUTINE(async::result<blockfs::IoError>, Port::_transfer(RequestType type,
+		uint64_t sector, void *buffer, size_t num_sectors), ([=] {
+	// PRD entries need to have an even byte count and address.
+	assert(!((uintptr_t)buffer & 1));
+	assert(sector + num_sectors <= _numSectors || type == RequestType::identify);
+
+	// Submit all requests at once; NCQ lets the device reorder them.
+	std::vector<Request *> requests;
+	for(size_t progress = 0; progress < num_sectors; progress += _maxSectors) {
+		auto request = new Request{type, sector + progress,
+				(char *)buffer + 512 * progress,
+				std::min(num_sectors - progress, _maxSectors)};
+		requests.push_back(request);
+		_pendingQueue.push(request);
+	}
+	_submitPending();
+	_updateCoalescing();
+
+	// Wait for all requests even if one of them fails; they reference the buffer.
+	auto error = blockfs::IoError::none;
+	for(auto request : requests) {
+		auto request_error = COFIBER_AWAIT request->promise.async_get();
+		if(request_error != blockfs::IoError::none)
+			error = request_error;
+		delete request;
+	}
+
+	COFIBER_RETURN(error);
+}))
+
+void Port::_submitPending() {
+	while(!_pendingQueue.empty()) {
+		auto in_flight = __builtin_popcount(_activeSlots);
+		if(static_cast<unsigned int>(in_flight) >= _queueDepth)
+			return;
+
+		// Non-queued commands must not overlap with other commands.
+		auto request = _pendingQueue.front();
+		bool queued = _useNcq && (request->type == RequestType::read
+				|| request->type == RequestType::write);
+		if(!queued && _activeSlots)
+			return;
+
+		unsigned int slot = 0;
+		while(_activeSlots & (uint32_t(1) << slot))
+			slot++;
+		assert(slot < _controller->numSlots());
+
+		_pendingQueue.pop();
+		_activeSlots |= uint32_t(1) << slot;
+		_slotRequests[slot] = request;
+		_issueCommand(slot, request);
+	}
+}
+
+void Port::_issueCommand(unsigned int slot, Request *request) {
+	auto table = _commandTables[slot].data();
+	bool write = request->type == RequestType::write;
+	bool queued = _useNcq && (request->type == RequestType::read
+			|| request->type == RequestType::write);
+
+	RegisterFis fis;
+	memset(&fis, 0, sizeof(RegisterFis));
+	fis.type = kFisTypeRegisterH2D;
+	fis.flags = kFisFlagCommand;
+
+	if(request->type == RequestType::identify) {
+		fis.command = kCommandIdentifyDevice;
+	}else if(request->type == RequestType::flush) {
+		fis.command = kCommandFlushCacheExt;
+		fis.device = kDeviceLba;
+	}else{
+		assert(request->numSectors && request->numSectors <= 65536);
+		fis.device = kDeviceLba;
+		fis.lba[0] = request->sector & 0xFF;
+		fis.lba[1] = (request->sector >> 8) & 0xFF;
+		fis.lba[2] = (request->sector >> 16) & 0xFF;
+		fis.lbaHigh[0] = (request->sector >> 24) & 0xFF;
+		fis.lbaHigh[1] = (request->sector >> 32) & 0xFF;
+		fis.lbaHigh[2] = (request->sector >> 40) & 0xFF;
+
+		// A sector count of zero means 65536 sectors.
+		if(queued) {
+			fis.command = write ? kCommandWriteFpdmaQueued : kCommandReadFpdmaQueued;
+			fis.featureLow = request->numSectors & 0xFF;
+			fis.featureHigh = (request->numSectors >> 8) & 0xFF;
+			fis.countLow = slot << 3;
+		}else{
+			fis.command = write ? kCommandWriteDmaExt : kCommandReadDmaExt;
+			fis.countLow = request->numSectors & 0xFF;
+			fis.countHigh = (request->numSectors >> 8) & 0xFF;
+		}
+	}
+	memcpy(table->commandFis, &fis, sizeof(RegisterFis));
+
+	auto num_prds = _buildPrds(table, request->buffer, 512 * request->numSectors);
+
+	auto &header = _commandList->slots[slot];
+	header.flags = (sizeof(RegisterFis) / 4) << header_bits::fisLengthShift
+			| (write ? header_bits::write : 0)
+			| (num_prds << header_bits::prdLengthShift);
+	header.prdByteCount = 0;
+
+	if(logCommands)
+		std::cout << "ahci: Issuing command 0x" << std::hex << (int)fis.command << std::dec
+				<< " in slot " << slot << " for " << request->numSectors
+				<< " sectors at " << request->sector << std::endl;
+
+	asm volatile ( "" : : : "memory" );
+	if(queued)
+		_space.store(port_regs::sact, uint32_t(1) << slot);
+	_space.store(port_regs::ci, uint32_t(1) << slot);
+}
+
+size_t Port::_buildPrds(CommandTable *table, void *buffer, size_t size) {
+	size_t n = 0;
+	size_t entry_size = 0;
+	uintptr_t entry_end = 0;
+	size_t offset = 0;
+	while(offset < size) {
+		auto address = reinterpret_cast<uintptr_t>(buffer) + offset;
+		auto chunk = std::min(size - offset, pageSize - (address & (pageSize - 1)));
+
+		uintptr_t physical;
+		HEL_CHECK(helPointerPhysical(reinterpret_cast<void *>(address), &physical));
+		assert(_controller->supports64Bit() || !((physical + chunk - 1) >> 32));
+
+		// Merge chunks that are contiguous in physical memory.
+		if(n && physical == entry_end && entry_size + chunk <= prd_bits::maxByteCount) {
+			entry_size += chunk;
+		}else{
+			assert(n < numPrdEntries);
+			table->prds[n].base = physical;
+			table->prds[n].baseUpper = physical >> 32;
+			table->prds[n].reserved = 0;
+			entry_size = chunk;
+			n++;
+		}
+		table->prds[n - 1].flags = entry_size - 1;
+		entry_end = physical + chunk;
+		offset += chunk;
+	}
+	return n;
+}
+
+void Port::_retireCommands() {
+	auto busy = _space.load(port_regs::ci) | _space.load(port_regs::sact);
+	auto completed = _activeSlots & ~busy;
+	if(!completed)
+		return;
+
+	std::vector<Request *> retired;
+	for(unsigned int slot = 0; slot < 32; slot++) {
+		if(!(completed & (uint32_t(1) << slot)))
+			continue;
+		assert(_slotRequests[slot]);
+		retired.push_back(_slotRequests[slot]);
+		_slotRequests[slot] = nullptr;
+	}
+	_activeSlots &= ~completed;
+
+	// Refill the slots before waking up the waiters.
+	_submitPending();
+	_updateCoalescing();
+
+	for(auto request : retired)
+		request->promise.set_value(blockfs::IoError::none);
+}
+
+void Port::_recoverFromError() {
+	// Commands that left PxCI/PxSACT have completed successfully. For the other ones,
+	// we do not know which one failed (for NCQ, this requires READ LOG EXT); fail all of them.
+	auto busy = _space.load(port_regs::ci) | _space.load(port_regs::sact);
+	std::vector<Request *> completed;
+	std::vector<Request *> failed;
+	for(unsigned int slot = 0; slot < 32; slot++) {
+		if(!(_activeSlots & (uint32_t(1) << slot)))
+			continue;
+		assert(_slotRequests[slot]);
+		if(busy & (uint32_t(1) << slot)) {
+			failed.push_back(_slotRequests[slot]);
+		}else{
+			completed.push_back(_slotRequests[slot]);
+		}
+		_slotRequests[slot] = nullptr;
+	}
+	_activeSlots = 0;
+
+	// Stopping the command list engine clears PxCI and PxSACT.
+	_space.store(port_regs::cmd, _space.load(port_regs::cmd) & ~pcmd_bits::start);
+	for(int ms = 0; _space.load(port_regs::cmd) & pcmd_bits::commandListRunning; ms++) {
+		if(ms > recoveryTimeout) {
+			std::cout << "\e[31m" "ahci: Port " << _index << " does not stop" "\e[39m"
+					<< std::endl;
+			break;
+		}
+		usleep(1000);
+	}
+
+	_space.store(port_regs::serr, 0xFFFFFFFF);
+	_space.store(port_regs::is, 0xFFFFFFFF);
+
+	// The device only accepts new commands once it has cleared BSY and DRQ.
+	if(_space.load(port_regs::tfd) & (tfd_bits::bsy | tfd_bits::drq))
+		_resetLink();
+
+	_space.store(port_regs::cmd, _space.load(port_regs::cmd) | pcmd_bits::start);
+
+	std::cout << "ahci: Port " << _index << " recovered, " << failed.size()
+			<< " command(s) failed" << std::endl;
+
+	_submitPending();
+	_updateCoalescing();
+
+	for(auto request : completed)
+		request->promise.set_value(blockfs::IoError::none);
+	for(auto request : failed)
+		request->promise.set_value(blockfs::IoError::deviceError);
+}
+
+void Port::_resetLink() {
+	// Keep DET at 1 for at least 1 ms to send COMRESET.
+	auto sctl = _space.load(port_regs::sctl) & ~sctl_bits::detectionMask;
+	_space.store(port_regs::sctl, sctl | sctl_bits::comReset);
+	usleep(1000);
+	_space.store(port_regs::sctl, sctl);
+
+	for(int ms = 0; (_space.load(port_regs::ssts) & ssts_bits::detectionMask)
+			!= ssts_bits::devicePresent; ms++) {
+		if(ms > recoveryTimeout) {
+			std::cout << "\e[31m" "ahci: Link of port " << _index
+					<< " does not come back after COMRESET" "\e[39m" << std::endl;
+			return;
+		}
+		usleep(1000);
+	}
+	_space.store(port_regs::serr, 0xFFFFFFFF);
+
+	for(int ms = 0; _space.load(port_regs::tfd) & (tfd_bits::bsy | tfd_bits::drq); ms++) {
+		if(ms > recoveryTimeout) {
+			std::cout << "\e[31m" "ahci: Device at port " << _index
+					<< " stays busy after COMRESET" "\e[39m" << std::endl;
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+void Port::_updateCoalescing() {
+	if(!_coalescingAllowed)
+		return;
+
+	auto in_flight = static_cast<unsigned int>(__builtin_popcount(_activeSlots));
+	bool enable = in_flight >= coalescingCompletions;
+	if(enable == _coalescing)
+		return;
+	_coalescing = enable;
+
+	// While CCC is active, completions are reported via the CCC interrupt
+	// and only errors raise port IRQs. Completions that arrive while port IRQs
+	// are masked stay flagged in PxIS and raise an IRQ once PxIE is restored.
+	_controller->setCoalescing(enable);
+	if(enable) {
+		_space.store(port_regs::ie, pis_bits::errors);
+	}else{
+		_space.store(port_regs::ie, pis_bits::completion | pis_bits::errors);
+	}
+}
+
+// ----------------------------------------------------------------
+// Controller.
+// ----------------------------------------------------------------
+
+Controller::Controller(protocols::hw::Device hw_device, helix::Mapping mapping,
+		helix::UniqueDescriptor mmio, helix::UniqueDescriptor irq)
+: _hwDevice{std::move(hw_device)}, _mapping{std::move(mapping)},
+		_mmio{std::move(mmio)}, _irq{std::move(irq)},
+		_space{_mapping.get()}, _cccIrqBit{0}, _coalescedPorts{0} {
+	auto cap = _space.load(regs::cap);
+	_numSlots = ((cap >> cap_bits::numSlotsShift) & cap_bits::numSlotsMask) + 1;
+
+	auto version = _space.load(regs::vs);
+	std::cout << "ahci: AHCI " << (version >> 16) << "." << ((version >> 8) & 0xFF)
+			<< ", " << ((cap & cap_bits::numPortsMask) + 1) << " ports, "
+			<< _numSlots << " command slots" << std::endl;
+}
+
+COFIBER_ROUTINE(cofiber::no_future, Controller::run(), ([=] {
+	// Take ownership from the firmware.
+	if(_space.load(regs::cap2) & cap2_bits::biosHandoff) {
+		_space.store(regs::bohc, _space.load(regs::bohc) | bohc_bits::osOwned);
+		while(_space.load(regs::bohc) & (bohc_bits::biosOwned | bohc_bits::biosBusy))
+			usleep(1000);
+	}
+
+	_space.store(regs::ghc, _space.load(regs::ghc) | ghc_bits::ahciEnable);
+
+	_handleIrqs();
+	_space.store(regs::is, 0xFFFFFFFF);
+	_space.store(regs::ghc, _space.load(regs::ghc) | ghc_bits::irqEnable);
+
+	auto implemented = _space.load(regs::pi);
+	Port *disk = nullptr;
+	for(unsigned int i = 0; i < 32; i++) {
+		if(!(implemented & (uint32_t(1) << i)))
+			continue;
+
+		_ports[i] = std::make_unique<Port>(this, i,
+				_space.subspace(portSpaceOffset(i)));
+		if(!(COFIBER_AWAIT _ports[i]->initialize()))
+			continue;
+
+		// TODO: libblockfs only supports one device per process.
+		if(disk) {
+			std::cout << "ahci: Ignoring additional disk at port " << i << std::endl;
+			continue;
+		}
+		disk = _ports[i].get();
+	}
+
+	if(!disk) {
+		std::cout << "ahci: No disks found" << std::endl;
+		COFIBER_RETURN();
+	}
+
+	_setupCoalescing(uint32_t(1) << disk->index());
+	blockfs::runDevice(disk);
+	COFIBER_RETURN();
+}))
+
+void Controller::_setupCoalescing(uint32_t port_mask) {
+	if(!(_space.load(regs::cap) & cap_bits::cccSupported))
+		return;
+
+	// CCC must be disabled while it is reconfigured.
+	_space.store(regs::cccCtl, _space.load(regs::cccCtl) & ~ccc_bits::enable);
+
+	auto irq = (_space.load(regs::cccCtl) >> ccc_bits::irqShift) & ccc_bits::irqMask;
+	_cccIrqBit = uint32_t(1) << irq;
+	_coalescedPorts = port_mask;
+
+	_space.store(regs::cccPorts, port_mask);
+	_space.store(regs::cccCtl, (coalescingCompletions << ccc_bits::completionsShift)
+			| (coalescingTimeout << ccc_bits::timeoutShift));
+
+	for(unsigned int i = 0; i < 32; i++)
+		if(port_mask & (uint32_t(1) << i))
+			_ports[i]->allowCoalescing();
+	std::cout << "ahci: Using command completion coalescing under load" << std::endl;
+}
+
+void Controller::setCoalescing(bool enable) {
+	assert(_cccIrqBit);
+	auto ctl = _space.load(regs::cccCtl);
+	if(enable) {
+		_space.store(regs::cccCtl, ctl | ccc_bits::enable);
+	}else{
+		_space.store(regs::cccCtl, ctl & ~ccc_bits::enable);
+	}
+}
+
+COFIBER_ROUTINE(cofiber::no_future, Controller::_handleIrqs(), ([=] {
+	COFIBER_AWAIT _hwDevice.enableBusIrq();
+
+	// TODO: The kick here should not be required.
+	HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckKick, 0));
+
+	uint64_t sequence = 0;
+	while(true) {
+		helix::AwaitEvent await;
+		auto &&submit = helix::submitAwaitEvent(_irq, &await, sequence,
+				helix::Dispatcher::global());
+		COFIBER_AWAIT(submit.async_wait());
+		HEL_CHECK(await.error());
+		sequence = await.sequence();
+
+		auto is = _space.load(regs::is);
+		if(!is) {
+			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, sequence));
+			continue;
+		}
+
+		// Port interrupt status has to be cleared before the global one.
+		for(unsigned int i = 0; i < 32; i++) {
+			if(!_ports[i])
+				continue;
+			if((is & (uint32_t(1) << i))
+					|| ((is & _cccIrqBit) && (_coalescedPorts & (uint32_t(1) << i))))
+				_ports[i]->handleIrq();
+		}
+		_space.store(regs::is, is);
+
+		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
+	}
+}))
+
+// ----------------------------------------------------------------
+// Freestanding PCI discovery functions.
+// ----------------------------------------------------------------
+
+// TODO: Support more than one controller.
+Controller *globalController;
+bool foundController = false;
+
+COFIBER_ROUTINE(cofiber::no_future, bindController(mbus::Entity entity), ([=] {
+	protocols::hw::Device device(COFIBER_AWAIT entity.bind());
+	auto info = COFIBER_AWAIT device.getPciInfo();
+	assert(info.barInfo[5].ioType == protocols::hw::IoType::kIoTypeMemory);
+	auto bar = COFIBER_AWAIT device.accessBar(5);
+	auto irq = COFIBER_AWAIT device.accessIrq();
+
+	// Enable bus mastering and memory space in the PCI command register.
+	auto command = COFIBER_AWAIT device.loadPciSpace(0x04, 2);
+	COFIBER_AWAIT device.storePciSpace(0x04, 2, command | 0x06);
+
+	helix::Mapping mapping{bar, info.barInfo[5].offset, info.barInfo[5].length};
+	globalController = new Controller{std::move(device), std::move(mapping),
+			std::move(bar), std::move(irq)};
+	globalController->run();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, observeControllers(), ([] {
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-class", "01"),
+		mbus::EqualsFilter("pci-subclass", "06"),
+		mbus::EqualsFilter("pci-interface", "01")
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties) {
+		if(foundController) {
+			std::cout << "ahci: Ignoring additional controller" << std::endl;
+			return;
+		}
+		foundController = true;
+		std::cout << "ahci: Detected controller" << std::endl;
+		bindController(std::move(entity));
+	});
+
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+}))
+
+// --------------------------------------------------------
+// main() function
+// --------------------------------------------------------
+
+int main() {
+	printf("ahci: Starting driver\n");
+
+	{
+		async::queue_scope scope{helix::globalQueue()};
+		observeControllers();
+	}
+
+	helix::globalQueue()->run();
+}
@@ -0,0 +1,217 @@
+
+#ifndef AHCI_SPEC_HPP
+#define AHCI_SPEC_HPP
+
+#include <stdint.h>
+#include <arch/register.hpp>
+
+//-------------------------------------------------
+// registers
+//-------------------------------------------------
+
+// Generic host control registers.
+namespace regs {
+	inline constexpr arch::scalar_register<uint32_t> cap{0x00};
+	inline constexpr arch::scalar_register<uint32_t> ghc{0x04};
+	inline constexpr arch::scalar_register<uint32_t> is{0x08};
+	inline constexpr arch::scalar_register<uint32_t> pi{0x0C};
+	inline constexpr arch::scalar_register<uint32_t> vs{0x10};
+	inline constexpr arch::scalar_register<uint32_t> cccCtl{0x14};
+	inline constexpr arch::scalar_register<uint32_t> cccPorts{0x18};
+	inline constexpr arch::scalar_register<uint32_t> cap2{0x24};
+	inline constexpr arch::scalar_register<uint32_t> bohc{0x28};
+}
+
+// Per-port registers, relative to portSpace(n).
+namespace port_regs {
+	inline constexpr arch::scalar_register<uint32_t> clb{0x00};
+	inline constexpr arch::scalar_register<uint32_t> clbu{0x04};
+	inline constexpr arch::scalar_register<uint32_t> fb{0x08};
+	inline constexpr arch::scalar_register<uint32_t> fbu{0x0C};
+	inline constexpr arch::scalar_register<uint32_t> is{0x10};
+	inline constexpr arch::scalar_register<uint32_t> ie{0x14};
+	inline constexpr arch::scalar_register<uint32_t> cmd{0x18};
+	inline constexpr arch::scalar_register<uint32_t> tfd{0x20};
+	inline constexpr arch::scalar_register<uint32_t> sig{0x24};
+	inline constexpr arch::scalar_register<uint32_t> ssts{0x28};
+	inline constexpr arch::scalar_register<uint32_t> sctl{0x2C};
+	inline constexpr arch::scalar_register<uint32_t> serr{0x30};
+	inline constexpr arch::scalar_register<uint32_t> sact{0x34};
+	inline constexpr arch::scalar_register<uint32_t> ci{0x38};
+}
+
+inline constexpr size_t portSpaceOffset(unsigned int port) {
+	return 0x100 + port * 0x80;
+}
+
+namespace cap_bits {
+	inline constexpr uint32_t numPortsMask = 0x1F;
+	inline constexpr int numSlotsShift = 8;
+	inline constexpr uint32_t numSlotsMask = 0x1F;
+	inline constexpr uint32_t cccSupported = uint32_t(1) << 7;
+	inline constexpr uint32_t ncqSupported = uint32_t(1) << 30;
+	inline constexpr uint32_t addressing64 = uint32_t(1) << 31;
+}
+
+namespace ghc_bits {
+	inline constexpr uint32_t hbaReset = uint32_t(1) << 0;
+	inline constexpr uint32_t irqEnable = uint32_t(1) << 1;
+	inline constexpr uint32_t ahciEnable = uint32_t(1) << 31;
+}
+
+namespace ccc_bits {
+	inline constexpr uint32_t enable = uint32_t(1) << 0;
+	inline constexpr int irqShift = 3;
+	inline constexpr uint32_t irqMask = 0x1F;
+	inline constexpr int completionsShift = 8;
+	inline constexpr int timeoutShift = 16;
+}
+
+namespace cap2_bits {
+	inline constexpr uint32_t biosHandoff = uint32_t(1) << 0;
+}
+
+namespace bohc_bits {
+	inline constexpr uint32_t biosOwned = uint32_t(1) << 0;
+	inline constexpr uint32_t osOwned = uint32_t(1) << 1;
+	inline constexpr uint32_t biosBusy = uint32_t(1) << 4;
+}
+
+namespace pcmd_bits {
+	inline constexpr uint32_t start = uint32_t(1) << 0;
+	inline constexpr uint32_t spinUp = uint32_t(1) << 1;
+	inline constexpr uint32_t powerOn = uint32_t(1) << 2;
+	inline constexpr uint32_t fisReceiveEnable = uint32_t(1) << 4;
+	inline constexpr uint32_t fisReceiveRunning = uint32_t(1) << 14;
+	inline constexpr uint32_t commandListRunning = uint32_t(1) << 15;
+}
+
+namespace pis_bits {
+	inline constexpr uint32_t d2hRegisterFis = uint32_t(1) << 0;
+	inline constexpr uint32_t pioSetupFis = uint32_t(1) << 1;
+	inline constexpr uint32_t dmaSetupFis = uint32_t(1) << 2;
+	inline constexpr uint32_t setDeviceBitsFis = uint32_t(1) << 3;
+	inline constexpr uint32_t interfaceFatal = uint32_t(1) << 27;
+	inline constexpr uint32_t hostBusData = uint32_t(1) << 28;
+	inline constexpr uint32_t hostBusFatal = uint32_t(1) << 29;
+	inline constexpr uint32_t taskFileError = uint32_t(1) << 30;
+
+	inline constexpr uint32_t completion = d2hRegisterFis | pioSetupFis
+			| dmaSetupFis | setDeviceBitsFis;
+	inline constexpr uint32_t errors = interfaceFatal | hostBusData
+			| hostBusFatal | taskFileError;
+}
+
+namespace tfd_bits {
+	inline constexpr uint32_t err = 0x01;
+	inline constexpr uint32_t drq = 0x08;
+	inline constexpr uint32_t bsy = 0x80;
+}
+
+namespace ssts_bits {
+	inline constexpr uint32_t detectionMask = 0x0F;
+	inline constexpr uint32_t devicePresent = 3;
+}
+
+namespace sctl_bits {
+	inline constexpr uint32_t detectionMask = 0x0F;
+	inline constexpr uint32_t comReset = 1;
+}
+
+inline constexpr uint32_t sataSignature = 0x00000101;
+
+//-------------------------------------------------
+// in-memory structures
+//-------------------------------------------------
+
+struct CommandHeader {
+	uint32_t flags;
+	uint32_t prdByteCount;
+	uint32_t tableBase;
+	uint32_t tableBaseUpper;
+	uint32_t reserved[4];
+};
+static_assert(sizeof(CommandHeader) == 32, "Bad sizeof(CommandHeader)");
+
+namespace header_bits {
+	inline constexpr uint32_t fisLengthShift = 0;
+	inline constexpr uint32_t write = uint32_t(1) << 6;
+	inline constexpr uint32_t prefetchable = uint32_t(1) << 7;
+	inline constexpr uint32_t clearBusy = uint32_t(1) << 10;
+	inline constexpr int prdLengthShift = 16;
+}
+
+struct CommandList {
+	CommandHeader slots[32];
+};
+static_assert(sizeof(CommandList) == 1024, "Bad sizeof(CommandList)");
+
+struct ReceivedFis {
+	uint8_t data[256];
+};
+
+struct PrdEntry {
+	uint32_t base;
+	uint32_t baseUpper;
+	uint32_t reserved;
+	uint32_t flags; // Byte count minus one in bits 0-21.
+};
+static_assert(sizeof(PrdEntry) == 16, "Bad sizeof(PrdEntry)");
+
+namespace prd_bits {
+	inline constexpr uint32_t maxByteCount = uint32_t(1) << 22;
+	inline constexpr uint32_t irqOnCompletion = uint32_t(1) << 31;
+}
+
+// Host to device register FIS.
+struct [[gnu::packed]] RegisterFis {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t command;
+	uint8_t featureLow;
+	uint8_t lba[3];
+	uint8_t device;
+	uint8_t lbaHigh[3];
+	uint8_t featureHigh;
+	uint8_t countLow;
+	uint8_t countHigh;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+};
+static_assert(sizeof(RegisterFis) == 20, "Bad sizeof(RegisterFis)");
+
+enum {
+	kFisTypeRegisterH2D = 0x27,
+	kFisFlagCommand = 0x80
+};
+
+// The size is chosen such that a command table fills exactly one page.
+inline constexpr size_t numPrdEntries = 248;
+
+struct CommandTable {
+	uint8_t commandFis[64];
+	uint8_t atapiCommand[16];
+	uint8_t reserved[48];
+	PrdEntry prds[numPrdEntries];
+};
+static_assert(sizeof(CommandTable) == 4096, "Bad sizeof(CommandTable)");
+
+//-------------------------------------------------
+// ATA commands
+//-------------------------------------------------
+
+enum {
+	kCommandReadDmaExt = 0x25,
+	kCommandWriteDmaExt = 0x35,
+	kCommandReadFpdmaQueued = 0x60,
+	kCommandWriteFpdmaQueued = 0x61,
+	kCommandFlushCacheExt = 0xEA,
+	kCommandIdentifyDevice = 0xEC
+};
+
+enum {
+	kDeviceLba = 0x40
+};
+
+#endif // AHCI_SPEC_HPP
@@ -2,13 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
-#include <queue>
+#include <vector>
 
 #include <async/result.hpp>
+#include <arch/dma_pool.hpp>
+#include <arch/dma_structs.hpp>
 #include <arch/io_space.hpp>
 #include <arch/register.hpp>
 #include <helix/ipc.hpp>
+#include <protocols/hw/client.hpp>
+#include <protocols/mbus/client.hpp>
 
 #include <blockfs.hpp>
 
@@ -23,8 +28,10 @@ namespace {
 
 namespace regs {
 	inline constexpr arch::scalar_register<uint16_t> inData{0};
+	inline constexpr arch::scalar_register<uint8_t> inError{1};
 	inline constexpr arch::scalar_register<uint8_t> inStatus{7};
 
+	inline constexpr arch::scalar_register<uint16_t> outData{0};
 	inline constexpr arch::scalar_register<uint8_t> outSectorCount{2};
 	inline constexpr arch::scalar_register<uint8_t> outLba1{3};
 	inline constexpr arch::scalar_register<uint8_t> outLba2{4};
@@ -37,6 +44,21 @@ namespace alt_regs {
 	inline constexpr arch::scalar_register<uint8_t> inStatus{0};
 }
 
+// Registers of the PCI IDE bus master (primary channel).
+namespace bm_regs {
+	inline constexpr arch::scalar_register<uint8_t> command{0};
+	inline constexpr arch::scalar_register<uint8_t> status{2};
+	inline constexpr arch::scalar_register<uint32_t> prdTable{4};
+}
+
+// Entry of the physical region descriptor table used by bus master DMA.
+struct PrdEntry {
+	uint32_t physical;
+	uint16_t size; // A size of zero means 64 KiB.
+	uint16_t flags;
+};
+static_assert(sizeof(PrdEntry) == 8, "Bad sizeof(PrdEntry)");
+
 class Controller : public blockfs::BlockDevice {
 public:
 	Controller();
@@ -44,19 +66,60 @@ public:
 public:
 	void run();
 
+	// Switches to bus master DMA. Called once the PCI IDE controller is found.
+	void enableBusMaster(arch::io_space bm_space);
+
 private:
 	cofiber::no_future _handleIrqs();
 
 public:
-	async::result<void> readSectors(uint64_t sector, void *buffer,
+	async::result<blockfs::IoError> readSectors(uint64_t sector, void *buffer,
 			size_t num_sectors) override;
 
+	async::result<blockfs::IoError> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<blockfs::IoError> flush() override;
+
 private:
+	struct Request {
+		bool isWrite;
+		bool isFlush;
+		uint64_t sector;
+		size_t numSectors;
+		size_t progress;
+		void *buffer;
+		async::promise<blockfs::IoError> promise;
+	};
+
+	async::result<blockfs::IoError> _submitRequest(Request *request);
+
+	// Picks the next request(s) from the elevator and starts them.
 	void _performRequest();
 
+	// Issues a single ATA command for the remaining part of _activeRequests.
+	void _issueCommand();
+
+	// Issues FLUSH CACHE EXT on behalf of all flush requests in _activeRequests.
+	void _issueFlush();
+
+	// Fills the PRD table. Returns the number of sectors that it covers.
+	size_t _buildPrdTable();
+
+	void _transferPioSector();
+
+	void _completeCommand();
+
+	// Completes the current command's requests with an error.
+	void _failCommand(uint8_t status);
+
 private:
 	enum Commands {
-		kCommandReadSectorsExt = 0x24
+		kCommandReadSectorsExt = 0x24,
+		kCommandReadDmaExt = 0x25,
+		kCommandWriteSectorsExt = 0x34,
+		kCommandWriteDmaExt = 0x35,
+		kCommandFlushCacheExt = 0xEA
 	};
 
 	enum Flags {
@@ -67,18 +130,36 @@ private:
 		kStatusBsy = 0x80,
 
 		kDeviceSlave = 0x10,
-		kDeviceLba = 0x40
-	};
+		kDeviceLba = 0x40,
 
-	struct Request {
-		uint64_t sector;
-		size_t numSectors;
-		size_t sectorsRead;
-		void *buffer;
-		async::promise<void> promise;
+		kBmStart = 0x01,
+		kBmRead = 0x08, // The bus master writes to memory.
+
+		kBmActive = 0x01,
+		kBmError = 0x02,
+		kBmInterrupt = 0x04,
+
+		kPrdEndOfTable = 0x8000
 	};
 
-	std::queue<Request> _requestQueue;
+	// 48-bit commands transfer at most 65536 sectors.
+	static constexpr size_t maxCommandSectors = 65536;
+
+	// Upper bound on the size of merged requests.
+	static constexpr size_t maxMergeSectors = 65536;
+
+	// The PRD table fills exactly one page; thus it never crosses a 64 KiB boundary.
+	static constexpr size_t maxPrdEntries = 512;
+
+	// Requests that have not been started yet.
+	std::vector<Request *> _pendingRequests;
+
+	// Adjacent requests that are served by the current command(s).
+	std::vector<Request *> _activeRequests;
+	size_t _activeIndex;
+
+	// The elevator continues from this sector.
+	uint64_t _headPosition;
 
 	helix::UniqueDescriptor _irq;
 	HelHandle _ioHandle;
@@ -86,10 +167,34 @@ private:
 	arch::io_space _altSpace;
 
 	bool _inRequest;
+
+	// State of the current command.
+	bool _commandFlush;
+	bool _commandWrite;
+	bool _commandDma;
+	size_t _commandSectors;
+	size_t _commandDone;
+	size_t _pioIndex;
+	size_t _pioProgress;
+
+	// Set when writes completed since the last FLUSH CACHE EXT.
+	bool _cacheDirty;
+
+	// Bus master DMA state.
+	bool _busMasterAvailable;
+	arch::io_space _bmSpace;
+	arch::contiguous_pool _dmaPool;
+	arch::dma_array<PrdEntry> _prdTable;
+	uintptr_t _prdTablePhysical;
 };
 
 Controller::Controller()
-: BlockDevice{512}, _ioSpace{0x1F0}, _altSpace{0x3F6}, _inRequest{false} {
+: BlockDevice{512}, _activeIndex{0}, _headPosition{0},
+		_ioSpace{0x1F0}, _altSpace{0x3F6}, _inRequest{false},
+		_commandFlush{false}, _commandWrite{false}, _commandDma{false},
+		_commandSectors{0}, _commandDone{0}, _pioIndex{0}, _pioProgress{0},
+		_cacheDirty{false}, _busMasterAvailable{false},
+		_prdTablePhysical{0} {
 	HelHandle irq_handle;
 	HEL_CHECK(helAccessIrq(14, &irq_handle));
 	_irq = helix::UniqueDescriptor{irq_handle};
@@ -105,6 +210,23 @@ void Controller::run() {
 	blockfs::runDevice(this);
 }
 
+void Controller::enableBusMaster(arch::io_space bm_space) {
+	if(_busMasterAvailable)
+		return;
+	_bmSpace = bm_space;
+	_prdTable = arch::dma_array<PrdEntry>{&_dmaPool, maxPrdEntries};
+	HEL_CHECK(helPointerPhysical(_prdTable.data(), &_prdTablePhysical));
+	assert(!(_prdTablePhysical >> 32));
+
+	// Stop the engine and clear stale status bits.
+	_bmSpace.store(bm_regs::command, 0);
+	_bmSpace.store(bm_regs::status, kBmInterrupt | kBmError);
+
+	// Commands that are already running keep using PIO.
+	_busMasterAvailable = true;
+	std::cout << "block-ata: Using bus master DMA" << std::endl;
+}
+
 COFIBER_ROUTINE(cofiber::no_future, Controller::_handleIrqs(), ([=] {
 	uint64_t sequence = 0;
 	while(true) {
@@ -119,60 +241,107 @@ COFIBER_ROUTINE(cofiber::no_future, Controller::_handleIrqs(), ([=] {
 		if(logIrqs)
 			std::cout << "block-ata: IRQ fired." << std::endl;
 
+		if(!_inRequest) {
+			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, sequence));
+			continue;
+		}
+
+		if(_commandDma) {
+			// The bus master tells us whether the IRQ belongs to this channel.
+			auto bm_status = _bmSpace.load(bm_regs::status);
+			if(!(bm_status & kBmInterrupt)) {
+				HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, sequence));
+				continue;
+			}
+
+			// Stop the engine, then clear the IRQ on both the drive and the bus master.
+			_bmSpace.store(bm_regs::command, 0);
+			auto status = _ioSpace.load(regs::inStatus);
+			_bmSpace.store(bm_regs::status, kBmInterrupt | kBmError);
+			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
+			if((bm_status & kBmError) || (status & (kStatusErr | kStatusDf))) {
+				_failCommand(status);
+				continue;
+			}
+			assert(!(status & kStatusBsy));
+
+			_commandDone = _commandSectors;
+			_completeCommand();
+			continue;
+		}
+
 		// Check if the device is ready without clearing the IRQ.
 		auto status = _altSpace.load(alt_regs::inStatus);
 		if(status & kStatusBsy) {
 			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, sequence));
 			continue;
 		}
-		assert(!(status & (kStatusErr | kStatusDf)));
-		assert(status & kStatusRdy);
-		assert(status & kStatusDrq);
-		
+
 		// Clear and acknowledge the IRQ.
-		auto cleared = _ioSpace.load(regs::inStatus);
+		status = _ioSpace.load(regs::inStatus);
 		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
-		assert(!(cleared & (kStatusErr | kStatusDf)));
-		assert(cleared & kStatusRdy);
-		assert(cleared & kStatusDrq);
-		status = cleared;
-
-		assert(_inRequest);
-		assert(!_requestQueue.empty());
-		auto request = &_requestQueue.front();
-	
-		auto dest = reinterpret_cast<uint8_t *>(request->buffer)
-				+ request->sectorsRead * 512;
-		for(int i = 0; i < 256; i++) {
-			// TODO: Be careful with endianess here.
-			uint16_t data = _ioSpace.load(regs::inData);
-			memcpy(dest + 2 * i, &data, sizeof(uint16_t));
+		if(status & (kStatusErr | kStatusDf)) {
+			_failCommand(status);
+			continue;
 		}
+		assert(status & kStatusRdy);
 
-		request->sectorsRead++;
-		assert(request->sectorsRead <= request->numSectors);
-		if(request->sectorsRead == request->numSectors) {
-			if(logRequests)
-				std::cout << "block-ata: Reading from " << request->sector
-						<< " complete" << std::endl;
-			request->promise.set_value();
-			_requestQueue.pop();
-			_inRequest = false;
-
-			if(!_requestQueue.empty())
-				_performRequest();
+		// For reads, each IRQ announces a sector. For writes, each IRQ
+		// acknowledges the previous sector (the first one is sent without an IRQ).
+		// Flushes raise a single IRQ once they are done.
+		if(_commandDone == _commandSectors) {
+			assert(_commandWrite || _commandFlush);
+			_completeCommand();
+			continue;
 		}
+		assert(status & kStatusDrq);
+		_transferPioSector();
+		if(!_commandWrite && _commandDone == _commandSectors)
+			_completeCommand();
 	}
 }))
 
-async::result<void> Controller::readSectors(uint64_t sector, void *buffer, size_t num_sectors) {
-	_requestQueue.emplace();
-	auto request = &_requestQueue.back();
+async::result<blockfs::IoError> Controller::readSectors(uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	assert(num_sectors);
+	auto request = new Request;
+	request->isWrite = false;
+	request->isFlush = false;
 	request->sector = sector;
 	request->numSectors = num_sectors;
-	request->sectorsRead = 0;
+	request->progress = 0;
 	request->buffer = buffer;
+	return _submitRequest(request);
+}
+
+async::result<blockfs::IoError> Controller::writeSectors(uint64_t sector, const void *buffer,
+		size_t num_sectors) {
+	assert(num_sectors);
+	auto request = new Request;
+	request->isWrite = true;
+	request->isFlush = false;
+	request->sector = sector;
+	request->numSectors = num_sectors;
+	request->progress = 0;
+	// The buffer is only read from.
+	request->buffer = const_cast<void *>(buffer);
+	return _submitRequest(request);
+}
+
+async::result<blockfs::IoError> Controller::flush() {
+	auto request = new Request;
+	request->isWrite = false;
+	request->isFlush = true;
+	request->sector = 0;
+	request->numSectors = 0;
+	request->progress = 0;
+	request->buffer = nullptr;
+	return _submitRequest(request);
+}
+
+async::result<blockfs::IoError> Controller::_submitRequest(Request *request) {
 	auto future = request->promise.async_get();
+	_pendingRequests.push_back(request);
 
 	if(!_inRequest)
 		_performRequest();
@@ -180,35 +349,390 @@ async::result<void> Controller::readSectors(uint64_t sector, void *buffer, size_
 }
 
 void Controller::_performRequest() {
+	assert(!_inRequest);
+	assert(_activeRequests.empty());
+	assert(!_pendingRequests.empty());
+
+	// Flushes go first. A flush only covers writes that completed before it was
+	// submitted; as commands are not overlapped, all of them have completed by now.
+	for(auto it = _pendingRequests.begin(); it != _pendingRequests.end(); ) {
+		if(!(*it)->isFlush) {
+			++it;
+			continue;
+		}
+		_activeRequests.push_back(*it);
+		it = _pendingRequests.erase(it);
+	}
+	if(!_activeRequests.empty()) {
+		_activeIndex = 0;
+		_issueFlush();
+		return;
+	}
+
+	// C-LOOK: Prefer the lowest sector at or behind the head position,
+	// otherwise wrap around to the lowest sector overall.
+	auto lowest = [] (Request *a, Request *b) {
+		return a->sector < b->sector;
+	};
+	auto it = _pendingRequests.end();
+	for(auto jt = _pendingRequests.begin(); jt != _pendingRequests.end(); ++jt) {
+		if((*jt)->sector < _headPosition)
+			continue;
+		if(it == _pendingRequests.end() || lowest(*jt, *it))
+			it = jt;
+	}
+	if(it == _pendingRequests.end())
+		it = std::min_element(_pendingRequests.begin(), _pendingRequests.end(), lowest);
+
+	auto first = *it;
+	_pendingRequests.erase(it);
+	_activeRequests.push_back(first);
+
+	// Merge requests that directly follow the current one.
+	auto end = first->sector + first->numSectors;
+	auto total = first->numSectors;
+	while(true) {
+		auto next = std::find_if(_pendingRequests.begin(), _pendingRequests.end(),
+				[&] (Request *request) {
+			return request->isWrite == first->isWrite && request->sector == end
+					&& total + request->numSectors <= maxMergeSectors;
+		});
+		if(next == _pendingRequests.end())
+			break;
+		end += (*next)->numSectors;
+		total += (*next)->numSectors;
+		_activeRequests.push_back(*next);
+		_pendingRequests.erase(next);
+	}
+
+	if(logRequests)
+		std::cout << "block-ata: " << (first->isWrite ? "Writing " : "Reading ")
+				<< total << " sectors at " << first->sector << " (merged "
+				<< _activeRequests.size() << " requests)" << std::endl;
+
+	_headPosition = end;
+	_activeIndex = 0;
+	_issueCommand();
+}
+
+void Controller::_issueCommand() {
 	assert(!_inRequest);
 	_inRequest = true;
 
-	assert(!_requestQueue.empty());
-	auto request = &_requestQueue.front();
-	
+	assert(_activeIndex < _activeRequests.size());
+	auto first = _activeRequests[_activeIndex];
+	auto sector = first->sector + first->progress;
+
+	_commandFlush = false;
+	_commandWrite = first->isWrite;
+	_commandDone = 0;
+	_commandSectors = 0;
+	if(_busMasterAvailable)
+		_commandSectors = _buildPrdTable();
+	_commandDma = _commandSectors > 0;
+
+	if(!_commandDma) {
+		// Fall back to PIO, e.g. if the buffer is not reachable by 32-bit DMA.
+		for(size_t i = _activeIndex; i < _activeRequests.size(); i++)
+			_commandSectors += _activeRequests[i]->numSectors - _activeRequests[i]->progress;
+		_commandSectors = std::min(_commandSectors, maxCommandSectors);
+		_pioIndex = _activeIndex;
+		_pioProgress = first->progress;
+	}
+
 	if(logRequests)
-		std::cout << "block-ata: Reading " << request->numSectors
-				<< " sectors from " << request->sector << std::endl;
+		std::cout << "block-ata: Issuing " << (_commandDma ? "DMA" : "PIO")
+				<< " command for " << _commandSectors << " sectors at " << sector << std::endl;
 
-	assert(!(request->sector & ~((size_t(1) << 48) - 1)));
+	assert(!(sector & ~((uint64_t(1) << 48) - 1)));
 	_ioSpace.store(regs::outDevice, kDeviceLba);
 	// TODO: There should be a delay after drive selection.
-	
-	_ioSpace.store(regs::outSectorCount, (request->numSectors >> 8) & 0xFF);
-	_ioSpace.store(regs::outLba1, (request->sector >> 24) & 0xFF);
-	_ioSpace.store(regs::outLba2, (request->sector >> 32) & 0xFF);
-	_ioSpace.store(regs::outLba3, (request->sector >> 40) & 0xFF);	
-	
-	_ioSpace.store(regs::outSectorCount, request->numSectors & 0xFF);
-	_ioSpace.store(regs::outLba1, request->sector & 0xFF);
-	_ioSpace.store(regs::outLba2, (request->sector >> 8) & 0xFF);
-	_ioSpace.store(regs::outLba3, (request->sector >> 16) & 0xFF);
-	
-	_ioSpace.store(regs::outCommand, kCommandReadSectorsExt);
+
+	// A sector count of zero means 65536 sectors.
+	_ioSpace.store(regs::outSectorCount, (_commandSectors >> 8) & 0xFF);
+	_ioSpace.store(regs::outLba1, (sector >> 24) & 0xFF);
+	_ioSpace.store(regs::outLba2, (sector >> 32) & 0xFF);
+	_ioSpace.store(regs::outLba3, (sector >> 40) & 0xFF);
+
+	_ioSpace.store(regs::outSectorCount, _commandSectors & 0xFF);
+	_ioSpace.store(regs::outLba1, sector & 0xFF);
+	_ioSpace.store(regs::outLba2, (sector >> 8) & 0xFF);
+	_ioSpace.store(regs::outLba3, (sector >> 16) & 0xFF);
+
+	if(_commandDma) {
+		_bmSpace.store(bm_regs::command, _commandWrite ? 0 : kBmRead);
+		_bmSpace.store(bm_regs::prdTable, _prdTablePhysical);
+		_bmSpace.store(bm_regs::status, kBmInterrupt | kBmError);
+
+		_ioSpace.store(regs::outCommand,
+				_commandWrite ? kCommandWriteDmaExt : kCommandReadDmaExt);
+		_bmSpace.store(bm_regs::command, (_commandWrite ? 0 : kBmRead) | kBmStart);
+	}else if(_commandWrite) {
+		_ioSpace.store(regs::outCommand, kCommandWriteSectorsExt);
+
+		// The first sector is transferred as soon as the drive asserts DRQ.
+		while(true) {
+			auto status = _altSpace.load(alt_regs::inStatus);
+			if(status & (kStatusErr | kStatusDf)) {
+				// Reading the status register clears the pending IRQ.
+				_failCommand(_ioSpace.load(regs::inStatus));
+				return;
+			}
+			if(!(status & kStatusBsy) && (status & kStatusDrq))
+				break;
+		}
+		_transferPioSector();
+	}else{
+		_ioSpace.store(regs::outCommand, kCommandReadSectorsExt);
+	}
+}
+
+void Controller::_issueFlush() {
+	assert(!_inRequest);
+	_inRequest = true;
+
+	_commandFlush = true;
+	_commandWrite = false;
+	_commandDma = false;
+	_commandSectors = 0;
+	_commandDone = 0;
+
+	// Writes cannot complete while the flush runs; hence we can already reset this.
+	_cacheDirty = false;
+
+	if(logRequests)
+		std::cout << "block-ata: Flushing the write cache ("
+				<< _activeRequests.size() << " requests)" << std::endl;
+
+	_ioSpace.store(regs::outDevice, kDeviceLba);
+	_ioSpace.store(regs::outCommand, kCommandFlushCacheExt);
+}
+
+size_t Controller::_buildPrdTable() {
+	constexpr size_t pageSize = 0x1000;
+
+	auto entrySize = [&] (size_t i) -> size_t {
+		return _prdTable[i].size ? _prdTable[i].size : 0x10000;
+	};
+
+	size_t n = 0;
+	size_t entry_size = 0;
+	size_t bytes = 0;
+	for(size_t i = _activeIndex; i < _activeRequests.size(); i++) {
+		auto request = _activeRequests[i];
+		auto offset = request->progress * 512;
+		while(offset < request->numSectors * 512) {
+			if(bytes == maxCommandSectors * 512)
+				goto done;
+
+			// PRD entries need an even address and byte count.
+			// Buffers that violate this are transferred by PIO.
+			auto address = reinterpret_cast<uintptr_t>(request->buffer) + offset;
+			if(address & 1)
+				goto done;
+			auto chunk = std::min({request->numSectors * 512 - offset,
+					pageSize - (address & (pageSize - 1)),
+					maxCommandSectors * 512 - bytes});
+
+			uintptr_t physical;
+			HEL_CHECK(helPointerPhysical(reinterpret_cast<void *>(address), &physical));
+			if((physical + chunk) > (uintptr_t(1) << 32))
+				goto done;
+
+			// Merge physically contiguous chunks as long as
+			// the entry does not cross a 64 KiB boundary.
+			if(n && _prdTable[n - 1].physical + entry_size == physical
+					&& (_prdTable[n - 1].physical >> 16) == ((physical + chunk - 1) >> 16)) {
+				entry_size += chunk;
+			}else{
+				if(n == maxPrdEntries)
+					goto done;
+				_prdTable[n].physical = physical;
+				_prdTable[n].flags = 0;
+				entry_size = chunk;
+				n++;
+			}
+			_prdTable[n - 1].size = entry_size & 0xFFFF;
+
+			bytes += chunk;
+			offset += chunk;
+		}
+	}
+
+done:
+	// Buffers that are not sector aligned split sectors at page boundaries.
+	// Drop the trailing partial sector; the next command starts with it.
+	auto excess = bytes % 512;
+	bytes -= excess;
+	while(excess) {
+		assert(n);
+		auto size = entrySize(n - 1);
+		if(size > excess) {
+			_prdTable[n - 1].size = (size - excess) & 0xFFFF;
+			break;
+		}
+		excess -= size;
+		n--;
+	}
+
+	if(n)
+		_prdTable[n - 1].flags = kPrdEndOfTable;
+	return bytes / 512;
+}
+
+void Controller::_transferPioSector() {
+	assert(_commandDone < _commandSectors);
+
+	auto request = _activeRequests[_pioIndex];
+	auto ptr = reinterpret_cast<uint8_t *>(request->buffer) + _pioProgress * 512;
+	for(int i = 0; i < 256; i++) {
+		// TODO: Be careful with endianess here.
+		uint16_t data;
+		if(_commandWrite) {
+			memcpy(&data, ptr + 2 * i, sizeof(uint16_t));
+			_ioSpace.store(regs::outData, data);
+		}else{
+			data = _ioSpace.load(regs::inData);
+			memcpy(ptr + 2 * i, &data, sizeof(uint16_t));
+		}
+	}
+
+	_commandDone++;
+	_pioProgress++;
+	if(_pioProgress == request->numSectors) {
+		_pioIndex++;
+		_pioProgress = 0;
+	}
+}
+
+void Controller::_completeCommand() {
+	assert(_inRequest);
+	assert(_commandDone == _commandSectors);
+
+	if(_commandFlush) {
+		_commandFlush = false;
+		_activeIndex = _activeRequests.size();
+	}else{
+		// Account the transferred sectors to the active requests.
+		auto n = _commandSectors;
+		while(n) {
+			assert(_activeIndex < _activeRequests.size());
+			auto request = _activeRequests[_activeIndex];
+			auto chunk = std::min(n, request->numSectors - request->progress);
+			request->progress += chunk;
+			n -= chunk;
+			if(request->progress == request->numSectors)
+				_activeIndex++;
+		}
+		if(_commandWrite)
+			_cacheDirty = true;
+	}
+	_inRequest = false;
+
+	// Continue if the merged requests did not fit into a single command.
+	if(_activeIndex < _activeRequests.size()) {
+		_issueCommand();
+		return;
+	}
+
+	// Keep _inRequest set while completing; completions may submit new requests.
+	_inRequest = true;
+	for(auto request : _activeRequests) {
+		if(logRequests)
+			std::cout << "block-ata: Request at " << request->sector
+					<< " complete" << std::endl;
+		request->promise.set_value(blockfs::IoError::none);
+		delete request;
+	}
+	_activeRequests.clear();
+	_inRequest = false;
+
+	if(!_pendingRequests.empty()) {
+		_performRequest();
+	}else if(_cacheDirty) {
+		// Do not leave written data in the drive's volatile cache once the queue drains.
+		_issueFlush();
+	}
+}
+
+void Controller::_failCommand(uint8_t status) {
+	assert(_inRequest);
+
+	std::cout << "\e[31m" "block-ata: " << (_commandFlush ? "Flush" : "Transfer")
+			<< " failed, status: 0x" << std::hex << (unsigned int)status
+			<< ", error: 0x" << (unsigned int)_ioSpace.load(regs::inError)
+			<< std::dec << "\e[39m" << std::endl;
+
+	// Sectors of failed writes may have partially reached the cache.
+	if(_commandWrite)
+		_cacheDirty = true;
+	if(_commandFlush)
+		_activeIndex = 0;
+	_commandFlush = false;
+
+	// Requests before _activeIndex were fully transferred by earlier commands.
+	for(size_t i = 0; i < _activeRequests.size(); i++) {
+		auto request = _activeRequests[i];
+		request->promise.set_value(i < _activeIndex
+				? blockfs::IoError::none : blockfs::IoError::deviceError);
+		delete request;
+	}
+	_activeRequests.clear();
+	_inRequest = false;
+
+	if(!_pendingRequests.empty())
+		_performRequest();
 }
 
 Controller globalController;
 
+// ----------------------------------------------------------------
+// Freestanding PCI discovery functions.
+// ----------------------------------------------------------------
+
+COFIBER_ROUTINE(cofiber::no_future, bindController(mbus::Entity entity), ([=] {
+	protocols::hw::Device device(COFIBER_AWAIT entity.bind());
+	auto info = COFIBER_AWAIT device.getPciInfo();
+	if(info.barInfo[4].ioType != protocols::hw::IoType::kIoTypePort) {
+		std::cout << "block-ata: IDE controller does not support bus mastering" << std::endl;
+		COFIBER_RETURN();
+	}
+	auto bar = COFIBER_AWAIT device.accessBar(4);
+	HEL_CHECK(helEnableIo(bar.getHandle()));
+
+	// Enable bus mastering in the PCI command register.
+	auto command = COFIBER_AWAIT device.loadPciSpace(0x04, 2);
+	COFIBER_AWAIT device.storePciSpace(0x04, 2, command | 0x04);
+
+	// The primary channel's registers are at the start of the BAR.
+	globalController.enableBusMaster(arch::global_io.subspace(info.barInfo[4].address));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, observeControllers(), ([] {
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-class", "01"),
+		mbus::EqualsFilter("pci-subclass", "01")
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties properties) {
+		// We drive the primary channel at its compatibility ports; bit 0 of the
+		// programming interface is clear in that case. Bit 7 indicates bus mastering.
+		auto interface = std::stoi(std::get<mbus::StringItem>(
+				properties.at("pci-interface")).value, nullptr, 16);
+		if((interface & 0x01) || !(interface & 0x80))
+			return;
+
+		std::cout << "block-ata: Detected IDE controller" << std::endl;
+		bindController(std::move(entity));
+	});
+
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+}))
+
 // --------------------------------------------------------
 // main() function
 // --------------------------------------------------------
@@ -219,8 +743,8 @@ int main() {
 	{
 		async::queue_scope scope{helix::globalQueue()};
 		globalController.run();
+		observeControllers();
 	}
 
 	helix::globalQueue()->run();
 }
-
@@ -0,0 +1,529 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+#include <helix/await.hpp>
+#include <protocols/mbus/client.hpp>
+
+#include "nvme.hpp"
+
+namespace {
+	constexpr bool logCommands = false;
+
+	constexpr size_t pageSize = 0x1000;
+
+	// Tunables. Queue depths are clamped to what the controller supports.
+	constexpr unsigned int numIoQueues = 4;
+	constexpr size_t ioQueueDepth = 64;
+	constexpr size_t adminQueueDepth = 32;
+
+	// PRP lists occupy a single page; this bounds the size of a single command.
+	constexpr size_t maxPrpEntries = pageSize / sizeof(uint64_t);
+}
+
+// ----------------------------------------------------------------
+// Command.
+// ----------------------------------------------------------------
+
+Command::Command()
+: buffer{nullptr}, size{0}, status{0}, result{0} {
+	memset(&entry, 0, sizeof(SubmissionEntry));
+}
+
+// ----------------------------------------------------------------
+// Queue.
+// ----------------------------------------------------------------
+
+Queue::Queue(unsigned int id, size_t depth, arch::dma_pool *pool,
+		arch::mem_space doorbells, unsigned int stride)
+: _id{id}, _depth{depth}, _doorbells{doorbells},
+		_sqTailDoorbell{static_cast<ptrdiff_t>(doorbellBase + (2 * id) * stride)},
+		_cqHeadDoorbell{static_cast<ptrdiff_t>(doorbellBase + (2 * id + 1) * stride)},
+		_sqTail{0}, _cqHead{0}, _phase{1} {
+	// Queues need to be page aligned; the pool returns naturally aligned memory.
+	_sqMemory = arch::dma_buffer{pool, std::max(depth * sizeof(SubmissionEntry), pageSize)};
+	_cqMemory = arch::dma_buffer{pool, std::max(depth * sizeof(CompletionEntry), pageSize)};
+	memset(_sqMemory.data(), 0, _sqMemory.size());
+	memset(_cqMemory.data(), 0, _cqMemory.size());
+	_sq = reinterpret_cast<SubmissionEntry *>(_sqMemory.data());
+	_cq = reinterpret_cast<CompletionEntry *>(_cqMemory.data());
+	assert(!(reinterpret_cast<uintptr_t>(_sq) & (pageSize - 1)));
+	assert(!(reinterpret_cast<uintptr_t>(_cq) & (pageSize - 1)));
+
+	// One slot has to stay empty to distinguish a full queue from an empty one.
+	_activeCommands.resize(depth - 1);
+	for(size_t i = 0; i < depth - 1; i++) {
+		_prpLists.push_back(arch::dma_array<uint64_t>{pool, maxPrpEntries});
+		_freeIds.push_back(depth - 2 - i);
+	}
+}
+
+uintptr_t Queue::sqPhysical() {
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(_sq, &physical));
+	return physical;
+}
+
+uintptr_t Queue::cqPhysical() {
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(_cq, &physical));
+	return physical;
+}
+
+void Queue::submitCommand(Command *command) {
+	_pendingQueue.push(command);
+	_submitPending();
+}
+
+void Queue::_submitPending() {
+	bool submitted = false;
+	while(!_pendingQueue.empty() && !_freeIds.empty()) {
+		auto command = _pendingQueue.front();
+		_pendingQueue.pop();
+
+		auto cid = _freeIds.back();
+		_freeIds.pop_back();
+		assert(!_activeCommands[cid]);
+		_activeCommands[cid] = command;
+
+		auto entry = &_sq[_sqTail];
+		*entry = command->entry;
+		entry->command = (command->entry.command & 0xFFFF) | (uint32_t(cid) << 16);
+		if(command->size)
+			_setupPrps(cid, entry, command->buffer, command->size);
+
+		_sqTail = (_sqTail + 1) % _depth;
+		submitted = true;
+	}
+
+	// Ring the doorbell once for the whole batch.
+	if(submitted) {
+		asm volatile ( "" : : : "memory" );
+		_doorbells.store(_sqTailDoorbell, _sqTail);
+	}
+}
+
+void Queue::_setupPrps(uint16_t cid, SubmissionEntry *entry, void *buffer, size_t size) {
+	auto address = reinterpret_cast<uintptr_t>(buffer);
+	assert(!(address & 3));
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(buffer, &physical));
+	entry->prp1 = physical;
+	entry->prp2 = 0;
+
+	auto first_chunk = std::min(size, pageSize - (address & (pageSize - 1)));
+	if(size == first_chunk)
+		return;
+
+	// Subsequent pages are always page aligned.
+	auto next = address + first_chunk;
+	auto remaining = size - first_chunk;
+	if(remaining <= pageSize) {
+		HEL_CHECK(helPointerPhysical(reinterpret_cast<void *>(next), &physical));
+		entry->prp2 = physical;
+		return;
+	}
+
+	auto &list = _prpLists[cid];
+	size_t n = 0;
+	for(size_t offset = 0; offset < remaining; offset += pageSize) {
+		assert(n < maxPrpEntries);
+		HEL_CHECK(helPointerPhysical(reinterpret_cast<void *>(next + offset), &physical));
+		list[n++] = physical;
+	}
+	HEL_CHECK(helPointerPhysical(list.data(), &physical));
+	entry->prp2 = physical;
+}
+
+bool Queue::processCompletions() {
+	std::vector<Command *> retired;
+	while(true) {
+		auto entry = &_cq[_cqHead];
+		auto status = entry->status.load();
+		if((status & 1) != _phase)
+			break;
+		asm volatile ( "" : : : "memory" );
+
+		auto cid = entry->commandId.load();
+		assert(cid < _activeCommands.size());
+		auto command = _activeCommands[cid];
+		assert(command);
+		_activeCommands[cid] = nullptr;
+		_freeIds.push_back(cid);
+
+		command->status = status >> 1;
+		command->result = entry->result.load();
+		retired.push_back(command);
+
+		_cqHead++;
+		if(_cqHead == _depth) {
+			_cqHead = 0;
+			_phase ^= 1;
+		}
+	}
+
+	if(retired.empty())
+		return false;
+
+	// Tell the controller about all consumed entries at once.
+	_doorbells.store(_cqHeadDoorbell, _cqHead);
+
+	// Refill the queue before waking up the waiters.
+	_submitPending();
+
+	for(auto command : retired)
+		command->promise.set_value();
+	return true;
+}
+
+// ----------------------------------------------------------------
+// Namespace.
+// ----------------------------------------------------------------
+
+Namespace::Namespace(Controller *controller, unsigned int nsid, size_t lba_size,
+		uint64_t num_lbas)
+: BlockDevice{lba_size}, _controller{controller}, _nsid{nsid}, _numLbas{num_lbas} { }
+
+async::result<blockfs::IoError> Namespace::readSectors(uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	assert(sector + num_sectors <= _numLbas);
+	return _controller->_transfer(_nsid, false, sector, buffer, num_sectors, sectorSize);
+}
+
+async::result<blockfs::IoError> Namespace::writeSectors(uint64_t sector, const void *buffer,
+		size_t num_sectors) {
+	assert(sector + num_sectors <= _numLbas);
+	// The device only reads from the buffer.
+	return _controller->_transfer(_nsid, true, sector, const_cast<void *>(buffer),
+			num_sectors, sectorSize);
+}
+
+async::result<blockfs::IoError> Namespace::flush() {
+	return _controller->_flush(_nsid);
+}
+
+// ----------------------------------------------------------------
+// Controller.
+// ----------------------------------------------------------------
+
+Controller::Controller(protocols::hw::Device hw_device, helix::Mapping mapping,
+		helix::UniqueDescriptor mmio, helix::UniqueDescriptor irq)
+: _hwDevice{std::move(hw_device)}, _mapping{std::move(mapping)},
+		_mmio{std::move(mmio)}, _irq{std::move(irq)},
+		_space{_mapping.get()}, _maxTransferSize{0}, _volatileWriteCache{false},
+		_nextQueue{0} {
+	auto cap = _space.load(regs::cap);
+	_doorbellStride = 4 << ((cap >> cap_bits::strideShift) & cap_bits::strideMask);
+	_maxQueueEntries = (cap & cap_bits::maxEntriesMask) + 1;
+
+	// We always use 4 KiB pages.
+	assert(!((cap >> cap_bits::minPageSizeShift) & cap_bits::minPageSizeMask));
+
+	auto version = _space.load(regs::vs);
+	std::cout << "nvme: NVMe " << (version >> 16) << "." << ((version >> 8) & 0xFF)
+			<< ", up to " << _maxQueueEntries << " queue entries" << std::endl;
+}
+
+void Controller::_waitReady(bool ready) {
+	auto timeout = ((_space.load(regs::cap) >> cap_bits::timeoutShift)
+			& cap_bits::timeoutMask) * 500;
+	for(uint64_t ms = 0; ; ms++) {
+		auto csts = _space.load(regs::csts);
+		if(csts & csts_bits::fatal)
+			throw std::runtime_error("nvme: Controller reported a fatal status");
+		if(static_cast<bool>(csts & csts_bits::ready) == ready)
+			return;
+		if(ms > timeout)
+			throw std::runtime_error("nvme: Timeout while waiting for the controller");
+		usleep(1000);
+	}
+}
+
+COFIBER_ROUTINE(cofiber::no_future, Controller::run(), ([=] {
+	// Reset the controller.
+	_space.store(regs::cc, _space.load(regs::cc) & ~cc_bits::enable);
+	_waitReady(false);
+
+	// Setup the admin queue.
+	auto admin_depth = std::min(adminQueueDepth, _maxQueueEntries);
+	_adminQueue = std::make_unique<Queue>(0, admin_depth, &_dmaPool,
+			_space, _doorbellStride);
+	_space.store(regs::aqa, (admin_depth - 1) | ((admin_depth - 1) << 16));
+	_space.store(regs::asq, _adminQueue->sqPhysical());
+	_space.store(regs::acq, _adminQueue->cqPhysical());
+
+	// Enable the controller with 64-byte SQ entries, 16-byte CQ entries and 4 KiB pages.
+	_space.store(regs::cc, (6 << cc_bits::sqEntrySizeShift)
+			| (4 << cc_bits::cqEntrySizeShift) | cc_bits::enable);
+	_waitReady(true);
+
+	_handleIrqs();
+
+	// Identify the controller.
+	arch::dma_buffer identify_controller{&_dmaPool, pageSize};
+	{
+		Command command;
+		command.entry.command = kAdminIdentify;
+		command.entry.cdw10 = kIdentifyController;
+		command.buffer = identify_controller.data();
+		command.size = pageSize;
+		COFIBER_AWAIT _submitAdmin(&command);
+	}
+
+	auto id = reinterpret_cast<uint8_t *>(identify_controller.data());
+	char model[41];
+	memcpy(model, id + identify::controllerModel, 40);
+	model[40] = 0;
+
+	_maxTransferSize = (maxPrpEntries - 1) * pageSize;
+	if(auto mdts = id[identify::controllerMdts]; mdts)
+		_maxTransferSize = std::min(_maxTransferSize, pageSize << mdts);
+
+	_volatileWriteCache = id[identify::controllerVwc] & 1;
+
+	uint32_t num_namespaces;
+	memcpy(&num_namespaces, id + identify::controllerNumNamespaces, sizeof(uint32_t));
+	std::cout << "nvme: " << model << ", " << num_namespaces << " namespace(s)"
+			<< (_volatileWriteCache ? ", volatile write cache" : "") << std::endl;
+
+	// Request I/O queues. The controller may grant fewer than we ask for.
+	unsigned int num_queues;
+	{
+		Command command;
+		command.entry.command = kAdminSetFeatures;
+		command.entry.cdw10 = kFeatureNumQueues;
+		command.entry.cdw11 = (numIoQueues - 1) | ((numIoQueues - 1) << 16);
+		COFIBER_AWAIT _submitAdmin(&command);
+		auto granted_sqs = (command.result & 0xFFFF) + 1;
+		auto granted_cqs = (command.result >> 16) + 1;
+		num_queues = std::min({numIoQueues, granted_sqs, granted_cqs});
+	}
+
+	auto io_depth = std::min(ioQueueDepth, _maxQueueEntries);
+	for(unsigned int i = 1; i <= num_queues; i++) {
+		auto queue = std::make_unique<Queue>(i, io_depth, &_dmaPool,
+				_space, _doorbellStride);
+
+		// TODO: Use one MSI vector per queue once protocols/hw supports MSIs.
+		Command create_cq;
+		create_cq.entry.command = kAdminCreateIoCq;
+		create_cq.entry.prp1 = queue->cqPhysical();
+		create_cq.entry.cdw10 = i | ((io_depth - 1) << 16);
+		create_cq.entry.cdw11 = kQueuePhysContiguous | kQueueIrqEnable;
+		COFIBER_AWAIT _submitAdmin(&create_cq);
+
+		Command create_sq;
+		create_sq.entry.command = kAdminCreateIoSq;
+		create_sq.entry.prp1 = queue->sqPhysical();
+		create_sq.entry.cdw10 = i | ((io_depth - 1) << 16);
+		create_sq.entry.cdw11 = kQueuePhysContiguous | (i << 16);
+		COFIBER_AWAIT _submitAdmin(&create_sq);
+
+		_ioQueues.push_back(std::move(queue));
+	}
+	std::cout << "nvme: Using " << num_queues << " I/O queue(s) with "
+			<< io_depth << " entries" << std::endl;
+
+	// TODO: libblockfs only supports one device per process; use the first namespace.
+	arch::dma_buffer identify_namespace{&_dmaPool, pageSize};
+	{
+		Command command;
+		command.entry.command = kAdminIdentify;
+		command.entry.nsid = 1;
+		command.entry.cdw10 = kIdentifyNamespace;
+		command.buffer = identify_namespace.data();
+		command.size = pageSize;
+		COFIBER_AWAIT _submitAdmin(&command);
+	}
+
+	auto ns = reinterpret_cast<uint8_t *>(identify_namespace.data());
+	uint64_t num_lbas;
+	memcpy(&num_lbas, ns + identify::namespaceSize, sizeof(uint64_t));
+	auto format = ns[identify::namespaceFormattedLbaSize] & 0xF;
+	uint32_t lba_format;
+	memcpy(&lba_format, ns + identify::namespaceLbaFormats + 4 * format, sizeof(uint32_t));
+	size_t lba_size = size_t(1) << ((lba_format >> 16) & 0xFF);
+	std::cout << "nvme: Namespace 1 has " << num_lbas << " blocks of "
+			<< lba_size << " bytes" << std::endl;
+
+	_namespace = std::make_unique<Namespace>(this, 1, lba_size, num_lbas);
+	blockfs::runDevice(_namespace.get());
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, Controller::_submitAdmin(Command *command),
+		([=] {
+	_adminQueue->submitCommand(command);
+	COFIBER_AWAIT command->promise.async_get();
+	if(command->status) {
+		std::cout << "\e[31m" "nvme: Admin command 0x" << std::hex
+				<< (command->entry.command & 0xFF) << " failed with status 0x"
+				<< command->status << std::dec << "\e[39m" << std::endl;
+		throw std::runtime_error("nvme: Admin command failed");
+	}
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<blockfs::IoError>, Controller::_transfer(unsigned int nsid, bool write,
+		uint64_t lba, void *buffer, size_t num_lbas, size_t lba_size), ([=] {
+	assert(!_ioQueues.empty());
+	auto max_lbas = std::min(size_t(65536), _maxTransferSize / lba_size);
+	assert(max_lbas);
+
+	// Submit all commands at once and spread them among the queues.
+	std::vector<Command *> commands;
+	for(size_t progress = 0; progress < num_lbas; progress += max_lbas) {
+		auto chunk = std::min(num_lbas - progress, max_lbas);
+		auto command = new Command;
+		command->entry.command = write ? kIoWrite : kIoRead;
+		command->entry.nsid = nsid;
+		command->entry.cdw10 = (lba + progress) & 0xFFFFFFFF;
+		command->entry.cdw11 = (lba + progress) >> 32;
+		command->entry.cdw12 = chunk - 1;
+		command->buffer = (char *)buffer + progress * lba_size;
+		command->size = chunk * lba_size;
+		commands.push_back(command);
+
+		if(logCommands)
+			std::cout << "nvme: " << (write ? "Writing " : "Reading ") << chunk
+					<< " blocks at " << (lba + progress) << std::endl;
+
+		auto queue = _ioQueues[_nextQueue].get();
+		_nextQueue = (_nextQueue + 1) % _ioQueues.size();
+		queue->submitCommand(command);
+	}
+
+	// Wait for all commands even if one of them fails; they reference the buffer.
+	auto error = blockfs::IoError::none;
+	for(auto command : commands) {
+		COFIBER_AWAIT command->promise.async_get();
+		if(command->status) {
+			std::cout << "\e[31m" "nvme: I/O command at block " << command->entry.cdw10
+					<< " failed with status 0x" << std::hex << command->status
+					<< std::dec << "\e[39m" << std::endl;
+			error = blockfs::IoError::deviceError;
+		}
+		delete command;
+	}
+
+	COFIBER_RETURN(error);
+}))
+
+COFIBER_ROUTINE(async::result<blockfs::IoError>, Controller::_flush(unsigned int nsid),
+		([=] {
+	if(!_volatileWriteCache)
+		COFIBER_RETURN(blockfs::IoError::none);
+
+	// The flush covers all writes that completed before it, regardless of their queue.
+	Command command;
+	command.entry.command = kIoFlush;
+	command.entry.nsid = nsid;
+	auto queue = _ioQueues[_nextQueue].get();
+	_nextQueue = (_nextQueue + 1) % _ioQueues.size();
+	queue->submitCommand(&command);
+
+	COFIBER_AWAIT command.promise.async_get();
+	if(command.status) {
+		std::cout << "\e[31m" "nvme: Flush failed with status 0x" << std::hex
+				<< command.status << std::dec << "\e[39m" << std::endl;
+		COFIBER_RETURN(blockfs::IoError::deviceError);
+	}
+	COFIBER_RETURN(blockfs::IoError::none);
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, Controller::_handleIrqs(), ([=] {
+	COFIBER_AWAIT _hwDevice.enableBusIrq();
+
+	// TODO: The kick here should not be required.
+	HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckKick, 0));
+
+	uint64_t sequence = 0;
+	while(true) {
+		helix::AwaitEvent await;
+		auto &&submit = helix::submitAwaitEvent(_irq, &await, sequence,
+				helix::Dispatcher::global());
+		COFIBER_AWAIT(submit.async_wait());
+		HEL_CHECK(await.error());
+		sequence = await.sequence();
+
+		// All queues share the pin-based IRQ; drain each of them in one pass.
+		bool any = _adminQueue->processCompletions();
+		for(auto &queue : _ioQueues)
+			if(queue->processCompletions())
+				any = true;
+
+		if(!any) {
+			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, sequence));
+			continue;
+		}
+		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
+	}
+}))
+
+// ----------------------------------------------------------------
+// Freestanding PCI discovery functions.
+// ----------------------------------------------------------------
+
+// TODO: Support more than one controller.
+Controller *globalController;
+bool foundController = false;
+
+COFIBER_ROUTINE(cofiber::no_future, bindController(mbus::Entity entity), ([=] {
+	protocols::hw::Device device(COFIBER_AWAIT entity.bind());
+	auto info = COFIBER_AWAIT device.getPciInfo();
+	assert(info.barInfo[0].ioType == protocols::hw::IoType::kIoTypeMemory);
+	auto bar = COFIBER_AWAIT device.accessBar(0);
+	auto irq = COFIBER_AWAIT device.accessIrq();
+
+	// Enable bus mastering and memory space in the PCI command register.
+	auto command = COFIBER_AWAIT device.loadPciSpace(0x04, 2);
+	COFIBER_AWAIT device.storePciSpace(0x04, 2, command | 0x06);
+
+	helix::Mapping mapping{bar, info.barInfo[0].offset, info.barInfo[0].length};
+	globalController = new Controller{std::move(device), std::move(mapping),
+			std::move(bar), std::move(irq)};
+	globalController->run();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, observeControllers(), ([] {
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-class", "01"),
+		mbus::EqualsFilter("pci-subclass", "08"),
+		mbus::EqualsFilter("pci-interface", "02")
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties) {
+		if(foundController) {
+			std::cout << "nvme: Ignoring additional controller" << std::endl;
+			return;
+		}
+		foundController = true;
+		std::cout << "nvme: Detected controller" << std::endl;
+		bindController(std::move(entity));
+	});
+
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+}))
+
+// --------------------------------------------------------
+// main() function
+// --------------------------------------------------------
+
+int main() {
+	printf("nvme: Starting driver\n");
+
+	{
+		async::queue_scope scope{helix::globalQueue()};
+		observeControllers();
+	}
+
+	helix::globalQueue()->run();
+}
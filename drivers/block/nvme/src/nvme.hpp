@@ -0,0 +1,167 @@
+
+#ifndef NVME_NVME_HPP
+#define NVME_NVME_HPP
+
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include <arch/dma_pool.hpp>
+#include <arch/dma_structs.hpp>
+#include <arch/mem_space.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+#include <cofiber.hpp>
+#include <helix/ipc.hpp>
+#include <helix/memory.hpp>
+#include <protocols/hw/client.hpp>
+
+#include "spec.hpp"
+
+struct Controller;
+
+// ----------------------------------------------------------------
+// Command.
+// ----------------------------------------------------------------
+
+struct Command {
+	Command();
+
+	// Filled in by the submitter. The command ID and PRPs are set up by the Queue.
+	SubmissionEntry entry;
+
+	// Data buffer of the command (if any).
+	void *buffer;
+	size_t size;
+
+	// Results of the command.
+	uint16_t status;
+	uint32_t result;
+
+	async::promise<void> promise;
+};
+
+// ----------------------------------------------------------------
+// Queue.
+// ----------------------------------------------------------------
+
+// A submission/completion queue pair.
+struct Queue {
+	Queue(unsigned int id, size_t depth, arch::dma_pool *pool,
+			arch::mem_space doorbells, unsigned int stride);
+
+	unsigned int id() {
+		return _id;
+	}
+
+	size_t depth() {
+		return _depth;
+	}
+
+	uintptr_t sqPhysical();
+	uintptr_t cqPhysical();
+
+	// Queues a command. The command's promise is fulfilled on completion.
+	void submitCommand(Command *command);
+
+	// Retires all completed commands. Returns false if there were none.
+	bool processCompletions();
+
+private:
+	// Moves commands from _pendingQueue to the submission queue.
+	void _submitPending();
+
+	void _setupPrps(uint16_t cid, SubmissionEntry *entry, void *buffer, size_t size);
+
+	unsigned int _id;
+	size_t _depth;
+	arch::mem_space _doorbells;
+	arch::scalar_register<uint32_t> _sqTailDoorbell;
+	arch::scalar_register<uint32_t> _cqHeadDoorbell;
+
+	arch::dma_buffer _sqMemory;
+	arch::dma_buffer _cqMemory;
+	SubmissionEntry *_sq;
+	CompletionEntry *_cq;
+
+	uint16_t _sqTail;
+	uint16_t _cqHead;
+	uint16_t _phase;
+
+	// Per-command PRP lists, indexed by command ID.
+	std::vector<arch::dma_array<uint64_t>> _prpLists;
+
+	std::vector<Command *> _activeCommands;
+	std::vector<uint16_t> _freeIds;
+	std::queue<Command *> _pendingQueue;
+};
+
+// ----------------------------------------------------------------
+// Namespace.
+// ----------------------------------------------------------------
+
+struct Namespace : blockfs::BlockDevice {
+	Namespace(Controller *controller, unsigned int nsid, size_t lba_size, uint64_t num_lbas);
+
+	async::result<blockfs::IoError> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<blockfs::IoError> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<blockfs::IoError> flush() override;
+
+private:
+	Controller *_controller;
+	unsigned int _nsid;
+	uint64_t _numLbas;
+};
+
+// ----------------------------------------------------------------
+// Controller.
+// ----------------------------------------------------------------
+
+struct Controller {
+	friend struct Namespace;
+
+	Controller(protocols::hw::Device hw_device, helix::Mapping mapping,
+			helix::UniqueDescriptor mmio, helix::UniqueDescriptor irq);
+
+	cofiber::no_future run();
+
+private:
+	// Submits an admin command and waits for its completion.
+	async::result<void> _submitAdmin(Command *command);
+
+	// Splits a transfer into I/O commands that are spread among all I/O queues.
+	async::result<blockfs::IoError> _transfer(unsigned int nsid, bool write, uint64_t lba,
+			void *buffer, size_t num_lbas, size_t lba_size);
+
+	// Commits the volatile write cache (if any) to non-volatile media.
+	async::result<blockfs::IoError> _flush(unsigned int nsid);
+
+	void _waitReady(bool ready);
+
+	cofiber::no_future _handleIrqs();
+
+	protocols::hw::Device _hwDevice;
+	helix::Mapping _mapping;
+	helix::UniqueDescriptor _mmio;
+	helix::UniqueDescriptor _irq;
+	arch::mem_space _space;
+
+	arch::contiguous_pool _dmaPool;
+
+	unsigned int _doorbellStride;
+	size_t _maxQueueEntries;
+	size_t _maxTransferSize;
+	bool _volatileWriteCache;
+
+	std::unique_ptr<Queue> _adminQueue;
+	std::vector<std::unique_ptr<Queue>> _ioQueues;
+	size_t _nextQueue;
+
+	std::unique_ptr<Namespace> _namespace;
+};
+
+#endif // NVME_NVME_HPP
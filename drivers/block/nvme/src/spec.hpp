@@ -0,0 +1,119 @@
+
+#ifndef NVME_SPEC_HPP
+#define NVME_SPEC_HPP
+
+#include <stdint.h>
+#include <arch/register.hpp>
+#include <arch/variable.hpp>
+
+//-------------------------------------------------
+// registers
+//-------------------------------------------------
+
+namespace regs {
+	inline constexpr arch::scalar_register<uint64_t> cap{0x00};
+	inline constexpr arch::scalar_register<uint32_t> vs{0x08};
+	inline constexpr arch::scalar_register<uint32_t> intms{0x0C};
+	inline constexpr arch::scalar_register<uint32_t> intmc{0x10};
+	inline constexpr arch::scalar_register<uint32_t> cc{0x14};
+	inline constexpr arch::scalar_register<uint32_t> csts{0x1C};
+	inline constexpr arch::scalar_register<uint32_t> aqa{0x24};
+	inline constexpr arch::scalar_register<uint64_t> asq{0x28};
+	inline constexpr arch::scalar_register<uint64_t> acq{0x30};
+}
+
+inline constexpr size_t doorbellBase = 0x1000;
+
+namespace cap_bits {
+	inline constexpr uint64_t maxEntriesMask = 0xFFFF;
+	inline constexpr int timeoutShift = 24;
+	inline constexpr uint64_t timeoutMask = 0xFF;
+	inline constexpr int strideShift = 32;
+	inline constexpr uint64_t strideMask = 0xF;
+	inline constexpr int minPageSizeShift = 48;
+	inline constexpr uint64_t minPageSizeMask = 0xF;
+}
+
+namespace cc_bits {
+	inline constexpr uint32_t enable = uint32_t(1) << 0;
+	inline constexpr int pageSizeShift = 7;
+	inline constexpr int sqEntrySizeShift = 16;
+	inline constexpr int cqEntrySizeShift = 20;
+}
+
+namespace csts_bits {
+	inline constexpr uint32_t ready = uint32_t(1) << 0;
+	inline constexpr uint32_t fatal = uint32_t(1) << 1;
+}
+
+//-------------------------------------------------
+// queue entries
+//-------------------------------------------------
+
+struct SubmissionEntry {
+	uint32_t command; // Opcode in bits 0-7, command ID in bits 16-31.
+	uint32_t nsid;
+	uint32_t reserved[2];
+	uint64_t metadata;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+};
+static_assert(sizeof(SubmissionEntry) == 64, "Bad sizeof(SubmissionEntry)");
+
+struct CompletionEntry {
+	arch::scalar_variable<uint32_t> result;
+	arch::scalar_variable<uint32_t> reserved;
+	arch::scalar_variable<uint16_t> sqHead;
+	arch::scalar_variable<uint16_t> sqId;
+	arch::scalar_variable<uint16_t> commandId;
+	arch::scalar_variable<uint16_t> status; // Phase tag in bit 0.
+};
+static_assert(sizeof(CompletionEntry) == 16, "Bad sizeof(CompletionEntry)");
+
+//-------------------------------------------------
+// commands
+//-------------------------------------------------
+
+enum AdminOpcode {
+	kAdminCreateIoSq = 0x01,
+	kAdminCreateIoCq = 0x05,
+	kAdminIdentify = 0x06,
+	kAdminSetFeatures = 0x09
+};
+
+enum IoOpcode {
+	kIoFlush = 0x00,
+	kIoWrite = 0x01,
+	kIoRead = 0x02
+};
+
+enum {
+	kIdentifyNamespace = 0,
+	kIdentifyController = 1,
+
+	kFeatureNumQueues = 0x07,
+
+	// Bits of CDW11 of the queue creation commands.
+	kQueuePhysContiguous = 1,
+	kQueueIrqEnable = 2
+};
+
+// Offsets into the identify data structures.
+namespace identify {
+	inline constexpr size_t controllerModel = 24;
+	inline constexpr size_t controllerMdts = 77;
+	inline constexpr size_t controllerNumNamespaces = 516;
+	inline constexpr size_t controllerVwc = 525;
+
+	inline constexpr size_t namespaceSize = 0;
+	inline constexpr size_t namespaceFormattedLbaSize = 26;
+	inline constexpr size_t namespaceLbaFormats = 128;
+}
+
+#endif // NVME_SPEC_HPP
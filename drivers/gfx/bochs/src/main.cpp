@@ -397,8 +397,8 @@ uint32_t GfxDevice::FrameBuffer::getPixelPitch() {
 	return _pixelPitch;
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-	
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::Rect>) {
+	// Nothing to do: the device scans out directly from the BufferObject in VRAM.
 }
 
 // ----------------------------------------------------------------
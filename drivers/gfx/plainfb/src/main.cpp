@@ -259,16 +259,12 @@ COFIBER_ROUTINE(cofiber::no_future, GfxDevice::Configuration::_dispatch(), ([=]
 		auto bo = _state->fb->getBufferObject();
 		assert(bo->getWidth() == _device->_screenWidth);
 		assert(bo->getHeight() == _device->_screenHeight);
-		auto dest = reinterpret_cast<char *>(_device->_fbMapping.get());
-		auto src = reinterpret_cast<char *>(bo->accessMapping());
-		for(unsigned int k = 0; k < bo->getHeight(); k++) {
-			memcpy(dest, src, bo->getWidth() * 4);
-			dest += _device->_screenPitch;
-			src += _state->fb->getPitch();
-		}
+		_state->fb->blit({drm_core::Rect{0, 0, bo->getWidth(), bo->getHeight()}});
+		_device->_displayedFb = _state->fb;
 	}else if(_state) {
 		assert(!_state->mode);
 		std::cout << "gfx/plainfb: Disable scanout" << std::endl;
+		_device->_displayedFb = nullptr;
 	}
 
 	complete();
@@ -310,7 +306,15 @@ drm_core::Plane *GfxDevice::Crtc::primaryPlane() {
 GfxDevice::FrameBuffer::FrameBuffer(GfxDevice *device,
 		std::shared_ptr<GfxDevice::BufferObject> bo, size_t pitch)
 : drm_core::FrameBuffer{device->allocator.allocate()},
-		_device{device}, _bo{std::move(bo)}, _pitch{pitch} { }
+		_device{device}, _bo{std::move(bo)}, _pitch{pitch},
+		_damage{_bo->getWidth(), _bo->getHeight(), [this] (std::vector<drm_core::Rect> rects) {
+			return _update(std::move(rects));
+		}} { }
+
+GfxDevice::FrameBuffer::~FrameBuffer() {
+	if(_device->_displayedFb == this)
+		_device->_displayedFb = nullptr;
+}
 
 size_t GfxDevice::FrameBuffer::getPitch() {
 	return _pitch;
@@ -320,9 +324,31 @@ GfxDevice::BufferObject *GfxDevice::FrameBuffer::getBufferObject() {
 	return _bo.get();
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-	// TODO: Re-blit the FrameBuffer if it is currently displayed.
-	std::cout << "gfx/plainfb: notifyDirty() is not implemented correctly" << std::endl;
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::Rect> rects) {
+	_damage.add(rects);
+}
+
+COFIBER_ROUTINE(async::result<void>, GfxDevice::FrameBuffer::_update(
+		std::vector<drm_core::Rect> rects), ([=] {
+	// Damage of FrameBuffers that are not on the screen can be discarded;
+	// they are blitted completely once they are displayed.
+	if(_device->_displayedFb == this)
+		blit(rects);
+	COFIBER_RETURN();
+}))
+
+void GfxDevice::FrameBuffer::blit(const std::vector<drm_core::Rect> &rects) {
+	auto screen = reinterpret_cast<char *>(_device->_fbMapping.get());
+	auto buffer = reinterpret_cast<char *>(_bo->accessMapping());
+	for(auto &rect : rects) {
+		auto dest = screen + rect.y1 * _device->_screenPitch + rect.x1 * 4;
+		auto src = buffer + rect.y1 * _pitch + rect.x1 * 4;
+		for(uint32_t k = 0; k < rect.height(); k++) {
+			memcpy(dest, src, rect.width() * 4);
+			dest += _device->_screenPitch;
+			src += _pitch;
+		}
+	}
 }
 
 // ----------------------------------------------------------------
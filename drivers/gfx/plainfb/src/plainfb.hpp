@@ -88,15 +88,23 @@ struct GfxDevice : drm_core::Device, std::enable_shared_from_this<GfxDevice> {
 		FrameBuffer(GfxDevice *device, std::shared_ptr<GfxDevice::BufferObject> bo,
 				size_t pitch);
 
+		~FrameBuffer();
+
 		size_t getPitch();
 
 		GfxDevice::BufferObject *getBufferObject();
-		void notifyDirty() override;
+		void notifyDirty(std::vector<drm_core::Rect> rects) override;
+
+		// Copies the given rectangles to the screen.
+		void blit(const std::vector<drm_core::Rect> &rects);
 
 	private:
+		async::result<void> _update(std::vector<drm_core::Rect> rects);
+
 		GfxDevice *_device;
 		std::shared_ptr<GfxDevice::BufferObject> _bo;
 		size_t _pitch;
+		drm_core::DamageScheduler _damage;
 	};
 
 	GfxDevice(protocols::hw::Device hw_device,
@@ -105,7 +113,7 @@ struct GfxDevice : drm_core::Device, std::enable_shared_from_this<GfxDevice> {
 	: _hwDevice{std::move(hw_device)},
 			_screenWidth{screen_width}, _screenHeight{screen_height},
 			_screenPitch{screen_pitch},_fbMapping{std::move(fb_mapping)},
-			_claimedDevice{false} { }
+			_displayedFb{nullptr}, _claimedDevice{false} { }
 	
 	cofiber::no_future initialize();
 	std::unique_ptr<drm_core::Configuration> createConfiguration() override;
@@ -129,6 +137,8 @@ private:
 	std::shared_ptr<Encoder> _theEncoder;
 	std::shared_ptr<Connector> _theConnector;
 
+	// The FrameBuffer that is currently shown on the screen (or null).
+	FrameBuffer *_displayedFb;
 	bool _claimedDevice;
 };
 
@@ -119,8 +119,70 @@ private:
 	cofiber::coroutine_handle<> _handle;
 };
 
+// Builds multiple control commands and submits them with a single notification of the device.
+// Command and response buffers must stay alive until submit() completes.
+struct CommandBatch {
+	CommandBatch(virtio_core::Queue *queue)
+	: _queue{queue}, _pending{0} { }
+
+	CommandBatch(const CommandBatch &) = delete;
+
+	CommandBatch &operator= (const CommandBatch &) = delete;
+
+	// Posts the command to the virtq but does not notify the device yet.
+	async::result<void> add(arch::dma_buffer_view command, arch::dma_buffer_view response);
+
+	// Notifies the device and completes once all commands are completed.
+	async::result<void> submit();
+
+private:
+	struct Command : virtio_core::Request {
+		CommandBatch *batch;
+	};
+
+	static void _complete(virtio_core::Request *base) {
+		auto self = static_cast<Command *>(base)->batch;
+		assert(self->_pending);
+		if(!--self->_pending)
+			self->_done.trigger();
+	}
+
+	virtio_core::Queue *_queue;
+	// std::deque keeps the Commands at stable addresses.
+	std::deque<Command> _commands;
+	size_t _pending;
+	async::jump _done;
+};
+
+COFIBER_ROUTINE(async::result<void>, CommandBatch::add(arch::dma_buffer_view command,
+		arch::dma_buffer_view response), ([=] {
+	virtio_core::Chain chain;
+	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice, chain, _queue, command);
+	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost, chain, _queue, response);
+
+	auto &slot = _commands.emplace_back();
+	slot.batch = this;
+	_pending++;
+	_queue->postDescriptor(chain.front(), &slot, &CommandBatch::_complete);
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, CommandBatch::submit(), ([=] {
+	if(!_pending)
+		COFIBER_RETURN();
+	_queue->notify();
+	COFIBER_AWAIT _done.async_wait();
+	COFIBER_RETURN();
+}))
+
 GfxDevice::GfxDevice(std::unique_ptr<virtio_core::Transport> transport)
-: _transport{std::move(transport)}, _claimedDevice{false} { }
+: _transport{std::move(transport)}, _claimedDevice{false}, _lastFence{0} { }
+
+uint64_t GfxDevice::fenceCommand(spec::Header &header) {
+	header.flags |= spec::flags::fence;
+	header.fenceId = ++_lastFence;
+	return header.fenceId;
+}
 
 COFIBER_ROUTINE(cofiber::no_future, GfxDevice::initialize(), ([=] { 
 	_transport->finalizeFeatures();
@@ -328,6 +390,21 @@ void GfxDevice::Configuration::commit() {
 }
 
 COFIBER_ROUTINE(cofiber::no_future, GfxDevice::Configuration::_dispatch(), ([=] {
+	// Commands of all scanouts are submitted as a single batch.
+	struct ScanoutCommands {
+		spec::XferToHost2d xfer;
+		spec::SetScanout scanout;
+		spec::ResourceFlush flush;
+		spec::Header xferResult;
+		spec::Header scanoutResult;
+		spec::Header flushResult;
+		uint64_t fence;
+	};
+
+	std::array<ScanoutCommands, 16> commands;
+	memset(commands.data(), 0, sizeof(ScanoutCommands) * commands.size());
+	CommandBatch batch{_device->_controlQ};
+
 	for(size_t i = 0; i < _state.size(); i++) {
 		if(!_state[i])
 			continue;
@@ -337,23 +414,15 @@ COFIBER_ROUTINE(cofiber::no_future, GfxDevice::Configuration::_dispatch(), ([=]
 			_device->_claimedDevice = true;
 		}
 
+		auto &cmds = commands[i];
+
 		if(!_state[i]->mode) {
 			std::cout << "gfx/virtio: Disable scanout" << std::endl;
-			spec::SetScanout scanout;
-			memset(&scanout, 0, sizeof(spec::SetScanout));
-			scanout.header.type = spec::cmd::setScanout;
-
-			spec::Header scanout_result;
-			virtio_core::Request scanout_request;	
-			virtio_core::Chain scanout_chain;
-			COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice,
-					scanout_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &scanout, sizeof(spec::SetScanout)});
-			COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost,
-					scanout_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &scanout_result, sizeof(spec::Header)});
-			COFIBER_AWAIT AwaitableRequest{_device->_controlQ, scanout_chain.front()};
-			
+			cmds.scanout.header.type = spec::cmd::setScanout;
+			cmds.scanout.scanoutId = i;
+			COFIBER_AWAIT batch.add(
+					arch::dma_buffer_view{nullptr, &cmds.scanout, sizeof(spec::SetScanout)},
+					arch::dma_buffer_view{nullptr, &cmds.scanoutResult, sizeof(spec::Header)});
 			continue;
 		}
 
@@ -362,66 +431,49 @@ COFIBER_ROUTINE(cofiber::no_future, GfxDevice::Configuration::_dispatch(), ([=]
 //		std::cout << "Swap to framebuffer " << _state[i]->fb->id()
 //				<< " " << _state[i]->width << "x" << _state[i]->height << std::endl;
 
-		spec::XferToHost2d xfer;
-		memset(&xfer, 0, sizeof(spec::XferToHost2d));
-		xfer.header.type = spec::cmd::xferToHost2d;
-		xfer.rect.x = 0;
-		xfer.rect.y = 0;
-		xfer.rect.width = _state[i]->width;
-		xfer.rect.height = _state[i]->height;
-		xfer.resourceId = _state[i]->fb->getBufferObject()->hardwareId();
-
-		spec::Header xfer_result;
-		virtio_core::Chain xfer_chain;
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice,
-				xfer_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &xfer, sizeof(spec::XferToHost2d)});
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost,
-				xfer_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &xfer_result, sizeof(spec::Header)});
-		COFIBER_AWAIT AwaitableRequest{_device->_controlQ, xfer_chain.front()};
-		assert(xfer_result.type == spec::resp::noData);
+		auto resource_id = _state[i]->fb->getBufferObject()->hardwareId();
+
+		cmds.xfer.header.type = spec::cmd::xferToHost2d;
+		cmds.xfer.rect.width = _state[i]->width;
+		cmds.xfer.rect.height = _state[i]->height;
+		cmds.xfer.resourceId = resource_id;
+		COFIBER_AWAIT batch.add(
+				arch::dma_buffer_view{nullptr, &cmds.xfer, sizeof(spec::XferToHost2d)},
+				arch::dma_buffer_view{nullptr, &cmds.xferResult, sizeof(spec::Header)});
+
+		cmds.scanout.header.type = spec::cmd::setScanout;
+		cmds.scanout.rect.width = _state[i]->width;
+		cmds.scanout.rect.height = _state[i]->height;
+		cmds.scanout.scanoutId = i;
+		cmds.scanout.resourceId = resource_id;
+		COFIBER_AWAIT batch.add(
+				arch::dma_buffer_view{nullptr, &cmds.scanout, sizeof(spec::SetScanout)},
+				arch::dma_buffer_view{nullptr, &cmds.scanoutResult, sizeof(spec::Header)});
+
+		// The page flip is complete once the device signals the fence of the flush.
+		cmds.flush.header.type = spec::cmd::resourceFlush;
+		cmds.fence = _device->fenceCommand(cmds.flush.header);
+		cmds.flush.rect.width = _state[i]->width;
+		cmds.flush.rect.height = _state[i]->height;
+		cmds.flush.resourceId = resource_id;
+		COFIBER_AWAIT batch.add(
+				arch::dma_buffer_view{nullptr, &cmds.flush, sizeof(spec::ResourceFlush)},
+				arch::dma_buffer_view{nullptr, &cmds.flushResult, sizeof(spec::Header)});
+	}
 
-		spec::SetScanout scanout;
-		memset(&scanout, 0, sizeof(spec::SetScanout));
-		scanout.header.type = spec::cmd::setScanout;
-		scanout.rect.x = 0;
-		scanout.rect.y = 0;
-		scanout.rect.width = _state[i]->width;
-		scanout.rect.height = _state[i]->height;
-		scanout.scanoutId = i;
-		scanout.resourceId = _state[i]->fb->getBufferObject()->hardwareId();
-
-		spec::Header scanout_result;
-		virtio_core::Chain scanout_chain;
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice,
-				scanout_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &scanout, sizeof(spec::SetScanout)});
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost,
-				scanout_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &scanout_result, sizeof(spec::Header)});
-		COFIBER_AWAIT AwaitableRequest{_device->_controlQ, scanout_chain.front()};
-		assert(scanout_result.type == spec::resp::noData);
+	COFIBER_AWAIT batch.submit();
 
-		spec::ResourceFlush flush;
-		memset(&flush, 0, sizeof(spec::ResourceFlush));
-		flush.header.type = spec::cmd::resourceFlush;
-		flush.rect.x = 0;
-		flush.rect.y = 0;
-		flush.rect.width = _state[i]->width;
-		flush.rect.height = _state[i]->height;
-		flush.resourceId = _state[i]->fb->getBufferObject()->hardwareId();
-
-		spec::Header flush_result;
-		virtio_core::Chain flush_chain;
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice,
-				flush_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &flush, sizeof(spec::ResourceFlush)});
-		COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost,
-				flush_chain, _device->_controlQ,
-				arch::dma_buffer_view{nullptr, &flush_result, sizeof(spec::Header)});
-		COFIBER_AWAIT AwaitableRequest{_device->_controlQ, flush_chain.front()};
-		assert(flush_result.type == spec::resp::noData);
+	for(size_t i = 0; i < _state.size(); i++) {
+		if(!_state[i])
+			continue;
+		auto &cmds = commands[i];
+		assert(cmds.scanoutResult.type == spec::resp::noData);
+		if(!_state[i]->mode)
+			continue;
+		assert(cmds.xferResult.type == spec::resp::noData);
+		assert(cmds.flushResult.type == spec::resp::noData);
+		assert(cmds.flushResult.flags & spec::flags::fence);
+		assert(cmds.flushResult.fenceId == cmds.fence);
 	}
 
 	complete();
@@ -469,7 +521,10 @@ int GfxDevice::Crtc::scanoutId() {
 
 GfxDevice::FrameBuffer::FrameBuffer(GfxDevice *device,
 		std::shared_ptr<GfxDevice::BufferObject> bo)
-: drm_core::FrameBuffer { device->allocator.allocate() } {
+: drm_core::FrameBuffer { device->allocator.allocate() },
+		_damage{bo->getWidth(), bo->getHeight(), [device, bo] (std::vector<drm_core::Rect> rects) {
+			return _xferAndFlush(device, bo, std::move(rects));
+		}} {
 	_bo = bo;
 	_device = device;
 }
@@ -478,47 +533,67 @@ GfxDevice::BufferObject *GfxDevice::FrameBuffer::getBufferObject() {
 	return _bo.get();
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-	_xferAndFlush();
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::Rect> rects) {
+	_damage.add(rects);
 }
 
-COFIBER_ROUTINE(cofiber::no_future, GfxDevice::FrameBuffer::_xferAndFlush(), ([=] {
-	spec::XferToHost2d xfer;
-	memset(&xfer, 0, sizeof(spec::XferToHost2d));
-	xfer.header.type = spec::cmd::xferToHost2d;
-	xfer.rect.x = 0;
-	xfer.rect.y = 0;
-	xfer.rect.width = _bo->getWidth();
-	xfer.rect.height = _bo->getHeight();
-	xfer.resourceId = _bo->hardwareId();
-
-	spec::Header xfer_result;
-	virtio_core::Request xfer_request;	
-	virtio_core::Chain xfer_chain;
-	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice, xfer_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &xfer, sizeof(spec::XferToHost2d)});
-	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost, xfer_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &xfer_result, sizeof(spec::Header)});
-	COFIBER_AWAIT AwaitableRequest{_device->_controlQ, xfer_chain.front()};
-		
-	spec::ResourceFlush flush;
-	memset(&flush, 0, sizeof(spec::ResourceFlush));
-	flush.header.type = spec::cmd::resourceFlush;
-	flush.rect.x = 0;
-	flush.rect.y = 0;
-	flush.rect.width = _bo->getWidth();
-	flush.rect.height = _bo->getHeight();
-	flush.resourceId = _bo->hardwareId();
-
-	spec::Header flush_result;
-	virtio_core::Request flush_request;	
-	virtio_core::Chain flush_chain;
-	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::hostToDevice, flush_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &flush, sizeof(spec::ResourceFlush)});
-	COFIBER_AWAIT virtio_core::scatterGather(virtio_core::deviceToHost, flush_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &flush_result, sizeof(spec::Header)});
-	COFIBER_AWAIT AwaitableRequest{_device->_controlQ, flush_chain.front()};
-}));
+COFIBER_ROUTINE(async::result<void>, GfxDevice::FrameBuffer::_xferAndFlush(GfxDevice *device,
+		std::shared_ptr<GfxDevice::BufferObject> bo, std::vector<drm_core::Rect> rects), ([=] {
+	// Transfers and flushes of all rectangles are submitted as a single batch.
+	struct RectCommands {
+		spec::XferToHost2d xfer;
+		spec::ResourceFlush flush;
+		spec::Header xferResult;
+		spec::Header flushResult;
+	};
+
+	std::vector<RectCommands> commands(rects.size());
+	memset(commands.data(), 0, sizeof(RectCommands) * commands.size());
+	CommandBatch batch{device->_controlQ};
+
+	uint64_t fence = 0;
+	for(size_t i = 0; i < rects.size(); i++) {
+		auto &rect = rects[i];
+		auto &cmds = commands[i];
+
+		// The offset refers to the backing storage of the resource (4 bytes per pixel).
+		cmds.xfer.header.type = spec::cmd::xferToHost2d;
+		cmds.xfer.rect.x = rect.x1;
+		cmds.xfer.rect.y = rect.y1;
+		cmds.xfer.rect.width = rect.width();
+		cmds.xfer.rect.height = rect.height();
+		cmds.xfer.offset = (uint64_t(rect.y1) * bo->getWidth() + rect.x1) * 4;
+		cmds.xfer.resourceId = bo->hardwareId();
+		COFIBER_AWAIT batch.add(
+				arch::dma_buffer_view{nullptr, &cmds.xfer, sizeof(spec::XferToHost2d)},
+				arch::dma_buffer_view{nullptr, &cmds.xferResult, sizeof(spec::Header)});
+
+		// Only the last flush is fenced; the update is done once it is signaled.
+		cmds.flush.header.type = spec::cmd::resourceFlush;
+		if(i + 1 == rects.size())
+			fence = device->fenceCommand(cmds.flush.header);
+		cmds.flush.rect.x = rect.x1;
+		cmds.flush.rect.y = rect.y1;
+		cmds.flush.rect.width = rect.width();
+		cmds.flush.rect.height = rect.height();
+		cmds.flush.resourceId = bo->hardwareId();
+		COFIBER_AWAIT batch.add(
+				arch::dma_buffer_view{nullptr, &cmds.flush, sizeof(spec::ResourceFlush)},
+				arch::dma_buffer_view{nullptr, &cmds.flushResult, sizeof(spec::Header)});
+	}
+
+	COFIBER_AWAIT batch.submit();
+
+	for(auto &cmds : commands) {
+		assert(cmds.xferResult.type == spec::resp::noData);
+		assert(cmds.flushResult.type == spec::resp::noData);
+	}
+	if(!commands.empty()) {
+		assert(commands.back().flushResult.flags & spec::flags::fence);
+		assert(commands.back().flushResult.fenceId == fence);
+	}
+	COFIBER_RETURN();
+}))
 
 // ----------------------------------------------------------------
 // GfxDevice: Plane.
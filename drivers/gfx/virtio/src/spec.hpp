@@ -22,6 +22,12 @@ namespace cmd {
 	
 } //namespace cmd
 
+namespace flags {
+	// The device completes the command only after it is fully processed
+	// and echoes the fence ID in the response.
+	inline constexpr uint32_t fence = 1;
+} //namespace flags
+
 namespace resp {
 	inline constexpr uint32_t noData = 0x1100;
 	inline constexpr uint32_t displayInfo = 0x1101;
@@ -103,16 +103,23 @@ struct GfxDevice : drm_core::Device, std::enable_shared_from_this<GfxDevice> {
 		std::shared_ptr<Plane> _primaryPlane;
 	};
 
+	// Fences the command; returns the fence ID to check against the response.
+	uint64_t fenceCommand(spec::Header &header);
+
 	struct FrameBuffer : drm_core::FrameBuffer {
 		FrameBuffer(GfxDevice *device, std::shared_ptr<GfxDevice::BufferObject> bo);
 
 		GfxDevice::BufferObject *getBufferObject();
-		void notifyDirty() override;
-		cofiber::no_future _xferAndFlush();
+		void notifyDirty(std::vector<drm_core::Rect> rects) override;
 
 	private:
+		// Transfers the damaged rectangles to the host and flushes them.
+		static async::result<void> _xferAndFlush(GfxDevice *device,
+				std::shared_ptr<GfxDevice::BufferObject> bo, std::vector<drm_core::Rect> rects);
+
 		std::shared_ptr<GfxDevice::BufferObject> _bo;
 		GfxDevice *_device;
+		drm_core::DamageScheduler _damage;
 	};
 
 	GfxDevice(std::unique_ptr<virtio_core::Transport> transport);
@@ -140,6 +147,7 @@ private:
 	virtio_core::Queue *_cursorQ;
 	bool _claimedDevice;
 	uint32_t _numScanouts;
+	uint64_t _lastFence;
 	id_allocator<uint32_t> _hwAllocator;
 };
 
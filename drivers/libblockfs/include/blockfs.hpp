@@ -7,21 +7,57 @@
 
 namespace blockfs {
 
+// Status of a completed block device request.
+enum class IoError {
+	none,
+
+	// The device failed to transfer the data (e.g. due to a medium error).
+	deviceError
+};
+
 struct BlockDevice {
 	BlockDevice(size_t sector_size);
 
-	virtual async::result<void> readSectors(uint64_t sector, void *buffer,
+	virtual async::result<IoError> readSectors(uint64_t sector, void *buffer,
 			size_t num_sectors) = 0;
 
-	virtual async::result<void> writeSectors(uint64_t sector, const void *buffer,
+	virtual async::result<IoError> writeSectors(uint64_t sector, const void *buffer,
 			size_t num_sectors) {
 		throw std::runtime_error("BlockDevice does not support writeSectors()");
 	}
 
+	// Makes sure that all writes that completed before the call are on stable storage.
+	// Devices without a volatile write cache do not need to override this.
+	virtual async::result<IoError> flush();
+
 	const size_t sectorSize;
 };
 
-cofiber::no_future runDevice(BlockDevice *device);
+// Tunables of the I/O scheduler that sits between the file system and the device.
+struct SchedulerOptions {
+	// Maximal number of (merged) requests that are passed to the device at the same time.
+	size_t maxInFlight = 16;
+
+	// Upper bound on the size of merged requests.
+	size_t maxMergeBytes = 1024 * 1024;
+
+	// Requests that wait longer than this (in nanoseconds) are served first.
+	uint64_t readExpire = 50'000'000;
+	uint64_t writeExpire = 500'000'000;
+
+	// Number of read dispatches before waiting writes are served.
+	unsigned int writesStarved = 2;
+
+	// Requests that arrive at an idle device are held back for this long (in nanoseconds)
+	// so that bursts can be merged. Zero delays them until the next dispatcher iteration.
+	bool plugging = true;
+	uint64_t unplugDelay = 0;
+
+	// Print latency histograms every N completed requests (zero disables this).
+	unsigned int statisticsInterval = 0;
+};
+
+cofiber::no_future runDevice(BlockDevice *device, SchedulerOptions options = {});
 
 } // namespace blockfs
 
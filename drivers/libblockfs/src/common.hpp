@@ -2,6 +2,11 @@
 #ifndef LIBFS_COMMON_H
 #define LIBFS_COMMON_H
 
+#include <iostream>
+#include <stdexcept>
+
+#include <blockfs.hpp>
+
 namespace blockfs {
 
 enum FileType {
@@ -11,6 +16,15 @@ enum FileType {
 	kTypeSymlink
 };
 
+// The file systems cannot recover from failed device requests yet.
+// Stop instead of continuing with stale or partially written data.
+inline void checkIo(IoError error) {
+	if(error == IoError::none)
+		return;
+	std::cout << "\e[31m" "libblockfs: Device request failed" "\e[39m" << std::endl;
+	throw std::runtime_error("libblockfs: I/O error");
+}
+
 } // namespace blockfs
 
 #endif // LIBFS_COMMON_H
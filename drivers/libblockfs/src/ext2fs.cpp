@@ -11,6 +11,7 @@
 #include <helix/memory.hpp>
 
 #include "ext2fs.hpp"
+#include "htree.hpp"
 
 namespace blockfs {
 namespace ext2fs {
@@ -20,6 +21,309 @@ namespace {
 
 	constexpr int pageShift = 12;
 	constexpr size_t pageSize = size_t{1} << pageShift;
+
+	// Maximal number of manage requests per memory object that are handled concurrently.
+	constexpr unsigned int maxConcurrentManage = 16;
+
+	// Number of blocks that are preallocated beyond each allocation for file data.
+	constexpr size_t preallocWindow = 8;
+
+	// Directories without an htree get an in-memory name index once they exceed this size.
+	constexpr size_t nameIndexThreshold = 32 * 1024;
+
+	DirEntry toDirEntry(DiskDirEntry *disk_entry) {
+		DirEntry entry;
+		entry.inode = disk_entry->inode;
+
+		switch(disk_entry->fileType) {
+		case EXT2_FT_REG_FILE:
+			entry.fileType = kTypeRegular; break;
+		case EXT2_FT_DIR:
+			entry.fileType = kTypeDirectory; break;
+		case EXT2_FT_SYMLINK:
+			entry.fileType = kTypeSymlink; break;
+		default:
+			entry.fileType = kTypeNone;
+		}
+		return entry;
+	}
+
+	// Searches the entries in [begin, end) of a mapped directory. Also returns the entry
+	// that precedes the result in the same block (or nullptr if the result starts a block).
+	DiskDirEntry *searchEntries(char *dir, size_t begin, size_t end, size_t block_size,
+			const std::string &name, DiskDirEntry **previous) {
+		DiskDirEntry *previous_entry = nullptr;
+		size_t offset = begin;
+		while(offset < end) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= end);
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(dir + offset);
+			assert(disk_entry->recordLength);
+
+			if(!(offset & (block_size - 1)))
+				previous_entry = nullptr;
+
+			if(disk_entry->inode
+					&& name.length() == disk_entry->nameLength
+					&& !memcmp(disk_entry->name, name.data(), name.length())) {
+				if(previous)
+					*previous = previous_entry;
+				return disk_entry;
+			}
+
+			offset += disk_entry->recordLength;
+			previous_entry = disk_entry;
+		}
+		assert(offset == end);
+
+		return nullptr;
+	}
+
+	// Inserts a new entry into [begin, end) of a mapped directory if there is enough space.
+	DiskDirEntry *insertEntry(char *dir, size_t begin, size_t end,
+			const std::string &name, uint32_t ino) {
+		// Space required for the new directory entry.
+		auto required = (sizeof(DiskDirEntry) + name.size() + 3) & ~size_t(3);
+
+		size_t offset = begin;
+		while(offset < end) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= end);
+			auto previous_entry = reinterpret_cast<DiskDirEntry *>(dir + offset);
+
+			// Calculate available space after we contract previous_entry.
+			// Unused entries can be replaced entirely.
+			size_t contracted = 0;
+			if(previous_entry->inode)
+				contracted = (sizeof(DiskDirEntry) + previous_entry->nameLength + 3) & ~size_t(3);
+			assert(previous_entry->recordLength >= contracted);
+			auto available = previous_entry->recordLength - contracted;
+
+			// Check whether we can shrink previous_entry and insert a new entry after it.
+			if(available >= required) {
+				auto disk_entry = reinterpret_cast<DiskDirEntry *>(dir + offset + contracted);
+				memset(disk_entry, 0, sizeof(DiskDirEntry));
+				disk_entry->inode = ino;
+				disk_entry->recordLength = available;
+				disk_entry->nameLength = name.length();
+				disk_entry->fileType = EXT2_FT_REG_FILE;
+				memcpy(disk_entry->name, name.data(), name.length());
+
+				if(contracted)
+					previous_entry->recordLength = contracted;
+				return disk_entry;
+			}
+
+			offset += previous_entry->recordLength;
+		}
+		assert(offset == end);
+
+		return nullptr;
+	}
+
+	bool isUninitialized(const DiskExtent &extent) {
+		return extent.length > maxExtentLength;
+	}
+
+	uint32_t extentLength(const DiskExtent &extent) {
+		return isUninitialized(extent) ? extent.length - maxExtentLength : extent.length;
+	}
+
+	uint64_t extentStart(const DiskExtent &extent) {
+		return extent.startLo | (uint64_t(extent.startHi) << 32);
+	}
+
+	// Uninitialized extents cannot be as long as initialized ones.
+	uint32_t maxLengthOf(bool uninitialized) {
+		return uninitialized ? maxExtentLength - 1 : maxExtentLength;
+	}
+
+	void setExtent(DiskExtent &extent, uint32_t logical, uint64_t physical,
+			uint32_t length, bool uninitialized) {
+		extent.block = logical;
+		extent.length = uninitialized ? length + maxExtentLength : length;
+		extent.startHi = physical >> 32;
+		extent.startLo = static_cast<uint32_t>(physical);
+	}
+
+	// Adds an extent to a leaf of the extent tree, or extends the preceding extent.
+	// Returns false if the leaf is full. If the extent becomes the first entry of
+	// the leaf, the keys of its parents have to be updated.
+	bool insertIntoLeaf(DiskExtentHeader *header, uint32_t logical, uint64_t physical,
+			uint32_t length, bool uninitialized) {
+		auto extents = reinterpret_cast<DiskExtent *>(header + 1);
+
+		size_t pos = 0;
+		while(pos < header->numEntries && extents[pos].block < logical)
+			pos++;
+
+		if(pos) {
+			auto &previous = extents[pos - 1];
+			auto previous_length = extentLength(previous);
+			if(isUninitialized(previous) == uninitialized
+					&& previous_length + length <= maxLengthOf(uninitialized)
+					&& previous.block + previous_length == logical
+					&& extentStart(previous) + previous_length == physical) {
+				previous.length += length;
+				return true;
+			}
+		}
+
+		if(header->numEntries == header->maxEntries)
+			return false;
+
+		memmove(&extents[pos + 1], &extents[pos],
+				(header->numEntries - pos) * sizeof(DiskExtent));
+		setExtent(extents[pos], logical, physical, length, uninitialized);
+		header->numEntries++;
+		return true;
+	}
+
+	// Moves the upper half (by hash) of the entries of a full htree leaf into an empty block.
+	// Returns the lowest hash of the new block, including the continuation bit.
+	uint32_t splitLeaf(char *leaf, char *new_leaf, size_t block_size,
+			int hash_version, const uint32_t *seed) {
+		std::vector<char> copy(leaf, leaf + block_size);
+
+		std::vector<std::pair<uint32_t, DiskDirEntry *>> items;
+		size_t offset = 0;
+		while(offset < block_size) {
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(copy.data() + offset);
+			assert(disk_entry->recordLength);
+			if(disk_entry->inode)
+				items.push_back({htree::hashName(disk_entry->name, disk_entry->nameLength,
+						hash_version, seed), disk_entry});
+			offset += disk_entry->recordLength;
+		}
+		assert(items.size() >= 2);
+
+		std::stable_sort(items.begin(), items.end(), [] (const auto &a, const auto &b) {
+			return a.first < b.first;
+		});
+
+		// If the split separates equal hashes, lookups have to continue into the new block.
+		auto split = items.size() / 2;
+		auto split_hash = items[split].first;
+		if(items[split - 1].first == split_hash)
+			split_hash |= htree::continuationBit;
+
+		auto pack = [&] (char *block, size_t first, size_t last) {
+			size_t offset = 0;
+			DiskDirEntry *previous_entry = nullptr;
+			for(size_t i = first; i < last; i++) {
+				auto size = (sizeof(DiskDirEntry) + items[i].second->nameLength + 3) & ~size_t(3);
+				memcpy(block + offset, items[i].second, size);
+				previous_entry = reinterpret_cast<DiskDirEntry *>(block + offset);
+				previous_entry->recordLength = size;
+				offset += size;
+			}
+			assert(previous_entry);
+			previous_entry->recordLength += block_size - offset;
+		};
+
+		pack(leaf, 0, split);
+		pack(new_leaf, split, items.size());
+		return split_hash;
+	}
+}
+
+// --------------------------------------------------------
+// Semaphore
+// --------------------------------------------------------
+
+Semaphore::Semaphore(unsigned int limit)
+: _available(limit) { }
+
+COFIBER_ROUTINE(async::result<void>, Semaphore::acquire(), ([=] {
+	if(_available) {
+		_available--;
+		COFIBER_RETURN();
+	}
+
+	// release() hands its slot directly to the oldest waiter.
+	async::promise<void> promise;
+	_waiters.push_back(&promise);
+	COFIBER_AWAIT promise.async_get();
+	COFIBER_RETURN();
+}))
+
+void Semaphore::release() {
+	if(_waiters.empty()) {
+		_available++;
+		return;
+	}
+
+	auto promise = _waiters.front();
+	_waiters.pop_front();
+	promise->set_value();
+}
+
+// --------------------------------------------------------
+// ExtentIndex
+// --------------------------------------------------------
+
+ExtentIndex::ExtentIndex()
+: _numFree(0) { }
+
+std::pair<uint32_t, uint32_t> ExtentIndex::allocate(uint32_t goal, uint32_t max_count) {
+	assert(max_count);
+	if(_extents.empty())
+		return {0, 0};
+
+	// Removes [start, start + count) from the extent that it points to.
+	auto take = [&] (std::map<uint32_t, uint32_t>::iterator it, uint32_t start, uint32_t count) {
+		auto extent_start = it->first;
+		auto extent_end = it->first + it->second;
+		assert(start >= extent_start && start + count <= extent_end);
+
+		if(start > extent_start) {
+			it->second = start - extent_start;
+		}else{
+			_extents.erase(it);
+		}
+		if(start + count < extent_end)
+			_extents.emplace(start + count, extent_end - (start + count));
+		_numFree -= count;
+		return std::pair<uint32_t, uint32_t>{start, count};
+	};
+
+	// Try to continue directly at the goal.
+	auto it = _extents.upper_bound(goal);
+	if(it != _extents.begin()) {
+		auto prev = std::prev(it);
+		if(goal < prev->first + prev->second)
+			return take(prev, goal, std::min(max_count, prev->first + prev->second - goal));
+	}
+
+	// Otherwise, look for a run after the goal that is large enough.
+	for(auto cand = it; cand != _extents.end(); ++cand)
+		if(cand->second >= max_count)
+			return take(cand, cand->first, max_count);
+
+	// Fall back to the nearest run (wrapping around at the end of the group).
+	auto nearest = it != _extents.end() ? it : _extents.begin();
+	return take(nearest, nearest->first, std::min(max_count, nearest->second));
+}
+
+void ExtentIndex::free(uint32_t start, uint32_t count) {
+	assert(count);
+	auto it = _extents.emplace(start, count).first;
+	_numFree += count;
+
+	// Merge with the following and preceding extents.
+	auto next = std::next(it);
+	if(next != _extents.end() && it->first + it->second == next->first) {
+		it->second += next->second;
+		_extents.erase(next);
+	}
+	if(it != _extents.begin()) {
+		auto prev = std::prev(it);
+		assert(prev->first + prev->second <= it->first);
+		if(prev->first + prev->second == it->first) {
+			prev->second += it->second;
+			_extents.erase(it);
+		}
+	}
 }
 
 // --------------------------------------------------------
@@ -27,7 +331,16 @@ namespace {
 // --------------------------------------------------------
 
 Inode::Inode(FileSystem &fs, uint32_t number)
-: fs(fs), number(number), isReady(false) { }
+: fs(fs), number(number), isReady(false), directoryLock(1),
+		extentsLoading(false), extentLock(1), preallocStart(0), preallocCount(0) { }
+
+Inode::~Inode() {
+	fs.discardPreallocation(this);
+}
+
+bool Inode::isIndexed() {
+	return fs.dirIndex && (diskInode()->flags & EXT2_INDEX_FL);
+}
 
 COFIBER_ROUTINE(async::result<std::experimental::optional<DirEntry>>,
 		Inode::findEntry(std::string name), ([=] {
@@ -47,39 +360,49 @@ COFIBER_ROUTINE(async::result<std::experimental::optional<DirEntry>>,
 	helix::Mapping file_map{helix::BorrowedDescriptor{frontalMemory},
 			0, map_size,
 			kHelMapProtRead | kHelMapDontRequireBacking};
-
-	// Read the directory structure.
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
-		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(file_map.get()) + offset);
-
-		if(disk_entry->inode
-				&& name.length() == disk_entry->nameLength
-				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			DirEntry entry;
-			entry.inode = disk_entry->inode;
-
-			switch(disk_entry->fileType) {
-			case EXT2_FT_REG_FILE:
-				entry.fileType = kTypeRegular; break;
-			case EXT2_FT_DIR:
-				entry.fileType = kTypeDirectory; break;
-			case EXT2_FT_SYMLINK:
-				entry.fileType = kTypeSymlink; break;
-			default:
-				entry.fileType = kTypeNone;
+	auto dir = reinterpret_cast<char *>(file_map.get());
+
+	if(isIndexed()) {
+		// Only search the leaves that can contain the hash of the name.
+		// If we do not understand the index, fall back to a linear search.
+		htree::Path path;
+		if(htree::lookup(dir, fileSize(), fs.blockSize, name.data(), name.size(),
+				fs.hashSeed, fs.unsignedHash, path)) {
+			do {
+				auto leaf = path.leafBlock() * fs.blockSize;
+				auto disk_entry = searchEntries(dir, leaf, leaf + fs.blockSize,
+						fs.blockSize, name, nullptr);
+				if(disk_entry)
+					COFIBER_RETURN(toDirEntry(disk_entry));
+			} while(htree::nextLeaf(dir, fs.blockSize, path, path.hash));
+
+			COFIBER_RETURN(std::experimental::nullopt);
+		}
+	}else if(nameIndex || fileSize() >= nameIndexThreshold) {
+		if(!nameIndex) {
+			nameIndex = std::make_unique<std::unordered_map<std::string, DirEntry>>();
+
+			uintptr_t offset = 0;
+			while(offset < fileSize()) {
+				auto disk_entry = reinterpret_cast<DiskDirEntry *>(dir + offset);
+				assert(disk_entry->recordLength);
+				if(disk_entry->inode)
+					nameIndex->emplace(std::string(disk_entry->name, disk_entry->nameLength),
+							toDirEntry(disk_entry));
+				offset += disk_entry->recordLength;
 			}
-
-			COFIBER_RETURN(entry);
+			assert(offset == fileSize());
 		}
 
-		offset += disk_entry->recordLength;
+		auto it = nameIndex->find(name);
+		if(it == nameIndex->end())
+			COFIBER_RETURN(std::experimental::nullopt);
+		COFIBER_RETURN(it->second);
 	}
-	assert(offset == fileSize());
 
+	auto disk_entry = searchEntries(dir, 0, fileSize(), fs.blockSize, name, nullptr);
+	if(disk_entry)
+		COFIBER_RETURN(toDirEntry(disk_entry));
 	COFIBER_RETURN(std::experimental::nullopt);
 }))
 
@@ -88,80 +411,134 @@ COFIBER_ROUTINE(async::result<std::experimental::optional<DirEntry>>,
 	assert(!name.empty() && name != "." && name != "..");
 	assert(ino);
 
+	if(fs.readOnly)
+		COFIBER_RETURN(std::experimental::nullopt);
+
 	COFIBER_AWAIT readyJump.async_wait();
+	COFIBER_AWAIT directoryLock.acquire();
 
-	helix::LockMemoryView lock_memory;
-	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
-	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-			&lock_memory,
-			0, map_size, helix::Dispatcher::global());
-	COFIBER_AWAIT submit.async_wait();
-	HEL_CHECK(lock_memory.error());
+	// Block that was appended to the directory but is not yet part of the htree.
+	// Block zero is always the root of the htree, so zero means none.
+	uint32_t spare_block = 0;
 
-	// Map the page cache into the address space.
-	helix::Mapping file_map{helix::BorrowedDescriptor{frontalMemory},
-			0, map_size,
-			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	while(true) {
+		helix::LockMemoryView lock_memory;
+		auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
+		auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
+				&lock_memory,
+				0, map_size, helix::Dispatcher::global());
+		COFIBER_AWAIT submit.async_wait();
+		HEL_CHECK(lock_memory.error());
+
+		// Map the page cache into the address space.
+		helix::Mapping file_map{helix::BorrowedDescriptor{frontalMemory},
+				0, map_size,
+				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+		auto dir = reinterpret_cast<char *>(file_map.get());
+
+		DiskDirEntry *disk_entry;
+		if(isIndexed()) {
+			htree::Path path;
+			if(!htree::lookup(dir, fileSize(), fs.blockSize, name.data(), name.size(),
+					fs.hashSeed, fs.unsignedHash, path)) {
+				directoryLock.release();
+				throw std::runtime_error("ext2fs: Unsupported htree directory index");
+			}
+
+			auto leaf = path.leafBlock() * fs.blockSize;
+			disk_entry = insertEntry(dir, leaf, leaf + fs.blockSize, name, ino);
+
+			auto isFull = [&] (int level) {
+				auto cl = htree::countLimit(path.frames[level].entries);
+				return cl->count == cl->limit;
+			};
+
+			if(!disk_entry && isFull(path.depth - 1)) {
+				// Make room for the new leaf first. Split the highest full node
+				// whose parent is not full; if all nodes up to the root are full,
+				// add a level of interior nodes.
+				int level = path.depth - 1;
+				while(level && isFull(level - 1))
+					level--;
+
+				if(!level && path.depth == (fs.largeDir ? htree::maxDepth : 2)) {
+					// The index cannot grow any further. e2fsck -D can rebuild it.
+					std::cout << "\e[33m" "ext2fs: htree of inode " << number
+							<< " is full, dropping the index" "\e[39m" << std::endl;
+					diskInode()->flags &= ~EXT2_INDEX_FL;
+
+					// Hack: For now, we just remap the inode to make sure the dirty bit is checked.
+					auto inode_address = (number - 1) * fs.inodeSize;
+					diskMapping = helix::Mapping{fs.inodeTable,
+							inode_address, fs.inodeSize,
+							kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
+					continue;
+				}
 
-	// Space required for the new directory entry.
-	auto required = (sizeof(DiskDirEntry) + name.size() + 3) & ~size_t(3);
+				if(spare_block) {
+					auto new_node = dir + spare_block * fs.blockSize;
+					if(level) {
+						htree::splitNode(path, level, new_node, spare_block, fs.blockSize);
+					}else{
+						htree::growRoot(dir, path, new_node, spare_block, fs.blockSize);
+					}
+					spare_block = 0;
+					continue;
+				}
+			}else if(!disk_entry && spare_block) {
+				auto split_hash = splitLeaf(dir + leaf, dir + spare_block * fs.blockSize,
+						fs.blockSize, path.hashVersion, fs.hashSeed);
+				htree::insertLeaf(path, split_hash, spare_block);
+				spare_block = 0;
+				continue;
+			}
+		}else{
+			disk_entry = insertEntry(dir, 0, fileSize(), name, ino);
+		}
 
-	// Walk the directory structure.
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
-		auto previous_entry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(file_map.get()) + offset);
+		if(!disk_entry) {
+			// Append an empty block to the directory and try again.
+			assert(!(fileSize() & (fs.blockSize - 1)));
+			std::vector<char> buffer(fs.blockSize);
+			reinterpret_cast<DiskDirEntry *>(buffer.data())->recordLength = fs.blockSize;
 
-		// Calculate available space after we contract previous_entry.
-		auto contracted = (sizeof(DiskDirEntry) + previous_entry->nameLength + 3) & ~size_t(3);
-		assert(previous_entry->recordLength >= contracted);
-		auto available = previous_entry->recordLength - contracted;
-
-		// Check whether we can shrink previous_entry and insert a new entry after it.
-		if(available >= required) {
-			// Create the new dentry.
-			auto disk_entry = reinterpret_cast<DiskDirEntry *>(
-					reinterpret_cast<char *>(file_map.get()) + offset + contracted);
-			memset(disk_entry, 0, sizeof(DiskDirEntry));
-			disk_entry->inode = ino;
-			disk_entry->recordLength = available;
-			disk_entry->nameLength = name.length();
-			disk_entry->fileType = EXT2_FT_REG_FILE;
-			memcpy(disk_entry->name, name.data(), name.length());
-
-			// Update the existing dentry.
-			previous_entry->recordLength = contracted;
-
-			// Update the inode.
-			auto target = fs.accessInode(ino);
-			COFIBER_AWAIT target->readyJump.async_wait();
-			target->diskInode()->linksCount++;
-
-			// Hack: For now, we just remap the inode to make sure the dirty bit is checked.
-			auto inode_address = (target->number - 1) * fs.inodeSize;
-			target->diskMapping = helix::Mapping{fs.inodeTable,
-					inode_address, fs.inodeSize,
-					kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
-
-			DirEntry entry;
-			entry.inode = ino;
-			entry.fileType = kTypeRegular;
-			COFIBER_RETURN(entry);
+			spare_block = fileSize() >> fs.blockShift;
+			COFIBER_AWAIT fs.write(this, fileSize(), buffer.data(), fs.blockSize);
+			continue;
 		}
 
-		offset += previous_entry->recordLength;
+		if(nameIndex)
+			nameIndex->emplace(name, toDirEntry(disk_entry));
+		break;
 	}
-	assert(offset == fileSize());
 
-	throw std::runtime_error("Not enough space for ext2fs directory entry");
+	directoryLock.release();
+
+	// Update the inode.
+	auto target = fs.accessInode(ino);
+	COFIBER_AWAIT target->readyJump.async_wait();
+	target->diskInode()->linksCount++;
+
+	// Hack: For now, we just remap the inode to make sure the dirty bit is checked.
+	auto inode_address = (target->number - 1) * fs.inodeSize;
+	target->diskMapping = helix::Mapping{fs.inodeTable,
+			inode_address, fs.inodeSize,
+			kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
+
+	DirEntry entry;
+	entry.inode = ino;
+	entry.fileType = kTypeRegular;
+	COFIBER_RETURN(entry);
 }))
 
-COFIBER_ROUTINE(async::result<void>, Inode::unlink(std::string name), ([=] {
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, Inode::unlink(std::string name), ([=] {
 	assert(!name.empty() && name != "." && name != "..");
 
+	if(fs.readOnly)
+		COFIBER_RETURN(protocols::fs::Error::readOnly);
+
 	COFIBER_AWAIT readyJump.async_wait();
+	COFIBER_AWAIT directoryLock.acquire();
 
 	helix::LockMemoryView lock_memory;
 	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
@@ -175,32 +552,40 @@ COFIBER_ROUTINE(async::result<void>, Inode::unlink(std::string name), ([=] {
 	helix::Mapping file_map{helix::BorrowedDescriptor{frontalMemory},
 			0, map_size,
 			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	auto dir = reinterpret_cast<char *>(file_map.get());
 
-	// Read the directory structure.
+	// Removing entries never changes the htree.
 	DiskDirEntry *previous_entry = nullptr;
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
-		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(file_map.get()) + offset);
+	DiskDirEntry *disk_entry = nullptr;
+	htree::Path path;
+	if(isIndexed() && htree::lookup(dir, fileSize(), fs.blockSize, name.data(), name.size(),
+			fs.hashSeed, fs.unsignedHash, path)) {
+		do {
+			auto leaf = path.leafBlock() * fs.blockSize;
+			disk_entry = searchEntries(dir, leaf, leaf + fs.blockSize,
+					fs.blockSize, name, &previous_entry);
+		} while(!disk_entry && htree::nextLeaf(dir, fs.blockSize, path, path.hash));
+	}else{
+		disk_entry = searchEntries(dir, 0, fileSize(), fs.blockSize, name, &previous_entry);
+	}
 
-		if(disk_entry->inode
-				&& name.length() == disk_entry->nameLength
-				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			// The directory should start with "." and "..". As those entries are never deleted,
-			// we can assume that a previous entry exists.
-			assert(previous_entry);
-			previous_entry->recordLength += disk_entry->recordLength;
-			COFIBER_RETURN();
-		}
+	if(!disk_entry) {
+		directoryLock.release();
+		throw std::runtime_error("Given link does not exist");
+	}
 
-		offset += disk_entry->recordLength;
-		previous_entry = disk_entry;
+	if(previous_entry) {
+		previous_entry->recordLength += disk_entry->recordLength;
+	}else{
+		// The entry starts a block. Keep it as an unused entry.
+		disk_entry->inode = 0;
 	}
-	assert(offset == fileSize());
 
-	throw std::runtime_error("Given link does not exist");
+	if(nameIndex)
+		nameIndex->erase(name);
+
+	directoryLock.release();
+	COFIBER_RETURN(protocols::fs::Error::none);
 }))
 
 // --------------------------------------------------------
@@ -212,21 +597,68 @@ FileSystem::FileSystem(BlockDevice *device)
 }
 
 COFIBER_ROUTINE(async::result<void>, FileSystem::init(), ([=] {
-	std::vector<uint8_t> buffer(1024);
-	COFIBER_AWAIT device->readSectors(2, buffer.data(), 2);
+	// The superblock occupies bytes 1024 to 2047 of the device.
+	auto sb_sector = 1024 / device->sectorSize;
+	auto sb_sectors = (2048 + device->sectorSize - 1) / device->sectorSize - sb_sector;
+	auto sb_offset = 1024 - sb_sector * device->sectorSize;
+	std::vector<uint8_t> buffer(sb_sectors * device->sectorSize);
+	checkIo(COFIBER_AWAIT device->readSectors(sb_sector, buffer.data(), sb_sectors));
 
 	DiskSuperblock sb;
-	memcpy(&sb, buffer.data(), sizeof(DiskSuperblock));
+	memcpy(&sb, buffer.data() + sb_offset, sizeof(DiskSuperblock));
 	assert(sb.magic == 0xEF53);
 
 	inodeSize = sb.inodeSize;
 	blockShift = 10 + sb.logBlockSize;
 	blockSize = 1024 << sb.logBlockSize;
 	blockPagesShift = blockShift < pageShift ? pageShift : blockShift;
-	sectorsPerBlock = blockSize / 512;
+	if(blockSize < device->sectorSize)
+		throw std::runtime_error("ext2fs: Blocks are smaller than the device's sectors");
+	sectorsPerBlock = blockSize / device->sectorSize;
 	blocksPerGroup = sb.blocksPerGroup;
 	inodesPerGroup = sb.inodesPerGroup;
-	numBlockGroups = (sb.blocksCount + (sb.blocksPerGroup - 1)) / sb.blocksPerGroup;
+	firstDataBlock = sb.firstDataBlock;
+	numBlocks = sb.blocksCount;
+	numInodes = sb.inodesCount;
+	sparseSuper = sb.featureRoCompat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	reservedGdtBlocks = sb.reservedGdtBlocks;
+	dirIndex = sb.featureCompat & EXT2_FEATURE_COMPAT_DIR_INDEX;
+	largeDir = sb.featureIncompat & EXT4_FEATURE_INCOMPAT_LARGEDIR;
+	extents = sb.featureIncompat & EXT4_FEATURE_INCOMPAT_EXTENTS;
+	is64Bit = sb.featureIncompat & EXT4_FEATURE_INCOMPAT_64BIT;
+	descSize = is64Bit ? sb.descSize : 32;
+	unsignedHash = sb.flags & EXT2_FLAGS_UNSIGNED_HASH;
+	memcpy(hashSeed, sb.hashSeed, sizeof(hashSeed));
+	numBlockGroups = (sb.blocksCount - sb.firstDataBlock + (sb.blocksPerGroup - 1))
+			/ sb.blocksPerGroup;
+
+	constexpr uint32_t supportedIncompat = EXT2_FEATURE_INCOMPAT_FILETYPE
+			| EXT3_FEATURE_INCOMPAT_RECOVER | EXT4_FEATURE_INCOMPAT_EXTENTS
+			| EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_FLEX_BG
+			| EXT4_FEATURE_INCOMPAT_CSUM_SEED | EXT4_FEATURE_INCOMPAT_LARGEDIR;
+	constexpr uint32_t writableRoCompat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER
+			| EXT2_FEATURE_RO_COMPAT_LARGE_FILE | EXT4_FEATURE_RO_COMPAT_DIR_NLINK
+			| EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE;
+
+	if(sb.featureIncompat & ~supportedIncompat) {
+		std::cout << "\e[31m" "ext2fs: Unsupported r/w-required features: "
+				<< (sb.featureIncompat & ~supportedIncompat) << "\e[39m" << std::endl;
+		throw std::runtime_error("ext2fs: Unsupported file system features");
+	}
+	if(is64Bit && (sb.descSize < sizeof(DiskGroupDesc) || (sb.descSize & (sb.descSize - 1))))
+		throw std::runtime_error("ext2fs: Unexpected group descriptor size");
+
+	// Our allocator and the inode block maps use 32-bit block numbers.
+	if(sb.blocksCountHi)
+		throw std::runtime_error("ext2fs: File systems with more than 2^32 blocks"
+				" are not supported");
+
+	// We do not update checksums. Avoid corrupting such file systems
+	// by refusing to modify them.
+	readOnly = sb.featureRoCompat & ~writableRoCompat;
+	if(readOnly)
+		std::cout << "\e[33m" "ext2fs: File system uses features that we cannot update,"
+				" it will be read-only" "\e[39m" << std::endl;
 
 	if(logSuperblock) {
 		std::cout << "ext2fs: Revision is: " << sb.revLevel << std::endl;
@@ -243,13 +675,44 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::init(), ([=] {
 		std::cout << "ext2fs:     Inodes per group: " << inodesPerGroup << std::endl;
 	}
 
-	auto bgdt_size = (numBlockGroups * sizeof(DiskGroupDesc) + 511) & ~size_t(511);
+	// Round up to whole blocks so that writeGroupDesc() can write them back.
+	auto bgdt_size = (numBlockGroups * descSize + blockSize - 1) & ~size_t(blockSize - 1);
 	// TODO: Use std::string instead of malloc().
 	blockGroupDescriptorBuffer = malloc(bgdt_size);
 
 	auto bgdt_offset = (2048 + blockSize - 1) & ~size_t(blockSize - 1);
-	COFIBER_AWAIT device->readSectors((bgdt_offset >> blockShift) * sectorsPerBlock,
-			blockGroupDescriptorBuffer, bgdt_size / 512);
+	checkIo(COFIBER_AWAIT device->readSectors((bgdt_offset >> blockShift) * sectorsPerBlock,
+			blockGroupDescriptorBuffer, bgdt_size / device->sectorSize));
+
+	if((sb.featureCompat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) && !readOnly) {
+		if(!sb.journalInum) {
+			std::cout << "\e[33m" "ext2fs: External journals are not supported" "\e[39m"
+					<< std::endl;
+		}else if(COFIBER_AWAIT loadJournal(sb.journalInum)) {
+			// Replaying the journal might have changed the group descriptors.
+			if(journal->replayedTransactions())
+				checkIo(COFIBER_AWAIT device->readSectors(
+						(bgdt_offset >> blockShift) * sectorsPerBlock,
+						blockGroupDescriptorBuffer, bgdt_size / device->sectorSize));
+
+			// Linux only replays the journal if this flag is set. We never unmount cleanly,
+			// so the flag stays set while the file system is in use.
+			checkIo(COFIBER_AWAIT device->readSectors(sb_sector, buffer.data(), sb_sectors));
+			auto disk_sb = reinterpret_cast<DiskSuperblock *>(buffer.data() + sb_offset);
+			if(!(disk_sb->featureIncompat & EXT3_FEATURE_INCOMPAT_RECOVER)) {
+				disk_sb->featureIncompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+				checkIo(COFIBER_AWAIT device->writeSectors(sb_sector,
+						buffer.data(), sb_sectors));
+			}
+		}
+	}
+
+	if(!journal && !readOnly && ((sb.featureCompat & EXT3_FEATURE_COMPAT_HAS_JOURNAL)
+			|| (sb.featureIncompat & EXT3_FEATURE_INCOMPAT_RECOVER))) {
+		std::cout << "\e[33m" "ext2fs: Cannot use the journal,"
+				" file system will be read-only" "\e[39m" << std::endl;
+		readOnly = true;
+	}
 
 	// Create memory bundles to manage the block and inode bitmaps.
 	HelHandle block_bitmap_frontal, inode_bitmap_frontal;
@@ -274,12 +737,44 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::init(), ([=] {
 
 	manageInodeTable(helix::UniqueDescriptor{inode_table_backing});
 
+	COFIBER_AWAIT buildFreeIndex();
+
 	COFIBER_RETURN();
 }))
 
+DiskGroupDesc *FileSystem::groupDesc(uint32_t bg_idx) {
+	assert(bg_idx < numBlockGroups);
+	return reinterpret_cast<DiskGroupDesc *>(
+			reinterpret_cast<char *>(blockGroupDescriptorBuffer) + bg_idx * descSize);
+}
+
+uint64_t FileSystem::blockBitmapOf(uint32_t bg_idx) {
+	auto desc = groupDesc(bg_idx);
+	if(is64Bit)
+		return desc->blockBitmap | (uint64_t(desc->blockBitmapHi) << 32);
+	return desc->blockBitmap;
+}
+
+uint64_t FileSystem::inodeBitmapOf(uint32_t bg_idx) {
+	auto desc = groupDesc(bg_idx);
+	if(is64Bit)
+		return desc->inodeBitmap | (uint64_t(desc->inodeBitmapHi) << 32);
+	return desc->inodeBitmap;
+}
+
+uint64_t FileSystem::inodeTableOf(uint32_t bg_idx) {
+	auto desc = groupDesc(bg_idx);
+	if(is64Bit)
+		return desc->inodeTable | (uint64_t(desc->inodeTableHi) << 32);
+	return desc->inodeTable;
+}
+
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageBlockBitmap(
 		helix::UniqueDescriptor the_memory), ([=, memory = std::move(the_memory)] {
+	Semaphore limiter{maxConcurrentManage};
 	while(true) {
+		COFIBER_AWAIT limiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit_manage = helix::submitManageMemory(memory,
 				&manage, helix::Dispatcher::global());
@@ -287,36 +782,20 @@ COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageBlockBitmap(
 		HEL_CHECK(manage.error());
 
 		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto bgdt = (DiskGroupDesc *)blockGroupDescriptorBuffer;
-		auto block = bgdt[bg_idx].blockBitmap;
+		auto block = blockBitmapOf(bg_idx);
 		assert(block);
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
-
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping bitmap_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+		handleBitmapRequest(memory, block,
+				ManageRequest{manage.type(), manage.offset(), manage.length()}, &limiter);
 	}
 }))
 
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageInodeBitmap(
 		helix::UniqueDescriptor the_memory), ([=, memory = std::move(the_memory)] {
+	Semaphore limiter{maxConcurrentManage};
 	while(true) {
+		COFIBER_AWAIT limiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit_manage = helix::submitManageMemory(memory,
 				&manage, helix::Dispatcher::global());
@@ -324,68 +803,84 @@ COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageInodeBitmap(
 		HEL_CHECK(manage.error());
 
 		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto bgdt = (DiskGroupDesc *)blockGroupDescriptorBuffer;
-		auto block = bgdt[bg_idx].inodeBitmap;
+		auto block = inodeBitmapOf(bg_idx);
 		assert(block);
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
-
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+		handleBitmapRequest(memory, block,
+				ManageRequest{manage.type(), manage.offset(), manage.length()}, &limiter);
+	}
+}))
 
-			helix::Mapping bitmap_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+COFIBER_ROUTINE(cofiber::no_future, FileSystem::handleBitmapRequest(
+		helix::BorrowedDescriptor memory, uint64_t block, ManageRequest request,
+		Semaphore *limiter), ([=] {
+	assert(!(request.offset & ((1 << blockPagesShift) - 1))
+			&& "TODO: propery support multi-page blocks");
+	assert(request.length == (1 << blockPagesShift)
+			&& "TODO: propery support multi-page blocks");
+
+	if(request.type == kHelManageInitialize) {
+		helix::Mapping bitmap_map{memory, request.offset, request.length};
+		COFIBER_AWAIT readMetadata(block, bitmap_map.get(), 1);
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
+				request.offset, request.length));
+	}else{
+		assert(request.type == kHelManageWriteback);
+
+		helix::Mapping bitmap_map{memory, request.offset, request.length};
+		COFIBER_AWAIT writeMetadata(block, bitmap_map.get(), 1);
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
+				request.offset, request.length));
 	}
+
+	limiter->release();
 }))
 
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageInodeTable(
 		helix::UniqueDescriptor the_memory), ([=, memory = std::move(the_memory)] {
+	Semaphore limiter{maxConcurrentManage};
 	while(true) {
+		COFIBER_AWAIT limiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit_manage = helix::submitManageMemory(memory,
 				&manage, helix::Dispatcher::global());
 		COFIBER_AWAIT(submit_manage.async_wait());
 		HEL_CHECK(manage.error());
 
-		// TODO: Make sure that we do not read/write past the end of the table.
-		assert(!((inodesPerGroup * inodeSize) & (blockSize - 1)));
-
-		// TODO: Use shifts instead of division.
-		auto bg_idx = manage.offset() / (inodesPerGroup * inodeSize);
-		auto bg_offset = manage.offset() % (inodesPerGroup * inodeSize);
-		auto bgdt = (DiskGroupDesc *)blockGroupDescriptorBuffer;
-		auto block = bgdt[bg_idx].inodeTable;
-		assert(block);
+		handleInodeTableRequest(memory,
+				ManageRequest{manage.type(), manage.offset(), manage.length()}, &limiter);
+	}
+}))
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping table_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->readSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+COFIBER_ROUTINE(cofiber::no_future, FileSystem::handleInodeTableRequest(
+		helix::BorrowedDescriptor memory, ManageRequest request,
+		Semaphore *limiter), ([=] {
+	// TODO: Make sure that we do not read/write past the end of the table.
+	assert(!((inodesPerGroup * inodeSize) & (blockSize - 1)));
+
+	// TODO: Use shifts instead of division.
+	auto bg_idx = request.offset / (inodesPerGroup * inodeSize);
+	auto bg_offset = request.offset % (inodesPerGroup * inodeSize);
+	assert(inodeTableOf(bg_idx));
+	assert(!(bg_offset & (blockSize - 1)));
+	auto block = inodeTableOf(bg_idx) + (bg_offset >> blockShift);
+
+	if(request.type == kHelManageInitialize) {
+		helix::Mapping table_map{memory, request.offset, request.length};
+		COFIBER_AWAIT readMetadata(block, table_map.get(), request.length >> blockShift);
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
+				request.offset, request.length));
+	}else{
+		assert(request.type == kHelManageWriteback);
 
-			helix::Mapping table_map{memory, manage.offset(), manage.length()};
-			COFIBER_AWAIT device->writeSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+		helix::Mapping table_map{memory, request.offset, request.length};
+		COFIBER_AWAIT writeMetadata(block, table_map.get(), request.length >> blockShift);
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
+				request.offset, request.length));
 	}
+
+	limiter->release();
 }))
 
 auto FileSystem::accessRoot() -> std::shared_ptr<Inode> {
@@ -407,6 +902,9 @@ auto FileSystem::accessInode(uint32_t number) -> std::shared_ptr<Inode> {
 }
 
 COFIBER_ROUTINE(async::result<std::shared_ptr<Inode>>, FileSystem::createRegular(), ([=] {
+	if(readOnly)
+		COFIBER_RETURN(nullptr);
+
 	auto ino = COFIBER_AWAIT allocateInode();
 	assert(ino);
 
@@ -431,17 +929,30 @@ COFIBER_ROUTINE(async::result<std::shared_ptr<Inode>>, FileSystem::createRegular
 	disk_inode->mode = EXT2_S_IFREG;
 	disk_inode->generation = generation + 1;
 
+	if(extents) {
+		// New files start with an empty extent tree in the inode.
+		disk_inode->flags |= EXT4_EXTENTS_FL;
+		auto header = reinterpret_cast<DiskExtentHeader *>(&disk_inode->data);
+		header->magic = EXT4_EXTENT_MAGIC;
+		header->maxEntries = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	}
+
 	COFIBER_RETURN(accessInode(ino));
 }))
 
-COFIBER_ROUTINE(async::result<void>, FileSystem::write(Inode *inode, uint64_t offset,
-		const void *buffer, size_t length), ([=] {
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, FileSystem::write(Inode *inode,
+		uint64_t offset, const void *buffer, size_t length), ([=] {
+	if(readOnly)
+		COFIBER_RETURN(protocols::fs::Error::readOnly);
+
 	COFIBER_AWAIT inode->readyJump.async_wait();
 
 	// Make sure that data blocks are allocated.
 	auto block_offset = (offset & ~(blockSize - 1)) >> blockShift;
 	auto block_count = ((offset & (blockSize - 1)) + length + (blockSize - 1)) >> blockShift;
-	COFIBER_AWAIT assignDataBlocks(inode, block_offset, block_count);
+	auto error = COFIBER_AWAIT assignDataBlocks(inode, block_offset, block_count);
+	if(error != protocols::fs::Error::none)
+		COFIBER_RETURN(error);
 
 	// Resize the file if necessary.
 	if(offset + length > inode->fileSize()) {
@@ -474,6 +985,7 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::write(Inode *inode, uint64_t of
 
 	memcpy(reinterpret_cast<char *>(file_map.get()) + (offset - map_offset),
 			buffer, length);
+	COFIBER_RETURN(protocols::fs::Error::none);
 }))
 
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::initiateInode(std::shared_ptr<Inode> inode),
@@ -549,7 +1061,12 @@ COFIBER_ROUTINE(cofiber::no_future, FileSystem::initiateInode(std::shared_ptr<In
 
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageFileData(std::shared_ptr<Inode> inode),
 		([=] {
+	// Each request is handled in its own coroutine, so that faults on different
+	// parts of the same file do not wait for each other.
+	Semaphore limiter{maxConcurrentManage};
 	while(true) {
+		COFIBER_AWAIT limiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit = helix::submitManageMemory(helix::BorrowedDescriptor(inode->backingMemory),
 				&manage, helix::Dispatcher::global());
@@ -557,43 +1074,55 @@ COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageFileData(std::shared_ptr<I
 		HEL_CHECK(manage.error());
 		assert(manage.offset() + manage.length() <= ((inode->fileSize() + 0xFFF) & ~size_t(0xFFF)));
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					manage.offset(), manage.length(), kHelMapProtWrite};
+		handleFileDataRequest(inode,
+				ManageRequest{manage.type(), manage.offset(), manage.length()}, &limiter);
+	}
+}))
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+COFIBER_ROUTINE(cofiber::no_future, FileSystem::handleFileDataRequest(
+		std::shared_ptr<Inode> inode, ManageRequest request,
+		Semaphore *limiter), ([=] {
+	if(request.type == kHelManageInitialize) {
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				request.offset, request.length, kHelMapProtWrite};
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			COFIBER_AWAIT inode->fs.readDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+		assert(!(request.offset % inode->fs.blockSize));
+		size_t backed_size = std::min(request.length, inode->fileSize() - request.offset);
+		size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+		assert(num_blocks * inode->fs.blockSize <= request.length);
+		COFIBER_AWAIT inode->fs.readDataBlocks(inode, request.offset / inode->fs.blockSize,
+				num_blocks, file_map.get());
 
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					manage.offset(), manage.length(), kHelMapProtRead};
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
+				request.offset, request.length));
+	}else{
+		assert(request.type == kHelManageWriteback);
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				request.offset, request.length, kHelMapProtRead};
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			COFIBER_AWAIT inode->fs.writeDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+		assert(!(request.offset % inode->fs.blockSize));
+		size_t backed_size = std::min(request.length, inode->fileSize() - request.offset);
+		size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+		assert(num_blocks * inode->fs.blockSize <= request.length);
+		COFIBER_AWAIT inode->fs.writeDataBlocks(inode, request.offset / inode->fs.blockSize,
+				num_blocks, file_map.get());
+
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
+				request.offset, request.length));
 	}
+
+	limiter->release();
 }))
 
 COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
 		int order, helix::UniqueDescriptor the_memory), ([=, memory = std::move(the_memory)] {
+	Semaphore limiter{maxConcurrentManage};
 	while(true) {
+		COFIBER_AWAIT limiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit_manage = helix::submitManageMemory(memory,
 				&manage, helix::Dispatcher::global());
@@ -601,132 +1130,484 @@ COFIBER_ROUTINE(cofiber::no_future, FileSystem::manageIndirect(std::shared_ptr<I
 		HEL_CHECK(manage.error());
 		assert(manage.type() == kHelManageInitialize);
 
-		uint32_t element = manage.offset() >> blockPagesShift;
+		handleIndirectRequest(inode, order, memory,
+				ManageRequest{manage.type(), manage.offset(), manage.length()}, &limiter);
+	}
+}))
 
-		uint32_t block;
-		if(order == 1) {
-			auto disk_inode = inode->diskInode();
+COFIBER_ROUTINE(cofiber::no_future, FileSystem::handleIndirectRequest(
+		std::shared_ptr<Inode> inode, int order, helix::BorrowedDescriptor memory,
+		ManageRequest request, Semaphore *limiter), ([=] {
+	uint32_t element = request.offset >> blockPagesShift;
+
+	uint32_t block;
+	if(order == 1) {
+		auto disk_inode = inode->diskInode();
+
+		switch(element) {
+		case 0: block = disk_inode->data.blocks.singleIndirect; break;
+		case 1: block = disk_inode->data.blocks.doubleIndirect; break;
+		case 2: block = disk_inode->data.blocks.tripleIndirect; break;
+		default:
+			assert(!"unexpected offset");
+			abort();
+		}
+	}else{
+		assert(order == 2);
+
+		auto indirect_frame = element >> (blockShift - 2);
+		auto indirect_index = element & ((1 << (blockShift - 2)) - 1);
+
+		helix::LockMemoryView lock_indirect;
+		auto &&submit_indirect = helix::submitLockMemoryView(inode->indirectOrder1,
+				&lock_indirect,
+				(1 + indirect_frame) << blockPagesShift, 1 << blockPagesShift,
+				helix::Dispatcher::global());
+		COFIBER_AWAIT submit_indirect.async_wait();
+		HEL_CHECK(lock_indirect.error());
+
+		helix::Mapping indirect_map{inode->indirectOrder1,
+				(1 + indirect_frame) << blockPagesShift, 1 << blockPagesShift,
+				kHelMapProtRead | kHelMapDontRequireBacking};
+		block = reinterpret_cast<uint32_t *>(indirect_map.get())[indirect_index];
+	}
+
+	assert(!(request.offset & ((1 << blockPagesShift) - 1))
+			&& "TODO: propery support multi-page blocks");
+	assert(request.length == (1 << blockPagesShift)
+			&& "TODO: propery support multi-page blocks");
 
-			switch(element) {
-			case 0: block = disk_inode->data.blocks.singleIndirect; break;
-			case 1: block = disk_inode->data.blocks.doubleIndirect; break;
-			case 2: block = disk_inode->data.blocks.tripleIndirect; break;
-			default:
-				assert(!"unexpected offset");
-				abort();
+	helix::Mapping out_map{memory, request.offset, request.length};
+	checkIo(COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
+			out_map.get(), sectorsPerBlock));
+	HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
+			request.offset, request.length));
+
+	limiter->release();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::buildFreeIndex(), ([=] {
+	// Collects the runs of clear bits in a bitmap.
+	auto scan = [] (ExtentIndex &index, uint32_t *words, uint32_t num_bits, uint32_t base) {
+		uint32_t i = 0;
+		while(i < num_bits) {
+			if(!(i & 31) && i + 32 <= num_bits && words[i / 32] == 0xFFFFFFFF) {
+				i += 32;
+				continue;
 			}
+			if(words[i / 32] & (static_cast<uint32_t>(1) << (i & 31))) {
+				i++;
+				continue;
+			}
+
+			auto start = i;
+			while(i < num_bits && !(words[i / 32] & (static_cast<uint32_t>(1) << (i & 31))))
+				i++;
+			index.free(base + start, i - start);
+		}
+	};
+
+	freeBlocks.resize(numBlockGroups);
+	freeInodes.resize(numBlockGroups);
+
+	uint64_t num_free_blocks = 0;
+	uint64_t num_free_inodes = 0;
+	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
+		auto group_first = firstDataBlock + bg_idx * blocksPerGroup;
+		auto group_blocks = std::min(blocksPerGroup, numBlocks - group_first);
+		auto group_inodes = std::min(inodesPerGroup, numInodes - bg_idx * inodesPerGroup);
+
+		// The on-disk bitmaps of uninitialized groups are not valid. We compute
+		// their contents here; markBitmap() writes them on the first allocation.
+		if(groupDesc(bg_idx)->flags & EXT4_BG_BLOCK_UNINIT) {
+			std::vector<uint32_t> words(blockSize / 4);
+			initBlockBitmap(bg_idx, words.data());
+			scan(freeBlocks[bg_idx], words.data(), group_blocks, group_first);
 		}else{
-			assert(order == 2);
+			helix::LockMemoryView lock_blocks;
+			auto &&submit_blocks = helix::submitLockMemoryView(blockBitmap,
+					&lock_blocks, bg_idx << blockPagesShift, 1 << blockPagesShift,
+					helix::Dispatcher::global());
+			COFIBER_AWAIT submit_blocks.async_wait();
+			HEL_CHECK(lock_blocks.error());
 
-			auto indirect_frame = element >> (blockShift - 2);
-			auto indirect_index = element & ((1 << (blockShift - 2)) - 1);
+			helix::Mapping block_map{blockBitmap,
+					bg_idx << blockPagesShift, 1 << blockPagesShift,
+					kHelMapProtRead | kHelMapDontRequireBacking};
+			scan(freeBlocks[bg_idx], reinterpret_cast<uint32_t *>(block_map.get()),
+					group_blocks, group_first);
+		}
 
-			helix::LockMemoryView lock_indirect;
-			auto &&submit_indirect = helix::submitLockMemoryView(inode->indirectOrder1,
-					&lock_indirect,
-					(1 + indirect_frame) << blockPagesShift, 1 << blockPagesShift,
+		if(groupDesc(bg_idx)->flags & EXT4_BG_INODE_UNINIT) {
+			freeInodes[bg_idx].free(bg_idx * inodesPerGroup + 1, group_inodes);
+		}else{
+			helix::LockMemoryView lock_inodes;
+			auto &&submit_inodes = helix::submitLockMemoryView(inodeBitmap,
+					&lock_inodes, bg_idx << blockPagesShift, 1 << blockPagesShift,
 					helix::Dispatcher::global());
-			COFIBER_AWAIT submit_indirect.async_wait();
-			HEL_CHECK(lock_indirect.error());
+			COFIBER_AWAIT submit_inodes.async_wait();
+			HEL_CHECK(lock_inodes.error());
 
-			helix::Mapping indirect_map{inode->indirectOrder1,
-					(1 + indirect_frame) << blockPagesShift, 1 << blockPagesShift,
+			helix::Mapping inode_map{inodeBitmap,
+					bg_idx << blockPagesShift, 1 << blockPagesShift,
 					kHelMapProtRead | kHelMapDontRequireBacking};
-			block = reinterpret_cast<uint32_t *>(indirect_map.get())[indirect_index];
+			scan(freeInodes[bg_idx], reinterpret_cast<uint32_t *>(inode_map.get()),
+					group_inodes, bg_idx * inodesPerGroup + 1);
 		}
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
+		num_free_blocks += freeBlocks[bg_idx].numFree();
+		num_free_inodes += freeInodes[bg_idx].numFree();
+	}
+
+	if(logSuperblock)
+		std::cout << "ext2fs: " << num_free_blocks << " free blocks, "
+				<< num_free_inodes << " free inodes" << std::endl;
 
-		helix::Mapping out_map{memory, manage.offset(), manage.length()};
-		COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
-				out_map.get(), sectorsPerBlock);
-		HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-				manage.offset(), manage.length()));
+	COFIBER_RETURN();
+}))
+
+bool FileSystem::hasSuperblockBackup(uint32_t bg_idx) {
+	// With sparse_super, only groups 0, 1 and powers of 3, 5 and 7 have backups.
+	if(!sparseSuper || bg_idx <= 1)
+		return true;
+	for(uint32_t base : {3, 5, 7}) {
+		uint32_t power = base;
+		while(power < bg_idx)
+			power *= base;
+		if(power == bg_idx)
+			return true;
 	}
+	return false;
+}
+
+void FileSystem::initBlockBitmap(uint32_t bg_idx, uint32_t *words) {
+	auto group_first = firstDataBlock + bg_idx * blocksPerGroup;
+	auto group_blocks = std::min(blocksPerGroup, numBlocks - group_first);
+	auto setBit = [&] (uint32_t i) {
+		words[i / 32] |= static_cast<uint32_t>(1) << (i & 31);
+	};
+	auto markUsed = [&] (uint64_t block, uint64_t count) {
+		for(auto b = block; b < block + count; b++)
+			if(b >= group_first && b < group_first + group_blocks)
+				setBit(b - group_first);
+	};
+
+	memset(words, 0, blockSize);
+
+	if(hasSuperblockBackup(bg_idx)) {
+		auto gdt_blocks = (numBlockGroups * descSize + blockSize - 1) / blockSize;
+		markUsed(group_first, 1 + gdt_blocks + reservedGdtBlocks);
+	}
+
+	// With flex_bg, the metadata of a group can be stored in other groups.
+	markUsed(blockBitmapOf(bg_idx), 1);
+	markUsed(inodeBitmapOf(bg_idx), 1);
+	markUsed(inodeTableOf(bg_idx), (inodesPerGroup * inodeSize + blockSize - 1) / blockSize);
+
+	// Bits beyond the end of the file system are set.
+	for(auto i = group_blocks; i < blockSize * 8; i++)
+		setBit(i);
+}
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::writeGroupDesc(uint32_t bg_idx), ([=] {
+	auto bgdt_block = (2048 + blockSize - 1) >> blockShift;
+	auto index = bg_idx * descSize / blockSize;
+	COFIBER_AWAIT writeMetadata(bgdt_block + index,
+			reinterpret_cast<char *>(blockGroupDescriptorBuffer) + index * blockSize, 1);
+	COFIBER_RETURN();
 }))
 
-COFIBER_ROUTINE(async::result<uint32_t>, FileSystem::allocateBlock(), ([=] {
-	uint64_t bg_idx = 0;
+COFIBER_ROUTINE(async::result<bool>, FileSystem::loadJournal(uint32_t number), ([=] {
+	// Read the journal inode directly; it is never accessed through the inode table.
+	auto bg_idx = (number - 1) / inodesPerGroup;
+	auto offset = ((number - 1) % inodesPerGroup) * inodeSize;
+	std::vector<char> table_block(blockSize);
+	checkIo(COFIBER_AWAIT device->readSectors((inodeTableOf(bg_idx) + (offset >> blockShift))
+			* sectorsPerBlock, table_block.data(), sectorsPerBlock));
+
+	DiskInode disk_inode;
+	memcpy(&disk_inode, table_block.data() + (offset & (blockSize - 1)), sizeof(DiskInode));
+	auto num_blocks = (disk_inode.size | (uint64_t(disk_inode.sizeHigh) << 32)) >> blockShift;
+
+	// Determine the physical location of each block of the journal.
+	std::vector<uint64_t> layout;
+	if(disk_inode.flags & EXT4_EXTENTS_FL) {
+		std::map<uint32_t, Inode::Extent> extent_map;
+		COFIBER_AWAIT readExtentTree(disk_inode.data, &extent_map);
+		for(auto &entry : extent_map) {
+			if(entry.first != layout.size())
+				break;
+			for(uint32_t i = 0; i < entry.second.length; i++)
+				layout.push_back(entry.second.physical + i);
+		}
+	}else{
+		size_t per_indirect = blockSize / 4;
+		std::vector<uint32_t> indirect(per_indirect);
+		std::vector<uint32_t> double_indirect(per_indirect);
+
+		for(size_t i = 0; i < 12 && layout.size() < num_blocks; i++)
+			layout.push_back(disk_inode.data.blocks.direct[i]);
+
+		if(layout.size() < num_blocks && disk_inode.data.blocks.singleIndirect) {
+			checkIo(COFIBER_AWAIT device->readSectors(disk_inode.data.blocks.singleIndirect
+					* sectorsPerBlock, indirect.data(), sectorsPerBlock));
+			for(size_t i = 0; i < per_indirect && layout.size() < num_blocks; i++)
+				layout.push_back(indirect[i]);
+		}
+
+		if(layout.size() < num_blocks && disk_inode.data.blocks.doubleIndirect) {
+			checkIo(COFIBER_AWAIT device->readSectors(disk_inode.data.blocks.doubleIndirect
+					* sectorsPerBlock, double_indirect.data(), sectorsPerBlock));
+			for(size_t j = 0; j < per_indirect && layout.size() < num_blocks; j++) {
+				if(!double_indirect[j])
+					break;
+				checkIo(COFIBER_AWAIT device->readSectors(double_indirect[j] * sectorsPerBlock,
+						indirect.data(), sectorsPerBlock));
+				for(size_t i = 0; i < per_indirect && layout.size() < num_blocks; i++)
+					layout.push_back(indirect[i]);
+			}
+		}
+	}
+
+	if(layout.size() > num_blocks)
+		layout.resize(num_blocks);
+	if(layout.empty() || layout.size() < num_blocks
+			|| std::find(layout.begin(), layout.end(), 0) != layout.end()) {
+		std::cout << "\e[31m" "ext2fs: Journal inode is sparse or too large" "\e[39m"
+				<< std::endl;
+		COFIBER_RETURN(false);
+	}
+
+	journal = std::make_unique<Journal>(device, blockSize, std::move(layout));
+	if(!(COFIBER_AWAIT journal->recover())) {
+		journal = nullptr;
+		COFIBER_RETURN(false);
+	}
+	COFIBER_RETURN(true);
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::readMetadata(uint64_t block,
+		void *buffer, size_t num_blocks), ([=] {
+	// Take the snapshot first; the journal might checkpoint the blocks during the read.
+	Journal::Overlay snapshot;
+	if(journal)
+		snapshot = journal->snapshot(block, num_blocks);
+
+	checkIo(COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
+			buffer, num_blocks * sectorsPerBlock));
+	if(journal)
+		journal->overlay(snapshot, buffer);
+	COFIBER_RETURN();
+}))
 
+COFIBER_ROUTINE(async::result<void>, FileSystem::writeMetadata(uint64_t block,
+		const void *buffer, size_t num_blocks), ([=] {
+	if(journal) {
+		COFIBER_AWAIT journal->write(block, buffer, num_blocks);
+		COFIBER_RETURN();
+	}
+	checkIo(COFIBER_AWAIT device->writeSectors(block * sectorsPerBlock,
+			buffer, num_blocks * sectorsPerBlock));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::readFileBlocks(Inode *inode, uint64_t block,
+		void *buffer, size_t num_blocks), ([=] {
+	if(inode->fileType == kTypeDirectory) {
+		COFIBER_AWAIT readMetadata(block, buffer, num_blocks);
+		COFIBER_RETURN();
+	}
+	checkIo(COFIBER_AWAIT device->readSectors(block * sectorsPerBlock,
+			buffer, num_blocks * sectorsPerBlock));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::writeFileBlocks(Inode *inode, uint64_t block,
+		const void *buffer, size_t num_blocks), ([=] {
+	if(inode->fileType == kTypeDirectory) {
+		COFIBER_AWAIT writeMetadata(block, buffer, num_blocks);
+		COFIBER_RETURN();
+	}
+	checkIo(COFIBER_AWAIT device->writeSectors(block * sectorsPerBlock,
+			buffer, num_blocks * sectorsPerBlock));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::markBitmap(helix::BorrowedDescriptor bitmap,
+		uint32_t bg_idx, uint32_t bit, size_t count), ([=] {
 	helix::LockMemoryView lock_bitmap;
-	auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
+	auto &&submit_bitmap = helix::submitLockMemoryView(bitmap,
 			&lock_bitmap,
 			bg_idx << blockPagesShift, 1 << blockPagesShift,
 			helix::Dispatcher::global());
 	COFIBER_AWAIT submit_bitmap.async_wait();
 	HEL_CHECK(lock_bitmap.error());
 
-	helix::Mapping bitmap_map{blockBitmap,
+	helix::Mapping bitmap_map{bitmap,
 			bg_idx << blockPagesShift, 1 << blockPagesShift,
 			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
 
 	// TODO: Update the block group descriptor table.
 
 	auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-	for(int i = 0; i < (blocksPerGroup + 31) / 32; i++) {
-		if(words[i] == 0xFFFFFFFF)
-			continue;
-		for(int j = 0; j < 32; j++) {
-			if(words[i] & (static_cast<uint32_t>(1) << j))
-				continue;
-			// TODO: Make sure we never return reserved blocks.
-			// TODO: Make sure we never return blocks higher than the max. block in the SB.
-			auto block = bg_idx * blocksPerGroup + i * 32 + j;
-			assert(block != 0);
-			assert(block < blocksPerGroup);
-			words[i] |= static_cast<uint32_t>(1) << j;
-			COFIBER_RETURN(block);
+
+	// Initialize the bitmaps of uninitialized groups on their first allocation.
+	// The bitmap has to reach the disk before the group descriptor.
+	bool is_block_bitmap = bitmap.getHandle() == blockBitmap.getHandle();
+	auto uninit_flag = is_block_bitmap ? EXT4_BG_BLOCK_UNINIT : EXT4_BG_INODE_UNINIT;
+	if(groupDesc(bg_idx)->flags & uninit_flag) {
+		if(is_block_bitmap) {
+			initBlockBitmap(bg_idx, words);
+		}else{
+			memset(words, 0, blockSize);
+			for(auto i = inodesPerGroup; i < blockSize * 8; i++)
+				words[i / 32] |= static_cast<uint32_t>(1) << (i & 31);
 		}
-		assert(!"Failed to find zero-bit");
+		COFIBER_AWAIT writeMetadata(is_block_bitmap ? blockBitmapOf(bg_idx)
+				: inodeBitmapOf(bg_idx), words, 1);
+
+		groupDesc(bg_idx)->flags &= ~uninit_flag;
+		COFIBER_AWAIT writeGroupDesc(bg_idx);
 	}
 
-	COFIBER_RETURN(0);
+	for(size_t i = bit; i < bit + count; i++) {
+		assert(!(words[i / 32] & (static_cast<uint32_t>(1) << (i & 31))));
+		words[i / 32] |= static_cast<uint32_t>(1) << (i & 31);
+	}
+
+	COFIBER_RETURN();
 }))
 
-COFIBER_ROUTINE(async::result<uint32_t>, FileSystem::allocateInode(), ([=] {
-	// TODO: Do not start at block group zero.
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
-		helix::LockMemoryView lock_bitmap;
-		auto &&submit_bitmap = helix::submitLockMemoryView(inodeBitmap,
-				&lock_bitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				helix::Dispatcher::global());
-		COFIBER_AWAIT submit_bitmap.async_wait();
-		HEL_CHECK(lock_bitmap.error());
+COFIBER_ROUTINE(async::result<void>, FileSystem::clearBitmap(helix::BorrowedDescriptor bitmap,
+		uint32_t bg_idx, uint32_t bit, size_t count), ([=] {
+	helix::LockMemoryView lock_bitmap;
+	auto &&submit_bitmap = helix::submitLockMemoryView(bitmap,
+			&lock_bitmap,
+			bg_idx << blockPagesShift, 1 << blockPagesShift,
+			helix::Dispatcher::global());
+	COFIBER_AWAIT submit_bitmap.async_wait();
+	HEL_CHECK(lock_bitmap.error());
 
-		helix::Mapping bitmap_map{inodeBitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	helix::Mapping bitmap_map{bitmap,
+			bg_idx << blockPagesShift, 1 << blockPagesShift,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
 
-		// TODO: Update the block group descriptor table.
+	auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
+	for(size_t i = bit; i < bit + count; i++) {
+		assert(words[i / 32] & (static_cast<uint32_t>(1) << (i & 31)));
+		words[i / 32] &= ~(static_cast<uint32_t>(1) << (i & 31));
+	}
 
-		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(int i = 0; i < (inodesPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
-				continue;
-			for(int j = 0; j < 32; j++) {
-				if(words[i] & (static_cast<uint32_t>(1) << j))
-					continue;
-				// TODO: Make sure we never return reserved inodes.
-				// TODO: Make sure we never return inodes higher than the max. inode in the SB.
-				auto ino = bg_idx * inodesPerGroup + i * 32 + j + 1;
-				assert(ino != 0);
-				assert(ino < inodesPerGroup);
-				words[i] |= static_cast<uint32_t>(1) << j;
-				COFIBER_RETURN(ino);
-			}
-			assert(!"Failed to find zero-bit");
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::releaseBlocks(uint32_t start,
+		size_t count), ([=] {
+	// Runs never cross a block group boundary.
+	auto bg_idx = (start - firstDataBlock) / blocksPerGroup;
+	COFIBER_AWAIT clearBitmap(blockBitmap, bg_idx,
+			start - firstDataBlock - bg_idx * blocksPerGroup, count);
+	freeBlocks[bg_idx].free(start, count);
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<std::pair<uint32_t, size_t>>, FileSystem::allocateBlocks(
+		Inode *inode, uint32_t goal, size_t num_blocks), ([=] {
+	assert(num_blocks);
+
+	std::pair<uint32_t, size_t> run{0, 0};
+	if(inode->preallocCount && (!goal || goal == inode->preallocStart)) {
+		// Continue in the preallocation window of the inode.
+		run = {inode->preallocStart, std::min(num_blocks, size_t(inode->preallocCount))};
+		inode->preallocStart += run.second;
+		inode->preallocCount -= run.second;
+	}else{
+		// The window is not contiguous with the goal; return it to the index.
+		discardPreallocation(inode);
+
+		// Without a goal, allocate in the block group of the inode.
+		if(!goal)
+			goal = firstDataBlock + ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+
+		// Reserve some more blocks than necessary for future appends.
+		auto want = std::min(num_blocks + preallocWindow, size_t(blocksPerGroup));
+		auto extent = findFreeRun(goal, want);
+		if(!extent.second)
+			COFIBER_RETURN(run);
+
+		run = {extent.first, std::min(num_blocks, size_t(extent.second))};
+		if(extent.second > run.second) {
+			inode->preallocStart = extent.first + run.second;
+			inode->preallocCount = extent.second - run.second;
 		}
 	}
 
+	// The run never crosses a block group boundary.
+	auto bg_idx = (run.first - firstDataBlock) / blocksPerGroup;
+	COFIBER_AWAIT markBitmap(blockBitmap, bg_idx,
+			run.first - firstDataBlock - bg_idx * blocksPerGroup, run.second);
+	COFIBER_RETURN(run);
+}))
+
+COFIBER_ROUTINE(async::result<uint32_t>, FileSystem::allocateTreeBlock(Inode *inode,
+		uint32_t goal), ([=] {
+	if(!goal)
+		goal = firstDataBlock + ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+
+	auto extent = findFreeRun(goal, 1);
+	if(!extent.second)
+		COFIBER_RETURN(0);
+
+	auto bg_idx = (extent.first - firstDataBlock) / blocksPerGroup;
+	COFIBER_AWAIT markBitmap(blockBitmap, bg_idx,
+			extent.first - firstDataBlock - bg_idx * blocksPerGroup, 1);
+	COFIBER_RETURN(extent.first);
+}))
+
+std::pair<uint32_t, uint32_t> FileSystem::findFreeRun(uint32_t goal, size_t want) {
+	auto goal_bg = std::min((goal - firstDataBlock) / blocksPerGroup, numBlockGroups - 1);
+	for(uint32_t i = 0; i < numBlockGroups; i++) {
+		auto bg_idx = (goal_bg + i) % numBlockGroups;
+		auto group_goal = i ? firstDataBlock + bg_idx * blocksPerGroup : goal;
+		auto extent = freeBlocks[bg_idx].allocate(group_goal, want);
+		if(extent.second)
+			return extent;
+	}
+	return {0, 0};
+}
+
+COFIBER_ROUTINE(async::result<uint32_t>, FileSystem::allocateInode(), ([=] {
+	// TODO: Do not start at block group zero.
+	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
+		auto extent = freeInodes[bg_idx].allocate(bg_idx * inodesPerGroup + 1, 1);
+		if(!extent.second)
+			continue;
+
+		// TODO: Make sure we never return reserved inodes.
+		auto ino = extent.first;
+		assert(ino != 0);
+		COFIBER_AWAIT markBitmap(inodeBitmap, bg_idx, ino - 1 - bg_idx * inodesPerGroup, 1);
+		COFIBER_RETURN(ino);
+	}
+
 	COFIBER_RETURN(0);
 }))
 
-COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
+void FileSystem::discardPreallocation(Inode *inode) {
+	if(!inode->preallocCount)
+		return;
+
+	auto bg_idx = (inode->preallocStart - firstDataBlock) / blocksPerGroup;
+	freeBlocks[bg_idx].free(inode->preallocStart, inode->preallocCount);
+	inode->preallocStart = 0;
+	inode->preallocCount = 0;
+}
+
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, FileSystem::assignDataBlocks(Inode *inode,
 		uint64_t block_offset, size_t num_blocks), ([=] {
+	if(inode->usesExtents())
+		COFIBER_RETURN(COFIBER_AWAIT assignExtents(inode, block_offset, num_blocks));
+
 	size_t per_indirect = blockSize / 4;
 	size_t per_single = per_indirect;
 	size_t per_double = per_indirect * per_indirect;
@@ -738,6 +1619,11 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
 
 	auto disk_inode = inode->diskInode();
 
+	// Place new blocks directly behind their predecessor if possible.
+	auto goal_after = [] (uint32_t block) -> uint32_t {
+		return block ? block + 1 : 0;
+	};
+
 	size_t prg = 0;
 	while(prg < num_blocks) {
 		if(block_offset + prg < i_range) {
@@ -748,10 +1634,19 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
 					prg++;
 					continue;
 				}
-				auto block = COFIBER_AWAIT allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->data.blocks.direct[idx] = block;
-				prg++;
+
+				// Allocate the whole run of missing blocks at once.
+				size_t n = 1;
+				while(prg + n < num_blocks && idx + n < i_range
+						&& !disk_inode->data.blocks.direct[idx + n])
+					n++;
+
+				auto run = COFIBER_AWAIT allocateBlocks(inode,
+						goal_after(idx ? disk_inode->data.blocks.direct[idx - 1] : 0), n);
+				assert(run.second && "Out of disk space"); // TODO: Fix this.
+				for(size_t k = 0; k < run.second; k++)
+					disk_inode->data.blocks.direct[idx + k] = run.first + k;
+				prg += run.second;
 			}
 		}else if(block_offset + prg < s_range) {
 			std::cout << "\e[33m" "ext2fs: Allocation in indirect blocks is untested"
@@ -759,9 +1654,10 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
 
 			// Allocate the single-indirect block itself.
 			if(!disk_inode->data.blocks.singleIndirect) {
-				auto block = COFIBER_AWAIT allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->data.blocks.singleIndirect = block;
+				auto run = COFIBER_AWAIT allocateBlocks(inode,
+						goal_after(disk_inode->data.blocks.direct[11]), 1);
+				assert(run.second && "Out of disk space"); // TODO: Fix this.
+				disk_inode->data.blocks.singleIndirect = run.first;
 			}
 
 			helix::LockMemoryView lock_indirect;
@@ -783,10 +1679,18 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
 					prg++;
 					continue;
 				}
-				auto block = COFIBER_AWAIT allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				window[idx] = block;
-				prg++;
+
+				size_t n = 1;
+				while(prg + n < num_blocks && block_offset + prg + n < s_range
+						&& !window[idx + n])
+					n++;
+
+				auto run = COFIBER_AWAIT allocateBlocks(inode,
+						goal_after(idx ? window[idx - 1] : disk_inode->data.blocks.singleIndirect), n);
+				assert(run.second && "Out of disk space"); // TODO: Fix this.
+				for(size_t k = 0; k < run.second; k++)
+					window[idx + k] = run.first + k;
+				prg += run.second;
 			}
 		}else if(block_offset + prg < d_range) {
 			assert(!"TODO: Implement allocation in double indirect blocks");
@@ -802,6 +1706,425 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::assignDataBlocks(Inode *inode,
 	inode->diskMapping = helix::Mapping{inodeTable,
 			inode_address, inodeSize,
 			kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
+
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, FileSystem::assignExtents(Inode *inode,
+		uint64_t block_offset, size_t num_blocks), ([=] {
+	COFIBER_AWAIT loadExtents(inode);
+	COFIBER_AWAIT inode->extentLock.acquire();
+
+	auto error = protocols::fs::Error::none;
+	size_t prg = 0;
+	while(prg < num_blocks) {
+		uint32_t index = block_offset + prg;
+
+		// Skip blocks that are already mapped.
+		auto it = inode->extentMap.upper_bound(index);
+		uint32_t goal = 0;
+		if(it != inode->extentMap.begin()) {
+			auto previous = std::prev(it);
+			auto end = previous->first + previous->second.length;
+			if(index < end) {
+				prg = std::min(num_blocks, size_t(end - block_offset));
+				continue;
+			}
+
+			// Keep the same distance to the preceding extent as on disk.
+			goal = previous->second.physical + (index - previous->first);
+		}
+
+		// Allocate everything up to the next extent at once.
+		size_t n = num_blocks - prg;
+		if(it != inode->extentMap.end())
+			n = std::min(n, size_t(it->first - index));
+
+		auto run = COFIBER_AWAIT allocateBlocks(inode, goal, n);
+		if(!run.second) {
+			error = protocols::fs::Error::noSpaceLeft;
+			break;
+		}
+
+		auto mapped = COFIBER_AWAIT insertExtent(inode, index, run.first, run.second);
+		if(mapped < run.second) {
+			std::cout << "\e[33m" "ext2fs: Extent tree of inode " << inode->number
+					<< " cannot be extended" "\e[39m" << std::endl;
+			COFIBER_AWAIT releaseBlocks(run.first + mapped, run.second - mapped);
+			error = protocols::fs::Error::noSpaceLeft;
+			break;
+		}
+		prg += run.second;
+	}
+
+	inode->extentLock.release();
+
+	// Notify the kernel that the inode might have changed.
+	// Hack: For now, we just remap the inode to make sure the dirty bit is checked.
+	auto inode_address = (inode->number - 1) * inodeSize;
+
+	inode->diskMapping = helix::Mapping{inodeTable,
+			inode_address, inodeSize,
+			kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
+	COFIBER_RETURN(error);
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::loadExtents(Inode *inode), ([=] {
+	if(inode->extentsLoading) {
+		COFIBER_AWAIT inode->extentsReady.async_wait();
+		COFIBER_RETURN();
+	}
+	inode->extentsLoading = true;
+
+	COFIBER_AWAIT readExtentTree(inode->diskInode()->data, &inode->extentMap);
+
+	inode->extentsReady.trigger();
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::readExtentTree(FileData root,
+		std::map<uint32_t, Inode::Extent> *map), ([=] {
+	// Walk the tree level by level. The children of each level are read concurrently.
+	std::vector<std::vector<char>> level;
+	level.emplace_back(root.embedded, root.embedded + sizeof(FileData));
+
+	while(!level.empty()) {
+		std::vector<std::vector<char>> children;
+		std::vector<uint64_t> child_blocks;
+
+		for(auto &node : level) {
+			auto header = reinterpret_cast<DiskExtentHeader *>(node.data());
+			if(header->magic != EXT4_EXTENT_MAGIC
+					|| sizeof(DiskExtentHeader) + header->numEntries * sizeof(DiskExtent)
+						> node.size())
+				throw std::runtime_error("ext2fs: Corrupted extent tree");
+
+			if(!header->depth) {
+				auto extents = reinterpret_cast<DiskExtent *>(header + 1);
+				for(size_t i = 0; i < header->numEntries; i++)
+					map->emplace(extents[i].block, Inode::Extent{extentStart(extents[i]),
+							extentLength(extents[i]), isUninitialized(extents[i])});
+			}else{
+				auto indices = reinterpret_cast<DiskExtentIndex *>(header + 1);
+				for(size_t i = 0; i < header->numEntries; i++)
+					child_blocks.push_back(indices[i].leafLo
+							| (uint64_t(indices[i].leafHi) << 32));
+			}
+		}
+
+		children.resize(child_blocks.size());
+		std::vector<async::result<void>> reads;
+		for(size_t i = 0; i < child_blocks.size(); i++) {
+			children[i].resize(blockSize);
+			reads.push_back(readMetadata(child_blocks[i], children[i].data(), 1));
+		}
+		for(auto &read : reads)
+			COFIBER_AWAIT std::move(read);
+
+		level = std::move(children);
+	}
+
+	COFIBER_RETURN();
+}))
+
+void FileSystem::mapExtent(Inode *inode, uint32_t logical, uint64_t physical,
+		uint32_t length, bool uninitialized) {
+	auto it = inode->extentMap.upper_bound(logical);
+	if(it != inode->extentMap.begin()) {
+		auto &previous = std::prev(it)->second;
+		if(previous.uninitialized == uninitialized
+				&& previous.length + length <= maxLengthOf(uninitialized)
+				&& std::prev(it)->first + previous.length == logical
+				&& previous.physical + previous.length == physical) {
+			previous.length += length;
+			return;
+		}
+	}
+	inode->extentMap.emplace(logical, Inode::Extent{physical, length, uninitialized});
+}
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::findExtentLeaf(Inode *inode,
+		uint32_t logical, ExtentPath *path), ([=] {
+	// Tree blocks are not cached, so we read and write them directly.
+	// We keep all levels as we might have to update the parents.
+	auto root = reinterpret_cast<DiskExtentHeader *>(&inode->diskInode()->data);
+	path->nodes = {root};
+	path->blocks = {0};
+	path->buffers.clear();
+	path->buffers.emplace_back();
+	path->positions.clear();
+
+	auto node = root;
+	while(node->depth) {
+		auto indices = reinterpret_cast<DiskExtentIndex *>(node + 1);
+		assert(node->numEntries);
+		size_t i = 0;
+		while(i + 1 < node->numEntries && indices[i + 1].block <= logical)
+			i++;
+
+		auto block = indices[i].leafLo | (uint64_t(indices[i].leafHi) << 32);
+		path->positions.push_back(i);
+		path->blocks.push_back(block);
+		path->buffers.emplace_back(blockSize);
+		COFIBER_AWAIT readMetadata(block, path->buffers.back().data(), 1);
+
+		auto child = reinterpret_cast<DiskExtentHeader *>(path->buffers.back().data());
+		if(child->magic != EXT4_EXTENT_MAGIC || child->depth + 1 != node->depth
+				|| !child->maxEntries || child->numEntries > child->maxEntries)
+			throw std::runtime_error("ext2fs: Corrupted extent tree");
+		path->nodes.push_back(child);
+		node = child;
+	}
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::writeExtentNode(ExtentPath *path,
+		size_t level), ([=] {
+	if(level)
+		COFIBER_AWAIT writeMetadata(path->blocks[level], path->buffers[level].data(), 1);
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<uint32_t>, FileSystem::insertExtent(Inode *inode,
+		uint32_t logical, uint64_t physical, uint32_t length, bool uninitialized), ([=] {
+	uint32_t mapped = 0;
+	while(length) {
+		auto chunk = std::min(length, maxLengthOf(uninitialized));
+
+		ExtentPath path;
+		COFIBER_AWAIT findExtentLeaf(inode, logical, &path);
+		auto depth = path.nodes.size() - 1;
+		auto leaf = path.leaf();
+		auto extents = reinterpret_cast<DiskExtent *>(leaf + 1);
+
+		if(insertIntoLeaf(leaf, logical, physical, chunk, uninitialized)) {
+			COFIBER_AWAIT writeExtentNode(&path, depth);
+
+			// The extent can only become the first entry of a leaf if it is in front
+			// of all other extents. In that case, the keys along the path are too large.
+			for(size_t level = depth; level-- > 0; ) {
+				auto indices = reinterpret_cast<DiskExtentIndex *>(path.nodes[level] + 1);
+				auto &index = indices[path.positions[level]];
+				if(index.block <= logical)
+					break;
+				index.block = logical;
+				COFIBER_AWAIT writeExtentNode(&path, level);
+			}
+		}else if(depth && extents[leaf->numEntries - 1].block < logical
+				&& path.nodes[depth - 1]->numEntries < path.nodes[depth - 1]->maxEntries) {
+			// Appends to a full leaf start a new leaf behind it instead of splitting it.
+			// This keeps the leaves of sequentially written files full.
+			auto block = COFIBER_AWAIT allocateTreeBlock(inode, path.blocks[depth]);
+			if(!block)
+				COFIBER_RETURN(mapped);
+
+			std::vector<char> buffer(blockSize);
+			auto new_leaf = reinterpret_cast<DiskExtentHeader *>(buffer.data());
+			new_leaf->magic = EXT4_EXTENT_MAGIC;
+			new_leaf->maxEntries = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+			insertIntoLeaf(new_leaf, logical, physical, chunk, uninitialized);
+			COFIBER_AWAIT writeMetadata(block, buffer.data(), 1);
+
+			// Link the new leaf into the parent; the root is written back with the inode.
+			auto parent = path.nodes[depth - 1];
+			auto indices = reinterpret_cast<DiskExtentIndex *>(parent + 1);
+			auto pos = path.positions[depth - 1] + 1;
+			memmove(&indices[pos + 1], &indices[pos],
+					(parent->numEntries - pos) * sizeof(DiskExtentIndex));
+			indices[pos].block = logical;
+			indices[pos].leafLo = block;
+			indices[pos].leafHi = 0;
+			indices[pos].unused = 0;
+			parent->numEntries++;
+			COFIBER_AWAIT writeExtentNode(&path, depth - 1);
+		}else{
+			if(!(COFIBER_AWAIT splitExtentPath(inode, &path)))
+				COFIBER_RETURN(mapped);
+			continue;
+		}
+
+		mapExtent(inode, logical, physical, chunk, uninitialized);
+		logical += chunk;
+		physical += chunk;
+		length -= chunk;
+		mapped += chunk;
+	}
+	COFIBER_RETURN(mapped);
+}))
+
+COFIBER_ROUTINE(async::result<bool>, FileSystem::splitExtentPath(Inode *inode,
+		ExtentPath *path), ([=] {
+	auto depth = path->nodes.size() - 1;
+	auto isFull = [&] (size_t level) {
+		return path->nodes[level]->numEntries == path->nodes[level]->maxEntries;
+	};
+
+	size_t level = depth;
+	while(level && isFull(level - 1))
+		level--;
+	if(!level)
+		COFIBER_RETURN(COFIBER_AWAIT growExtentRoot(inode));
+
+	auto block = COFIBER_AWAIT allocateTreeBlock(inode, path->blocks[level]);
+	if(!block)
+		COFIBER_RETURN(false);
+
+	// Move the upper half of the entries into the new node.
+	// Extents and indices have the same size and both start with their first logical block.
+	auto node = path->nodes[level];
+	assert(node->numEntries >= 2);
+	auto split = node->numEntries / 2;
+	auto entries = reinterpret_cast<DiskExtent *>(node + 1);
+	auto key = entries[split].block;
+
+	std::vector<char> buffer(blockSize);
+	auto new_node = reinterpret_cast<DiskExtentHeader *>(buffer.data());
+	new_node->magic = EXT4_EXTENT_MAGIC;
+	new_node->numEntries = node->numEntries - split;
+	new_node->maxEntries = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	new_node->depth = node->depth;
+	memcpy(new_node + 1, entries + split, new_node->numEntries * sizeof(DiskExtent));
+	COFIBER_AWAIT writeMetadata(block, buffer.data(), 1);
+
+	node->numEntries = split;
+	COFIBER_AWAIT writeExtentNode(path, level);
+
+	auto parent = path->nodes[level - 1];
+	auto indices = reinterpret_cast<DiskExtentIndex *>(parent + 1);
+	auto pos = path->positions[level - 1] + 1;
+	memmove(&indices[pos + 1], &indices[pos],
+			(parent->numEntries - pos) * sizeof(DiskExtentIndex));
+	indices[pos].block = key;
+	indices[pos].leafLo = block;
+	indices[pos].leafHi = 0;
+	indices[pos].unused = 0;
+	parent->numEntries++;
+	COFIBER_AWAIT writeExtentNode(path, level - 1);
+	COFIBER_RETURN(true);
+}))
+
+COFIBER_ROUTINE(async::result<bool>, FileSystem::growExtentRoot(Inode *inode), ([=] {
+	auto root = reinterpret_cast<DiskExtentHeader *>(&inode->diskInode()->data);
+	assert(root->numEntries);
+
+	auto block = COFIBER_AWAIT allocateTreeBlock(inode, 0);
+	if(!block)
+		COFIBER_RETURN(false);
+
+	// Extents and indices have the same size, so we can copy either.
+	std::vector<char> buffer(blockSize);
+	auto node = reinterpret_cast<DiskExtentHeader *>(buffer.data());
+	*node = *root;
+	node->maxEntries = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	memcpy(node + 1, root + 1, root->numEntries * sizeof(DiskExtent));
+	COFIBER_AWAIT writeMetadata(block, buffer.data(), 1);
+
+	// The first index covers the same range as the first entry of the old root.
+	auto indices = reinterpret_cast<DiskExtentIndex *>(root + 1);
+	indices[0].leafLo = block;
+	indices[0].leafHi = 0;
+	indices[0].unused = 0;
+	root->numEntries = 1;
+	root->depth++;
+	COFIBER_RETURN(true);
+}))
+
+COFIBER_ROUTINE(async::result<void>, FileSystem::markInitialized(Inode *inode,
+		uint32_t logical, uint32_t length), ([=] {
+	COFIBER_AWAIT inode->extentLock.acquire();
+
+	while(length) {
+		ExtentPath path;
+		COFIBER_AWAIT findExtentLeaf(inode, logical, &path);
+		auto leaf = path.leaf();
+		auto extents = reinterpret_cast<DiskExtent *>(leaf + 1);
+
+		size_t pos = 0;
+		while(pos < leaf->numEntries && extents[pos].block + extentLength(extents[pos]) <= logical)
+			pos++;
+		if(pos == leaf->numEntries || extents[pos].block > logical) {
+			inode->extentLock.release();
+			throw std::runtime_error("ext2fs: Extent tree does not match the extent map");
+		}
+
+		auto &extent = extents[pos];
+		auto start = extent.block;
+		auto end = start + extentLength(extent);
+		auto n = std::min(length, end - logical);
+		if(!isUninitialized(extent)) {
+			// Another writeback already converted the range.
+			logical += n;
+			length -= n;
+			continue;
+		}
+
+		// Replace the extent by [uninitialized prefix] [written part] [uninitialized suffix].
+		auto physical = extentStart(extent);
+		DiskExtent pieces[3];
+		size_t num_pieces = 0;
+		if(start < logical)
+			setExtent(pieces[num_pieces++], start, physical, logical - start, true);
+		setExtent(pieces[num_pieces++], logical, physical + (logical - start), n, false);
+		if(logical + n < end)
+			setExtent(pieces[num_pieces++], logical + n, physical + (logical + n - start),
+					end - logical - n, true);
+
+		if(leaf->numEntries + num_pieces - 1 > leaf->maxEntries) {
+			if(COFIBER_AWAIT splitExtentPath(inode, &path))
+				continue;
+
+			// The tree cannot grow. Zero the rest of the extent and initialize all of it.
+			constexpr uint32_t zeroBlocks = 16;
+			std::vector<char> zeros(zeroBlocks * blockSize);
+			for(auto block = start; block < end; ) {
+				if(block == logical) {
+					block += n;
+					continue;
+				}
+				auto limit = block < logical ? logical : end;
+				auto count = std::min(limit - block, zeroBlocks);
+				COFIBER_AWAIT writeFileBlocks(inode, physical + (block - start),
+						zeros.data(), count);
+				block += count;
+			}
+			num_pieces = 1;
+			setExtent(pieces[0], start, physical, end - start, false);
+		}
+
+		memmove(&extents[pos + num_pieces], &extents[pos + 1],
+				(leaf->numEntries - pos - 1) * sizeof(DiskExtent));
+		memcpy(&extents[pos], pieces, num_pieces * sizeof(DiskExtent));
+		leaf->numEntries += num_pieces - 1;
+		COFIBER_AWAIT writeExtentNode(&path, path.nodes.size() - 1);
+
+		// Mirror the change in the in-memory map. Split the extent that contains
+		// the range and add the pieces again.
+		auto it = std::prev(inode->extentMap.upper_bound(logical));
+		auto cached_start = it->first;
+		auto cached = it->second;
+		assert(cached.uninitialized && cached_start <= start
+				&& cached_start + cached.length >= end);
+		inode->extentMap.erase(it);
+		if(cached_start < start)
+			mapExtent(inode, cached_start, cached.physical, start - cached_start, true);
+		for(size_t i = 0; i < num_pieces; i++)
+			mapExtent(inode, pieces[i].block, extentStart(pieces[i]),
+					extentLength(pieces[i]), isUninitialized(pieces[i]));
+		if(end < cached_start + cached.length)
+			mapExtent(inode, end, cached.physical + (end - cached_start),
+					cached_start + cached.length - end, true);
+
+		logical += n;
+		length -= n;
+	}
+
+	inode->extentLock.release();
+
+	// Hack: For now, we just remap the inode to make sure the dirty bit is checked.
+	auto inode_address = (inode->number - 1) * inodeSize;
+	inode->diskMapping = helix::Mapping{inodeTable,
+			inode_address, inodeSize,
+			kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
+	COFIBER_RETURN();
 }))
 
 COFIBER_ROUTINE(async::result<void>, FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
@@ -830,6 +2153,43 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::readDataBlocks(std::shared_ptr<
 	COFIBER_AWAIT inode->readyJump.async_wait();
 	// TODO: Assert that we do not read past the EOF.
 
+	if(inode->usesExtents()) {
+		COFIBER_AWAIT loadExtents(inode.get());
+
+		size_t progress = 0;
+		while(progress < num_blocks) {
+			uint32_t index = offset + progress;
+			auto dest = (uint8_t *)buffer + progress * blockSize;
+
+			// Read as much as possible with a single readSectors() command.
+			auto it = inode->extentMap.upper_bound(index);
+			if(it != inode->extentMap.begin()) {
+				auto previous = std::prev(it);
+				auto extent = previous->second;
+				if(index < previous->first + extent.length) {
+					auto n = std::min(num_blocks - progress,
+							size_t(previous->first + extent.length - index));
+					if(extent.uninitialized) {
+						memset(dest, 0, n * blockSize);
+					}else{
+						COFIBER_AWAIT readFileBlocks(inode.get(),
+								extent.physical + (index - previous->first), dest, n);
+					}
+					progress += n;
+					continue;
+				}
+			}
+
+			// Holes read as zeros.
+			auto n = num_blocks - progress;
+			if(it != inode->extentMap.end())
+				n = std::min(n, size_t(it->first - index));
+			memset(dest, 0, n * blockSize);
+			progress += n;
+		}
+		COFIBER_RETURN();
+	}
+
 	size_t progress = 0;
 	while(progress < num_blocks) {
 		// Block number and block count of the readSectors() command that we will issue here.
@@ -884,9 +2244,8 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::readDataBlocks(std::shared_ptr<
 //				<< " blocks, starting at " << issue.first << std::endl;
 
 		assert(issue.first);
-		COFIBER_AWAIT device->readSectors(issue.first * sectorsPerBlock,
-				(uint8_t *)buffer + progress * blockSize,
-				issue.second * sectorsPerBlock);
+		COFIBER_AWAIT readFileBlocks(inode.get(), issue.first,
+				(uint8_t *)buffer + progress * blockSize, issue.second);
 		progress += issue.second;
 	}
 }))
@@ -919,6 +2278,36 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::writeDataBlocks(std::shared_ptr
 	COFIBER_AWAIT inode->readyJump.async_wait();
 	// TODO: Assert that we do not write past the EOF.
 
+	if(inode->usesExtents()) {
+		COFIBER_AWAIT loadExtents(inode.get());
+
+		size_t progress = 0;
+		while(progress < num_blocks) {
+			uint32_t index = offset + progress;
+
+			// Blocks are allocated by assignDataBlocks() before they are written.
+			auto it = inode->extentMap.upper_bound(index);
+			if(it == inode->extentMap.begin())
+				throw std::runtime_error("ext2fs: Writeback to unallocated block");
+			auto previous = std::prev(it);
+			auto extent = previous->second;
+			if(index >= previous->first + extent.length)
+				throw std::runtime_error("ext2fs: Writeback to unallocated block");
+
+			auto n = std::min(num_blocks - progress,
+					size_t(previous->first + extent.length - index));
+			COFIBER_AWAIT writeFileBlocks(inode.get(), extent.physical + (index - previous->first),
+					(const uint8_t *)buffer + progress * blockSize, n);
+
+			// Uninitialized extents read as zeros. Only mark them as initialized once
+			// the data was written; otherwise, a crash would expose stale blocks.
+			if(extent.uninitialized)
+				COFIBER_AWAIT markInitialized(inode.get(), index, n);
+			progress += n;
+		}
+		COFIBER_RETURN();
+	}
+
 	size_t progress = 0;
 	while(progress < num_blocks) {
 		// Block number and block count of the writeSectors() command that we will issue here.
@@ -973,9 +2362,8 @@ COFIBER_ROUTINE(async::result<void>, FileSystem::writeDataBlocks(std::shared_ptr
 //				<< " blocks, starting at " << issue.first << std::endl;
 
 		assert(issue.first);
-		COFIBER_AWAIT device->writeSectors(issue.first * sectorsPerBlock,
-				(const uint8_t *)buffer + progress * blockSize,
-				issue.second * sectorsPerBlock);
+		COFIBER_AWAIT writeFileBlocks(inode.get(), issue.first,
+				(const uint8_t *)buffer + progress * blockSize, issue.second);
 		progress += issue.second;
 	}
 }))
@@ -1,9 +1,12 @@
 
 #include <string.h>
 #include <time.h>
+#include <deque>
 #include <experimental/optional>
+#include <map>
 #include <memory>
 #include <optional>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -11,7 +14,9 @@
 #include <hel.h>
 
 #include <blockfs.hpp>
+#include <protocols/fs/common.hpp>
 #include "common.hpp"
+#include "journal.hpp"
 #include "fs.pb.h"
 
 namespace blockfs {
@@ -74,7 +79,7 @@ struct DiskSuperblock {
 	//-- Performance Hints --
 	uint8_t preallocBlocks;
 	uint8_t preallocDirBlocks;
-	uint16_t alignment;
+	uint16_t reservedGdtBlocks;
 	//-- Journaling Support --
 	uint8_t journalUuid[16];
 	uint32_t journalInum;
@@ -83,11 +88,21 @@ struct DiskSuperblock {
 	//-- Directory Indexing Support --
 	uint32_t hashSeed[4];
 	uint8_t defHashVersion;
-	uint8_t padding[3];
+	uint8_t jnlBackupType;
+	uint16_t descSize;
 	//-- Other options --
 	uint32_t defaultMountOptions;
 	uint32_t firstMetaBg;
-	uint8_t unused[760];
+	uint32_t mkfsTime;
+	uint32_t jnlBlocks[17];
+	//-- 64bit Support --
+	uint32_t blocksCountHi;
+	uint32_t rBlocksCountHi;
+	uint32_t freeBlocksCountHi;
+	uint16_t minExtraIsize;
+	uint16_t wantExtraIsize;
+	uint32_t flags;
+	uint8_t unused[668];
 };
 static_assert(sizeof(DiskSuperblock) == 1024, "Bad DiskSuperblock struct size");
 
@@ -98,10 +113,31 @@ struct DiskGroupDesc {
 	uint16_t freeBlocksCount;
 	uint16_t freeInodesCount;
 	uint16_t usedDirsCount;
-	uint16_t pad;
-	uint8_t reserved[12];
+	uint16_t flags;
+	uint32_t excludeBitmap;
+	uint16_t blockBitmapCsum;
+	uint16_t inodeBitmapCsum;
+	uint16_t itableUnused;
+	uint16_t checksum;
+	//-- Only present if descSize >= 64 --
+	uint32_t blockBitmapHi;
+	uint32_t inodeBitmapHi;
+	uint32_t inodeTableHi;
+	uint16_t freeBlocksCountHi;
+	uint16_t freeInodesCountHi;
+	uint16_t usedDirsCountHi;
+	uint16_t itableUnusedHi;
+	uint32_t excludeBitmapHi;
+	uint16_t blockBitmapCsumHi;
+	uint16_t inodeBitmapCsumHi;
+	uint32_t reserved;
+};
+static_assert(sizeof(DiskGroupDesc) == 64, "Bad DiskGroupDesc struct size");
+
+enum {
+	EXT4_BG_INODE_UNINIT = 0x1,
+	EXT4_BG_BLOCK_UNINIT = 0x2
 };
-static_assert(sizeof(DiskGroupDesc) == 32, "Bad DiskGroupDesc struct size");
 
 struct DiskInode {
 	uint16_t mode;
@@ -119,16 +155,81 @@ struct DiskInode {
 	FileData data;
 	uint32_t generation;
 	uint32_t fileAcl;
-	uint32_t dirAcl;
+	uint32_t sizeHigh;
 	uint32_t faddr;
 	uint8_t osd2[12];
 };
 static_assert(sizeof(DiskInode) == 128, "Bad DiskInode struct size");
 
+// ext4 extent trees are stored in DiskInode::data and in tree blocks.
+struct DiskExtentHeader {
+	uint16_t magic;
+	uint16_t numEntries;
+	uint16_t maxEntries;
+	uint16_t depth;
+	uint32_t generation;
+};
+static_assert(sizeof(DiskExtentHeader) == 12, "Bad DiskExtentHeader struct size");
+
+struct DiskExtent {
+	uint32_t block;
+	uint16_t length; // Values above maxExtentLength denote uninitialized extents.
+	uint16_t startHi;
+	uint32_t startLo;
+};
+static_assert(sizeof(DiskExtent) == 12, "Bad DiskExtent struct size");
+
+struct DiskExtentIndex {
+	uint32_t block;
+	uint32_t leafLo;
+	uint16_t leafHi;
+	uint16_t unused;
+};
+static_assert(sizeof(DiskExtentIndex) == 12, "Bad DiskExtentIndex struct size");
+
+enum {
+	EXT4_EXTENT_MAGIC = 0xF30A
+};
+
+inline constexpr uint32_t maxExtentLength = 32768;
+
 enum {
 	EXT2_ROOT_INO = 2
 };
 
+enum {
+	EXT3_FEATURE_COMPAT_HAS_JOURNAL = 0x4,
+	EXT2_FEATURE_COMPAT_DIR_INDEX = 0x20
+};
+
+enum {
+	EXT2_FEATURE_INCOMPAT_FILETYPE = 0x2,
+	EXT3_FEATURE_INCOMPAT_RECOVER = 0x4,
+	EXT4_FEATURE_INCOMPAT_EXTENTS = 0x40,
+	EXT4_FEATURE_INCOMPAT_64BIT = 0x80,
+	EXT4_FEATURE_INCOMPAT_FLEX_BG = 0x200,
+	EXT4_FEATURE_INCOMPAT_CSUM_SEED = 0x2000,
+	EXT4_FEATURE_INCOMPAT_LARGEDIR = 0x4000
+};
+
+enum {
+	EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER = 0x1,
+	EXT2_FEATURE_RO_COMPAT_LARGE_FILE = 0x2,
+	EXT4_FEATURE_RO_COMPAT_GDT_CSUM = 0x10,
+	EXT4_FEATURE_RO_COMPAT_DIR_NLINK = 0x20,
+	EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE = 0x40,
+	EXT4_FEATURE_RO_COMPAT_METADATA_CSUM = 0x400
+};
+
+enum {
+	EXT2_FLAGS_UNSIGNED_HASH = 0x2
+};
+
+enum {
+	EXT2_INDEX_FL = 0x1000,
+	EXT4_EXTENTS_FL = 0x80000
+};
+
 enum {
 	EXT2_S_IFMT = 0xF000,
 	EXT2_S_IFLNK = 0xA000,
@@ -159,6 +260,59 @@ struct DirEntry {
 	FileType fileType;
 };
 
+// --------------------------------------------------------
+// ManageRequest
+// --------------------------------------------------------
+
+// An initialization or writeback request for a range of a managed memory object.
+struct ManageRequest {
+	int type;
+	uintptr_t offset;
+	size_t length;
+};
+
+// --------------------------------------------------------
+// Semaphore
+// --------------------------------------------------------
+
+// Counting semaphore for coroutines. Bounds the number of manage requests
+// that are handled concurrently and serializes updates of directories.
+struct Semaphore {
+	Semaphore(unsigned int limit);
+
+	async::result<void> acquire();
+	void release();
+
+private:
+	unsigned int _available;
+	std::deque<async::promise<void> *> _waiters;
+};
+
+// --------------------------------------------------------
+// ExtentIndex
+// --------------------------------------------------------
+
+// In-memory index of the free blocks (or inodes) of a single block group.
+struct ExtentIndex {
+	ExtentIndex();
+
+	uint32_t numFree() {
+		return _numFree;
+	}
+
+	// Allocates a run of up to max_count entries. Prefers a run that starts at goal,
+	// then a run after goal that is large enough, then the nearest run after goal.
+	// Returns the first entry and the length of the run (zero if the group is full).
+	std::pair<uint32_t, uint32_t> allocate(uint32_t goal, uint32_t max_count);
+
+	void free(uint32_t start, uint32_t count);
+
+private:
+	// Maps the first entry of each free extent to its length.
+	std::map<uint32_t, uint32_t> _extents;
+	uint32_t _numFree;
+};
+
 // --------------------------------------------------------
 // Inode
 // --------------------------------------------------------
@@ -168,23 +322,33 @@ struct FileSystem;
 struct Inode : std::enable_shared_from_this<Inode> {
 	Inode(FileSystem &fs, uint32_t number);
 
+	~Inode();
+
 	DiskInode *diskInode() {
 		return reinterpret_cast<DiskInode *>(diskMapping.get());
 	}
 
 	// Returns the size of the file in bytes.
 	uint64_t fileSize() {
-		return diskInode()->size;
+		return diskInode()->size | (uint64_t(diskInode()->sizeHigh) << 32);
 	}
 
 	void setFileSize(uint64_t size) {
-		assert(!(size & ~uint64_t(0xFFFFFFFF)));
 		diskInode()->size = size;
+		diskInode()->sizeHigh = size >> 32;
+	}
+
+	// Returns true if the data blocks are mapped by an ext4 extent tree.
+	bool usesExtents() {
+		return diskInode()->flags & EXT4_EXTENTS_FL;
 	}
 
+	// Returns true if the directory uses a hashed (htree) index.
+	bool isIndexed();
+
 	async::result<std::experimental::optional<DirEntry>> findEntry(std::string name);
 	async::result<std::experimental::optional<DirEntry>> link(std::string name, int64_t ino);
-	async::result<void> unlink(std::string name);
+	async::result<protocols::fs::Error> unlink(std::string name);
 
 	FileSystem &fs;
 
@@ -217,6 +381,33 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	// - Indirection level 3/3 for triple indirect blocks.
 	helix::UniqueDescriptor indirectOrder3;
 
+	// Serializes link() and unlink() on directories.
+	Semaphore directoryLock;
+
+	// In-memory name index of large directories without an htree.
+	// Built on the first lookup and maintained by link() and unlink().
+	std::unique_ptr<std::unordered_map<std::string, DirEntry>> nameIndex;
+
+	// Extents of the file, indexed by their first logical block.
+	// Loaded from the extent tree on the first access to the file's data.
+	struct Extent {
+		uint64_t physical;
+		uint32_t length;
+		bool uninitialized;
+	};
+
+	std::map<uint32_t, Extent> extentMap;
+	bool extentsLoading;
+	async::jump extentsReady;
+
+	// Serializes updates of the extent tree.
+	Semaphore extentLock;
+
+	// Blocks that are reserved for future appends to this file.
+	// They are marked in the free-extent index but not in the on-disk bitmap.
+	uint32_t preallocStart;
+	uint32_t preallocCount;
+
 	// NOTE: The following fields are only meaningful if the isReady is true
 
 	FileType fileType;
@@ -234,6 +425,21 @@ struct Inode : std::enable_shared_from_this<Inode> {
 // FileSystem
 // --------------------------------------------------------
 
+// Path from the root of an extent tree to a leaf. nodes[0] is the root in the inode,
+// the other nodes point into copies of the tree blocks (blocks[0] is unused).
+struct ExtentPath {
+	std::vector<DiskExtentHeader *> nodes;
+	std::vector<uint64_t> blocks;
+	std::vector<std::vector<char>> buffers;
+
+	// Index of the entry that leads to the next level, for each interior node.
+	std::vector<size_t> positions;
+
+	DiskExtentHeader *leaf() {
+		return nodes.back();
+	}
+};
+
 struct FileSystem {
 	FileSystem(BlockDevice *device);
 
@@ -247,7 +453,7 @@ struct FileSystem {
 	std::shared_ptr<Inode> accessInode(uint32_t number);
 	async::result<std::shared_ptr<Inode>> createRegular();
 
-	async::result<void> write(Inode *inode, uint64_t offset,
+	async::result<protocols::fs::Error> write(Inode *inode, uint64_t offset,
 			const void *buffer, size_t length);
 
 	cofiber::no_future initiateInode(std::shared_ptr<Inode> inode);
@@ -255,12 +461,118 @@ struct FileSystem {
 	cofiber::no_future manageIndirect(std::shared_ptr<Inode> inode, int order,
 			helix::UniqueDescriptor memory);
 
-	async::result<uint32_t> allocateBlock();
+	// Handle a single manage request each. The limiter slot is released on completion.
+	cofiber::no_future handleBitmapRequest(helix::BorrowedDescriptor memory,
+			uint64_t block, ManageRequest request, Semaphore *limiter);
+	cofiber::no_future handleInodeTableRequest(helix::BorrowedDescriptor memory,
+			ManageRequest request, Semaphore *limiter);
+	cofiber::no_future handleFileDataRequest(std::shared_ptr<Inode> inode,
+			ManageRequest request, Semaphore *limiter);
+	cofiber::no_future handleIndirectRequest(std::shared_ptr<Inode> inode, int order,
+			helix::BorrowedDescriptor memory, ManageRequest request, Semaphore *limiter);
+
+	// Locations of the per-group metadata.
+	DiskGroupDesc *groupDesc(uint32_t bg_idx);
+	uint64_t blockBitmapOf(uint32_t bg_idx);
+	uint64_t inodeBitmapOf(uint32_t bg_idx);
+	uint64_t inodeTableOf(uint32_t bg_idx);
+
+	// Builds the free-extent indices from the on-disk bitmaps.
+	async::result<void> buildFreeIndex();
+
+	// Returns true if the block group contains a copy of the superblock and the group descriptors.
+	bool hasSuperblockBackup(uint32_t bg_idx);
+
+	// Computes the block bitmap of a group with EXT4_BG_BLOCK_UNINIT.
+	void initBlockBitmap(uint32_t bg_idx, uint32_t *words);
+
+	// Writes the block of the group descriptor table that contains a descriptor.
+	async::result<void> writeGroupDesc(uint32_t bg_idx);
+
+	// Maps the journal inode, replays the journal and enables journaling.
+	// Returns false if the journal cannot be used.
+	async::result<bool> loadJournal(uint32_t number);
+
+	// Metadata writes go through the journal (if there is one). Reads return
+	// the latest logged contents of blocks that were not checkpointed yet.
+	async::result<void> readMetadata(uint64_t block, void *buffer, size_t num_blocks);
+	async::result<void> writeMetadata(uint64_t block, const void *buffer, size_t num_blocks);
+
+	// Accesses the data blocks of a file. Directory blocks are treated as metadata.
+	async::result<void> readFileBlocks(Inode *inode, uint64_t block,
+			void *buffer, size_t num_blocks);
+	async::result<void> writeFileBlocks(Inode *inode, uint64_t block,
+			const void *buffer, size_t num_blocks);
+
+	// Allocates a run of up to num_blocks blocks close to goal (zero if there is no goal).
+	// Returns the first block and the length of the run.
+	async::result<std::pair<uint32_t, size_t>> allocateBlocks(Inode *inode,
+			uint32_t goal, size_t num_blocks);
 	async::result<uint32_t> allocateInode();
 
-	async::result<void> assignDataBlocks(Inode *inode,
+	// Allocates a block of the extent tree of an inode close to goal.
+	// Unlike allocateBlocks(), this does not consume the preallocation window.
+	// Returns zero if the file system is full.
+	async::result<uint32_t> allocateTreeBlock(Inode *inode, uint32_t goal);
+
+	// Takes a run of up to want free blocks from the free-extent index, starting at the
+	// group of goal. The bitmap is not updated. Returns a zero length if there is no space.
+	std::pair<uint32_t, uint32_t> findFreeRun(uint32_t goal, size_t want);
+
+	// Returns the preallocation window of an inode to the free-extent index.
+	void discardPreallocation(Inode *inode);
+
+	// Sets bits of the block or inode bitmap.
+	async::result<void> markBitmap(helix::BorrowedDescriptor bitmap,
+			uint32_t bg_idx, uint32_t bit, size_t count);
+	// Clears bits of the block or inode bitmap.
+	async::result<void> clearBitmap(helix::BorrowedDescriptor bitmap,
+			uint32_t bg_idx, uint32_t bit, size_t count);
+
+	// Returns a run of blocks from allocateBlocks() to the free space.
+	async::result<void> releaseBlocks(uint32_t start, size_t count);
+
+	async::result<protocols::fs::Error> assignDataBlocks(Inode *inode,
+			uint64_t block_offset, size_t num_blocks);
+
+	// Allocates the unmapped blocks of a range of an inode that uses extents.
+	async::result<protocols::fs::Error> assignExtents(Inode *inode,
 			uint64_t block_offset, size_t num_blocks);
 
+	// Reads the extent tree of an inode into Inode::extentMap.
+	async::result<void> loadExtents(Inode *inode);
+
+	// Collects the extents of the tree that starts at root.
+	async::result<void> readExtentTree(FileData root, std::map<uint32_t, Inode::Extent> *map);
+
+	// Adds a run of blocks to the in-memory extent map.
+	void mapExtent(Inode *inode, uint32_t logical, uint64_t physical, uint32_t length,
+			bool uninitialized);
+
+	// Descends from the root of the extent tree to the leaf that covers a logical block.
+	async::result<void> findExtentLeaf(Inode *inode, uint32_t logical, ExtentPath *path);
+
+	// Writes a node of the path back. The root is written back with the inode.
+	async::result<void> writeExtentNode(ExtentPath *path, size_t level);
+
+	// Maps a run of logical blocks to newly allocated physical blocks in the extent tree.
+	// Returns the number of blocks that were mapped; this is less than length
+	// if the tree cannot be extended.
+	async::result<uint32_t> insertExtent(Inode *inode, uint32_t logical,
+			uint64_t physical, uint32_t length, bool uninitialized = false);
+
+	// Makes room in the leaf of a path: splits the highest full node whose parent
+	// is not full or grows the root. The path is invalid afterwards.
+	// Returns false if no tree block can be allocated.
+	async::result<bool> splitExtentPath(Inode *inode, ExtentPath *path);
+
+	// Moves the entries of the root of the extent tree into a new block
+	// and increases the depth of the tree.
+	async::result<bool> growExtentRoot(Inode *inode);
+
+	// Marks a written range of uninitialized extents as initialized.
+	async::result<void> markInitialized(Inode *inode, uint32_t logical, uint32_t length);
+
 	async::result<void> readDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
 			size_t num_blocks, void *buffer);
 	async::result<void> writeDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
@@ -275,12 +587,33 @@ struct FileSystem {
 	uint32_t numBlockGroups;
 	uint32_t blocksPerGroup;
 	uint32_t inodesPerGroup;
+	uint32_t firstDataBlock;
+	uint32_t numBlocks;
+	uint32_t numInodes;
+	bool sparseSuper;
+	uint16_t reservedGdtBlocks;
+	bool dirIndex;
+	// Allows a second level of htree interior nodes.
+	bool largeDir;
+	bool extents;
+	bool is64Bit;
+	// Set if the file system uses features that we cannot update correctly (e.g., checksums).
+	bool readOnly;
+	uint16_t descSize;
+	bool unsignedHash;
+	uint32_t hashSeed[4];
 	void *blockGroupDescriptorBuffer;
 
 	helix::UniqueDescriptor blockBitmap;
 	helix::UniqueDescriptor inodeBitmap;
 	helix::UniqueDescriptor inodeTable;
 
+	// Free blocks and inodes per block group.
+	std::vector<ExtentIndex> freeBlocks;
+	std::vector<ExtentIndex> freeInodes;
+
+	std::unique_ptr<Journal> journal;
+
 	std::unordered_map<uint32_t, std::weak_ptr<Inode>> activeInodes;
 };
 
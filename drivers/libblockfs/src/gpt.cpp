@@ -1,6 +1,8 @@
 
-#include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 
 #include "gpt.hpp"
 
@@ -15,26 +17,29 @@ Table::Table(BlockDevice *device)
 : device(device) { }
 
 COFIBER_ROUTINE(async::result<void>, Table::parse(), ([=] {
-	assert(getDevice()->sectorSize == 512);
-
-	auto header_buffer = malloc(512);
-	assert(header_buffer);
-	COFIBER_AWAIT getDevice()->readSectors(1, header_buffer, 1);
-	
-	DiskHeader *header = (DiskHeader *)header_buffer;
-	assert(header->signature == 0x5452415020494645); // TODO: handle this error
-
-	size_t table_size = header->entrySize * header->numEntries;
-	size_t table_sectors = table_size / 512;
-	if(!(table_size % 512))
-		table_sectors++;
-
-	auto table_buffer = malloc(table_sectors * 512);
-	assert(table_buffer);
-	COFIBER_AWAIT getDevice()->readSectors(2, table_buffer, table_sectors);
-	
-	for(uint32_t i = 0; i < header->numEntries; i++) {
-		DiskEntry *entry = (DiskEntry *)((char *)table_buffer + i * header->entrySize);
+	// All LBAs in the GPT are in units of the device's logical sectors.
+	// The header is stored at the start of LBA 1.
+	auto sector_size = getDevice()->sectorSize;
+	assert(sector_size >= sizeof(DiskHeader));
+
+	std::vector<char> header_buffer(sector_size);
+	if(COFIBER_AWAIT getDevice()->readSectors(1, header_buffer.data(), 1) != IoError::none)
+		throw std::runtime_error("gpt: I/O error while reading the header");
+
+	DiskHeader header;
+	memcpy(&header, header_buffer.data(), sizeof(DiskHeader));
+	assert(header.signature == 0x5452415020494645); // TODO: handle this error
+
+	size_t table_size = header.entrySize * header.numEntries;
+	size_t table_sectors = (table_size + sector_size - 1) / sector_size;
+
+	std::vector<char> table_buffer(table_sectors * sector_size);
+	if(COFIBER_AWAIT getDevice()->readSectors(header.startingLba,
+			table_buffer.data(), table_sectors) != IoError::none)
+		throw std::runtime_error("gpt: I/O error while reading the partition table");
+
+	for(uint32_t i = 0; i < header.numEntries; i++) {
+		DiskEntry *entry = (DiskEntry *)(table_buffer.data() + i * header.entrySize);
 
 		if(entry->typeGuid == type_guids::null)
 			continue;
@@ -43,8 +48,6 @@ COFIBER_ROUTINE(async::result<void>, Table::parse(), ([=] {
 				entry->firstLba, entry->lastLba - entry->firstLba + 1});
 	}
 
-	free(header_buffer);
-	free(table_buffer);
 	COFIBER_RETURN();
 }))
 
@@ -73,17 +76,21 @@ Guid Partition::type() {
 	return _type;
 }
 
-async::result<void> Partition::readSectors(uint64_t sector, void *buffer, size_t count) {
+async::result<IoError> Partition::readSectors(uint64_t sector, void *buffer, size_t count) {
 	assert(sector + count <= _numSectors);
 	return _table.getDevice()->readSectors(_startLba + sector,
 			buffer, count);
 }
 
-async::result<void> Partition::writeSectors(uint64_t sector, const void *buffer, size_t count) {
+async::result<IoError> Partition::writeSectors(uint64_t sector, const void *buffer, size_t count) {
 	assert(sector + count <= _numSectors);
 	return _table.getDevice()->writeSectors(_startLba + sector,
 			buffer, count);
 }
 
+async::result<IoError> Partition::flush() {
+	return _table.getDevice()->flush();
+}
+
 } } // namespace blockfs::gpt
 
@@ -96,12 +96,14 @@ struct Partition : public BlockDevice {
 	Partition(Table &table, Guid id, Guid type,
 			uint64_t start_lba, uint64_t num_sectors);
 
-	async::result<void> readSectors(uint64_t sector, void *buffer,
+	async::result<IoError> readSectors(uint64_t sector, void *buffer,
 			size_t num_sectors) override;
 
-	async::result<void> writeSectors(uint64_t sector, const void *buffer,
+	async::result<IoError> writeSectors(uint64_t sector, const void *buffer,
 			size_t num_sectors) override;
 
+	async::result<IoError> flush() override;
+
 	Guid id();
 
 	Guid type();
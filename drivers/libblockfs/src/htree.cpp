@@ -0,0 +1,298 @@
+
+#include <assert.h>
+#include <string.h>
+
+#include "htree.hpp"
+
+namespace blockfs {
+namespace ext2fs {
+namespace htree {
+
+namespace {
+	uint32_t rotateLeft(uint32_t x, int s) {
+		return (x << s) | (x >> (32 - s));
+	}
+
+	// The legacy hash of ext3.
+	template<typename C>
+	uint32_t legacyHash(const char *name, size_t length) {
+		uint32_t hash0 = 0x12A3FE2D;
+		uint32_t hash1 = 0x37ABE8F9;
+		auto p = reinterpret_cast<const C *>(name);
+		for(size_t i = 0; i < length; i++) {
+			uint32_t hash = hash1 + (hash0 ^ (static_cast<uint32_t>(int(p[i])) * 7152373));
+			if(hash & 0x80000000)
+				hash -= 0x7FFFFFFF;
+			hash1 = hash0;
+			hash0 = hash;
+		}
+		return hash0 << 1;
+	}
+
+	// Converts (a chunk of) the name into num words of input for TEA and half-MD4.
+	template<typename C>
+	void toHashBuffer(const char *name, size_t length, uint32_t *buf, int num) {
+		auto p = reinterpret_cast<const C *>(name);
+
+		uint32_t pad = static_cast<uint32_t>(length) | (static_cast<uint32_t>(length) << 8);
+		pad |= pad << 16;
+
+		uint32_t val = pad;
+		if(length > size_t(num) * 4)
+			length = num * 4;
+		for(size_t i = 0; i < length; i++) {
+			val = static_cast<uint32_t>(int(p[i])) + (val << 8);
+			if((i % 4) == 3) {
+				*buf++ = val;
+				val = pad;
+				num--;
+			}
+		}
+		if(--num >= 0)
+			*buf++ = val;
+		while(--num >= 0)
+			*buf++ = pad;
+	}
+
+	void teaTransform(uint32_t *buf, const uint32_t *in) {
+		uint32_t sum = 0;
+		uint32_t b0 = buf[0], b1 = buf[1];
+		uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+		for(int n = 0; n < 16; n++) {
+			sum += 0x9E3779B9;
+			b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+			b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+		}
+		buf[0] += b0;
+		buf[1] += b1;
+	}
+
+	void halfMd4Transform(uint32_t *buf, const uint32_t *in) {
+		auto f = [] (uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+		auto g = [] (uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+		auto h = [] (uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+
+		constexpr uint32_t k2 = 0x5A827999;
+		constexpr uint32_t k3 = 0x6ED9EBA1;
+
+		uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+		a = rotateLeft(a + f(b, c, d) + in[0], 3);
+		d = rotateLeft(d + f(a, b, c) + in[1], 7);
+		c = rotateLeft(c + f(d, a, b) + in[2], 11);
+		b = rotateLeft(b + f(c, d, a) + in[3], 19);
+		a = rotateLeft(a + f(b, c, d) + in[4], 3);
+		d = rotateLeft(d + f(a, b, c) + in[5], 7);
+		c = rotateLeft(c + f(d, a, b) + in[6], 11);
+		b = rotateLeft(b + f(c, d, a) + in[7], 19);
+
+		a = rotateLeft(a + g(b, c, d) + in[1] + k2, 3);
+		d = rotateLeft(d + g(a, b, c) + in[3] + k2, 5);
+		c = rotateLeft(c + g(d, a, b) + in[5] + k2, 9);
+		b = rotateLeft(b + g(c, d, a) + in[7] + k2, 13);
+		a = rotateLeft(a + g(b, c, d) + in[0] + k2, 3);
+		d = rotateLeft(d + g(a, b, c) + in[2] + k2, 5);
+		c = rotateLeft(c + g(d, a, b) + in[4] + k2, 9);
+		b = rotateLeft(b + g(c, d, a) + in[6] + k2, 13);
+
+		a = rotateLeft(a + h(b, c, d) + in[3] + k3, 3);
+		d = rotateLeft(d + h(a, b, c) + in[7] + k3, 9);
+		c = rotateLeft(c + h(d, a, b) + in[2] + k3, 11);
+		b = rotateLeft(b + h(c, d, a) + in[6] + k3, 15);
+		a = rotateLeft(a + h(b, c, d) + in[1] + k3, 3);
+		d = rotateLeft(d + h(a, b, c) + in[5] + k3, 9);
+		c = rotateLeft(c + h(d, a, b) + in[0] + k3, 11);
+		b = rotateLeft(b + h(c, d, a) + in[4] + k3, 15);
+
+		buf[0] += a;
+		buf[1] += b;
+		buf[2] += c;
+		buf[3] += d;
+	}
+
+	template<typename C>
+	uint32_t chunkedHash(const char *name, size_t length, bool tea, uint32_t *buf) {
+		uint32_t in[8];
+		size_t chunk = tea ? 16 : 32;
+		for(size_t offset = 0; offset < length; offset += chunk) {
+			if(tea) {
+				toHashBuffer<C>(name + offset, length - offset, in, 4);
+				teaTransform(buf, in);
+			}else{
+				toHashBuffer<C>(name + offset, length - offset, in, 8);
+				halfMd4Transform(buf, in);
+			}
+		}
+		return tea ? buf[0] : buf[1];
+	}
+
+	// Finds the last entry of a node whose hash is not greater than hash.
+	Entry *searchNode(Entry *entries, uint32_t hash) {
+		auto count = countLimit(entries)->count;
+		assert(count);
+
+		// entries[0] has an implicit hash of zero.
+		size_t low = 1;
+		size_t high = count;
+		while(low < high) {
+			auto mid = low + (high - low) / 2;
+			if(entries[mid].hash > hash) {
+				high = mid;
+			}else{
+				low = mid + 1;
+			}
+		}
+		return &entries[low - 1];
+	}
+
+	Entry *nodeEntries(char *dir, size_t block_size, uint32_t block) {
+		return reinterpret_cast<Entry *>(dir + (block & 0x0FFFFFFF) * block_size
+				+ nodeEntriesOffset);
+	}
+
+	void insertAfter(Frame &frame, uint32_t hash, uint32_t block) {
+		auto cl = countLimit(frame.entries);
+		assert(cl->count < cl->limit);
+
+		auto end = frame.entries + cl->count;
+		auto position = frame.at + 1;
+		memmove(position + 1, position, (end - position) * sizeof(Entry));
+		position->hash = hash;
+		position->block = block;
+		cl->count++;
+	}
+
+	// Interior nodes start with an empty directory entry that spans the whole block,
+	// so that they look like empty leaves to implementations without htree support.
+	Entry *initNode(char *node, size_t block_size) {
+		memset(node, 0, nodeEntriesOffset);
+		uint16_t record_length = block_size;
+		memcpy(node + 4, &record_length, sizeof(uint16_t));
+
+		return reinterpret_cast<Entry *>(node + nodeEntriesOffset);
+	}
+}
+
+uint32_t hashName(const char *name, size_t length, int version, const uint32_t *seed) {
+	uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+	if(seed[0] || seed[1] || seed[2] || seed[3])
+		memcpy(buf, seed, sizeof(buf));
+
+	uint32_t hash;
+	switch(version) {
+	case kHashLegacy: hash = legacyHash<signed char>(name, length); break;
+	case kHashLegacyUnsigned: hash = legacyHash<unsigned char>(name, length); break;
+	case kHashHalfMd4: hash = chunkedHash<signed char>(name, length, false, buf); break;
+	case kHashHalfMd4Unsigned: hash = chunkedHash<unsigned char>(name, length, false, buf); break;
+	case kHashTea: hash = chunkedHash<signed char>(name, length, true, buf); break;
+	case kHashTeaUnsigned: hash = chunkedHash<unsigned char>(name, length, true, buf); break;
+	default:
+		assert(!"Unexpected hash version");
+		__builtin_unreachable();
+	}
+
+	// 0xFFFFFFFE is reserved as an end-of-directory marker.
+	hash &= ~uint32_t(1);
+	if(hash == (uint32_t(0x7FFFFFFF) << 1))
+		hash = uint32_t(0x7FFFFFFE) << 1;
+	return hash;
+}
+
+bool lookup(char *dir, size_t dir_size, size_t block_size, const char *name, size_t length,
+		const uint32_t *seed, bool unsigned_hash, Path &path) {
+	auto info = reinterpret_cast<RootInfo *>(dir + rootInfoOffset);
+	if(info->reservedZero || info->hashVersion > kHashTea
+			|| info->indirectLevels >= maxDepth
+			|| rootInfoOffset + info->infoLength + sizeof(Entry) > block_size)
+		return false;
+
+	path.hashVersion = info->hashVersion + (unsigned_hash ? 3 : 0);
+	path.hash = hashName(name, length, path.hashVersion, seed);
+	path.depth = info->indirectLevels + 1;
+
+	auto entries = reinterpret_cast<Entry *>(dir + rootInfoOffset + info->infoLength);
+	for(int level = 0; level < path.depth; level++) {
+		auto cl = countLimit(entries);
+		if(!cl->count || cl->count > cl->limit)
+			return false;
+
+		path.frames[level].entries = entries;
+		path.frames[level].at = searchNode(entries, path.hash);
+
+		auto block = path.frames[level].at->block & 0x0FFFFFFF;
+		if((block + 1) * block_size > dir_size)
+			return false;
+		if(level + 1 < path.depth)
+			entries = nodeEntries(dir, block_size, block);
+	}
+	return true;
+}
+
+bool nextLeaf(char *dir, size_t block_size, Path &path, uint32_t hash) {
+	// Find the deepest node that has entries left.
+	int level = path.depth - 1;
+	while(true) {
+		auto &frame = path.frames[level];
+		if(frame.at + 1 < frame.entries + countLimit(frame.entries)->count)
+			break;
+		if(!level)
+			return false;
+		level--;
+	}
+
+	path.frames[level].at++;
+
+	// Only continue if the next leaf starts with the same hash.
+	auto next_hash = path.frames[level].at->hash;
+	if(!(next_hash & continuationBit) || (next_hash & ~continuationBit) != hash)
+		return false;
+
+	for(level++; level < path.depth; level++) {
+		auto entries = nodeEntries(dir, block_size, path.frames[level - 1].at->block);
+		path.frames[level].entries = entries;
+		path.frames[level].at = entries;
+	}
+	return true;
+}
+
+void insertLeaf(Path &path, uint32_t hash, uint32_t block) {
+	insertAfter(path.frames[path.depth - 1], hash, block);
+}
+
+void splitNode(Path &path, int level, char *new_node, uint32_t new_block, size_t block_size) {
+	assert(level > 0 && level < path.depth);
+	auto entries = path.frames[level].entries;
+	auto cl = countLimit(entries);
+	auto count = cl->count;
+	auto split = count / 2;
+	assert(split);
+
+	// The hash of the first moved entry becomes the key of the new node in the parent;
+	// in the new node, its place is taken by the count and limit.
+	auto hash = entries[split].hash;
+	auto new_entries = initNode(new_node, block_size);
+	memcpy(new_entries, entries + split, (count - split) * sizeof(Entry));
+	countLimit(new_entries)->limit = (block_size - nodeEntriesOffset) / sizeof(Entry);
+	countLimit(new_entries)->count = count - split;
+	cl->count = split;
+
+	insertAfter(path.frames[level - 1], hash, new_block);
+}
+
+void growRoot(char *dir, Path &path, char *new_node, uint32_t new_block, size_t block_size) {
+	auto info = reinterpret_cast<RootInfo *>(dir + rootInfoOffset);
+	assert(info->indirectLevels + 1 < maxDepth);
+
+	auto entries = path.frames[0].entries;
+	auto cl = countLimit(entries);
+	// Interior nodes have room for more entries than the root.
+	auto new_entries = initNode(new_node, block_size);
+	memcpy(new_entries, entries, cl->count * sizeof(Entry));
+	countLimit(new_entries)->limit = (block_size - nodeEntriesOffset) / sizeof(Entry);
+
+	cl->count = 1;
+	entries[0].block = new_block;
+	info->indirectLevels++;
+}
+
+} } } // namespace blockfs::ext2fs::htree
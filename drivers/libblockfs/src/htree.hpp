@@ -0,0 +1,111 @@
+
+#ifndef LIBFS_HTREE_HPP
+#define LIBFS_HTREE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace blockfs {
+namespace ext2fs {
+namespace htree {
+
+// --------------------------------------------------------
+// On-disk structures
+// --------------------------------------------------------
+
+// Follows the "." and ".." entries in the first block of an indexed directory.
+struct RootInfo {
+	uint32_t reservedZero;
+	uint8_t hashVersion;
+	uint8_t infoLength;
+	uint8_t indirectLevels;
+	uint8_t unusedFlags;
+};
+static_assert(sizeof(RootInfo) == 8, "Bad RootInfo struct size");
+
+// Overlays the hash field of the first Entry of each index node.
+struct CountLimit {
+	uint16_t limit;
+	uint16_t count;
+};
+static_assert(sizeof(CountLimit) == 4, "Bad CountLimit struct size");
+
+struct Entry {
+	uint32_t hash;
+	uint32_t block;
+};
+static_assert(sizeof(Entry) == 8, "Bad Entry struct size");
+
+enum {
+	kHashLegacy = 0,
+	kHashHalfMd4 = 1,
+	kHashTea = 2,
+	kHashLegacyUnsigned = 3,
+	kHashHalfMd4Unsigned = 4,
+	kHashTeaUnsigned = 5
+};
+
+// Offset of the RootInfo (after the "." and ".." entries) and of the entries of interior nodes.
+inline constexpr size_t rootInfoOffset = 24;
+inline constexpr size_t nodeEntriesOffset = 8;
+
+// ext3 only supports a single level of interior nodes; ext4's largedir supports two.
+inline constexpr int maxDepth = 3;
+
+// The low bit of Entry::hash marks blocks that continue a run of colliding hashes.
+inline constexpr uint32_t continuationBit = 1;
+
+// --------------------------------------------------------
+// Lookup
+// --------------------------------------------------------
+
+// Returns the (major) hash of a name. The low bit is always clear.
+uint32_t hashName(const char *name, size_t length, int version, const uint32_t *seed);
+
+// Position of a lookup in one index node.
+struct Frame {
+	Entry *entries;
+	Entry *at;
+};
+
+struct Path {
+	uint32_t hash;
+	int hashVersion;
+
+	// frames[0] is the root, frames[depth - 1] points to the leaf.
+	Frame frames[maxDepth];
+	int depth;
+
+	uint32_t leafBlock() {
+		return frames[depth - 1].at->block & 0x0FFFFFFF;
+	}
+};
+
+inline CountLimit *countLimit(Entry *entries) {
+	return reinterpret_cast<CountLimit *>(entries);
+}
+
+// Descends from the root of a mapped directory to the leaf that contains the hash of name.
+// Returns false if the index uses features that we do not support.
+bool lookup(char *dir, size_t dir_size, size_t block_size, const char *name, size_t length,
+		const uint32_t *seed, bool unsigned_hash, Path &path);
+
+// Advances the path to the next leaf if it continues the run of hash.
+bool nextLeaf(char *dir, size_t block_size, Path &path, uint32_t hash);
+
+// Inserts an index entry for a new leaf after the current position of the deepest node.
+// The node must not be full.
+void insertLeaf(Path &path, uint32_t hash, uint32_t block);
+
+// Moves the upper half of the entries of the interior node at the given level into
+// new_node and inserts an index entry for it into the parent, which must not be full.
+// The path is invalid afterwards.
+void splitNode(Path &path, int level, char *new_node, uint32_t new_block, size_t block_size);
+
+// Moves all entries of the root into new_node, which becomes the only child of the root.
+// This adds a level of interior nodes. The path is invalid afterwards.
+void growRoot(char *dir, Path &path, char *new_node, uint32_t new_block, size_t block_size);
+
+} } } // namespace blockfs::ext2fs::htree
+
+#endif // LIBFS_HTREE_HPP
@@ -0,0 +1,566 @@
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
+
+#include "journal.hpp"
+
+namespace blockfs {
+namespace ext2fs {
+
+namespace {
+	// Converts between big-endian (on-disk) and host byte order.
+	uint16_t bigEndian16(uint16_t x) { return __builtin_bswap16(x); }
+	uint32_t bigEndian32(uint32_t x) { return __builtin_bswap32(x); }
+	uint64_t bigEndian64(uint64_t x) { return __builtin_bswap64(x); }
+
+	uint32_t loadBig32(const char *p) {
+		uint32_t x;
+		memcpy(&x, p, sizeof(uint32_t));
+		return bigEndian32(x);
+	}
+
+	uint16_t loadBig16(const char *p) {
+		uint16_t x;
+		memcpy(&x, p, sizeof(uint16_t));
+		return bigEndian16(x);
+	}
+
+	void storeBig32(char *p, uint32_t x) {
+		x = bigEndian32(x);
+		memcpy(p, &x, sizeof(uint32_t));
+	}
+
+	void storeBig16(char *p, uint16_t x) {
+		x = bigEndian16(x);
+		memcpy(p, &x, sizeof(uint16_t));
+	}
+
+	void fillHeader(DiskJournalHeader *header, uint32_t type, uint32_t sequence) {
+		header->magic = bigEndian32(JBD2_MAGIC);
+		header->blockType = bigEndian32(type);
+		header->sequence = bigEndian32(sequence);
+	}
+}
+
+Journal::Transaction::Transaction()
+: sequence{0}, commitRequested{false}, start{0}, length{0} { }
+
+Journal::Journal(BlockDevice *device, size_t block_size, std::vector<uint64_t> layout)
+: _device{device}, _blockSize{block_size}, _sectorsPerBlock{block_size / device->sectorSize},
+		_layout{std::move(layout)}, _first{0}, _maxLength{0}, _has64Bit{false},
+		_replayed{false}, _maxTransaction{0}, _head{0}, _tail{0},
+		_tailSequence{0}, _nextSequence{0}, _diskStart{0}, _diskSequence{0},
+		_checkpointActive{false} {
+	assert(!_layout.empty());
+}
+
+COFIBER_ROUTINE(async::result<bool>, Journal::recover(), ([=] {
+	std::vector<char> buffer(_blockSize);
+	checkIo(COFIBER_AWAIT _device->readSectors(_layout[0] * _sectorsPerBlock,
+			buffer.data(), _sectorsPerBlock));
+	memcpy(&_superblock, buffer.data(), sizeof(DiskJournalSuperblock));
+
+	auto type = bigEndian32(_superblock.header.blockType);
+	if(bigEndian32(_superblock.header.magic) != JBD2_MAGIC
+			|| (type != JBD2_SUPERBLOCK_V1 && type != JBD2_SUPERBLOCK_V2)) {
+		std::cout << "\e[31m" "ext2fs: Journal superblock is corrupted" "\e[39m" << std::endl;
+		COFIBER_RETURN(false);
+	}
+
+	_first = bigEndian32(_superblock.first);
+	_maxLength = bigEndian32(_superblock.maxLength);
+	if(bigEndian32(_superblock.blockSize) != _blockSize
+			|| !_first || _first >= _maxLength || _maxLength > _layout.size()) {
+		std::cout << "\e[31m" "ext2fs: Journal geometry does not match the journal inode"
+				"\e[39m" << std::endl;
+		COFIBER_RETURN(false);
+	}
+
+	if(type == JBD2_SUPERBLOCK_V2) {
+		// We neither compute nor verify checksums.
+		auto compat = bigEndian32(_superblock.featureCompat);
+		auto incompat = bigEndian32(_superblock.featureIncompat);
+		auto ro_compat = bigEndian32(_superblock.featureRoCompat);
+		if((compat & JBD2_FEATURE_COMPAT_CHECKSUM) || ro_compat
+				|| (incompat & ~(JBD2_FEATURE_INCOMPAT_REVOKE | JBD2_FEATURE_INCOMPAT_64BIT))) {
+			std::cout << "\e[31m" "ext2fs: Journal uses unsupported features" "\e[39m"
+					<< std::endl;
+			COFIBER_RETURN(false);
+		}
+		_has64Bit = incompat & JBD2_FEATURE_INCOMPAT_64BIT;
+	}
+
+	// Bound transactions so that the log always fits a few of them (like Linux does).
+	_maxTransaction = (_maxLength - _first) / 4;
+
+	auto sequence = bigEndian32(_superblock.sequence);
+	auto start = bigEndian32(_superblock.start);
+	if(start) {
+		struct LoggedBlock {
+			uint32_t sequence;
+			uint64_t block;
+			uint32_t position;
+			bool escaped;
+		};
+
+		// Find all committed transactions together with their blocks and revoke records.
+		std::vector<LoggedBlock> logged;
+		std::vector<LoggedBlock> uncommitted;
+		std::map<uint64_t, uint32_t> revoked;
+		std::vector<uint64_t> uncommitted_revokes;
+		unsigned int num_transactions = 0;
+
+		uint32_t position = start;
+		uint32_t scanned = 0;
+		while(scanned < _maxLength - _first) {
+			COFIBER_AWAIT _readLog(position, buffer.data(), 1);
+			auto header = reinterpret_cast<DiskJournalHeader *>(buffer.data());
+			if(bigEndian32(header->magic) != JBD2_MAGIC
+					|| bigEndian32(header->sequence) != sequence)
+				break;
+
+			auto block_type = bigEndian32(header->blockType);
+			uint32_t n = 1;
+			if(block_type == JBD2_DESCRIPTOR_BLOCK) {
+				size_t offset = sizeof(DiskJournalHeader);
+				while(offset + _tagSize() <= _blockSize) {
+					auto tag = buffer.data() + offset;
+					uint64_t block = loadBig32(tag);
+					auto flags = loadBig16(tag + 6);
+					if(_has64Bit)
+						block |= uint64_t(loadBig32(tag + 8)) << 32;
+
+					uncommitted.push_back(LoggedBlock{sequence, block,
+							_advance(position, n), bool(flags & JBD2_FLAG_ESCAPE)});
+					n++;
+
+					offset += _tagSize();
+					if(!(flags & JBD2_FLAG_SAME_UUID))
+						offset += 16;
+					if(flags & JBD2_FLAG_LAST_TAG)
+						break;
+				}
+			}else if(block_type == JBD2_COMMIT_BLOCK) {
+				logged.insert(logged.end(), uncommitted.begin(), uncommitted.end());
+				for(auto block : uncommitted_revokes)
+					revoked[block] = sequence;
+				uncommitted.clear();
+				uncommitted_revokes.clear();
+				num_transactions++;
+				sequence++;
+			}else if(block_type == JBD2_REVOKE_BLOCK) {
+				auto revoke = reinterpret_cast<DiskRevokeHeader *>(buffer.data());
+				auto size = std::min(size_t(bigEndian32(revoke->numBytes)), _blockSize);
+				size_t record_size = _has64Bit ? 8 : 4;
+				for(size_t offset = sizeof(DiskRevokeHeader); offset + record_size <= size;
+						offset += record_size) {
+					uint64_t block = loadBig32(buffer.data() + offset);
+					if(_has64Bit)
+						block = (block << 32) | loadBig32(buffer.data() + offset + 4);
+					uncommitted_revokes.push_back(block);
+				}
+			}else{
+				break;
+			}
+
+			position = _advance(position, n);
+			scanned += n;
+		}
+
+		// Only replay the latest copy of each block that was not revoked afterwards.
+		std::map<uint64_t, LoggedBlock> replay;
+		for(auto &entry : logged) {
+			auto it = revoked.find(entry.block);
+			if(it != revoked.end() && int32_t(it->second - entry.sequence) >= 0)
+				continue;
+			replay[entry.block] = entry;
+		}
+
+		// Copy the blocks to their home locations. Each chunk is issued at once
+		// so that the I/O scheduler can merge adjacent writes.
+		constexpr size_t chunkSize = 256;
+		std::vector<char> chunk(chunkSize * _blockSize);
+		auto it = replay.begin();
+		while(it != replay.end()) {
+			std::vector<LoggedBlock> entries;
+			while(it != replay.end() && entries.size() < chunkSize) {
+				entries.push_back(it->second);
+				++it;
+			}
+
+			std::vector<async::result<void>> reads;
+			for(size_t i = 0; i < entries.size(); i++)
+				reads.push_back(_readLog(entries[i].position,
+						chunk.data() + i * _blockSize, 1));
+			for(auto &read : reads)
+				COFIBER_AWAIT std::move(read);
+
+			std::vector<async::result<IoError>> writes;
+			for(size_t i = 0; i < entries.size(); i++) {
+				auto data = chunk.data() + i * _blockSize;
+				if(entries[i].escaped)
+					storeBig32(data, JBD2_MAGIC);
+				writes.push_back(_device->writeSectors(entries[i].block * _sectorsPerBlock,
+						data, _sectorsPerBlock));
+			}
+			for(auto &write : writes)
+				checkIo(COFIBER_AWAIT std::move(write));
+		}
+
+		std::cout << "ext2fs: Replayed " << num_transactions << " transactions ("
+				<< replay.size() << " blocks) from the journal" << std::endl;
+		_replayed = num_transactions > 0;
+
+		// Do not confuse stale blocks of the last (uncommitted) transaction with new ones.
+		sequence++;
+	}
+
+	_head = _first;
+	_tail = _first;
+	_tailSequence = sequence;
+	_nextSequence = sequence;
+	if(start) {
+		_diskStart = 0;
+		COFIBER_AWAIT _writeSuperblock();
+	}
+
+	_runCommits();
+	COFIBER_RETURN(true);
+}))
+
+COFIBER_ROUTINE(async::result<void>, Journal::write(uint64_t block, const void *buffer,
+		size_t num_blocks), ([=] {
+	// Copy the blocks before we suspend; the caller's buffer may change afterwards.
+	auto source = static_cast<const char *>(buffer);
+	std::vector<char> copy(source, source + num_blocks * _blockSize);
+
+	// Blocks that are already part of the running transaction are simply replaced.
+	// Transactions never grow beyond _maxTransaction blocks: if the running transaction
+	// is full, we wait until the commit loop takes it, so that writers cannot outpace commits.
+	std::vector<std::shared_ptr<Transaction>> transactions;
+	size_t i = 0;
+	while(i < num_blocks) {
+		if(!_running) {
+			_running = std::make_shared<Transaction>();
+			_commitLater(_running);
+		}
+
+		auto transaction = _running;
+		if(transaction->blocks.size() >= _maxTransaction
+				&& !transaction->blocks.count(block + i)) {
+			transaction->commitRequested = true;
+			_commitBell.ring();
+			COFIBER_AWAIT _transactionBell.async_wait();
+			continue;
+		}
+
+		auto data = copy.data() + i * _blockSize;
+		transaction->blocks[block + i].assign(data, data + _blockSize);
+		if(transactions.empty() || transactions.back() != transaction)
+			transactions.push_back(transaction);
+		i++;
+	}
+
+	if(_running && _running->blocks.size() >= _maxTransaction) {
+		_running->commitRequested = true;
+		_commitBell.ring();
+	}
+
+	for(auto &transaction : transactions)
+		COFIBER_AWAIT transaction->committed.async_wait();
+	COFIBER_RETURN();
+}))
+
+Journal::Overlay Journal::snapshot(uint64_t block, size_t num_blocks) {
+	Overlay snapshot;
+	for(size_t i = 0; i < num_blocks; i++) {
+		const std::vector<char> *copy = nullptr;
+		for(auto transaction : {_running.get(), _committing.get()}) {
+			if(!transaction)
+				continue;
+			auto it = transaction->blocks.find(block + i);
+			if(it != transaction->blocks.end()) {
+				copy = &it->second;
+				break;
+			}
+		}
+		if(!copy) {
+			auto it = _latest.find(block + i);
+			if(it != _latest.end())
+				copy = &it->second->blocks.at(block + i);
+		}
+
+		if(copy)
+			snapshot.emplace_back(i, *copy);
+	}
+	return snapshot;
+}
+
+void Journal::overlay(const Overlay &snapshot, void *buffer) {
+	for(auto &entry : snapshot)
+		memcpy(static_cast<char *>(buffer) + entry.first * _blockSize,
+				entry.second.data(), _blockSize);
+}
+
+uint32_t Journal::_advance(uint32_t position, size_t i) {
+	assert(position >= _first && position < _maxLength);
+	return _first + (position - _first + i) % (_maxLength - _first);
+}
+
+uint32_t Journal::_distance(uint32_t from, uint32_t to) {
+	auto area = _maxLength - _first;
+	return (to + area - from) % area;
+}
+
+uint32_t Journal::_freeSpace() {
+	// Keep one block free to distinguish a full log from an empty one.
+	return _maxLength - _first - _distance(_tail, _head) - 1;
+}
+
+COFIBER_ROUTINE(async::result<void>, Journal::_readLog(uint32_t position,
+		void *buffer, size_t num_blocks), ([=] {
+	// Issue one request per physically contiguous run of journal blocks.
+	std::vector<async::result<IoError>> reads;
+	size_t i = 0;
+	while(i < num_blocks) {
+		auto physical = _layout[_advance(position, i)];
+		size_t n = 1;
+		while(i + n < num_blocks && _layout[_advance(position, i + n)] == physical + n)
+			n++;
+
+		reads.push_back(_device->readSectors(physical * _sectorsPerBlock,
+				static_cast<char *>(buffer) + i * _blockSize, n * _sectorsPerBlock));
+		i += n;
+	}
+	for(auto &read : reads)
+		checkIo(COFIBER_AWAIT std::move(read));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, Journal::_writeLog(uint32_t position,
+		const void *buffer, size_t num_blocks), ([=] {
+	std::vector<async::result<IoError>> writes;
+	size_t i = 0;
+	while(i < num_blocks) {
+		auto physical = _layout[_advance(position, i)];
+		size_t n = 1;
+		while(i + n < num_blocks && _layout[_advance(position, i + n)] == physical + n)
+			n++;
+
+		writes.push_back(_device->writeSectors(physical * _sectorsPerBlock,
+				static_cast<const char *>(buffer) + i * _blockSize, n * _sectorsPerBlock));
+		i += n;
+	}
+	for(auto &write : writes)
+		checkIo(COFIBER_AWAIT std::move(write));
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(async::result<void>, Journal::_writeSuperblock(), ([=] {
+	_diskSequence = _tailSequence;
+	_superblock.sequence = bigEndian32(_diskSequence);
+	_superblock.start = bigEndian32(_diskStart);
+
+	// Moving the tail frees log space; the checkpointed blocks have to be stable first.
+	checkIo(COFIBER_AWAIT _device->flush());
+
+	// The superblock occupies the first 1024 bytes of the first journal block.
+	// Write the whole block so that the buffer is aligned for any sector size.
+	std::vector<char> buffer(_blockSize);
+	memcpy(buffer.data(), &_superblock, sizeof(DiskJournalSuperblock));
+	checkIo(COFIBER_AWAIT _device->writeSectors(_layout[0] * _sectorsPerBlock,
+			buffer.data(), _sectorsPerBlock));
+	COFIBER_RETURN();
+}))
+
+size_t Journal::_tagSize() {
+	return _has64Bit ? 12 : 8;
+}
+
+COFIBER_ROUTINE(cofiber::no_future, Journal::_commitLater(
+		std::shared_ptr<Transaction> transaction), ([=] {
+	uint64_t tick;
+	HEL_CHECK(helGetClock(&tick));
+
+	helix::AwaitClock await_clock;
+	auto &&submit = helix::submitAwaitClock(&await_clock, tick + commitDelay,
+			helix::Dispatcher::global());
+	COFIBER_AWAIT submit.async_wait();
+	HEL_CHECK(await_clock.error());
+
+	transaction->commitRequested = true;
+	_commitBell.ring();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, Journal::_runCommits(), ([=] {
+	// Commits are serialized. Writes that arrive during a commit go to the next transaction.
+	while(true) {
+		if(!_running || !_running->commitRequested) {
+			COFIBER_AWAIT _commitBell.async_wait();
+			continue;
+		}
+
+		auto transaction = std::move(_running);
+		_running = nullptr;
+		_transactionBell.ring();
+		COFIBER_AWAIT _commit(std::move(transaction));
+	}
+}))
+
+COFIBER_ROUTINE(async::result<void>, Journal::_commit(std::shared_ptr<Transaction> transaction),
+		([=] {
+	_committing = transaction;
+	transaction->sequence = _nextSequence++;
+
+	auto tag_size = _tagSize();
+	auto per_descriptor = (_blockSize - sizeof(DiskJournalHeader) - 16) / tag_size;
+	auto num_data = transaction->blocks.size();
+	auto num_descriptors = (num_data + per_descriptor - 1) / per_descriptor;
+	uint32_t length = num_descriptors + num_data + 1;
+	assert(length < _maxLength - _first);
+
+	while(_freeSpace() < length) {
+		_checkpoint();
+		if(_freeSpace() >= length)
+			break;
+		COFIBER_AWAIT _spaceBell.async_wait();
+	}
+
+	// The journal superblock must not point to space that we are about to overwrite.
+	// If its tail is outdated, the log between that tail and _tail is still intact.
+	if(!_diskStart || (_diskSequence != _tailSequence
+			&& _distance(_head, _diskStart) < length)) {
+		_diskStart = _tail;
+		COFIBER_AWAIT _writeSuperblock();
+	}
+
+	// Build the descriptor and data blocks of the transaction.
+	std::vector<char> log((length - 1) * _blockSize);
+	size_t index = 0;
+	auto it = transaction->blocks.begin();
+	while(it != transaction->blocks.end()) {
+		auto descriptor = log.data() + index * _blockSize;
+		fillHeader(reinterpret_cast<DiskJournalHeader *>(descriptor),
+				JBD2_DESCRIPTOR_BLOCK, transaction->sequence);
+		index++;
+
+		size_t offset = sizeof(DiskJournalHeader);
+		for(size_t j = 0; j < per_descriptor && it != transaction->blocks.end(); j++, ++it) {
+			auto data = log.data() + index * _blockSize;
+			memcpy(data, it->second.data(), _blockSize);
+			index++;
+
+			// Blocks that look like journal blocks must be escaped.
+			uint16_t flags = 0;
+			if(loadBig32(data) == JBD2_MAGIC) {
+				memset(data, 0, sizeof(uint32_t));
+				flags |= JBD2_FLAG_ESCAPE;
+			}
+			if(j)
+				flags |= JBD2_FLAG_SAME_UUID;
+			if(j + 1 == per_descriptor || std::next(it) == transaction->blocks.end())
+				flags |= JBD2_FLAG_LAST_TAG;
+
+			auto tag = descriptor + offset;
+			storeBig32(tag, static_cast<uint32_t>(it->first));
+			storeBig16(tag + 6, flags);
+			if(_has64Bit)
+				storeBig32(tag + 8, it->first >> 32);
+			offset += tag_size;
+
+			if(!j) {
+				memcpy(descriptor + offset, _superblock.uuid, 16);
+				offset += 16;
+			}
+		}
+	}
+	assert(index == length - 1);
+
+	COFIBER_AWAIT _writeLog(_head, log.data(), length - 1);
+
+	// The commit block is only written once the rest of the transaction is on stable
+	// storage. Otherwise, the device could reorder the writes and recovery would replay
+	// garbage after a crash.
+	checkIo(COFIBER_AWAIT _device->flush());
+
+	std::vector<char> commit(_blockSize);
+	auto commit_block = reinterpret_cast<DiskCommitBlock *>(commit.data());
+	fillHeader(&commit_block->header, JBD2_COMMIT_BLOCK, transaction->sequence);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	commit_block->commitSeconds = bigEndian64(now.tv_sec);
+	commit_block->commitNanos = bigEndian32(now.tv_nsec);
+	COFIBER_AWAIT _writeLog(_advance(_head, length - 1), commit.data(), 1);
+
+	// The transaction is only durable once the commit block is stable, too.
+	checkIo(COFIBER_AWAIT _device->flush());
+
+	transaction->start = _head;
+	transaction->length = length;
+	_head = _advance(_head, length);
+	for(auto &entry : transaction->blocks)
+		_latest[entry.first] = transaction.get();
+	_committed.push_back(transaction);
+	_committing = nullptr;
+
+	transaction->committed.trigger();
+
+	// Checkpoint lazily so that blocks that are logged repeatedly are only written once.
+	if(_distance(_tail, _head) > (_maxLength - _first) / 2)
+		_checkpoint();
+	COFIBER_RETURN();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, Journal::_checkpoint(), ([=] {
+	if(_checkpointActive || _committed.empty())
+		COFIBER_RETURN();
+	_checkpointActive = true;
+
+	// Write each block once, from the latest transaction that contains it.
+	// Transactions that commit while we are writing are left for the next checkpoint.
+	auto count = _committed.size();
+	std::vector<async::result<IoError>> writes;
+	for(size_t i = 0; i < count; i++) {
+		auto transaction = _committed[i].get();
+		for(auto &entry : transaction->blocks) {
+			auto it = _latest.find(entry.first);
+			assert(it != _latest.end());
+			if(it->second != transaction)
+				continue;
+			writes.push_back(_device->writeSectors(entry.first * _sectorsPerBlock,
+					entry.second.data(), _sectorsPerBlock));
+		}
+	}
+	for(auto &write : writes)
+		checkIo(COFIBER_AWAIT std::move(write));
+
+	for(size_t i = 0; i < count; i++) {
+		auto transaction = _committed.front().get();
+		for(auto &entry : transaction->blocks) {
+			auto it = _latest.find(entry.first);
+			if(it->second == transaction)
+				_latest.erase(it);
+		}
+		_committed.pop_front();
+	}
+
+	// Transactions that committed in the meantime are still live.
+	if(!_committed.empty()) {
+		_tail = _committed.front()->start;
+		_tailSequence = _committed.front()->sequence;
+	}else{
+		_tail = _head;
+		_tailSequence = _committing ? _committing->sequence : _nextSequence;
+	}
+
+	_checkpointActive = false;
+	_spaceBell.ring();
+}))
+
+} } // namespace blockfs::ext2fs
@@ -0,0 +1,231 @@
+
+#ifndef LIBFS_JOURNAL_HPP
+#define LIBFS_JOURNAL_HPP
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <async/doorbell.hpp>
+#include <async/jump.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+#include <cofiber.hpp>
+
+#include "common.hpp"
+
+namespace blockfs {
+namespace ext2fs {
+
+// --------------------------------------------------------
+// On-disk structures
+// --------------------------------------------------------
+
+// All fields of the journal are stored in big-endian byte order.
+struct DiskJournalHeader {
+	uint32_t magic;
+	uint32_t blockType;
+	uint32_t sequence;
+};
+static_assert(sizeof(DiskJournalHeader) == 12, "Bad DiskJournalHeader struct size");
+
+struct DiskJournalSuperblock {
+	DiskJournalHeader header;
+	//-- Static information --
+	uint32_t blockSize;
+	uint32_t maxLength;
+	uint32_t first;
+	//-- Dynamic information --
+	uint32_t sequence;
+	uint32_t start;
+	uint32_t errorCode;
+	//-- Only present in version 2 superblocks --
+	uint32_t featureCompat;
+	uint32_t featureIncompat;
+	uint32_t featureRoCompat;
+	uint8_t uuid[16];
+	uint32_t numUsers;
+	uint32_t dynamicSuperblock;
+	uint32_t maxTransaction;
+	uint32_t maxTransactionData;
+	uint8_t checksumType;
+	uint8_t padding2[3];
+	uint32_t padding[42];
+	uint32_t checksum;
+	uint8_t users[16 * 48];
+};
+static_assert(sizeof(DiskJournalSuperblock) == 1024, "Bad DiskJournalSuperblock struct size");
+
+// Follows the header of a commit block.
+struct DiskCommitBlock {
+	DiskJournalHeader header;
+	uint8_t checksumType;
+	uint8_t checksumSize;
+	uint8_t padding[2];
+	uint32_t checksum[8];
+	uint64_t commitSeconds;
+	uint32_t commitNanos;
+};
+
+// Follows the header of a revoke block. numBytes includes the header.
+struct DiskRevokeHeader {
+	DiskJournalHeader header;
+	uint32_t numBytes;
+};
+static_assert(sizeof(DiskRevokeHeader) == 16, "Bad DiskRevokeHeader struct size");
+
+enum {
+	JBD2_MAGIC = 0xC03B3998
+};
+
+enum {
+	JBD2_DESCRIPTOR_BLOCK = 1,
+	JBD2_COMMIT_BLOCK = 2,
+	JBD2_SUPERBLOCK_V1 = 3,
+	JBD2_SUPERBLOCK_V2 = 4,
+	JBD2_REVOKE_BLOCK = 5
+};
+
+enum {
+	JBD2_FEATURE_COMPAT_CHECKSUM = 0x1
+};
+
+enum {
+	JBD2_FEATURE_INCOMPAT_REVOKE = 0x1,
+	JBD2_FEATURE_INCOMPAT_64BIT = 0x2
+};
+
+// Flags of the tags in descriptor blocks.
+enum {
+	JBD2_FLAG_ESCAPE = 0x1,
+	JBD2_FLAG_SAME_UUID = 0x2,
+	JBD2_FLAG_DELETED = 0x4,
+	JBD2_FLAG_LAST_TAG = 0x8
+};
+
+// --------------------------------------------------------
+// Journal
+// --------------------------------------------------------
+
+// ext3-compatible (JBD2) write-ahead log for metadata blocks.
+// Metadata writes are collected into transactions. A transaction is committed
+// once it becomes large enough or after a short delay; writes that arrive while
+// a commit is in progress are committed together by the next transaction.
+// Committed blocks are written to their home location (i.e., checkpointed)
+// once the log fills up.
+struct Journal {
+	// Delay (in nanoseconds) between the first write of a transaction and its commit.
+	static constexpr uint64_t commitDelay = 5'000'000;
+
+	// layout contains the physical block of each block of the journal.
+	Journal(BlockDevice *device, size_t block_size, std::vector<uint64_t> layout);
+
+	// Reads the journal superblock and replays all committed transactions.
+	// Returns false if the journal uses features that we do not support.
+	// In this case, the journal must not be used.
+	async::result<bool> recover();
+
+	// True if recover() found committed transactions.
+	bool replayedTransactions() {
+		return _replayed;
+	}
+
+	// Logs a run of blocks. Completes once the blocks are committed to the journal.
+	// Blocks if the running transaction is full until the commit loop takes it.
+	async::result<void> write(uint64_t block, const void *buffer, size_t num_blocks);
+
+	// Logged blocks of a range, as pairs of (index in the range, contents).
+	using Overlay = std::vector<std::pair<size_t, std::vector<char>>>;
+
+	// Copies all logged blocks in the given range that were not checkpointed yet.
+	// This has to be done before the range is read from the home location:
+	// a checkpoint that completes during the read drops the blocks from the journal.
+	Overlay snapshot(uint64_t block, size_t num_blocks);
+
+	// Applies a snapshot to data that was read from the home location.
+	void overlay(const Overlay &snapshot, void *buffer);
+
+private:
+	struct Transaction {
+		Transaction();
+
+		uint32_t sequence;
+		bool commitRequested;
+
+		// Contents of the logged blocks, indexed by their home location.
+		std::map<uint64_t, std::vector<char>> blocks;
+
+		// Position of the transaction in the log.
+		uint32_t start;
+		uint32_t length;
+
+		async::jump committed;
+	};
+
+	// Journal block of the i-th entry after position.
+	uint32_t _advance(uint32_t position, size_t i);
+
+	// Number of journal blocks in [from, to).
+	uint32_t _distance(uint32_t from, uint32_t to);
+
+	uint32_t _freeSpace();
+
+	async::result<void> _readLog(uint32_t position, void *buffer, size_t num_blocks);
+	async::result<void> _writeLog(uint32_t position, const void *buffer, size_t num_blocks);
+
+	// Writes the current tail of the log to the journal superblock.
+	async::result<void> _writeSuperblock();
+
+	// Size of the tags in descriptor blocks.
+	size_t _tagSize();
+
+	cofiber::no_future _commitLater(std::shared_ptr<Transaction> transaction);
+	cofiber::no_future _runCommits();
+	async::result<void> _commit(std::shared_ptr<Transaction> transaction);
+
+	// Writes all committed transactions to their home locations and frees their space.
+	cofiber::no_future _checkpoint();
+
+	BlockDevice *_device;
+	size_t _blockSize;
+	size_t _sectorsPerBlock;
+	std::vector<uint64_t> _layout;
+
+	DiskJournalSuperblock _superblock;
+	uint32_t _first;
+	uint32_t _maxLength;
+	bool _has64Bit;
+	bool _replayed;
+	size_t _maxTransaction;
+
+	// Live part of the log in [_tail, _head). _tailSequence is the sequence of
+	// the oldest transaction that was not checkpointed yet.
+	uint32_t _head;
+	uint32_t _tail;
+	uint32_t _tailSequence;
+	uint32_t _nextSequence;
+
+	// Tail that is recorded in the journal superblock (zero if the log is empty on disk).
+	uint32_t _diskStart;
+	uint32_t _diskSequence;
+
+	std::shared_ptr<Transaction> _running;
+	std::shared_ptr<Transaction> _committing;
+	std::deque<std::shared_ptr<Transaction>> _committed;
+
+	// Latest committed transaction that contains each block.
+	std::map<uint64_t, Transaction *> _latest;
+
+	bool _checkpointActive;
+
+	async::doorbell _commitBell;
+	async::doorbell _spaceBell;
+	// Rung when the running transaction is handed to the commit loop.
+	async::doorbell _transactionBell;
+};
+
+} } // namespace blockfs::ext2fs
+
+#endif // LIBFS_JOURNAL_HPP
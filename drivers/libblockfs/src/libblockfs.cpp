@@ -11,6 +11,7 @@
 #include <blockfs.hpp>
 #include "gpt.hpp"
 #include "ext2fs.hpp"
+#include "scheduler.hpp"
 #include "fs.pb.h"
 
 namespace blockfs {
@@ -69,13 +70,17 @@ COFIBER_ROUTINE(async::result<protocols::fs::ReadResult>, read(void *object, con
 	COFIBER_RETURN(chunk_size);
 }))
 
-COFIBER_ROUTINE(async::result<void>, write(void *object, const char *,
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, write(void *object, const char *,
 		const void *buffer, size_t length), ([=] {
 	assert(length);
 
 	auto self = static_cast<ext2fs::OpenFile *>(object);
-	COFIBER_AWAIT self->inode->fs.write(self->inode.get(), self->offset, buffer, length);
+	auto error = COFIBER_AWAIT self->inode->fs.write(self->inode.get(),
+			self->offset, buffer, length);
+	if(error != protocols::fs::Error::none)
+		COFIBER_RETURN(error);
 	self->offset += length;
+	COFIBER_RETURN(protocols::fs::Error::none);
 }))
 
 COFIBER_ROUTINE(async::result<protocols::fs::AccessMemoryResult>,
@@ -154,10 +159,10 @@ COFIBER_ROUTINE(async::result<protocols::fs::GetLinkResult>, link(std::shared_pt
 	COFIBER_RETURN((protocols::fs::GetLinkResult{fs->accessInode(entry->inode), entry->inode, type}));
 }))
 
-COFIBER_ROUTINE(async::result<void>, unlink(std::shared_ptr<void> object,
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, unlink(std::shared_ptr<void> object,
 		std::string name), ([=] {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
-	COFIBER_AWAIT self->unlink(std::move(name));
+	COFIBER_RETURN(COFIBER_AWAIT self->unlink(std::move(name)));
 }))
 
 COFIBER_ROUTINE(cofiber::no_future, serve(smarter::shared_ptr<ext2fs::OpenFile> file,
@@ -230,6 +235,10 @@ constexpr protocols::fs::NodeOperations nodeOperations{
 BlockDevice::BlockDevice(size_t sector_size)
 : sectorSize(sector_size) { }
 
+COFIBER_ROUTINE(async::result<IoError>, BlockDevice::flush(), ([=] {
+	COFIBER_RETURN(IoError::none);
+}))
+
 COFIBER_ROUTINE(cofiber::no_future, servePartition(helix::UniqueLane p),
 		([lane = std::move(p)] {
 	std::cout << "unix device: Connection" << std::endl;
@@ -273,6 +282,17 @@ COFIBER_ROUTINE(cofiber::no_future, servePartition(helix::UniqueLane p),
 			helix::PushDescriptor push_node;
 
 			auto inode = COFIBER_AWAIT fs->createRegular();
+			if(!inode) {
+				managarm::fs::SvrResponse resp;
+				resp.set_error(managarm::fs::Errors::READ_ONLY);
+
+				auto ser = resp.SerializeAsString();
+				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+						helix::action(&send_resp, ser.data(), ser.size()));
+				COFIBER_AWAIT transmit.async_wait();
+				HEL_CHECK(send_resp.error());
+				continue;
+			}
 
 			helix::UniqueLane local_lane, remote_lane;
 			std::tie(local_lane, remote_lane) = helix::createStream();
@@ -297,8 +317,12 @@ COFIBER_ROUTINE(cofiber::no_future, servePartition(helix::UniqueLane p),
 	}
 }))
 
-COFIBER_ROUTINE(cofiber::no_future, runDevice(BlockDevice *device), ([=] {
-	table = new gpt::Table(device);
+COFIBER_ROUTINE(cofiber::no_future, runDevice(BlockDevice *device,
+		SchedulerOptions options), ([=] {
+	// All partitions of the device share a single request queue.
+	auto scheduler = new IoScheduler(device, options);
+
+	table = new gpt::Table(scheduler);
 	COFIBER_AWAIT table->parse();
 
 	for(size_t i = 0; i < table->numPartitions(); ++i) {
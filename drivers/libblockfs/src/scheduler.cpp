@@ -0,0 +1,344 @@
+
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+
+#include <helix/ipc.hpp>
+
+#include "scheduler.hpp"
+
+namespace blockfs {
+
+namespace {
+	uint64_t currentTime() {
+		uint64_t tick;
+		HEL_CHECK(helGetClock(&tick));
+		return tick;
+	}
+
+	bool overlaps(uint64_t sector, size_t num_sectors, uint64_t other_sector,
+			size_t other_num_sectors) {
+		return sector < other_sector + other_num_sectors
+				&& other_sector < sector + num_sectors;
+	}
+}
+
+// --------------------------------------------------------
+// LatencyHistogram
+// --------------------------------------------------------
+
+LatencyHistogram::LatencyHistogram()
+: _buckets{}, _count{0}, _totalNanos{0}, _maxNanos{0} { }
+
+void LatencyHistogram::record(uint64_t nanos) {
+	auto micros = nanos / 1000;
+	int bucket = 0;
+	while(micros && bucket < numBuckets - 1) {
+		micros >>= 1;
+		bucket++;
+	}
+
+	_buckets[bucket]++;
+	_count++;
+	_totalNanos += nanos;
+	_maxNanos = std::max(_maxNanos, nanos);
+}
+
+void LatencyHistogram::dump(const char *name) {
+	if(!_count)
+		return;
+
+	std::cout << "libblockfs: " << name << " latency: " << _count << " requests, avg "
+			<< (_totalNanos / _count / 1000) << " us, max "
+			<< (_maxNanos / 1000) << " us" << std::endl;
+	for(int i = 0; i < numBuckets; i++) {
+		if(!_buckets[i])
+			continue;
+		std::cout << "    < " << (uint64_t(1) << i) << " us: " << _buckets[i] << std::endl;
+	}
+}
+
+// --------------------------------------------------------
+// IoScheduler
+// --------------------------------------------------------
+
+IoScheduler::Request::Request(bool write, uint64_t sector, void *buffer, size_t num_sectors)
+: write{write}, sector{sector}, buffer{buffer}, numSectors{num_sectors},
+		sequence{0}, submitTime{0}, deadline{0}, active{false} { }
+
+IoScheduler::IoScheduler(BlockDevice *device, SchedulerOptions options)
+: BlockDevice{device->sectorSize}, _device{device}, _options{options},
+		_maxMergeSectors{std::max(options.maxMergeBytes / device->sectorSize, size_t(1))},
+		_maxRequestSectors{0}, _nextSequence{0}, _plugCount{0}, _inFlight{0}, _position{0},
+		_starvedWrites{0}, _numMerged{0}, _numCompleted{0} {
+	assert(_options.maxInFlight);
+}
+
+COFIBER_ROUTINE(async::result<IoError>, IoScheduler::readSectors(uint64_t sector,
+		void *buffer, size_t num_sectors), ([=] {
+	Request request{false, sector, buffer, num_sectors};
+	COFIBER_RETURN(COFIBER_AWAIT _submit(&request));
+}))
+
+COFIBER_ROUTINE(async::result<IoError>, IoScheduler::writeSectors(uint64_t sector,
+		const void *buffer, size_t num_sectors), ([=] {
+	// The buffer is only read from; Request does not distinguish the directions.
+	Request request{true, sector, const_cast<void *>(buffer), num_sectors};
+	COFIBER_RETURN(COFIBER_AWAIT _submit(&request));
+}))
+
+async::result<IoError> IoScheduler::flush() {
+	// Callers only expect completed writes to be flushed; queued ones are not waited for.
+	return _device->flush();
+}
+
+void IoScheduler::plug() {
+	_plugCount++;
+}
+
+void IoScheduler::unplug() {
+	assert(_plugCount);
+	_plugCount--;
+	_dispatch();
+}
+
+void IoScheduler::dumpStatistics() {
+	std::cout << "libblockfs: " << _numCompleted << " requests completed, "
+			<< _numMerged << " merged" << std::endl;
+	_readLatency.dump("Read");
+	_writeLatency.dump("Write");
+}
+
+async::result<IoError> IoScheduler::_submit(Request *request) {
+	auto now = currentTime();
+	request->sequence = _nextSequence++;
+	request->submitTime = now;
+	request->deadline = now + (request->write ? _options.writeExpire : _options.readExpire);
+
+	// Hold back requests to an idle device so that the rest of the burst can be merged.
+	bool idle = !_inFlight && _reads.empty() && _writes.empty();
+	_pending.emplace(request->sector, request);
+	_maxRequestSectors = std::max(_maxRequestSectors, request->numSectors);
+	if(request->write) {
+		_writes.push_back(request);
+	}else{
+		_reads.push_back(request);
+	}
+
+	auto future = request->promise.async_get();
+	if(idle && _options.plugging) {
+		plug();
+		_unplugLater();
+	}else{
+		_dispatch();
+	}
+	return future;
+}
+
+COFIBER_ROUTINE(cofiber::no_future, IoScheduler::_unplugLater(), ([=] {
+	helix::AwaitClock await_clock;
+	auto &&submit = helix::submitAwaitClock(&await_clock,
+			currentTime() + _options.unplugDelay, helix::Dispatcher::global());
+	COFIBER_AWAIT submit.async_wait();
+	HEL_CHECK(await_clock.error());
+
+	unplug();
+}))
+
+void IoScheduler::_dispatch() {
+	if(_plugCount)
+		return;
+
+	while(_inFlight < _options.maxInFlight) {
+		Batch batch;
+		if(!_selectBatch(batch, currentTime()))
+			return;
+
+		_inFlight++;
+		_position = batch.sector + batch.numSectors;
+		_numMerged += batch.requests.size() - 1;
+		for(auto request : batch.requests)
+			request->active = true;
+		_issue(std::move(batch));
+	}
+}
+
+bool IoScheduler::_hasHazard(Request *request) {
+	// Only requests that start less than _maxRequestSectors before the request can overlap it.
+	auto lowest = request->sector >= _maxRequestSectors
+			? request->sector - _maxRequestSectors + 1 : 0;
+	auto end = _pending.lower_bound(request->sector + request->numSectors);
+	for(auto it = _pending.lower_bound(lowest); it != end; ++it) {
+		auto other = it->second;
+		if(other == request || (!request->write && !other->write))
+			continue;
+		// Active requests always conflict, even if they were submitted later.
+		if(!other->active && other->sequence > request->sequence)
+			continue;
+		if(overlaps(request->sector, request->numSectors,
+				other->sector, other->numSectors))
+			return true;
+	}
+	return false;
+}
+
+IoScheduler::Request *IoScheduler::_findMergeable(const Batch &batch) {
+	auto mergeable = [&] (Request *request) {
+		return !request->active && request->write == batch.write
+				&& batch.numSectors + request->numSectors <= _maxMergeSectors
+				&& !_hasHazard(request);
+	};
+
+	// Requests that directly follow the batch, both on disk and in memory.
+	auto tail = static_cast<char *>(batch.buffer) + batch.numSectors * sectorSize;
+	auto range = _pending.equal_range(batch.sector + batch.numSectors);
+	for(auto it = range.first; it != range.second; ++it) {
+		auto request = it->second;
+		if(request->buffer == tail && mergeable(request))
+			return request;
+	}
+
+	// Requests that directly precede the batch.
+	auto lowest = batch.sector >= _maxRequestSectors ? batch.sector - _maxRequestSectors : 0;
+	auto end = _pending.lower_bound(batch.sector);
+	for(auto it = _pending.lower_bound(lowest); it != end; ++it) {
+		auto request = it->second;
+		if(request->sector + request->numSectors != batch.sector)
+			continue;
+		if(static_cast<char *>(request->buffer) + request->numSectors * sectorSize
+				== batch.buffer && mergeable(request))
+			return request;
+	}
+	return nullptr;
+}
+
+bool IoScheduler::_selectBatch(Batch &batch, uint64_t now) {
+	if(_reads.empty() && _writes.empty())
+		return false;
+
+	// Prefer reads unless writes have waited for too long.
+	bool write;
+	if(!_reads.empty() && !_writes.empty()) {
+		write = _starvedWrites >= _options.writesStarved
+				|| _writes.front()->deadline <= now;
+	}else{
+		write = !_writes.empty();
+	}
+
+	auto &fifo = write ? _writes : _reads;
+
+	// Serve expired requests in FIFO order, otherwise continue the elevator sweep.
+	auto it = fifo.end();
+	if(fifo.front()->deadline <= now) {
+		if(!_hasHazard(fifo.front()))
+			it = fifo.begin();
+	}else{
+		auto wrapped = fifo.end();
+		for(auto cand = fifo.begin(); cand != fifo.end(); ++cand) {
+			if(_hasHazard(*cand))
+				continue;
+			if((*cand)->sector >= _position) {
+				if(it == fifo.end() || (*cand)->sector < (*it)->sector)
+					it = cand;
+			}else{
+				if(wrapped == fifo.end() || (*cand)->sector < (*wrapped)->sector)
+					wrapped = cand;
+			}
+		}
+		if(it == fifo.end())
+			it = wrapped;
+	}
+
+	if(it == fifo.end()) {
+		// All candidates conflict with older requests. The oldest request
+		// can only conflict with active requests; wait for them in that case.
+		Request *oldest;
+		if(_reads.empty()) {
+			oldest = _writes.front();
+		}else if(_writes.empty()) {
+			oldest = _reads.front();
+		}else{
+			oldest = _reads.front()->sequence < _writes.front()->sequence
+					? _reads.front() : _writes.front();
+		}
+		if(_hasHazard(oldest))
+			return false;
+		write = oldest->write;
+		it = write ? _writes.begin() : _reads.begin();
+	}
+
+	auto &queue = write ? _writes : _reads;
+	if(write) {
+		_starvedWrites = 0;
+	}else if(!_writes.empty()) {
+		_starvedWrites++;
+	}
+
+	auto first = *it;
+	queue.erase(it);
+	batch.write = write;
+	batch.sector = first->sector;
+	batch.numSectors = first->numSectors;
+	batch.buffer = first->buffer;
+	batch.requests.push_back(first);
+
+	// Merge requests in the same direction as long as the batch stays contiguous
+	// in memory. This way, the device can transfer directly from the callers' buffers.
+	while(auto request = _findMergeable(batch)) {
+		auto cand = std::find(queue.begin(), queue.end(), request);
+		assert(cand != queue.end());
+		queue.erase(cand);
+		if(request->sector < batch.sector) {
+			batch.sector = request->sector;
+			batch.buffer = request->buffer;
+		}
+		batch.numSectors += request->numSectors;
+		batch.requests.push_back(request);
+	}
+
+	return true;
+}
+
+COFIBER_ROUTINE(cofiber::no_future, IoScheduler::_issue(Batch batch),
+		([this, batch = std::move(batch)] {
+	auto &requests = batch.requests;
+	IoError error;
+	if(batch.write) {
+		error = COFIBER_AWAIT _device->writeSectors(batch.sector,
+				batch.buffer, batch.numSectors);
+	}else{
+		error = COFIBER_AWAIT _device->readSectors(batch.sector,
+				batch.buffer, batch.numSectors);
+	}
+
+	auto now = currentTime();
+	for(auto request : requests) {
+		auto range = _pending.equal_range(request->sector);
+		auto it = std::find_if(range.first, range.second,
+				[&] (auto &entry) { return entry.second == request; });
+		assert(it != range.second);
+		_pending.erase(it);
+
+		if(request->write) {
+			_writeLatency.record(now - request->submitTime);
+		}else{
+			_readLatency.record(now - request->submitTime);
+		}
+		_numCompleted++;
+		if(_options.statisticsInterval && !(_numCompleted % _options.statisticsInterval))
+			dumpStatistics();
+	}
+	_inFlight--;
+
+	// Refill the device before waking up the submitters.
+	_dispatch();
+
+	// The device does not tell us which part of a merged request failed.
+	if(error != IoError::none)
+		std::cout << "\e[31m" "libblockfs: I/O error at sector " << batch.sector
+				<< " (" << batch.numSectors << " sectors)" "\e[39m" << std::endl;
+	for(auto request : requests)
+		request->promise.set_value(error);
+}))
+
+} // namespace blockfs
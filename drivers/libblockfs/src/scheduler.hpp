@@ -0,0 +1,130 @@
+
+#ifndef LIBFS_SCHEDULER_HPP
+#define LIBFS_SCHEDULER_HPP
+
+#include <map>
+#include <vector>
+
+#include <async/result.hpp>
+#include <blockfs.hpp>
+#include <cofiber.hpp>
+
+namespace blockfs {
+
+// Log2 histogram of request latencies in microseconds.
+struct LatencyHistogram {
+	static constexpr int numBuckets = 24;
+
+	LatencyHistogram();
+
+	void record(uint64_t nanos);
+
+	void dump(const char *name);
+
+private:
+	uint64_t _buckets[numBuckets];
+	uint64_t _count;
+	uint64_t _totalNanos;
+	uint64_t _maxNanos;
+};
+
+// Queues the requests of a single device. Adjacent requests whose buffers are
+// also adjacent in memory are merged, reads are preferred over writes (as long as no deadline expires)
+// and the number of requests that are in flight at the device is bounded.
+struct IoScheduler final : BlockDevice {
+	IoScheduler(BlockDevice *device, SchedulerOptions options);
+
+	async::result<IoError> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<IoError> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<IoError> flush() override;
+
+	// While the scheduler is plugged, requests are queued but not dispatched.
+	void plug();
+	void unplug();
+
+	void dumpStatistics();
+
+private:
+	struct Request {
+		Request(bool write, uint64_t sector, void *buffer, size_t num_sectors);
+
+		bool write;
+		uint64_t sector;
+		void *buffer;
+		size_t numSectors;
+
+		// Submission order. Used to resolve overlaps between requests.
+		uint64_t sequence;
+		uint64_t submitTime;
+		uint64_t deadline;
+
+		// True once the request was passed to the device.
+		bool active;
+
+		async::promise<IoError> promise;
+	};
+
+	// A (merged) request that is passed to the device.
+	struct Batch {
+		bool write;
+		uint64_t sector;
+		size_t numSectors;
+		void *buffer;
+		std::vector<Request *> requests;
+	};
+
+	async::result<IoError> _submit(Request *request);
+
+	// Issues requests as long as the in-flight limit permits.
+	void _dispatch();
+
+	// Chooses the next request and merges its neighbors into it.
+	bool _selectBatch(Batch &batch, uint64_t now);
+
+	// Checks whether an older request in the opposite direction overlaps the request.
+	bool _hasHazard(Request *request);
+
+	// Returns a queued request that can be merged into the batch or nullptr.
+	Request *_findMergeable(const Batch &batch);
+
+	cofiber::no_future _issue(Batch batch);
+
+	cofiber::no_future _unplugLater();
+
+	BlockDevice *_device;
+	SchedulerOptions _options;
+	size_t _maxMergeSectors;
+
+	// Queued requests in submission order.
+	std::vector<Request *> _reads;
+	std::vector<Request *> _writes;
+
+	// All requests that did not complete yet (queued and active), indexed by sector.
+	std::multimap<uint64_t, Request *> _pending;
+
+	// Size of the largest request so far. Bounds the lookups in _pending.
+	size_t _maxRequestSectors;
+
+	uint64_t _nextSequence;
+	unsigned int _plugCount;
+	size_t _inFlight;
+
+	// Position of the elevator, i.e., the sector after the last dispatched request.
+	uint64_t _position;
+
+	// Number of read dispatches while writes were waiting.
+	unsigned int _starvedWrites;
+
+	LatencyHistogram _readLatency;
+	LatencyHistogram _writeLatency;
+	uint64_t _numMerged;
+	uint64_t _numCompleted;
+};
+
+} // namespace blockfs
+
+#endif // LIBFS_SCHEDULER_HPP
@@ -41,7 +41,7 @@ struct File {
 	static async::result<protocols::fs::ReadResult>
 	read(void *object, const char *, void *buffer, size_t length);
 
-	static async::result<void>
+	static async::result<protocols::fs::Error>
 	write(void *object, const char *, const void *buffer, size_t length);
 
 	static async::result<protocols::fs::PollResult>
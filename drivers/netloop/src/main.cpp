@@ -0,0 +1,66 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+#include <cofiber.hpp>
+#include <helix/ipc.hpp>
+#include <libnet.hpp>
+
+// Serves AF_INET sockets on top of a loopback device. Together with utils/netbench,
+// this measures the network stack and the POSIX socket layer without any hardware.
+//
+// Usage: netloop [--mtu <bytes>] [--loss <probability>] [--seed <n>] [--no-csum-offload]
+
+int main(int argc, char **argv) {
+	size_t mtu = 65535;
+	double loss_rate = 0;
+	uint32_t seed = 1;
+	bool checksum_offload = true;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--mtu") && i + 1 < argc) {
+			mtu = strtoul(argv[++i], nullptr, 10);
+		}else if(!strcmp(argv[i], "--loss") && i + 1 < argc) {
+			loss_rate = strtod(argv[++i], nullptr);
+		}else if(!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			seed = strtoul(argv[++i], nullptr, 10);
+		}else if(!strcmp(argv[i], "--no-csum-offload")) {
+			checksum_offload = false;
+		}else{
+			std::cout << "\e[31m" "netloop: Unexpected argument " << argv[i]
+					<< "\e[39m" << std::endl;
+			return 1;
+		}
+	}
+
+	if(mtu < 576 || mtu > 65535) {
+		std::cout << "\e[31m" "netloop: MTU must be between 576 and 65535" "\e[39m" << std::endl;
+		return 1;
+	}
+	if(loss_rate < 0 || loss_rate >= 1) {
+		std::cout << "\e[31m" "netloop: Loss rate must be in [0, 1)" "\e[39m" << std::endl;
+		return 1;
+	}
+
+	std::cout << "netloop: Starting loopback device (MTU " << mtu
+			<< ", loss rate " << loss_rate << ")" << std::endl;
+
+	auto device = new libnet::VirtualDevice{mtu};
+	device->setLossRate(loss_rate, seed);
+	device->setChecksumOffload(checksum_offload);
+
+	// A locally administered MAC address.
+	uint8_t mac[6] = {0x02, 0, 0, 0, 0, 1};
+	libnet::Ip4Config config{{127, 0, 0, 1}, {255, 0, 0, 0}, {0, 0, 0, 0}};
+
+	{
+		async::queue_scope scope{helix::globalQueue()};
+		libnet::runDevice(device, mac, config);
+	}
+
+	helix::globalQueue()->run();
+
+	return 0;
+}
@@ -65,7 +65,7 @@ struct WriteRequest {
 	const void *buffer;
 	size_t length;
 	size_t progress;
-	async::promise<void> promise;
+	async::promise<protocols::fs::Error> promise;
 	boost::intrusive::list_member_hook<> hook;
 };
 boost::intrusive::list<
@@ -90,7 +90,7 @@ void sendBurst() {
 	req->progress += send_size;
 	
 	if(req->progress >= req->length) {
-		req->promise.set_value();
+		req->promise.set_value(protocols::fs::Error::none);
 		sendRequests.pop_front();
 		delete req;
 	}
@@ -140,7 +140,7 @@ read(void *, const char *, void *buffer, size_t length), ([=] {
 	COFIBER_RETURN(value);
 }))
 
-async::result<void> write(void *, const char *, const void *buffer, size_t length) {
+async::result<protocols::fs::Error> write(void *, const char *, const void *buffer, size_t length) {
 	auto req = new WriteRequest(buffer, length);
 	sendRequests.push_back(*req);
 	auto value = req->promise.async_get();
@@ -137,13 +137,13 @@ COFIBER_ROUTINE(cofiber::no_future, StorageDevice::run(int config_num, int intf_
 			assert(csw.tag == 1);
 			assert(!csw.dataResidue);
 			if(csw.status) {
-				std::cout << "block-usb: Error status 0x"
+				std::cout << "\e[31m" "block-usb: Error status 0x"
 						<< std::hex << (unsigned int)csw.status << std::dec
-						<<  " in CSW" << std::endl;
-				throw std::runtime_error("block-usb: Giving up");
+						<<  " in CSW" "\e[39m" << std::endl;
+				req->promise.set_value(blockfs::IoError::deviceError);
+			}else{
+				req->promise.set_value(blockfs::IoError::none);
 			}
-
-			req->promise.set_value();
 			_queue.pop_front();
 			delete req;
 		}else{
@@ -153,7 +153,7 @@ COFIBER_ROUTINE(cofiber::no_future, StorageDevice::run(int config_num, int intf_
 
 }))
 
-async::result<void> StorageDevice::readSectors(uint64_t sector, void *buffer,
+async::result<blockfs::IoError> StorageDevice::readSectors(uint64_t sector, void *buffer,
 			size_t num_sectors) {
 	auto req = new Request(sector, buffer, num_sectors);
 	_queue.push_back(*req);
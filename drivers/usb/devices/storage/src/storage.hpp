@@ -90,7 +90,7 @@ struct StorageDevice : blockfs::BlockDevice {
 
 	cofiber::no_future run(int config_num, int intf_num);
 
-	async::result<void> readSectors(uint64_t sector, void *buffer,
+	async::result<blockfs::IoError> readSectors(uint64_t sector, void *buffer,
 			size_t num_sectors) override;
 
 private:
@@ -101,7 +101,7 @@ private:
 		uint64_t sector;
 		void *buffer;
 		size_t numSectors;
-		async::promise<void> promise;
+		async::promise<blockfs::IoError> promise;
 		boost::intrusive::list_member_hook<> requestHook;
 	};
 
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>
 #include <helix/await.hpp>
 
@@ -15,102 +16,212 @@ static bool logInitiateRetire = false;
 // --------------------------------------------------------
 
 UserRequest::UserRequest(bool write_, uint64_t sector_, void *buffer_, size_t num_sectors_)
-: write{write_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_} { }
+: write{write_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_},
+		status{nullptr} { }
+
+// --------------------------------------------------------
+// RequestQueue
+// --------------------------------------------------------
+
+RequestQueue::RequestQueue(virtio_core::Queue *queue_)
+: queue{queue_}, virtRequestBuffer{nullptr}, statusBuffer{nullptr},
+		indirectBuffer{nullptr} { }
 
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
 
+namespace {
+	constexpr size_t pageSize = 0x1000;
+
+	// Upper bound on the number of virtqs that we use.
+	constexpr unsigned int maxQueues = 4;
+
+	// Number of entries per indirect table. Tables are naturally aligned
+	// and thus never cross page boundaries.
+	constexpr size_t indirectTableSize = 128;
+	static_assert(indirectTableSize * sizeof(virtio_core::spec::Descriptor) <= pageSize);
+}
+
 Device::Device(std::unique_ptr<virtio_core::Transport> transport)
 : blockfs::BlockDevice{512}, _transport{std::move(transport)},
-		_requestQueue{nullptr} { }
+		_nextQueue{0}, _useIndirect{false}, _maxSegments{0},
+		_maxSegmentSize{0}, _maxSectors{0} { }
 
 void Device::runDevice() {
+	// Negotiate optional features.
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC)) {
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC);
+		_useIndirect = true;
+	}
+
+	size_t device_seg_max = 0;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_SEG_MAX)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_SEG_MAX);
+		device_seg_max = _transport->space().load(spec::regs::segMax);
+	}
+
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_SIZE_MAX)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_SIZE_MAX);
+		_maxSegmentSize = _transport->space().load(spec::regs::sizeMax);
+		// We always need to be able to submit single pages.
+		assert(_maxSegmentSize >= pageSize);
+	}
+
+	unsigned int num_queues = 1;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_MQ)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_MQ);
+		num_queues = _transport->space().load(spec::regs::numQueues) >> 16;
+		num_queues = std::max(1u, std::min(num_queues, maxQueues));
+	}
+
 	_transport->finalizeFeatures();
-	_transport->claimQueues(1);
-	_requestQueue = _transport->setupQueue(0);
+	_transport->claimQueues(num_queues);
+	for(unsigned int i = 0; i < num_queues; i++)
+		_queues.push_back(std::make_unique<RequestQueue>(_transport->setupQueue(i)));
 
 	auto size = static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[0]))
 			| (static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[1])) << 32);
-	std::cout << "virtio: Disk size: " << size << " sectors" << std::endl;
+	std::cout << "virtio: Disk size: " << size << " sectors, using " << num_queues
+			<< " queue(s)" << (_useIndirect ? " with indirect descriptors" : "") << std::endl;
 
 	_transport->runDevice();
 
+	// Determine the maximal number of data segments per request.
+	auto num_descriptors = _queues.front()->queue->numDescriptors();
+	if(_useIndirect) {
+		// The header and the status byte need one entry each.
+		_maxSegments = indirectTableSize - 2;
+	}else{
+		// Limit to ensure that we don't monopolize the device.
+		_maxSegments = (num_descriptors / 4 > 2) ? num_descriptors / 4 - 2 : 1;
+	}
+	if(device_seg_max)
+		_maxSegments = std::min(_maxSegments, device_seg_max);
+
+	// In the worst case, an unaligned buffer touches one additional page.
+	if(_maxSegments > 1) {
+		_maxSectors = (_maxSegments - 1) * (pageSize / 512);
+	}else{
+		_maxSectors = 1;
+	}
+
 	// perform device specific setup
-	virtRequestBuffer = (VirtRequest *)malloc(_requestQueue->numDescriptors() * sizeof(VirtRequest));
-	statusBuffer = (uint8_t *)malloc(_requestQueue->numDescriptors());
+	for(auto &queue : _queues) {
+		auto n = queue->queue->numDescriptors();
+		queue->virtRequestBuffer = (VirtRequest *)malloc(n * sizeof(VirtRequest));
+		queue->statusBuffer = (uint8_t *)malloc(n);
 
-	// natural alignment makes sure that request headers do not cross page boundaries
-	assert((uintptr_t)virtRequestBuffer % sizeof(VirtRequest) == 0);
-	
-	// setup an interrupt for the device
-	_processRequests();
+		// natural alignment makes sure that request headers do not cross page boundaries
+		assert((uintptr_t)queue->virtRequestBuffer % sizeof(VirtRequest) == 0);
+
+		if(_useIndirect) {
+			auto table_bytes = (n * indirectTableSize * sizeof(virtio_core::spec::Descriptor)
+					+ (pageSize - 1)) & ~(pageSize - 1);
+			HelHandle memory;
+			void *window;
+			HEL_CHECK(helAllocateMemory(table_bytes, 0, &memory));
+			HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
+					0, table_bytes, kHelMapProtRead | kHelMapProtWrite, &window));
+			HEL_CHECK(helCloseDescriptor(memory));
+			queue->indirectBuffer = reinterpret_cast<virtio_core::spec::Descriptor *>(window);
+		}
+
+		_processRequests(queue.get());
+	}
 
 	blockfs::runDevice(this);
 }
 
-COFIBER_ROUTINE(async::result<void>, Device::readSectors(uint64_t sector,
+async::result<blockfs::IoError> Device::readSectors(uint64_t sector,
+		void *buffer, size_t num_sectors) {
+	return _transfer(false, sector, buffer, num_sectors);
+}
+
+async::result<blockfs::IoError> Device::writeSectors(uint64_t sector,
+		const void *buffer, size_t num_sectors) {
+	// The device only reads from the buffer.
+	return _transfer(true, sector, const_cast<void *>(buffer), num_sectors);
+}
+
+COFIBER_ROUTINE(async::result<blockfs::IoError>, Device::_transfer(bool write, uint64_t sector,
 		void *buffer, size_t num_sectors), ([=] {
 	// Natural alignment makes sure a sector does not cross a page boundary.
 	assert(!((uintptr_t)buffer % 512));
-//	printf("readSectors(%lu, %lu)\n", sector, num_sectors);
+	assert(_maxSectors >= 1);
 
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
-
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(false, sector + progress,
+	// Submit all requests before waiting for any of them;
+	// this allows the device to process them concurrently.
+	std::vector<UserRequest *> requests;
+	for(size_t progress = 0; progress < num_sectors; progress += _maxSectors) {
+		auto request = new UserRequest(write, sector + progress,
 				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.ring();
-		COFIBER_AWAIT request->promise.async_get();
+				std::min(num_sectors - progress, _maxSectors));
+		requests.push_back(request);
+
+		auto queue = _queues[_nextQueue].get();
+		_nextQueue = (_nextQueue + 1) % _queues.size();
+		queue->pendingQueue.push(request);
+		queue->pendingDoorbell.ring();
+	}
+
+	// Wait for all requests even if one of them fails; they reference the buffer.
+	auto error = blockfs::IoError::none;
+	for(auto request : requests) {
+		auto request_error = COFIBER_AWAIT request->promise.async_get();
+		if(request_error != blockfs::IoError::none)
+			error = request_error;
 		delete request;
 	}
 
-	COFIBER_RETURN();
+	COFIBER_RETURN(error);
 }))
 
-COFIBER_ROUTINE(async::result<void>, Device::writeSectors(uint64_t sector,
-		const void *buffer, size_t num_sectors), ([=] {
-	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
-//	printf("writeSectors(%lu, %lu)\n", sector, num_sectors);
+void Device::_buildSegments(std::vector<arch::dma_buffer_view> &segments,
+		void *buffer, size_t size) {
+	uintptr_t last_physical = 0;
+	size_t offset = 0;
+	while(offset < size) {
+		auto address = reinterpret_cast<uintptr_t>(buffer) + offset;
+		auto chunk = std::min(size - offset, pageSize - (address & (pageSize - 1)));
 
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
+		uintptr_t physical;
+		HEL_CHECK(helPointerPhysical(reinterpret_cast<void *>(address), &physical));
 
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(true, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.ring();
-		COFIBER_AWAIT request->promise.async_get();
-		delete request;
+		// Merge pages that are contiguous in physical memory.
+		if(!segments.empty() && physical == last_physical
+				&& (!_maxSegmentSize || segments.back().size() + chunk <= _maxSegmentSize)) {
+			auto &back = segments.back();
+			back = arch::dma_buffer_view{nullptr, back.data(), back.size() + chunk};
+		}else{
+			segments.push_back(arch::dma_buffer_view{nullptr,
+					reinterpret_cast<void *>(address), chunk});
+		}
+		last_physical = physical + chunk;
+		offset += chunk;
 	}
+}
 
-	COFIBER_RETURN();
-}))
-
-COFIBER_ROUTINE(cofiber::no_future, Device::_processRequests(), ([=] {
+COFIBER_ROUTINE(cofiber::no_future, Device::_processRequests(RequestQueue *queue), ([=] {
+	std::vector<arch::dma_buffer_view> segments;
 	while(true) {
-		if(_pendingQueue.empty()) {
-			COFIBER_AWAIT _pendingDoorbell.async_wait();
+		if(queue->pendingQueue.empty()) {
+			COFIBER_AWAIT queue->pendingDoorbell.async_wait();
 			continue;
 		}
 
-		auto request = _pendingQueue.front();
-		_pendingQueue.pop();
+		auto request = queue->pendingQueue.front();
+		queue->pendingQueue.pop();
 		assert(request->numSectors);
 
-		// Setup the descriptor for the request header.
-		virtio_core::Chain chain;
-		chain.append(COFIBER_AWAIT _requestQueue->obtainDescriptor());
+		segments.clear();
+		_buildSegments(segments, request->buffer, 512 * request->numSectors);
+		assert(segments.size() <= _maxSegments);
 
-		VirtRequest *header = &virtRequestBuffer[chain.front().tableIndex()];
+		// Setup the request header.
+		auto head = COFIBER_AWAIT queue->queue->obtainDescriptor();
+
+		VirtRequest *header = &queue->virtRequestBuffer[head.tableIndex()];
 		if(request->write) {
 			header->type = VIRTIO_BLK_T_OUT;
 		}else{
@@ -119,40 +230,68 @@ COFIBER_ROUTINE(cofiber::no_future, Device::_processRequests(), ([=] {
 		header->reserved = 0;
 		header->sector = request->sector;
 
-		chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-				header, sizeof(VirtRequest)});
-		
-		// Setup descriptors for the transfered data.
-		for(size_t i = 0; i < request->numSectors; i++) {
-			chain.append(COFIBER_AWAIT _requestQueue->obtainDescriptor());
-			if(request->write) {
-				chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
-			}else{
-				chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
+		arch::dma_buffer_view header_view{nullptr, header, sizeof(VirtRequest)};
+		request->status = &queue->statusBuffer[head.tableIndex()];
+		arch::dma_buffer_view status_view{nullptr, request->status, 1};
+
+		if(_useIndirect) {
+			// The whole request only occupies a single descriptor of the virtq.
+			virtio_core::IndirectTable table{queue->indirectBuffer
+					+ head.tableIndex() * indirectTableSize, indirectTableSize};
+			table.append(virtio_core::hostToDevice, header_view);
+			for(auto segment : segments) {
+				if(request->write) {
+					table.append(virtio_core::hostToDevice, segment);
+				}else{
+					table.append(virtio_core::deviceToHost, segment);
+				}
 			}
+			table.append(virtio_core::deviceToHost, status_view);
+			head.setupIndirect(table.view());
+		}else{
+			virtio_core::Chain chain;
+			chain.append(head);
+			chain.setupBuffer(virtio_core::hostToDevice, header_view);
+
+			// Setup descriptors for the transfered data.
+			for(auto segment : segments) {
+				chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+				if(request->write) {
+					chain.setupBuffer(virtio_core::hostToDevice, segment);
+				}else{
+					chain.setupBuffer(virtio_core::deviceToHost, segment);
+				}
+			}
+
+			// Setup a descriptor for the status byte.
+			chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+			chain.setupBuffer(virtio_core::deviceToHost, status_view);
 		}
 
 		if(logInitiateRetire)
 			std::cout << "Submitting " << request->numSectors
-					<< " data descriptors" << std::endl;
-
-		// Setup a descriptor for the status byte.
-		chain.append(COFIBER_AWAIT _requestQueue->obtainDescriptor());
-		chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-				&statusBuffer[chain.front().tableIndex()], 1});
+					<< " sectors in " << segments.size() << " segments" << std::endl;
 
 		// Submit the request to the device
-		_requestQueue->postDescriptor(chain.front(), request,
+		queue->queue->postDescriptor(head, request,
 				[] (virtio_core::Request *base_request) {
 			auto request = static_cast<UserRequest *>(base_request);
 			if(logInitiateRetire)
 				std::cout << "Retiring " << request->numSectors
-						<< " data descriptors" << std::endl;
-			request->promise.set_value();
+						<< " sectors" << std::endl;
+			if(*request->status != VIRTIO_BLK_S_OK) {
+				std::cout << "\e[31m" "virtio: Request at sector " << request->sector
+						<< " failed with status " << (int)*request->status
+						<< "\e[39m" << std::endl;
+				request->promise.set_value(blockfs::IoError::deviceError);
+			}else{
+				request->promise.set_value(blockfs::IoError::none);
+			}
 		});
-		_requestQueue->notify();
+
+		// Batch notifications while more requests are pending.
+		if(queue->pendingQueue.empty())
+			queue->queue->notify();
 	}
 }))
 
@@ -1,5 +1,7 @@
 
+#include <memory>
 #include <queue>
+#include <vector>
 
 #include <blockfs.hpp>
 #include <core/virtio/core.hpp>
@@ -23,10 +25,28 @@ enum {
 	VIRTIO_BLK_T_OUT = 1
 };
 
+// Values of the status byte that the device writes on completion.
+enum {
+	VIRTIO_BLK_S_OK = 0,
+	VIRTIO_BLK_S_IOERR = 1,
+	VIRTIO_BLK_S_UNSUPP = 2
+};
+
+// Feature bits of virtio-block devices.
+enum {
+	VIRTIO_BLK_F_SIZE_MAX = 1,
+	VIRTIO_BLK_F_SEG_MAX = 2,
+	VIRTIO_BLK_F_MQ = 12
+};
+
 namespace spec::regs {
 	inline constexpr arch::scalar_register<uint32_t> capacity[] = {
 			arch::scalar_register<uint32_t>{0},
 			arch::scalar_register<uint32_t>{4}};
+	inline constexpr arch::scalar_register<uint32_t> sizeMax{8};
+	inline constexpr arch::scalar_register<uint32_t> segMax{12};
+	// num_queues is stored in the upper 16 bits of this register.
+	inline constexpr arch::scalar_register<uint32_t> numQueues{32};
 }
 
 struct Device;
@@ -43,7 +63,31 @@ struct UserRequest : virtio_core::Request {
 	void *buffer;
 	size_t numSectors;
 
-	async::promise<void> promise;
+	// Points to the status byte in the RequestQueue's statusBuffer.
+	uint8_t *status;
+
+	async::promise<blockfs::IoError> promise;
+};
+
+// --------------------------------------------------------
+// RequestQueue
+// --------------------------------------------------------
+
+// State associated with a single virtq of the device.
+struct RequestQueue {
+	RequestQueue(virtio_core::Queue *queue);
+
+	virtio_core::Queue *queue;
+
+	// Stores UserRequest objects that have not been submitted yet.
+	std::queue<UserRequest *> pendingQueue;
+	async::doorbell pendingDoorbell;
+
+	// these buffers store virtio-block request headers, status bytes and indirect tables
+	// they are indexed by the index of the request's first descriptor
+	VirtRequest *virtRequestBuffer;
+	uint8_t *statusBuffer;
+	virtio_core::spec::Descriptor *indirectBuffer;
 };
 
 // --------------------------------------------------------
@@ -55,29 +99,37 @@ struct Device : blockfs::BlockDevice {
 
 	void runDevice();
 
-	async::result<void> readSectors(uint64_t sector,
+	async::result<blockfs::IoError> readSectors(uint64_t sector,
 			void *buffer, size_t num_sectors) override;
 
-	async::result<void> writeSectors(uint64_t sector,
+	async::result<blockfs::IoError> writeSectors(uint64_t sector,
 			const void *buffer, size_t num_sectors) override;
 
 private:
-	// Submits requests from _pendingQueue to the device.
-	cofiber::no_future _processRequests();
+	// Splits a transfer into requests and waits until all of them complete.
+	async::result<blockfs::IoError> _transfer(bool write, uint64_t sector,
+			void *buffer, size_t num_sectors);
+
+	// Splits a buffer into physically contiguous segments.
+	void _buildSegments(std::vector<arch::dma_buffer_view> &segments,
+			void *buffer, size_t size);
+
+	// Submits requests from the queue's pendingQueue to the device.
+	cofiber::no_future _processRequests(RequestQueue *queue);
 	
 	std::unique_ptr<virtio_core::Transport> _transport;
 
-	// The single virtq of this device.
-	virtio_core::Queue *_requestQueue;
+	// With VIRTIO_BLK_F_MQ, requests are distributed among multiple virtqs.
+	std::vector<std::unique_ptr<RequestQueue>> _queues;
+	size_t _nextQueue;
 
-	// Stores UserRequest objects that have not been submitted yet.
-	std::queue<UserRequest *> _pendingQueue;
-	async::doorbell _pendingDoorbell;
+	// Whether VIRTIO_RING_F_INDIRECT_DESC was negotiated.
+	bool _useIndirect;
 
-	// these two buffer store virtio-block request header and status bytes
-	// they are indexed by the index of the request's first descriptor
-	VirtRequest *virtRequestBuffer;
-	uint8_t *statusBuffer;
+	// Limits on the shape of a single request.
+	size_t _maxSegments;
+	size_t _maxSegmentSize;
+	size_t _maxSectors;
 };
 
 } } // namespace block::virtio
@@ -1,78 +1,49 @@
 
-#include <stdlib.h>
+#include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <assert.h>
-
-#include <vector>
-#include <helx.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <memory>
+
+#include <cofiber.hpp>
+#include <hel.h>
+#include <hel-syscalls.h>
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
+#include <protocols/mbus/client.hpp>
+#include <protocols/hw/client.hpp>
 
-#include <bragi/mbus.hpp>
-#include <hw.pb.h>
 #include "net.hpp"
 
-helx::EventHub eventHub = helx::EventHub::create();
-bragi_mbus::Connection mbusConnection(eventHub);
-virtio::net::Device device;
-
-// --------------------------------------------------------
-// InitClosure
-// --------------------------------------------------------
-
-struct InitClosure {
-	void operator() ();
+// TODO: Support more than one device.
 
-private:
-	void connected();
-	void enumeratedDevice(std::vector<bragi_mbus::ObjectId> objects);
-	void queriredDevice(HelHandle handle);
-};
+COFIBER_ROUTINE(cofiber::no_future, bindDevice(mbus::Entity entity), ([=] {
+	protocols::hw::Device hw_device(COFIBER_AWAIT entity.bind());
+	auto transport = COFIBER_AWAIT virtio_core::discover(std::move(hw_device),
+			virtio_core::DiscoverMode::transitional);
 
-void InitClosure::operator() () {
-	mbusConnection.connect(CALLBACK_MEMBER(this, &InitClosure::connected));
-}
-
-void InitClosure::connected() {
-	mbusConnection.enumerate({ "pci-vendor:0x1af4", "pci-device:0x1000" },
-			CALLBACK_MEMBER(this, &InitClosure::enumeratedDevice));
-}
-
-void InitClosure::enumeratedDevice(std::vector<bragi_mbus::ObjectId> objects) {
-	assert(objects.size() == 1);
-	mbusConnection.queryIf(objects[0],
-			CALLBACK_MEMBER(this, &InitClosure::queriredDevice));
-}
+	auto device = new nic::virtio::Device{std::move(transport)};
+	device->runDevice();
+}))
 
-void InitClosure::queriredDevice(HelHandle handle) {
-	helx::Pipe device_pipe(handle);
+COFIBER_ROUTINE(cofiber::no_future, observeDevices(), ([] {
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
 
-	// acquire the device's resources
-	HelError acquire_error;
-	uint8_t acquire_buffer[128];
-	size_t acquire_length;
-	device_pipe.recvStringRespSync(acquire_buffer, 128, eventHub, 1, 0,
-			acquire_error, acquire_length);
-	HEL_CHECK(acquire_error);
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-vendor", "1af4"),
+		mbus::EqualsFilter("pci-device", "1000")
+	});
 
-	managarm::hw::PciDevice acquire_response;
-	acquire_response.ParseFromArray(acquire_buffer, acquire_length);
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties) {
+		std::cout << "virtio: Detected network device" << std::endl;
+		bindDevice(std::move(entity));
+	});
 
-	HelError bar_error;
-	HelHandle bar_handle;
-	device_pipe.recvDescriptorRespSync(eventHub, 1, 1, bar_error, bar_handle);
-	HEL_CHECK(bar_error);
-
-	HelError irq_error;
-	HelHandle irq_handle;
-	device_pipe.recvDescriptorRespSync(eventHub, 1, 7, irq_error, irq_handle);
-	HEL_CHECK(irq_error);
-
-	assert(acquire_response.bars(0).io_type() == managarm::hw::IoType::PORT);
-	HEL_CHECK(helEnableIo(bar_handle));
-
-	device.setupDevice(acquire_response.bars(0).address(), helx::Irq(irq_handle));
-	device.testDevice();
-}
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+}))
 
 // --------------------------------------------------------
 // main() function
@@ -81,9 +52,10 @@ void InitClosure::queriredDevice(HelHandle handle) {
 int main() {
 	printf("Starting virtio-net driver\n");
 
-	auto closure = new InitClosure();
-	(*closure)();
+	{
+		async::queue_scope scope{helix::globalQueue()};
+		observeDevices();
+	}
 
-	while(true)
-		eventHub.defaultProcessEvents();	
+	helix::globalQueue()->run();
 }
@@ -1,149 +1,331 @@
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <helix/await.hpp>
 
 #include "net.hpp"
 
-extern helx::EventHub eventHub;
-
+namespace nic {
 namespace virtio {
-namespace net {
-
-void *receiveBuffer;
-
-Device::Device()
-		: receiveQueue(*this, 0), transmitQueue(*this, 1) { }
-
-void Device::sendPacket(std::string packet) {
-	size_t tx_header_index = transmitQueue.lockDescriptor();
-	size_t tx_packet_index = transmitQueue.lockDescriptor();
-	
-	// natural alignment to make sure we do not cross page boundaries
-	void *transmit_buffer = malloc(2048);
-	assert((uintptr_t)transmit_buffer % 2048 == 0);	
-
-	auto header = (VirtHeader *)transmit_buffer;
-	header->flags = 0;
-	header->gsoType = 0;
-	header->hdrLen = 0;
-	header->gsoSize = 0;
-	header->csumStart = 0;
-	header->csumOffset = 0;
-	
-	memcpy((char *)transmit_buffer + sizeof(VirtHeader), packet.data(), packet.length());
-	
-	// setup a descriptor for the virtio header
-	uintptr_t tx_header_physical;
-	HEL_CHECK(helPointerPhysical(transmit_buffer, &tx_header_physical));
-	
-	VirtDescriptor *tx_header_desc = transmitQueue.accessDescriptor(tx_header_index);
-	tx_header_desc->address = tx_header_physical;
-	tx_header_desc->length = sizeof(VirtHeader);
-	tx_header_desc->flags = VIRTQ_DESC_F_NEXT;
-	tx_header_desc->next = tx_packet_index;
-
-	// setup a descriptor for the packet
-	VirtDescriptor *tx_packet_desc = transmitQueue.accessDescriptor(tx_packet_index);
-	tx_packet_desc->address = tx_header_physical + sizeof(VirtHeader);
-	tx_packet_desc->length = packet.length();
-	tx_packet_desc->flags = 0;
-
-	transmitQueue.postDescriptor(tx_header_index);
-	transmitQueue.notifyDevice();
-}
 
-void Device::testDevice() {
-	printf("testDevice()\n");
-
-	uint8_t mac_octets[6];
-	for(size_t i = 0; i < 6; i++)
-		mac_octets[i] = readConfig8(i);
-	printf("localMac: %x:%x:%x:%x:%x:%x\n",
-			mac_octets[0], mac_octets[1], mac_octets[2],
-			mac_octets[3], mac_octets[4], mac_octets[5]);
-
-	libnet::testDevice(eventHub, *this, mac_octets);
-
-	// -----------------------------------------------------------------------------------------
-
-	size_t rx_header_index = receiveQueue.lockDescriptor();
-	size_t rx_packet_index = receiveQueue.lockDescriptor();
-
-	// setup a descriptor for the header
-	uintptr_t rx_header_physical;
-	HEL_CHECK(helPointerPhysical((char *)receiveBuffer, &rx_header_physical));
-	
-	VirtDescriptor *rx_header_desc = receiveQueue.accessDescriptor(rx_header_index);
-	rx_header_desc->address = rx_header_physical;
-	rx_header_desc->length = sizeof(VirtHeader);
-	rx_header_desc->flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-	rx_header_desc->next = rx_packet_index;
-
-	// setup a descriptor for the packet
-	VirtDescriptor *rx_packet_desc = receiveQueue.accessDescriptor(rx_packet_index);
-	rx_packet_desc->address = rx_header_physical + sizeof(VirtHeader);
-	rx_packet_desc->length = 1514;
-	rx_packet_desc->flags = VIRTQ_DESC_F_WRITE;
-
-	receiveQueue.postDescriptor(rx_header_index);
-	receiveQueue.notifyDevice();
+// --------------------------------------------------------
+// Queue pairs
+// --------------------------------------------------------
+
+ReceiveBuffer::ReceiveBuffer(ReceiveQueue *queue_, void *buffer_)
+: queue{queue_}, buffer{buffer_} { }
+
+ReceiveQueue::ReceiveQueue(Device *device_, virtio_core::Queue *queue_)
+: device{device_}, queue{queue_} { }
+
+TransmitRequest::TransmitRequest(libnet::PacketBuffer packet_)
+: packet{std::move(packet_)} { }
+
+TransmitQueue::TransmitQueue(virtio_core::Queue *queue_)
+: queue{queue_} { }
+
+// --------------------------------------------------------
+// Device
+// --------------------------------------------------------
+
+namespace {
+	// Upper bound on the number of queue pairs that we use.
+	constexpr unsigned int maxPairs = 4;
+
+	// Largest Ethernet frame (without FCS) that we receive.
+	constexpr size_t maxFrameSize = 1514;
+	static_assert(sizeof(VirtHeader) + maxFrameSize <= libnet::PacketPool::bufferSize);
+	static_assert(sizeof(VirtHeader) <= libnet::PacketBuffer::headroom);
+
+	struct ControlRequest : virtio_core::Request {
+		async::promise<void> promise;
+	};
 }
 
-void Device::doInitialize() {
-	receiveQueue.setupQueue();
-	transmitQueue.setupQueue();
+Device::Device(std::unique_ptr<virtio_core::Transport> transport)
+: _transport{std::move(transport)}, _headerSize{0}, _anyLayout{false},
+		_offloads{0}, _controlQueue{nullptr}, _activePairs{1} { }
+
+void Device::runDevice() {
+	// Negotiate optional features.
+	bool version_1 = _transport->checkDeviceFeature(virtio_core::VIRTIO_F_VERSION_1);
+	_headerSize = version_1 ? sizeof(VirtHeader) : offsetof(VirtHeader, numBuffers);
+	_anyLayout = version_1;
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_F_ANY_LAYOUT)) {
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_F_ANY_LAYOUT);
+		_anyLayout = true;
+	}
+
+	bool event_index = false;
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_RING_F_EVENT_IDX)) {
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_RING_F_EVENT_IDX);
+		event_index = true;
+	}
+
+	if(_transport->checkDeviceFeature(VIRTIO_NET_F_MAC))
+		_transport->acknowledgeDriverFeature(VIRTIO_NET_F_MAC);
+
+	// We do not verify checksums that the device already verified.
+	if(_transport->checkDeviceFeature(VIRTIO_NET_F_GUEST_CSUM))
+		_transport->acknowledgeDriverFeature(VIRTIO_NET_F_GUEST_CSUM);
+
+	if(_transport->checkDeviceFeature(VIRTIO_NET_F_CSUM)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_NET_F_CSUM);
+		_offloads |= libnet::kNetOffloadTxChecksum;
+
+		if(_transport->checkDeviceFeature(VIRTIO_NET_F_HOST_TSO4)) {
+			_transport->acknowledgeDriverFeature(VIRTIO_NET_F_HOST_TSO4);
+			_offloads |= libnet::kNetOffloadTso;
+		}
+	}
+
+	// Multiple queue pairs are configured via the control virtq.
+	unsigned int max_pairs = 1;
+	unsigned int num_pairs = 1;
+	bool control_queue = false;
+	if(_transport->checkDeviceFeature(VIRTIO_NET_F_CTRL_VQ)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_NET_F_CTRL_VQ);
+		control_queue = true;
+
+		if(_transport->checkDeviceFeature(VIRTIO_NET_F_MQ)) {
+			_transport->acknowledgeDriverFeature(VIRTIO_NET_F_MQ);
+			max_pairs = _transport->space().load(spec::regs::maxQueuePairs) & 0xFFFF;
+			num_pairs = std::max(1u, std::min(max_pairs, maxPairs));
+		}
+	}
+
+	_transport->finalizeFeatures();
+
+	// The control virtq follows the last possible queue pair.
+	_transport->claimQueues(2 * max_pairs + (control_queue ? 1 : 0));
+	for(unsigned int i = 0; i < num_pairs; i++) {
+		auto receive_queue = _transport->setupQueue(2 * i);
+		auto transmit_queue = _transport->setupQueue(2 * i + 1);
+		if(event_index) {
+			receive_queue->enableEventIndex();
+			transmit_queue->enableEventIndex();
+		}
+		// Completed transmissions are reaped whenever we transmit.
+		transmit_queue->disableInterrupts();
+
+		_receiveQueues.push_back(std::make_unique<ReceiveQueue>(this, receive_queue));
+		_transmitQueues.push_back(std::make_unique<TransmitQueue>(transmit_queue));
+	}
+	if(control_queue) {
+		_controlQueue = _transport->setupQueue(2 * max_pairs);
+		if(event_index)
+			_controlQueue->enableEventIndex();
+	}
+
+	auto mac_low = _transport->space().load(spec::regs::mac[0]);
+	auto mac_high = _transport->space().load(spec::regs::mac[1]);
+	memcpy(_mac, &mac_low, 4);
+	memcpy(_mac + 4, &mac_high, 2);
+
+	std::cout << "virtio: Using " << num_pairs << " queue pair(s)"
+			<< ((_offloads & libnet::kNetOffloadTxChecksum) ? ", checksum offload" : "")
+			<< ((_offloads & libnet::kNetOffloadTso) ? ", TSO" : "")
+			<< (event_index ? ", event indices" : "") << std::endl;
 
-	// natural alignment to make sure we do not cross page boundaries
-	receiveBuffer = malloc(2048);
-	assert((uintptr_t)receiveBuffer % 2048 == 0);
-	
-	// setup an interrupt for the device
-	interrupt.wait(eventHub, CALLBACK_MEMBER(this, &Device::onInterrupt));
+	_transport->runDevice();
+
+	// Pre-fill all receive virtqs. Without VIRTIO_F_ANY_LAYOUT, each buffer
+	// needs a separate descriptor for the header.
+	for(auto &queue : _receiveQueues) {
+		auto n = queue->queue->numDescriptors() / (_anyLayout ? 1 : 2);
+		for(size_t i = 0; i < n; i++)
+			queue->freeBuffers.push_back(new ReceiveBuffer{queue.get(),
+					libnet::PacketPool::global()->allocate()});
+		_refillReceive(queue.get());
+	}
+
+	for(auto &queue : _transmitQueues)
+		_processTransmit(queue.get());
+
+	_configure();
 }
 
-void Device::retrieveDescriptor(size_t queue_index, size_t desc_index, size_t bytes_written) {
-	printf("retrieve(%lu, %lu)\n", queue_index, desc_index);
-
-	if(queue_index == 0) {
-		assert(bytes_written >= sizeof(VirtHeader));
-		libnet::onReceive((char *)receiveBuffer + sizeof(VirtHeader),
-				bytes_written - sizeof(VirtHeader));
-	
-		size_t rx_header_index = receiveQueue.lockDescriptor();
-		size_t rx_packet_index = receiveQueue.lockDescriptor();
-
-		// setup a descriptor for the header
-		uintptr_t rx_header_physical;
-		HEL_CHECK(helPointerPhysical((char *)receiveBuffer, &rx_header_physical));
-		
-		VirtDescriptor *rx_header_desc = receiveQueue.accessDescriptor(rx_header_index);
-		rx_header_desc->address = rx_header_physical;
-		rx_header_desc->length = sizeof(VirtHeader);
-		rx_header_desc->flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-		rx_header_desc->next = rx_packet_index;
-
-		// setup a descriptor for the packet
-		VirtDescriptor *rx_packet_desc = receiveQueue.accessDescriptor(rx_packet_index);
-		rx_packet_desc->address = rx_header_physical + sizeof(VirtHeader);
-		rx_packet_desc->length = 1514;
-		rx_packet_desc->flags = VIRTQ_DESC_F_WRITE;
-
-		receiveQueue.postDescriptor(rx_header_index);
-		receiveQueue.notifyDevice();
+void Device::sendPacket(libnet::PacketBuffer packet) {
+	auto queue = _selectQueue(packet);
+	queue->pendingQueue.push_back(std::move(packet));
+	queue->pendingDoorbell.ring();
+}
+
+COFIBER_ROUTINE(cofiber::no_future, Device::_configure(), ([=] {
+	// Until VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET completes, the device only uses the first pair.
+	if(_receiveQueues.size() > 1) {
+		if(COFIBER_AWAIT _setQueuePairs(_receiveQueues.size())) {
+			_activePairs = _receiveQueues.size();
+		}else{
+			std::cout << "\e[33m" "virtio: Device rejected multiple queue pairs" "\e[39m"
+					<< std::endl;
+		}
+	}
+
+	libnet::runDevice(this, _mac);
+}))
+
+COFIBER_ROUTINE(async::result<bool>, Device::_setQueuePairs(unsigned int num_pairs), ([=] {
+	assert(_controlQueue);
+
+	// The pool's buffers are physically contiguous.
+	auto buffer = static_cast<uint8_t *>(libnet::PacketPool::global()->allocate());
+	buffer[0] = VIRTIO_NET_CTRL_MQ;
+	buffer[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+	uint16_t pairs = num_pairs;
+	memcpy(buffer + 2, &pairs, sizeof(uint16_t));
+	buffer[4] = 0xFF;
+
+	// Command header, command data and the acknowledgement byte.
+	virtio_core::Chain chain;
+	chain.append(COFIBER_AWAIT _controlQueue->obtainDescriptor());
+	chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr, buffer, 2});
+	chain.append(COFIBER_AWAIT _controlQueue->obtainDescriptor());
+	chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr, buffer + 2, 2});
+	chain.append(COFIBER_AWAIT _controlQueue->obtainDescriptor());
+	chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr, buffer + 4, 1});
+
+	ControlRequest request;
+	_controlQueue->postDescriptor(chain.front(), &request,
+			[] (virtio_core::Request *base_request) {
+		auto request = static_cast<ControlRequest *>(base_request);
+		request->promise.set_value();
+	});
+	_controlQueue->notify();
+
+	COFIBER_AWAIT request.promise.async_get();
+	bool success = buffer[4] == VIRTIO_NET_OK;
+	libnet::PacketPool::global()->free(buffer);
+	COFIBER_RETURN(success);
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, Device::_refillReceive(ReceiveQueue *queue), ([=] {
+	while(true) {
+		if(queue->freeBuffers.empty()) {
+			COFIBER_AWAIT queue->refillDoorbell.async_wait();
+			continue;
+		}
+
+		while(!queue->freeBuffers.empty()) {
+			auto rx = queue->freeBuffers.back();
+			queue->freeBuffers.pop_back();
+
+			virtio_core::Chain chain;
+			if(_anyLayout) {
+				chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+				chain.setupBuffer(virtio_core::deviceToHost,
+						arch::dma_buffer_view{nullptr, rx->buffer, _headerSize + maxFrameSize});
+			}else{
+				chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+				chain.setupBuffer(virtio_core::deviceToHost,
+						arch::dma_buffer_view{nullptr, rx->buffer, _headerSize});
+				chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+				chain.setupBuffer(virtio_core::deviceToHost,
+						arch::dma_buffer_view{nullptr,
+								static_cast<char *>(rx->buffer) + _headerSize, maxFrameSize});
+			}
+			queue->queue->postDescriptor(chain.front(), rx, &Device::_completeReceive);
+		}
+
+		// Notify the device once per batch.
+		queue->queue->notify();
 	}
+}))
+
+void Device::_completeReceive(virtio_core::Request *base_request) {
+	auto rx = static_cast<ReceiveBuffer *>(base_request);
+	auto queue = rx->queue;
+	auto self = queue->device;
+	assert(rx->bytesWritten >= self->_headerSize);
+
+	// DATA_VALID is only set if VIRTIO_NET_F_GUEST_CSUM was negotiated. NEEDS_CSUM means
+	// that the packet was sent by a local guest that left the checksum to the hardware.
+	VirtHeader header;
+	memcpy(&header, rx->buffer, self->_headerSize);
+	unsigned int flags = 0;
+	if(header.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		flags |= libnet::kReceiveChecksumValid;
+
+	libnet::onReceive(static_cast<char *>(rx->buffer) + self->_headerSize,
+			rx->bytesWritten - self->_headerSize, flags);
+
+	queue->freeBuffers.push_back(rx);
+	queue->refillDoorbell.ring();
 }
 
-void Device::afterRetrieve() { }
+COFIBER_ROUTINE(cofiber::no_future, Device::_processTransmit(TransmitQueue *queue), ([=] {
+	while(true) {
+		if(queue->pendingQueue.empty()) {
+			COFIBER_AWAIT queue->pendingDoorbell.async_wait();
+			continue;
+		}
+
+		// TX interrupts are disabled; free the packets that the device already sent.
+		queue->queue->processInterrupt();
+
+		auto request = new TransmitRequest{std::move(queue->pendingQueue.front())};
+		queue->pendingQueue.pop_front();
+		auto &packet = request->packet;
+
+		// Offsets in the header exclude the header itself.
+		VirtHeader header;
+		memset(&header, 0, sizeof(VirtHeader));
+		if(packet.needsChecksum()) {
+			header.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+			header.csumStart = packet.checksumStart();
+			header.csumOffset = packet.checksumField();
+		}
+		if(packet.segmentSize()) {
+			header.gsoType = VIRTIO_NET_HDR_GSO_TCPV4;
+			header.gsoSize = packet.segmentSize();
+			header.hdrLen = packet.headerLength();
+		}
+		memcpy(packet.prepend(_headerSize), &header, _headerSize);
+
+		// Each segment of the packet is physically contiguous and becomes one descriptor.
+		virtio_core::Chain chain;
+		for(size_t n = 0; n < packet.numSegments(); n++) {
+			auto view = packet.segment(n);
+			if(!n && !_anyLayout) {
+				chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+				chain.setupBuffer(virtio_core::hostToDevice, view.subview(0, _headerSize));
+				view = view.subview(_headerSize, view.size() - _headerSize);
+			}
+			if(!view.size())
+				continue;
+			chain.append(COFIBER_AWAIT queue->queue->obtainDescriptor());
+			chain.setupBuffer(virtio_core::hostToDevice, view);
+		}
+
+		queue->queue->postDescriptor(chain.front(), request,
+				[] (virtio_core::Request *base_request) {
+			delete static_cast<TransmitRequest *>(base_request);
+		});
+
+		// Batch notifications while more packets are pending.
+		if(queue->pendingQueue.empty())
+			queue->queue->notify();
+	}
+}))
 
-void Device::onInterrupt(HelError error) {
-	HEL_CHECK(error);
+TransmitQueue *Device::_selectQueue(const libnet::PacketBuffer &packet) {
+	if(_activePairs == 1)
+		return _transmitQueues.front().get();
 
-	readIsr();
-	receiveQueue.processInterrupt();
-	transmitQueue.processInterrupt();
+	// Hash the IPv4 addresses and (if the IPv4 header has no options) the ports.
+	uint8_t bytes[38];
+	if(packet.size() < sizeof(bytes))
+		return _transmitQueues.front().get();
+	packet.read(0, bytes, sizeof(bytes));
+	if(bytes[12] != 0x08 || bytes[13] != 0x00)
+		return _transmitQueues.front().get();
 
-	interrupt.wait(eventHub, CALLBACK_MEMBER(this, &Device::onInterrupt));
+	size_t end = ((bytes[14] & 0x0F) == 5) ? 38 : 34;
+	uint32_t hash = 2166136261;
+	for(size_t i = 26; i < end; i++)
+		hash = (hash ^ bytes[i]) * 16777619;
+	return _transmitQueues[hash % _activePairs].get();
 }
 
-} } // namespace virtio::net
+} } // namespace nic::virtio
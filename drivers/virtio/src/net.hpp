@@ -1,30 +1,52 @@
 
-#include <queue>
-#include <string>
-#include <helx.hpp>
-#include <libnet.hpp>
+#include <deque>
+#include <memory>
+#include <vector>
 
-#include "virtio.hpp"
+#include <async/doorbell.hpp>
+#include <async/result.hpp>
+#include <core/virtio/core.hpp>
+#include <libnet.hpp>
 
+namespace nic {
 namespace virtio {
-namespace net {
 
 // --------------------------------------------------------
-// VirtHeader 
+// VirtIO data structures and constants
 // --------------------------------------------------------
 
+// Feature bits of virtio-net devices.
+enum {
+	VIRTIO_NET_F_CSUM = 0,
+	VIRTIO_NET_F_GUEST_CSUM = 1,
+	VIRTIO_NET_F_MAC = 5,
+	VIRTIO_NET_F_HOST_TSO4 = 11,
+	VIRTIO_NET_F_CTRL_VQ = 17,
+	VIRTIO_NET_F_MQ = 22
+};
+
+// Bits of the VirtHeader::flags field.
 enum {
-	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1
+	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+	VIRTIO_NET_HDR_F_DATA_VALID = 2
 };
 
 enum {
 	VIRTIO_NET_HDR_GSO_NONE = 0,
 	VIRTIO_NET_HDR_GSO_TCPV4 = 1,
-	VIRTIO_NET_HDR_GSO_UDP = 2,
-	VIRTIO_NET_HDR_GSO_TCPV6 = 3,
+	VIRTIO_NET_HDR_GSO_UDP = 3,
+	VIRTIO_NET_HDR_GSO_TCPV6 = 4,
 	VIRTIO_NET_HDR_GSO_ECN = 0x80
 };
 
+// Commands on the control virtq.
+enum {
+	VIRTIO_NET_CTRL_MQ = 4,
+	VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0,
+
+	VIRTIO_NET_OK = 0
+};
+
 struct VirtHeader {
 	uint8_t flags;
 	uint8_t gsoType;
@@ -32,30 +54,114 @@ struct VirtHeader {
 	uint16_t gsoSize;
 	uint16_t csumStart;
 	uint16_t csumOffset;
+	// Only present for VIRTIO_F_VERSION_1 devices.
+	uint16_t numBuffers;
 };
+static_assert(sizeof(VirtHeader) == 12, "Bad sizeof(VirtHeader)");
+
+namespace spec::regs {
+	// The MAC address is stored in the first six bytes of the configuration space.
+	inline constexpr arch::scalar_register<uint32_t> mac[] = {
+			arch::scalar_register<uint32_t>{0},
+			arch::scalar_register<uint32_t>{4}};
+	// max_virtqueue_pairs is stored in the lower 16 bits of this register.
+	inline constexpr arch::scalar_register<uint32_t> maxQueuePairs{8};
+}
+
+struct Device;
 
 // --------------------------------------------------------
-// NetDevice
+// Queue pairs
 // --------------------------------------------------------
 
-struct Device : public GenericDevice, public libnet::NetDevice {
-	Device();
+struct ReceiveQueue;
 
-	void doInitialize() override;
-	void retrieveDescriptor(size_t queue_index, size_t desc_index, size_t bytes_written) override;
-	void afterRetrieve() override;
+// A pooled buffer that is posted to a receive virtq.
+struct ReceiveBuffer : virtio_core::Request {
+	ReceiveBuffer(ReceiveQueue *queue, void *buffer);
 
-	void sendPacket(std::string packet) override;
+	ReceiveQueue *queue;
+	void *buffer;
+};
 
-	void testDevice();
-	void onInterrupt(HelError error);
+struct ReceiveQueue {
+	ReceiveQueue(Device *device, virtio_core::Queue *queue);
 
-private:
-	Queue receiveQueue;
-	Queue transmitQueue;
+	Device *device;
+	virtio_core::Queue *queue;
+
+	// Buffers that are not posted to the virtq; they are re-posted in batches.
+	std::vector<ReceiveBuffer *> freeBuffers;
+	async::doorbell refillDoorbell;
+};
+
+// Keeps the packet alive until the device is done with it.
+struct TransmitRequest : virtio_core::Request {
+	TransmitRequest(libnet::PacketBuffer packet);
+
+	libnet::PacketBuffer packet;
+};
+
+struct TransmitQueue {
+	TransmitQueue(virtio_core::Queue *queue);
+
+	virtio_core::Queue *queue;
 
-	helx::Irq irq;
+	// Packets that have not been submitted yet.
+	std::deque<libnet::PacketBuffer> pendingQueue;
+	async::doorbell pendingDoorbell;
 };
 
-} } // namespace virtio::net
+// --------------------------------------------------------
+// Device
+// --------------------------------------------------------
+
+struct Device : libnet::NetDevice {
+	Device(std::unique_ptr<virtio_core::Transport> transport);
+
+	void runDevice();
+
+	void sendPacket(libnet::PacketBuffer packet) override;
+
+	unsigned int offloads() override {
+		return _offloads;
+	}
+
+private:
+	// Activates additional queue pairs (requires VIRTIO_NET_F_MQ). Completes once
+	// the device acknowledged the command; returns false if it failed.
+	async::result<bool> _setQueuePairs(unsigned int num_pairs);
+
+	// Activates the queue pairs and starts the network stack.
+	cofiber::no_future _configure();
+
+	// Posts the queue's free buffers to its virtq.
+	cofiber::no_future _refillReceive(ReceiveQueue *queue);
+
+	// Submits packets from the queue's pendingQueue to the device.
+	cofiber::no_future _processTransmit(TransmitQueue *queue);
+
+	static void _completeReceive(virtio_core::Request *base_request);
+
+	// Selects a transmit queue such that packets of a single flow are never reordered.
+	TransmitQueue *_selectQueue(const libnet::PacketBuffer &packet);
+
+	std::unique_ptr<virtio_core::Transport> _transport;
+
+	uint8_t _mac[6];
+
+	// Size of the VirtHeader (without numBuffers for legacy devices).
+	size_t _headerSize;
+	// Whether the header may share a descriptor with the packet (VIRTIO_F_ANY_LAYOUT).
+	bool _anyLayout;
+	unsigned int _offloads;
+
+	std::vector<std::unique_ptr<ReceiveQueue>> _receiveQueues;
+	std::vector<std::unique_ptr<TransmitQueue>> _transmitQueues;
+	virtio_core::Queue *_controlQueue;
+
+	// Queue pairs that the device currently uses.
+	unsigned int _activePairs;
+};
 
+} } // namespace nic::virtio
@@ -31,6 +31,13 @@ extern inline __attribute__ (( always_inline )) HelError helTransferDescriptor(H
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helTransferDescriptors(
+		const HelHandle *handles, size_t count, HelHandle universe_handle,
+		HelHandle *out_handles) {
+	return helSyscall4(kHelCallTransferDescriptors, (HelWord)handles, (HelWord)count,
+			(HelWord)universe_handle, (HelWord)out_handles);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helDescriptorInfo(HelHandle handle,
 		struct HelDescriptorInfo *info) {
 	return helSyscall2(kHelCallDescriptorInfo, (HelWord)handle, (HelWord)info);
@@ -15,13 +15,14 @@
 
 enum {
 	// largest system call number plus 1
-	kHelNumCalls = 99,
+	kHelNumCalls = 100,
 
 	kHelCallLog = 1,
 	kHelCallPanic = 10,
 
 	kHelCallCreateUniverse = 62,
 	kHelCallTransferDescriptor = 66,
+	kHelCallTransferDescriptors = 99,
 	kHelCallDescriptorInfo = 32,
 	kHelCallGetCredentials = 84,
 	kHelCallCloseDescriptor = 20,
@@ -379,6 +380,10 @@ HEL_C_LINKAGE void helPanic(const char *string, size_t length)
 HEL_C_LINKAGE HelError helCreateUniverse(HelHandle *handle);
 HEL_C_LINKAGE HelError helTransferDescriptor(HelHandle handle, HelHandle universe_handle,
 		HelHandle *out_handle);
+//! Transfers count descriptors at once. Either all descriptors are transferred or none.
+//! handles and out_handles may point to the same array.
+HEL_C_LINKAGE HelError helTransferDescriptors(const HelHandle *handles, size_t count,
+		HelHandle universe_handle, HelHandle *out_handles);
 HEL_C_LINKAGE HelError helDescriptorInfo(HelHandle handle, struct HelDescriptorInfo *info);
 HEL_C_LINKAGE HelError helGetCredentials(HelHandle handle, uint32_t flags,
 		char *credentials);
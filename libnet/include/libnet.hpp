@@ -5,11 +5,15 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <helx.hpp>
-#include <bragi/mbus.hpp>
-#include <vector>
-#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <random>
 #include <string>
+#include <vector>
+
+#include <arch/dma_structs.hpp>
+#include <async/doorbell.hpp>
+#include <cofiber.hpp>
 
 namespace libnet {
 
@@ -37,17 +41,274 @@ inline uint32_t netToHost(uint32_t value) {
 	return __builtin_bswap32(value);
 }
 
+// Fixed-size packet buffers. Each buffer is naturally aligned and hence
+// physically contiguous, so that devices can access it via a single descriptor.
+struct PacketPool {
+	static constexpr size_t bufferSize = 2048;
+
+	static PacketPool *global();
+
+	PacketPool(arch::dma_pool *dma_pool);
+
+	PacketPool(const PacketPool &) = delete;
+
+	PacketPool &operator= (const PacketPool &) = delete;
+
+	arch::dma_pool *dmaPool() {
+		return _dmaPool;
+	}
+
+	void *allocate();
+	void free(void *buffer);
+
+private:
+	arch::dma_pool *_dmaPool;
+
+	// Buffers are recycled instead of being returned to the DMA pool.
+	std::vector<void *> _freeList;
+};
+
+// A packet that is being transmitted. Its data is stored in a chain of segments
+// that are allocated from the PacketPool. The first segment reserves headroom so that
+// each layer can prepend its header in place; hence payloads are written exactly once.
+struct PacketBuffer {
+	// Enough for the virtio-net header, Ethernet, IPv4 and TCP (with options).
+	static constexpr size_t headroom = 160;
+
+	friend void swap(PacketBuffer &a, PacketBuffer &b) {
+		using std::swap;
+		swap(a._head, b._head);
+		swap(a._tail, b._tail);
+		swap(a._checksumTail, b._checksumTail);
+		swap(a._checksumField, b._checksumField);
+		swap(a._segmentSize, b._segmentSize);
+		swap(a._transportHeaderLength, b._transportHeaderLength);
+	}
+
+	PacketBuffer();
+
+	// Allocates enough segments for length bytes of payload.
+	explicit PacketBuffer(size_t length);
+
+	PacketBuffer(PacketBuffer &&other)
+	: PacketBuffer() {
+		swap(*this, other);
+	}
+
+	~PacketBuffer();
+
+	PacketBuffer &operator= (PacketBuffer other) {
+		swap(*this, other);
+		return *this;
+	}
+
+	explicit operator bool () const {
+		return _head.buffer;
+	}
+
+	// Total number of bytes (headers and payload).
+	size_t size() const;
+
+	size_t numSegments() const {
+		return 1 + _tail.size();
+	}
+
+	// Returns the bytes of the given segment. Except for the last one,
+	// all segments have an even length (relevant for checksums).
+	arch::dma_buffer_view segment(size_t n) const;
+
+	// Extends the packet at the front and returns a pointer to the new bytes.
+	void *prepend(size_t length);
+
+	// Copies data into or out of the packet.
+	void write(size_t offset, const void *data, size_t length);
+	void read(size_t offset, void *data, size_t length) const;
+
+	// Checksum offload (kNetOffloadTxChecksum): the device checksums everything from
+	// the current start of the packet to its end and stores the result at the given offset.
+	// The checksum field has to be initialized with the (folded) pseudo header sum.
+	void requestChecksum(size_t field) {
+		_checksumTail = size();
+		_checksumField = field;
+	}
+
+	bool needsChecksum() const {
+		return _checksumTail;
+	}
+
+	// Offset of the checksummed data. Stays valid when headers are prepended.
+	size_t checksumStart() const {
+		return size() - _checksumTail;
+	}
+
+	// Offset of the checksum field relative to checksumStart().
+	size_t checksumField() const {
+		return _checksumField;
+	}
+
+	// Segmentation offload (kNetOffloadTso): the device splits the TCP payload into
+	// segments of segment_size bytes. Requires requestChecksum().
+	void requestSegmentation(size_t segment_size, size_t transport_header_length) {
+		assert(needsChecksum());
+		_segmentSize = segment_size;
+		_transportHeaderLength = transport_header_length;
+	}
+
+	// Zero if no segmentation was requested.
+	size_t segmentSize() const {
+		return _segmentSize;
+	}
+
+	// Length of all headers (up to and including TCP) of a packet that is segmented.
+	size_t headerLength() const {
+		return checksumStart() + _transportHeaderLength;
+	}
+
+private:
+	struct Segment {
+		char *buffer;
+		size_t offset;
+		size_t length;
+	};
+
+	const Segment &_segmentAt(size_t n) const {
+		return n ? _tail[n - 1] : _head;
+	}
+
+	// Most packets fit into a single segment; only the remaining segments are stored in the vector.
+	Segment _head;
+	std::vector<Segment> _tail;
+
+	// Offload requests. _checksumTail is the number of bytes that are checksummed;
+	// it is zero if no checksum offload was requested.
+	size_t _checksumTail;
+	size_t _checksumField;
+	size_t _segmentSize;
+	size_t _transportHeaderLength;
+};
+
+// Offloads that a NetDevice can perform on behalf of the network stack.
+enum {
+	// The device computes TCP and UDP checksums (see PacketBuffer::requestChecksum()).
+	kNetOffloadTxChecksum = 1,
+	// The device performs TCP segmentation (see PacketBuffer::requestSegmentation()).
+	kNetOffloadTso = 2
+};
+
+// Flags that drivers pass to onReceive().
+enum {
+	// The device already verified the TCP or UDP checksum.
+	kReceiveChecksumValid = 1
+};
+
 struct NetDevice {
-	virtual void sendPacket(std::string packet) = 0;
+	// Transmits a single Ethernet frame (without FCS).
+	virtual void sendPacket(PacketBuffer packet) = 0;
+
+	// Returns a mask of kNetOffload* bits.
+	virtual unsigned int offloads() {
+		return 0;
+	}
+
+	// Largest IPv4 packet that the device can transmit.
+	virtual size_t mtu() {
+		return 1500;
+	}
 };
 
-extern NetDevice *globalDevice;
+// A NetDevice that is implemented entirely in user space. Frames that are transmitted
+// on one device are received by its peer, i.e. a pair of devices behaves like a veth pair
+// and a device that is its own peer behaves like a loopback device.
+// This allows running (and benchmarking) the stack without hardware.
+struct VirtualDevice : NetDevice {
+	using ReceiveHandler = std::function<void(void *, size_t, unsigned int)>;
+
+	struct Statistics {
+		uint64_t txFrames = 0;
+		uint64_t txBytes = 0;
+		uint64_t rxFrames = 0;
+		uint64_t rxBytes = 0;
+		// Frames that were larger than the MTU.
+		uint64_t oversized = 0;
+		// Frames that were dropped by loss injection.
+		uint64_t lost = 0;
+	};
+
+	VirtualDevice(size_t mtu = 1500);
+
+	VirtualDevice(const VirtualDevice &) = delete;
+
+	VirtualDevice &operator= (const VirtualDevice &) = delete;
+
+	// Connects two devices. A device that is never connected acts as a loopback device.
+	static void connect(VirtualDevice *a, VirtualDevice *b);
+
+	// By default, received frames are passed to onReceive().
+	void setReceiveHandler(ReceiveHandler handler) {
+		_handler = std::move(handler);
+	}
 
-void onReceive(void *buffer, size_t length);
+	// Drops transmitted frames with the given probability. The seed makes runs reproducible.
+	void setLossRate(double rate, uint32_t seed = 1);
 
-void testDevice(helx::EventHub &event_hub, NetDevice &device, uint8_t mac_octets[6]);
+	// Frames never leave the process, hence checksums can be omitted (like on Linux' lo).
+	void setChecksumOffload(bool enable) {
+		_offloads = enable ? kNetOffloadTxChecksum : 0;
+	}
+
+	const Statistics &statistics() const {
+		return _stats;
+	}
+
+	void sendPacket(PacketBuffer packet) override;
+
+	unsigned int offloads() override {
+		return _offloads;
+	}
+
+	size_t mtu() override {
+		return _mtu;
+	}
+
+private:
+	// Delivers frames asynchronously; this avoids re-entering the stack from sendPacket().
+	cofiber::no_future _processReceive();
+
+	VirtualDevice *_peer;
+	size_t _mtu;
+	unsigned int _offloads;
+	ReceiveHandler _handler;
+
+	double _lossRate;
+	std::minstd_rand _random;
+
+	std::deque<PacketBuffer> _receiveQueue;
+	async::doorbell _receiveDoorbell;
+	// Frames that consist of multiple segments are linearized into this buffer.
+	std::vector<char> _linearBuffer;
+
+	Statistics _stats;
+};
+
+// Passes an Ethernet frame that was received by the device to the network stack.
+// flags is a mask of kReceive* bits.
+void onReceive(void *buffer, size_t length, unsigned int flags = 0);
+
+// Configures the network stack on top of the device (via DHCP) and
+// exposes its AF_INET sockets through an mbus object.
+cofiber::no_future runDevice(NetDevice *device, uint8_t mac_octets[6]);
+
+// Static IPv4 configuration. All addresses are given as octets in network order.
+struct Ip4Config {
+	uint8_t address[4];
+	uint8_t subnetMask[4];
+	// May be zero if there is no router.
+	uint8_t router[4];
+};
+
+// Same as above but uses a static configuration instead of DHCP.
+cofiber::no_future runDevice(NetDevice *device, uint8_t mac_octets[6], Ip4Config config);
 
 } // namespace libnet
 
 #endif // LIBNET_HPP
-
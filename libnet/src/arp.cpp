@@ -1,87 +1,103 @@
 
+#include <unordered_map>
+
+#include <helix/ipc.hpp>
 #include <libnet.hpp>
 #include "arp.hpp"
 
 namespace libnet {
 
-std::unordered_map<Ip4Address, ArpEntry *> arpCache;
+namespace {
+	// Resend requests for unresolved addresses at most once per second.
+	constexpr uint64_t requestInterval = 1'000'000'000;
 
-ArpEntry::ArpEntry()
-: finished(false) { }
+	// Drop packets instead of queueing them indefinitely; TCP retransmits them anyway.
+	constexpr size_t maxPending = 16;
 
-void arpLookup(Ip4Address address, frigg::CallbackPtr<void(MacAddress)> callback) {	
-	auto it = arpCache.find(address);
-	if(it != arpCache.end()) {
-		if(it->second->finished) {
-			callback(it->second->result);
-		}else{
-			it->second->callbacks.push_back(callback);
-		}
-	}else{
-		auto entry = new ArpEntry;
-		entry->address = address;
-		entry->callbacks.push_back(callback);
-		arpCache.insert({ address, entry });
-	
-		std::string packet;
-		packet.resize(sizeof(ArpPacket));
+	std::unordered_map<Ip4Address, ArpEntry> arpCache;
 
+	void sendArpPacket(int operation, MacAddress dest_hw, Ip4Address dest_proto) {
 		ArpPacket arp_packet;
 		arp_packet.hwType = hostToNet<uint16_t>(1);
-		arp_packet.protoType = hostToNet<uint16_t>(0x800);
+		arp_packet.protoType = hostToNet<uint16_t>(kEtherIp4);
 		arp_packet.hwLength = 6;
 		arp_packet.protoLength = 4;
-		arp_packet.operation = hostToNet<uint16_t>(1);
+		arp_packet.operation = hostToNet<uint16_t>(operation);
 		arp_packet.senderHw = localMac;
 		arp_packet.senderProto = localIp;
-		arp_packet.targetHw = MacAddress::broadcast();
-		arp_packet.targetProto = address;
+		arp_packet.targetHw = (operation == kArpRequest) ? MacAddress() : dest_hw;
+		arp_packet.targetProto = dest_proto;
+
+		PacketBuffer packet{sizeof(ArpPacket)};
+		packet.write(0, &arp_packet, sizeof(ArpPacket));
 
-		memcpy(&packet[0], &arp_packet, sizeof(ArpPacket));
-		
 		EthernetInfo ethernet_info;
 		ethernet_info.sourceMac = localMac;
-		ethernet_info.destMac = MacAddress::broadcast();
+		ethernet_info.destMac = dest_hw;
 		ethernet_info.etherType = kEtherArp;
+		sendEthernetPacket(ethernet_info, std::move(packet));
+	}
 
-		sendEthernetPacket(*globalDevice, ethernet_info, packet);
+	void sendToHw(MacAddress address, PacketBuffer packet) {
+		EthernetInfo ethernet_info;
+		ethernet_info.sourceMac = localMac;
+		ethernet_info.destMac = address;
+		ethernet_info.etherType = kEtherIp4;
+		sendEthernetPacket(ethernet_info, std::move(packet));
 	}
 }
 
+ArpEntry::ArpEntry()
+: finished(false), lastRequest(0) { }
+
+void arpSend(Ip4Address address, PacketBuffer packet) {
+	auto &entry = arpCache[address];
+	if(entry.finished) {
+		sendToHw(entry.result, std::move(packet));
+		return;
+	}
+
+	if(entry.pending.size() < maxPending)
+		entry.pending.push_back(std::move(packet));
+
+	uint64_t now;
+	HEL_CHECK(helGetClock(&now));
+	if(entry.lastRequest && now - entry.lastRequest < requestInterval)
+		return;
+	entry.lastRequest = now;
+	sendArpPacket(kArpRequest, MacAddress::broadcast(), address);
+}
+
 void receiveArpPacket(void *buffer, size_t length) {
-	printf("    sizeof(ArpPacket): %lu\n", length);
-	if(length != sizeof(ArpPacket)) {
-		printf("    Length is not the actual ArpPacket length!\n");
-// 		return;
+	if(length < sizeof(ArpPacket)) {
+		printf("    Arp: Packet is too short!\n");
+		return;
 	}
-	
+
 	auto arp_packet = (ArpPacket *)buffer;
-	
-	printf("    hwType: %i, protoType: %i, hwLength: %i, protoLength: %i, operation: %i \n",
-			netToHost<uint16_t>(arp_packet->hwType), netToHost<uint16_t>(arp_packet->protoType),
-			arp_packet->hwLength, arp_packet->protoLength, netToHost<uint16_t>(arp_packet->operation));
-
-	printf("    senderMac: %d:%d:%d:%d:%d:%d\n", arp_packet->senderHw.octets[0],
-			arp_packet->senderHw.octets[1], arp_packet->senderHw.octets[2],
-			arp_packet->senderHw.octets[3], arp_packet->senderHw.octets[4],
-			arp_packet->senderHw.octets[5]);
-	printf("    targetMac: %d:%d:%d:%d:%d:%d\n", arp_packet->targetHw.octets[0],
-			arp_packet->targetHw.octets[1], arp_packet->targetHw.octets[2],
-			arp_packet->targetHw.octets[3], arp_packet->targetHw.octets[4],
-			arp_packet->targetHw.octets[5]);		
-	
-	
-	auto entry_it = arpCache.find(arp_packet->senderProto);
-	if(entry_it != arpCache.end()) {
-		ArpEntry *entry = entry_it->second;
-		entry->finished = true;
-		entry->result = arp_packet->targetHw;
-		for(auto it = entry->callbacks.begin(); it != entry->callbacks.end(); ++it)
-			(*it)(arp_packet->senderHw);
+	if(netToHost<uint16_t>(arp_packet->hwType) != 1
+			|| netToHost<uint16_t>(arp_packet->protoType) != kEtherIp4
+			|| arp_packet->hwLength != 6 || arp_packet->protoLength != 4)
+		return;
+
+	// As recommended by RFC 826, update existing entries before looking at the operation.
+	// Only insert new entries for hosts that talk to us.
+	auto for_us = localIp != Ip4Address() && arp_packet->targetProto == localIp;
+	auto it = arpCache.find(arp_packet->senderProto);
+	if(it == arpCache.end() && for_us)
+		it = arpCache.insert({arp_packet->senderProto, ArpEntry{}}).first;
+
+	if(it != arpCache.end()) {
+		auto &entry = it->second;
+		entry.result = arp_packet->senderHw;
+		entry.finished = true;
+		for(auto &packet : entry.pending)
+			sendToHw(entry.result, std::move(packet));
+		entry.pending.clear();
 	}
 
-	//tcpSocket.connect();
+	if(for_us && netToHost<uint16_t>(arp_packet->operation) == kArpRequest)
+		sendArpPacket(kArpReply, arp_packet->senderHw, arp_packet->senderProto);
 }
 
 } // namespace libnet
-
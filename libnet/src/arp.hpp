@@ -4,15 +4,18 @@
 
 #include <stdio.h>
 #include <string>
-#include <unordered_map>
 #include <vector>
-#include <frigg/callback.hpp>
 
 #include "ethernet.hpp"
 #include "ip4.hpp"
 
 namespace libnet {
 
+enum {
+	kArpRequest = 1,
+	kArpReply = 2
+};
+
 struct ArpPacket {
 	uint16_t hwType;
 	uint16_t protoType;
@@ -23,22 +26,27 @@ struct ArpPacket {
 	MacAddress targetHw;
 	Ip4Address targetProto;
 };
+static_assert(sizeof(ArpPacket) == 28, "Bad sizeof(ArpPacket)");
 
 struct ArpEntry {
 	ArpEntry();
 
-	Ip4Address address;
 	MacAddress result;
 	bool finished;
 
-	std::vector<frigg::CallbackPtr<void(MacAddress)>> callbacks;
+	// Time (in nanoseconds) of the last request for this address.
+	uint64_t lastRequest;
+
+	// IPv4 packets that wait for the address to be resolved.
+	std::vector<PacketBuffer> pending;
 };
 
-void arpLookup(Ip4Address address, frigg::CallbackPtr<void(MacAddress)> callback);
+// Sends an IPv4 packet to a host on the local network.
+// Packets to unresolved addresses are queued until an ARP reply arrives.
+void arpSend(Ip4Address address, PacketBuffer packet);
 
 void receiveArpPacket(void *buffer, size_t length);
 
 } // namespace libnet
 
 #endif // LIBNET_ARP_HPP
-
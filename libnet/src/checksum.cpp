@@ -0,0 +1,239 @@
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "checksum.hpp"
+
+namespace libnet {
+
+namespace {
+	using AccumulateFunction = uint64_t (*)(const void *, size_t, uint64_t);
+	using CopyFunction = uint64_t (*)(void *, const void *, size_t, uint64_t);
+
+	// One's complement addition: the carry wraps around.
+	uint64_t addCarry(uint64_t sum, uint64_t value) {
+		sum += value;
+		return sum + (sum < value);
+	}
+
+	// --------------------------------------------------------------------
+	// Scalar kernels.
+	// --------------------------------------------------------------------
+
+	// 2^32 is congruent to 1 modulo 2^16 - 1; hence we can sum 32-bit words.
+	// The 64-bit accumulator cannot overflow for any buffer that is shorter than 16 GiB.
+
+	uint64_t scalarAccumulate(const void *buffer, size_t size, uint64_t sum) {
+		auto p = static_cast<const unsigned char *>(buffer);
+		uint64_t acc = 0;
+		while(size >= 4) {
+			uint32_t word;
+			memcpy(&word, p, 4);
+			acc += word;
+			p += 4;
+			size -= 4;
+		}
+		if(size >= 2) {
+			uint16_t word;
+			memcpy(&word, p, 2);
+			acc += word;
+			p += 2;
+			size -= 2;
+		}
+		// An odd trailing byte is padded with zero on the right.
+		if(size)
+			acc += *p;
+		return addCarry(sum, acc);
+	}
+
+	uint64_t scalarCopy(void *dest, const void *src, size_t size, uint64_t sum) {
+		auto d = static_cast<unsigned char *>(dest);
+		auto s = static_cast<const unsigned char *>(src);
+		uint64_t acc = 0;
+		while(size >= 4) {
+			uint32_t word;
+			memcpy(&word, s, 4);
+			memcpy(d, &word, 4);
+			acc += word;
+			d += 4;
+			s += 4;
+			size -= 4;
+		}
+		memcpy(d, s, size);
+		return scalarAccumulate(s, size, addCarry(sum, acc));
+	}
+
+#if defined(__x86_64__)
+	// --------------------------------------------------------------------
+	// SSE2 kernels. SSE2 is part of the x86_64 baseline.
+	// --------------------------------------------------------------------
+
+	// Zero-extends the 32-bit lanes and adds them to the 64-bit lanes of acc.
+	inline __m128i addWords128(__m128i acc, __m128i v) {
+		auto zero = _mm_setzero_si128();
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+
+	inline uint64_t reduce128(__m128i acc) {
+		uint64_t lanes[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+		return addCarry(lanes[0], lanes[1]);
+	}
+
+	uint64_t sse2Accumulate(const void *buffer, size_t size, uint64_t sum) {
+		auto p = static_cast<const unsigned char *>(buffer);
+		auto acc0 = _mm_setzero_si128();
+		auto acc1 = _mm_setzero_si128();
+		while(size >= 32) {
+			acc0 = addWords128(acc0, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+			acc1 = addWords128(acc1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16)));
+			p += 32;
+			size -= 32;
+		}
+		if(size >= 16) {
+			acc0 = addWords128(acc0, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+			p += 16;
+			size -= 16;
+		}
+		sum = addCarry(sum, reduce128(_mm_add_epi64(acc0, acc1)));
+		return scalarAccumulate(p, size, sum);
+	}
+
+	uint64_t sse2Copy(void *dest, const void *src, size_t size, uint64_t sum) {
+		auto d = static_cast<unsigned char *>(dest);
+		auto s = static_cast<const unsigned char *>(src);
+		auto acc = _mm_setzero_si128();
+		while(size >= 16) {
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(d), v);
+			acc = addWords128(acc, v);
+			d += 16;
+			s += 16;
+			size -= 16;
+		}
+		sum = addCarry(sum, reduce128(acc));
+		return scalarCopy(d, s, size, sum);
+	}
+
+	// --------------------------------------------------------------------
+	// AVX2 kernels. Only used if both the CPU and the kernel support AVX.
+	// --------------------------------------------------------------------
+
+	__attribute__((target("avx2")))
+	inline __m256i addWords256(__m256i acc, __m256i v) {
+		auto zero = _mm256_setzero_si256();
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+
+	__attribute__((target("avx2")))
+	inline uint64_t reduce256(__m256i acc) {
+		uint64_t lanes[4];
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+		return addCarry(addCarry(lanes[0], lanes[1]), addCarry(lanes[2], lanes[3]));
+	}
+
+	__attribute__((target("avx2")))
+	uint64_t avx2Accumulate(const void *buffer, size_t size, uint64_t sum) {
+		auto p = static_cast<const unsigned char *>(buffer);
+		auto acc0 = _mm256_setzero_si256();
+		auto acc1 = _mm256_setzero_si256();
+		while(size >= 64) {
+			acc0 = addWords256(acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+			acc1 = addWords256(acc1, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32)));
+			p += 64;
+			size -= 64;
+		}
+		sum = addCarry(sum, reduce256(_mm256_add_epi64(acc0, acc1)));
+		// The SSE2 kernel uses legacy encodings. GCC omits vzeroupper on tail calls,
+		// and mixing those with dirty upper YMM state is very slow.
+		_mm256_zeroupper();
+		return sse2Accumulate(p, size, sum);
+	}
+
+	__attribute__((target("avx2")))
+	uint64_t avx2Copy(void *dest, const void *src, size_t size, uint64_t sum) {
+		auto d = static_cast<unsigned char *>(dest);
+		auto s = static_cast<const unsigned char *>(src);
+		auto acc = _mm256_setzero_si256();
+		while(size >= 32) {
+			auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(d), v);
+			acc = addWords256(acc, v);
+			d += 32;
+			s += 32;
+			size -= 32;
+		}
+		sum = addCarry(sum, reduce256(acc));
+		_mm256_zeroupper();
+		return sse2Copy(d, s, size, sum);
+	}
+
+	bool haveAvx2() {
+		unsigned int a, b, c, d;
+		if(!__get_cpuid(1, &a, &b, &c, &d))
+			return false;
+		if(!(c & bit_AVX) || !(c & bit_OSXSAVE))
+			return false;
+
+		// The kernel has to save the YMM state on context switches (XCR0 bits 1 and 2).
+		uint32_t xcr0_low, xcr0_high;
+		asm volatile ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+		if((xcr0_low & 6) != 6)
+			return false;
+
+		if(__get_cpuid_max(0, nullptr) < 7)
+			return false;
+		__cpuid_count(7, 0, a, b, c, d);
+		return b & bit_AVX2;
+	}
+#endif // defined(__x86_64__)
+
+	struct Kernels {
+		Kernels() {
+#if defined(__x86_64__)
+			if(haveAvx2()) {
+				accumulate = &avx2Accumulate;
+				copy = &avx2Copy;
+			}else{
+				accumulate = &sse2Accumulate;
+				copy = &sse2Copy;
+			}
+#else
+			accumulate = &scalarAccumulate;
+			copy = &scalarCopy;
+#endif
+		}
+
+		AccumulateFunction accumulate;
+		CopyFunction copy;
+	};
+
+	const Kernels &kernels() {
+		static Kernels instance;
+		return instance;
+	}
+}
+
+uint64_t checksumAccumulate(const void *buffer, size_t size, uint64_t sum) {
+	return kernels().accumulate(buffer, size, sum);
+}
+
+uint64_t checksumCopy(void *dest, const void *src, size_t size, uint64_t sum) {
+	return kernels().copy(dest, src, size, sum);
+}
+
+uint16_t checksumFold(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+} // namespace libnet
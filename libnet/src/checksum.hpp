@@ -0,0 +1,96 @@
+
+#ifndef LIBNET_CHECKSUM_HPP
+#define LIBNET_CHECKSUM_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libnet.hpp>
+
+namespace libnet {
+
+// The kernels below compute the one's complement sum of RFC 1071 over 16-bit words
+// in memory byte order; the sum is kept in a 64-bit accumulator and folded at the end.
+// The fastest kernel (AVX2, SSE2 or scalar) is selected at runtime.
+
+// Adds the bytes to sum. An odd trailing byte is padded with zero.
+uint64_t checksumAccumulate(const void *buffer, size_t size, uint64_t sum);
+
+// Same as checksumAccumulate() but also copies the bytes to dest in the same pass.
+uint64_t checksumCopy(void *dest, const void *src, size_t size, uint64_t sum);
+
+// Folds a 64-bit accumulator into 16 bits (still in memory byte order).
+uint16_t checksumFold(uint64_t sum);
+
+struct Checksum {
+	// Incrementally updates a checksum (in host byte order) after a 16-bit field
+	// of the covered data changed from old_value to new_value (RFC 1624, eqn. 3).
+	static uint16_t adjust(uint16_t checksum, uint16_t old_value, uint16_t new_value) {
+		uint32_t sum = uint16_t(~checksum) + uint16_t(~old_value) + uint32_t(new_value);
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		return ~sum;
+	}
+
+	Checksum()
+	: _sum{0}, _odd{false} { }
+
+	// Adds the bytes to the sum. Consecutive calls checksum the concatenation
+	// of all buffers, even if some of them have an odd length.
+	void update(const void *buffer, size_t size) {
+		_add(checksumAccumulate(buffer, size, 0));
+		_odd ^= size & 1;
+	}
+
+	// Copies the bytes to dest and adds them to the sum in a single pass.
+	void copyAndUpdate(void *dest, const void *src, size_t size) {
+		_add(checksumCopy(dest, src, size, 0));
+		_odd ^= size & 1;
+	}
+
+	// Adds a 16-bit word that is given in host byte order.
+	void update(uint16_t value) {
+		assert(!_odd);
+		_add(hostToNet<uint16_t>(value));
+	}
+
+	// Adds the sum of data that directly follows the data that was already summed.
+	void update(const Checksum &other) {
+		_add(other._sum);
+		_odd ^= other._odd;
+	}
+
+	void update(const PacketBuffer &packet) {
+		for(size_t n = 0; n < packet.numSegments(); n++) {
+			auto view = packet.segment(n);
+			update(view.data(), view.size());
+		}
+	}
+
+	// Returns the folded sum in host byte order.
+	uint16_t fold() const {
+		return netToHost<uint16_t>(checksumFold(_sum));
+	}
+
+	// Returns the one's complement of the sum. Verifying a buffer that
+	// includes a correct checksum results in zero.
+	uint16_t finish() const {
+		return ~fold();
+	}
+
+private:
+	void _add(uint64_t partial) {
+		// Data that starts at an odd offset contributes with swapped bytes (RFC 1071, 2.B).
+		if(_odd)
+			partial = __builtin_bswap16(checksumFold(partial));
+		_sum += partial;
+		if(_sum < partial)
+			_sum++;
+	}
+
+	uint64_t _sum;
+	bool _odd;
+};
+
+} // namespace libnet
+
+#endif // LIBNET_CHECKSUM_HPP
@@ -0,0 +1,202 @@
+
+#include <async/jump.hpp>
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
+#include <libnet.hpp>
+#include "dhcp.hpp"
+#include "udp.hpp"
+
+namespace libnet {
+
+namespace {
+	uint32_t dhcpTransaction = 0xD61FF088; // some random integer
+	DhcpState dhcpState = kDefaultState;
+
+	// Incremented on every state transition; used to detect lost messages.
+	uint64_t dhcpProgress = 0;
+
+	Ip4Address offeredIp;
+	Ip4Address offeringServer;
+
+	async::jump dhcpAcked;
+
+	void sendDhcpMessage(int type) {
+		std::string message;
+		message.resize(sizeof(DhcpHeader));
+
+		DhcpHeader dhcp_header;
+		dhcp_header.op = 1;
+		dhcp_header.htype = 1;
+		dhcp_header.hlen = 6;
+		dhcp_header.hops = 0;
+		dhcp_header.transaction = hostToNet<uint32_t>(dhcpTransaction);
+		dhcp_header.secondsSinceBoot = 0;
+		dhcp_header.flags = hostToNet<uint16_t>(kDhcpBroadcast);
+		dhcp_header.clientIp = Ip4Address();
+		dhcp_header.assignedIp = Ip4Address();
+		dhcp_header.serverIp = Ip4Address();
+		dhcp_header.gatewayIp = Ip4Address();
+		memset(dhcp_header.clientHardware, 0, 16);
+		memcpy(dhcp_header.clientHardware, localMac.octets, 6);
+		memset(dhcp_header.serverHost, 0, 64);
+		memset(dhcp_header.file, 0, 128);
+		dhcp_header.magic = hostToNet<uint32_t>(kDhcpMagic);
+		memcpy(&message[0], &dhcp_header, sizeof(DhcpHeader));
+
+		message += char(kDhcpMessageType);
+		message += char(1);
+		message += char(type);
+		if(type == kTypeRequest) {
+			message += char(kDhcpServer);
+			message += char(4);
+			message.append(reinterpret_cast<char *>(offeringServer.octets), 4);
+			message += char(kDhcpRequestedIp);
+			message += char(4);
+			message.append(reinterpret_cast<char *>(offeredIp.octets), 4);
+		}
+		message += char(kBootpEnd);
+
+		PacketBuffer packet{message.size()};
+		packet.write(0, message.data(), message.size());
+
+		// We do not have an address yet, hence all messages are broadcast.
+		Ip4Info ip_info;
+		ip_info.sourceIp = Ip4Address();
+		ip_info.destIp = Ip4Address::broadcast();
+		ip_info.protocol = kUdpProtocol;
+
+		UdpInfo udp_info;
+		udp_info.sourcePort = kDhcpClientPort;
+		udp_info.destPort = kDhcpServerPort;
+
+		sendUdpPacket(ip_info, udp_info, std::move(packet));
+	}
+
+	void sendCurrentMessage() {
+		if(dhcpState == kDiscoverySent) {
+			sendDhcpMessage(kTypeDiscover);
+		}else{
+			assert(dhcpState == kRequestSent);
+			sendDhcpMessage(kTypeRequest);
+		}
+	}
+
+	// Retransmits the current message with exponential backoff until the state changes.
+	COFIBER_ROUTINE(cofiber::no_future, retransmitLater(uint64_t progress, uint64_t timeout),
+			([=] {
+		uint64_t tick;
+		HEL_CHECK(helGetClock(&tick));
+
+		helix::AwaitClock await_clock;
+		auto &&submit = helix::submitAwaitClock(&await_clock, tick + timeout,
+				helix::Dispatcher::global());
+		COFIBER_AWAIT submit.async_wait();
+		HEL_CHECK(await_clock.error());
+
+		if(dhcpProgress != progress || dhcpState == kAckReceived)
+			COFIBER_RETURN();
+
+		printf("libnet: Retransmitting DHCP message\n");
+		sendCurrentMessage();
+		retransmitLater(progress, std::min(timeout * 2, uint64_t(64'000'000'000)));
+	}))
+
+	void enterState(DhcpState state) {
+		dhcpState = state;
+		dhcpProgress++;
+		if(state == kAckReceived)
+			return;
+		sendCurrentMessage();
+		retransmitLater(dhcpProgress, 4'000'000'000);
+	}
+}
+
+COFIBER_ROUTINE(async::result<void>, configureDhcp(), ([=] {
+	enterState(kDiscoverySent);
+	COFIBER_AWAIT dhcpAcked.async_wait();
+}))
+
+void receiveDhcpPacket(Ip4Info network_info, void *buffer, size_t length) {
+	if(length < sizeof(DhcpHeader)) {
+		printf("libnet: DHCP packet is too short!\n");
+		return;
+	}
+
+	auto dhcp_header = (DhcpHeader *)buffer;
+	if(dhcp_header->op != 2
+			|| netToHost<uint32_t>(dhcp_header->transaction) != dhcpTransaction
+			|| netToHost<uint32_t>(dhcp_header->magic) != kDhcpMagic)
+		return;
+
+	int dhcp_type = 0;
+	Ip4Address dhcp_server;
+	Ip4Address subnet;
+	Ip4Address router;
+	Ip4Address dns;
+
+	size_t offset = 0;
+	auto options = (uint8_t *)buffer + sizeof(DhcpHeader);
+	size_t options_length = length - sizeof(DhcpHeader);
+	while(offset < options_length) {
+		uint8_t tag = options[offset];
+		if(tag == kBootpNull) {
+			offset++;
+			continue;
+		}else if(tag == kBootpEnd) {
+			break;
+		}
+
+		if(offset + 2 > options_length || offset + 2 + options[offset + 1] > options_length) {
+			printf("libnet: DHCP option exceeds packet!\n");
+			return;
+		}
+		uint8_t opt_size = options[offset + 1];
+		uint8_t *opt_data = &options[offset + 2];
+
+		// Routers and DNS servers may be lists; we use the first entry.
+		auto address = [&] (Ip4Address &out) {
+			if(opt_size >= 4)
+				out = Ip4Address(opt_data[0], opt_data[1], opt_data[2], opt_data[3]);
+		};
+
+		if(tag == kBootpSubnet) {
+			address(subnet);
+		}else if(tag == kBootpRouters) {
+			address(router);
+		}else if(tag == kBootpDns) {
+			address(dns);
+		}else if(tag == kDhcpMessageType) {
+			if(opt_size == 1)
+				dhcp_type = *opt_data;
+		}else if(tag == kDhcpServer) {
+			address(dhcp_server);
+		}
+
+		offset += 2 + opt_size;
+	}
+
+	if(dhcpState == kDiscoverySent && dhcp_type == kTypeOffer) {
+		offeredIp = dhcp_header->assignedIp;
+		offeringServer = dhcp_server;
+		enterState(kRequestSent);
+	}else if(dhcpState == kRequestSent && dhcp_type == kTypeAck) {
+		if(dhcp_server != offeringServer)
+			return;
+
+		localIp = dhcp_header->assignedIp;
+		subnetMask = subnet;
+		routerIp = router;
+		dnsIp = dns;
+		printf("libnet: Configured address %d.%d.%d.%d, router %d.%d.%d.%d\n",
+				localIp.octets[0], localIp.octets[1], localIp.octets[2], localIp.octets[3],
+				routerIp.octets[0], routerIp.octets[1], routerIp.octets[2], routerIp.octets[3]);
+
+		enterState(kAckReceived);
+		dhcpAcked.trigger();
+	}else if(dhcpState == kRequestSent && dhcp_type == kTypeNak) {
+		printf("libnet: DHCP request was rejected, restarting discovery\n");
+		enterState(kDiscoverySent);
+	}
+}
+
+} // namespace libnet
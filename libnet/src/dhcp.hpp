@@ -1,14 +1,21 @@
 
-#ifndef LIBNET_USERNET_HPP
-#define LIBNET_USERNET_HPP
+#ifndef LIBNET_DHCP_HPP
+#define LIBNET_DHCP_HPP
 
 #include <stdio.h>
 #include <string>
+
+#include <async/result.hpp>
 #include "ethernet.hpp"
 #include "ip4.hpp"
 
 namespace libnet {
 
+enum {
+	kDhcpServerPort = 67,
+	kDhcpClientPort = 68
+};
+
 enum {
 	kBootpNull = 0,
 	kBootpEnd = 255,
@@ -67,20 +74,12 @@ struct DhcpHeader {
 	uint32_t magic; // move this out of DhcpHeader
 };
 
-extern DhcpState dhcpState;
-extern uint32_t dhcpTransaction;
-
-void receivePacket(EthernetInfo link_info, Ip4Info network_info, void *buffer, size_t length);
-
-void receiveDnsPacket(void *buffer, size_t length);
-
-void sendDnsRequest();
-
-void sendDhcpDiscover(NetDevice &device);
+// Obtains an address lease. Completes once the server acknowledged the lease.
+async::result<void> configureDhcp();
 
-std::string readDnsName(void *packet, uint8_t *&it);
+void receiveDhcpPacket(Ip4Info network_info, void *buffer, size_t length);
 
 } // namespace libnet
 
-#endif // LIBNET_USERNET_HPP
+#endif // LIBNET_DHCP_HPP
 
@@ -1,8 +0,0 @@
-
-#include <libnet.hpp>
-#include "dns.hpp"
-
-namespace libnet {
-
-} // namespace libnet
-
@@ -3,6 +3,7 @@
 #define LIBNET_ETHERNET_HPP
 
 #include <string>
+#include <libnet.hpp>
 
 namespace libnet {
 
@@ -18,14 +19,14 @@ struct MacAddress {
 
 	MacAddress() : octets{ 0, 0, 0, 0, 0, 0 } { }
 
-	MacAddress(uint8_t octet0, uint8_t octet1, uint8_t octet2, 
+	MacAddress(uint8_t octet0, uint8_t octet1, uint8_t octet2,
 			uint8_t octet3, uint8_t octet4, uint8_t octet5)
 	: octets{ octet0, octet1, octet2, octet3, octet4, octet5 } { }
 
-	bool operator== (const MacAddress &other) {
+	bool operator== (const MacAddress &other) const {
 		return memcmp(octets, other.octets, 6) == 0;
 	}
-	bool operator!= (const MacAddress &other) {
+	bool operator!= (const MacAddress &other) const {
 		return !(*this == other);
 	}
 
@@ -43,15 +44,16 @@ struct EthernetHeader {
 	MacAddress sourceAddress;
 	uint16_t etherType;
 };
+static_assert(sizeof(EthernetHeader) == 14, "Bad sizeof(EthernetHeader)");
 
+extern NetDevice *globalDevice;
 extern MacAddress localMac;
-extern MacAddress routerMac;
 
-void sendEthernetPacket(NetDevice &device, EthernetInfo link_info, std::string payload);
+void sendEthernetPacket(EthernetInfo link_info, PacketBuffer packet);
 
-void receiveEthernetPacket(void *buffer, size_t length);
+// checksum_valid is set if the device already verified the transport checksum.
+void receiveEthernetPacket(void *buffer, size_t length, bool checksum_valid);
 
 } // namespace libnet
 
 #endif // LIBNET_ETHERNET_HPP
-
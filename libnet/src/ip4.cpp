@@ -1,19 +1,39 @@
 
 #include <libnet.hpp>
+#include "arp.hpp"
+#include "dhcp.hpp"
 #include "ip4.hpp"
 #include "tcp.hpp"
 #include "udp.hpp"
 
 namespace libnet {
 
-void sendIp4Packet(NetDevice &device, EthernetInfo link_info,
-		Ip4Info network_info, std::string payload) {
+namespace {
+	uint16_t nextIdentification = 1;
+
+	bool isLocalDestination(Ip4Address address) {
+		if(address == Ip4Address::broadcast())
+			return true;
+		// Before DHCP completes, we have to accept packets to any address.
+		if(localIp == Ip4Address())
+			return true;
+		if(address == localIp)
+			return true;
+		// Subnet-directed broadcasts.
+		auto mask = subnetMask.toWord();
+		return mask && (address.toWord() & ~mask) == ~mask
+				&& (address.toWord() & mask) == (localIp.toWord() & mask);
+	}
+}
+
+void sendIp4Packet(Ip4Info network_info, PacketBuffer packet) {
 	Ip4Header header;
 	header.version_headerLength = (kIp4Version << 4) | (sizeof(Ip4Header) / 4);
 	header.dscp_ecn = 0;
-	header.length = hostToNet<uint16_t>(sizeof(Ip4Header) + payload.length());
-	header.identification = hostToNet<uint16_t>(666);
-	header.flags_offset = 0;
+	header.length = hostToNet<uint16_t>(sizeof(Ip4Header) + packet.size());
+	header.identification = hostToNet<uint16_t>(nextIdentification++);
+	// We do not implement fragmentation; ask routers to send ICMP errors instead.
+	header.flags_offset = hostToNet<uint16_t>(kFlagDF);
 	header.ttl = kTtl;
 	header.protocol = network_info.protocol;
 	header.checksum = 0;
@@ -23,20 +43,32 @@ void sendIp4Packet(NetDevice &device, EthernetInfo link_info,
 	Checksum checksum;
 	checksum.update(&header, sizeof(Ip4Header));
 	header.checksum = hostToNet<uint16_t>(checksum.finish());
-	
-	std::string packet(sizeof(Ip4Header) + payload.length(), 0);
-	memcpy(&packet[0], &header, sizeof(Ip4Header));
-	memcpy(&packet[sizeof(Ip4Header)], payload.data(), payload.length());
 
-	sendEthernetPacket(device, link_info, packet);
+	memcpy(packet.prepend(sizeof(Ip4Header)), &header, sizeof(Ip4Header));
+
+	if(network_info.destIp == Ip4Address::broadcast()) {
+		EthernetInfo link_info;
+		link_info.sourceMac = localMac;
+		link_info.destMac = MacAddress::broadcast();
+		link_info.etherType = kEtherIp4;
+		sendEthernetPacket(link_info, std::move(packet));
+		return;
+	}
+
+	auto mask = subnetMask.toWord();
+	if((network_info.destIp.toWord() & mask) == (localIp.toWord() & mask)) {
+		arpSend(network_info.destIp, std::move(packet));
+	}else{
+		arpSend(routerIp, std::move(packet));
+	}
 }
 
-void receiveIp4Packet(EthernetInfo link_info, void *buffer, size_t length) {
+void receiveIp4Packet(void *buffer, size_t length, bool checksum_valid) {
 	if(length < sizeof(Ip4Header)) {
 		printf("    Ip4: Packet is too short!\n");
 		return;
 	}
-	
+
 	auto ip_header = (Ip4Header *)buffer;
 
 	if((ip_header->version_headerLength >> 4) != kIp4Version) {
@@ -44,15 +76,24 @@ void receiveIp4Packet(EthernetInfo link_info, void *buffer, size_t length) {
 		return;
 	}
 
+	// Ethernet pads short frames; only the total length of the header is relevant.
 	size_t header_length = (ip_header->version_headerLength & 0x0F) * 4;
+	size_t total_length = netToHost<uint16_t>(ip_header->length);
 	if(header_length < sizeof(Ip4Header)) {
 		printf("    Ip4: headerLength is too small!\n");
 		return;
-	}else if(netToHost<uint16_t>(ip_header->length) < header_length) {
+	}else if(total_length < header_length) {
 		printf("    Ip4: totalLength < headerLength!\n");
 		return;
-	}else if(netToHost<uint16_t>(ip_header->length) != length) {
-		printf("    Ip4: totalLength does not match packet length!\n");
+	}else if(total_length > length) {
+		printf("    Ip4: totalLength exceeds packet length!\n");
+		return;
+	}
+
+	Checksum checksum;
+	checksum.update(buffer, header_length);
+	if(checksum.finish()) {
+		printf("    Ip4: Bad header checksum!\n");
 		return;
 	}
 
@@ -60,45 +101,26 @@ void receiveIp4Packet(EthernetInfo link_info, void *buffer, size_t length) {
 	network_info.sourceIp = ip_header->sourceIp;
 	network_info.destIp = ip_header->targetIp;
 	network_info.protocol = ip_header->protocol;
-	
+	network_info.checksumValid = checksum_valid;
+
+	if(!isLocalDestination(network_info.destIp))
+		return;
+
 	void *payload_buffer = (char *)buffer + header_length;
-	size_t payload_length = length - header_length;
-	
-	printf("    Ip4 header. srcIp: %d.%d.%d.%d, destIp: %d.%d.%d.%d, protocol: %d\n",
-			network_info.sourceIp.octets[0], network_info.sourceIp.octets[1],
-			network_info.sourceIp.octets[2], network_info.sourceIp.octets[3],
-			network_info.destIp.octets[0], network_info.destIp.octets[1],
-			network_info.destIp.octets[2], network_info.destIp.octets[3],
-			network_info.protocol);
-	printf("    headerLength: %lu, payloadLength: %lu\n", header_length, payload_length);
-	
+	size_t payload_length = total_length - header_length;
+
 	auto flags = netToHost<uint16_t>(ip_header->flags_offset);
 	auto fragment_offset = flags & kFragmentOffsetMask;
-	
-	assert(!(flags & kFlagReserved));
-	if(fragment_offset != 0) {
-		printf("    Ip4: Non-zero fragment offset %d not implemented!\n", fragment_offset);
-		return;
-	}else if(flags & kFlagMF) {
-		printf("    Ip4: MF flag not implemented\n");
+	if(fragment_offset || (flags & kFlagMF)) {
+		printf("    Ip4: Fragmented packets are not supported!\n");
 		return;
 	}
 
-	printf("    flags:");
-	if(flags & kFlagDF)
-		printf(" DF");
-	if(flags & kFlagMF)
-		printf(" MF");
-	printf("\n");
-
 	if(network_info.protocol == kUdpProtocol) {
-		receiveUdpPacket(link_info, network_info, payload_buffer, payload_length);
+		receiveUdpPacket(network_info, payload_buffer, payload_length);
 	} else if(network_info.protocol == kTcpProtocol) {
-		receiveTcpPacket(payload_buffer, payload_length);
-	} else {
-		printf("    Invalid Ip4 protocol type!\n");
+		receiveTcpPacket(network_info, payload_buffer, payload_length);
 	}
 }
 
 } // namespace libnet
-
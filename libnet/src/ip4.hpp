@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <string>
+#include <libnet.hpp>
+#include "checksum.hpp"
 #include "ethernet.hpp"
 
 namespace libnet {
@@ -43,6 +45,11 @@ struct Ip4Address {
 		return !(*this == other);
 	}
 
+	uint32_t toWord() const {
+		return (uint32_t(octets[0]) << 24) | (uint32_t(octets[1]) << 16)
+				| (uint32_t(octets[2]) << 8) | octets[3];
+	}
+
 	uint8_t octets[4];
 };
 
@@ -50,6 +57,8 @@ struct Ip4Info {
 	Ip4Address sourceIp;
 	Ip4Address destIp;
 	uint8_t protocol;
+	// Only used for incoming packets: the device already verified the transport checksum.
+	bool checksumValid = false;
 };
 
 struct Ip4Header {
@@ -75,50 +84,15 @@ struct PseudoIp4Header {
 };
 static_assert(sizeof(PseudoIp4Header) == 12, "Bad sizeof(PseudoIp4Header)");
 
-struct Checksum {
-	Checksum()
-	: currentSum(0) { }
-
-	void update(const void *buffer, size_t size) {
-		auto bytes = reinterpret_cast<const unsigned char *>(buffer);
-
-		if(size == 0)
-			return;
-
-		size_t i;
-		for(i = 0; i < size - 1; i += 2) {
-			uint16_t high = bytes[i], low = bytes[i + 1];
-			update((high << 8) | low);
-		}
-		if(size % 2)
-			update(bytes[i]);
-	}
-
-	void update(uint16_t value) {
-		currentSum += value;
-	}
-
-	uint16_t finish() {
-		uint32_t result = currentSum;
-		while (result >> 16)
-			result = (result & 0xFFFF) + (result >> 16);
-		assert(result != 0 && result != 0xFFFF); // FIXME: fix this case
-		return ~result;
-	}
-
-private:
-	uint32_t currentSum;
-};
-
 extern Ip4Address localIp;
 extern Ip4Address routerIp;
 extern Ip4Address dnsIp;
 extern Ip4Address subnetMask;
 
-void sendIp4Packet(NetDevice &device, EthernetInfo link_info,
-		Ip4Info network_info, std::string payload);
+// Routes the packet either directly to the destination or via the router.
+void sendIp4Packet(Ip4Info network_info, PacketBuffer packet);
 
-void receiveIp4Packet(EthernetInfo link_info, void *buffer, size_t length);
+void receiveIp4Packet(void *buffer, size_t length, bool checksum_valid);
 
 } // namespace libnet
 
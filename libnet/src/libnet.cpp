@@ -1,49 +1,76 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <fs.pb.h>
+
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
+#include <protocols/mbus/client.hpp>
 #include <libnet.hpp>
-#include "udp.hpp"
-#include "tcp.hpp"
-#include "dns.hpp"
-#include "arp.hpp"
-#include "usernet.hpp"
+#include "dhcp.hpp"
 #include "ethernet.hpp"
+#include "ip4.hpp"
 #include "network.hpp"
 
 namespace libnet {
 
-uint32_t dhcpTransaction = 0xD61FF088; // some random integer
-DhcpState dhcpState = kDefaultState;
-
 NetDevice *globalDevice;
 Ip4Address dnsIp;
 Ip4Address localIp;
 Ip4Address routerIp;
 Ip4Address subnetMask;
 MacAddress localMac;
-MacAddress routerMac;
-TcpSocket tcpSocket;
 
-void receivePacket(EthernetInfo link_info, Ip4Info network_info, void *buffer, size_t length);
+void onReceive(void *buffer, size_t length, unsigned int flags) {
+	receiveEthernetPacket(buffer, length, flags & kReceiveChecksumValid);
+}
+
+namespace {
+	// Creates an mbus object that POSIX uses to create sockets.
+	COFIBER_ROUTINE(async::result<void>, publishStack(), ([] {
+		auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+		mbus::Properties descriptor{
+			{"class", mbus::StringItem{"netserver"}}
+		};
+
+		auto handler = mbus::ObjectHandler{}
+		.withBind([] () -> async::result<helix::UniqueDescriptor> {
+			helix::UniqueLane local_lane, remote_lane;
+			std::tie(local_lane, remote_lane) = helix::createStream();
+			serveStack(std::move(local_lane));
+
+			async::promise<helix::UniqueDescriptor> promise;
+			promise.set_value(std::move(remote_lane));
+			return promise.async_get();
+		});
 
-void deviceReady(void *object) {
-	printf("Network registered!\n");
+		COFIBER_AWAIT root.createObject("netserver", descriptor, std::move(handler));
+		COFIBER_RETURN();
+	}))
 }
 
-void testDevice(helx::EventHub &event_hub, NetDevice &device, uint8_t mac_octets[6]) {
-	globalDevice = &device;
+COFIBER_ROUTINE(cofiber::no_future, runDevice(NetDevice *device, uint8_t mac_octets[6]),
+		([=] {
+	globalDevice = device;
 	memcpy(localMac.octets, mac_octets, 6);
-	
-	//sendDhcpDiscover(device);
-	auto network = new Network(device);
-	auto client = new Client(event_hub, *network);
-	client->init(CALLBACK_STATIC(nullptr, &deviceReady));
-};
-
-void onReceive(void *buffer, size_t length) {
-	receiveEthernetPacket(buffer, length);
-}
 
-} // namespace libnet
+	COFIBER_AWAIT configureDhcp();
+	COFIBER_AWAIT publishStack();
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, runDevice(NetDevice *device, uint8_t mac_octets[6],
+		Ip4Config config), ([=] {
+	globalDevice = device;
+	memcpy(localMac.octets, mac_octets, 6);
 
+	memcpy(localIp.octets, config.address, 4);
+	memcpy(subnetMask.octets, config.subnetMask, 4);
+	memcpy(routerIp.octets, config.router, 4);
+	printf("libnet: Using static address %d.%d.%d.%d\n",
+			localIp.octets[0], localIp.octets[1], localIp.octets[2], localIp.octets[3]);
+
+	COFIBER_AWAIT publishStack();
+}))
+
+} // namespace libnet
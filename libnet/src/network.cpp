@@ -1,213 +1,299 @@
 
 #include <stdio.h>
-#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
-#include <libchain/all.hpp>
-
-#include <fs.pb.h>
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
+#include <protocols/fs/server.hpp>
 #include <libnet.hpp>
-
-#include "udp.hpp"
-#include "tcp.hpp"
-#include "dns.hpp"
-#include "arp.hpp"
-#include "usernet.hpp"
-#include "ethernet.hpp"
 #include "network.hpp"
-
-template<typename... Args>
-frigg::CallbackPtr<void(Args...)> libchainToFrigg(libchain::Callback<void(Args...)> callback) {
-	return CALLBACK_STATIC(callback.implementation(),
-			&libchain::Callback<void(Args...)>::invoke);
-}
+#include "tcp.hpp"
+#include "udp.hpp"
+#include "fs.pb.h"
 
 namespace libnet {
 
-Network::Network(NetDevice &device)
-: device(device) { }
+namespace {
+
+bool parseAddress(const void *addr_ptr, size_t addr_length,
+		Ip4Address &address, uint16_t &port) {
+	if(addr_length < sizeof(struct sockaddr_in))
+		return false;
 
-// --------------------------------------------------------
-// Client
-// --------------------------------------------------------
+	struct sockaddr_in sa;
+	memcpy(&sa, addr_ptr, sizeof(struct sockaddr_in));
+	if(sa.sin_family != AF_INET)
+		return false;
 
-Client::Client(helx::EventHub &event_hub, Network &net)
-: eventHub(event_hub), net(net), objectHandler(*this), mbusConnection(eventHub) {
-	mbusConnection.setObjectHandler(&objectHandler);
+	address = Ip4Address(netToHost<uint32_t>(sa.sin_addr.s_addr));
+	port = netToHost<uint16_t>(sa.sin_port);
+	return true;
 }
 
-void Client::init(frigg::CallbackPtr<void()> callback) {
-	auto closure = new InitClosure(*this, callback);
-	(*closure)();
+size_t formatAddress(Ip4Address address, uint16_t port,
+		void *addr_ptr, size_t max_addr_length) {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(struct sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_port = hostToNet<uint16_t>(port);
+	sa.sin_addr.s_addr = hostToNet<uint32_t>(address.toWord());
+
+	memcpy(addr_ptr, &sa, std::min(sizeof(struct sockaddr_in), max_addr_length));
+	return sizeof(struct sockaddr_in);
+}
+
+template<typename T>
+async::result<T> ready(T value) {
+	async::promise<T> promise;
+	promise.set_value(std::move(value));
+	return promise.async_get();
 }
 
-// --------------------------------------------------------
-// Client::ObjectHandler
-// --------------------------------------------------------
+// ----------------------------------------------------------------------------
+// TCP files.
+// ----------------------------------------------------------------------------
+
+struct TcpFile {
+	static helix::UniqueLane serve(smarter::shared_ptr<TcpFile> file);
 
-Client::ObjectHandler::ObjectHandler(Client &client)
-: client(client) { }
+	TcpFile(std::shared_ptr<TcpSocket> socket)
+	: socket{std::move(socket)} { }
 
-void Client::ObjectHandler::requireIf(bragi_mbus::ObjectId object_id,
-		frigg::CallbackPtr<void(HelHandle)> callback) {
-	helx::Pipe local, remote;
-	helx::Pipe::createFullPipe(local, remote);
-	callback(remote.getHandle());
-	remote.reset();
+	// The socket outlives the file until the connection is shut down.
+	~TcpFile() {
+		socket->close();
+	}
+
+	std::shared_ptr<TcpSocket> socket;
+};
 
-	auto closure = new Connection(client.eventHub, client.net, std::move(local));
-	(*closure)();
+async::result<protocols::fs::ReadResult> tcpRead(void *object, const char *,
+		void *buffer, size_t length) {
+	auto self = static_cast<TcpFile *>(object);
+	return self->socket->read(buffer, length);
 }
 
-// --------------------------------------------------------
-// Client::InitClosure
-// --------------------------------------------------------
+async::result<protocols::fs::Error> tcpWrite(void *object, const char *,
+		const void *buffer, size_t length) {
+	auto self = static_cast<TcpFile *>(object);
+	return self->socket->write(buffer, length);
+}
 
-Client::InitClosure::InitClosure(Client &client, frigg::CallbackPtr<void()> callback)
-: client(client), callback(callback) { }
+async::result<protocols::fs::PollResult> tcpPoll(void *object, uint64_t past_seq,
+		async::cancellation_token cancellation) {
+	auto self = static_cast<TcpFile *>(object);
+	return self->socket->poll(past_seq, cancellation);
+}
 
-void Client::InitClosure::operator() () {
-	client.mbusConnection.connect(CALLBACK_MEMBER(this, &InitClosure::connected));
+async::result<protocols::fs::Error> tcpBind(void *object, const char *,
+		const void *addr_ptr, size_t addr_length) {
+	auto self = static_cast<TcpFile *>(object);
+	Ip4Address address;
+	uint16_t port;
+	if(!parseAddress(addr_ptr, addr_length, address, port))
+		return ready(protocols::fs::Error::illegalArguments);
+	return ready(self->socket->bind(address, port));
 }
 
-void Client::InitClosure::connected() {
-	client.mbusConnection.registerObject("network",
-			CALLBACK_MEMBER(this, &InitClosure::registered));
+async::result<protocols::fs::Error> tcpConnect(void *object, const char *,
+		const void *addr_ptr, size_t addr_length) {
+	auto self = static_cast<TcpFile *>(object);
+	Ip4Address address;
+	uint16_t port;
+	if(!parseAddress(addr_ptr, addr_length, address, port))
+		return ready(protocols::fs::Error::illegalArguments);
+	return self->socket->connect(address, port);
 }
 
-void Client::InitClosure::registered(bragi_mbus::ObjectId object_id) {
-	callback();
+async::result<protocols::fs::Error> tcpListen(void *object) {
+	auto self = static_cast<TcpFile *>(object);
+	return ready(self->socket->listen());
 }
 
-// --------------------------------------------------------
-// Connection
-// --------------------------------------------------------
+COFIBER_ROUTINE(async::result<protocols::fs::AcceptResult>, tcpAccept(void *object), ([=] {
+	auto self = static_cast<TcpFile *>(object);
+	if(self->socket->state() != TcpSocket::kStateListen)
+		COFIBER_RETURN(protocols::fs::Error::illegalArguments);
+
+	auto child = COFIBER_AWAIT self->socket->accept();
+	if(!child)
+		COFIBER_RETURN(protocols::fs::Error::wouldBlock);
+
+	auto file = smarter::make_shared<TcpFile>(std::move(child));
+	COFIBER_RETURN(TcpFile::serve(std::move(file)));
+}))
+
+async::result<size_t> tcpSockname(void *object, void *addr_ptr, size_t max_addr_length) {
+	auto self = static_cast<TcpFile *>(object);
+	auto address = self->socket->localAddress();
+	if(address == Ip4Address())
+		address = localIp;
+	return ready(formatAddress(address, self->socket->localPort(),
+			addr_ptr, max_addr_length));
+}
+
+constexpr protocols::fs::FileOperations tcpOperations = protocols::fs::FileOperations{}
+	.withRead(&tcpRead)
+	.withWrite(&tcpWrite)
+	.withPoll(&tcpPoll)
+	.withBind(&tcpBind)
+	.withConnect(&tcpConnect)
+	.withListen(&tcpListen)
+	.withAccept(&tcpAccept)
+	.withSockname(&tcpSockname);
+
+helix::UniqueLane TcpFile::serve(smarter::shared_ptr<TcpFile> file) {
+	helix::UniqueLane local_lane, remote_lane;
+	std::tie(local_lane, remote_lane) = helix::createStream();
+	async::detach(protocols::fs::servePassthrough(
+			std::move(local_lane), file, &tcpOperations));
+	return std::move(remote_lane);
+}
+
+// ----------------------------------------------------------------------------
+// UDP files.
+// ----------------------------------------------------------------------------
+
+struct UdpFile {
+	static helix::UniqueLane serve(smarter::shared_ptr<UdpFile> file);
+
+	UdpFile(bool non_block)
+	: socket{non_block} { }
+
+	~UdpFile() {
+		socket.close();
+	}
 
-Connection::Connection(helx::EventHub &event_hub, Network &net, helx::Pipe pipe)
-: eventHub(event_hub), net(net), pipe(std::move(pipe)), nextHandle(1) { }
+	UdpSocket socket;
+};
 
-void Connection::operator() () {
-	HEL_CHECK(pipe.recvStringReq(buffer, 128, eventHub, kHelAnyRequest, 0,
-			CALLBACK_MEMBER(this, &Connection::recvRequest)));
+async::result<protocols::fs::ReadResult> udpRead(void *object, const char *,
+		void *buffer, size_t length) {
+	auto self = static_cast<UdpFile *>(object);
+	return self->socket.read(buffer, length);
 }
 
-Network &Connection::getNet() {
-	return net;
+async::result<protocols::fs::Error> udpWrite(void *object, const char *,
+		const void *buffer, size_t length) {
+	auto self = static_cast<UdpFile *>(object);
+	return ready(self->socket.write(buffer, length));
 }
 
-int Connection::attachOpenFile(OpenFile *file) {
-	int handle = nextHandle++;
-	fileHandles.insert(std::make_pair(handle, file));
-	return handle;
+async::result<protocols::fs::PollResult> udpPoll(void *object, uint64_t past_seq,
+		async::cancellation_token cancellation) {
+	auto self = static_cast<UdpFile *>(object);
+	return self->socket.poll(past_seq, cancellation);
 }
 
-OpenFile *Connection::getOpenFile(int handle) {
-	return fileHandles.at(handle);
+async::result<protocols::fs::Error> udpBind(void *object, const char *,
+		const void *addr_ptr, size_t addr_length) {
+	auto self = static_cast<UdpFile *>(object);
+	Ip4Address address;
+	uint16_t port;
+	if(!parseAddress(addr_ptr, addr_length, address, port))
+		return ready(protocols::fs::Error::illegalArguments);
+	return ready(self->socket.bind(address, port));
 }
 
-void Connection::recvRequest(HelError error, int64_t msg_request, int64_t msg_seq,
-		size_t length) {
-	HEL_CHECK(error);
+async::result<protocols::fs::Error> udpConnect(void *object, const char *,
+		const void *addr_ptr, size_t addr_length) {
+	auto self = static_cast<UdpFile *>(object);
+	Ip4Address address;
+	uint16_t port;
+	if(!parseAddress(addr_ptr, addr_length, address, port))
+		return ready(protocols::fs::Error::illegalArguments);
+	return ready(self->socket.connect(address, port));
+}
+
+async::result<size_t> udpSockname(void *object, void *addr_ptr, size_t max_addr_length) {
+	auto self = static_cast<UdpFile *>(object);
+	auto address = self->socket.localAddress();
+	if(address == Ip4Address())
+		address = localIp;
+	return ready(formatAddress(address, self->socket.localPort(),
+			addr_ptr, max_addr_length));
+}
 
-	managarm::fs::CntRequest request;
-	request.ParseFromArray(buffer, length);
-	
-	if(request.req_type() == managarm::fs::CntReqType::OPEN) {
-		auto action = libchain::compose([this, request, msg_request] () {
-			managarm::fs::SvrResponse response;
+constexpr protocols::fs::FileOperations udpOperations = protocols::fs::FileOperations{}
+	.withRead(&udpRead)
+	.withWrite(&udpWrite)
+	.withPoll(&udpPoll)
+	.withBind(&udpBind)
+	.withConnect(&udpConnect)
+	.withSockname(&udpSockname);
+
+helix::UniqueLane UdpFile::serve(smarter::shared_ptr<UdpFile> file) {
+	helix::UniqueLane local_lane, remote_lane;
+	std::tie(local_lane, remote_lane) = helix::createStream();
+	async::detach(protocols::fs::servePassthrough(
+			std::move(local_lane), file, &udpOperations));
+	return std::move(remote_lane);
+}
 
-			if(request.path() == "ip+udp") {
-				int handle = attachOpenFile(new OpenFile);
-				response.set_error(managarm::fs::Errors::SUCCESS);
-				response.set_file_type(managarm::fs::FileType::SOCKET);
-				response.set_fd(handle);
+} // anonymous namespace
+
+COFIBER_ROUTINE(cofiber::no_future, serveStack(helix::UniqueLane p),
+		([lane = std::move(p)] {
+	while(true) {
+		helix::Accept accept;
+		helix::RecvInline recv_req;
+
+		auto &&header = helix::submitAsync(lane, helix::Dispatcher::global(),
+				helix::action(&accept, kHelItemAncillary),
+				helix::action(&recv_req));
+		COFIBER_AWAIT header.async_wait();
+		if(accept.error() == kHelErrEndOfLane)
+			COFIBER_RETURN();
+		HEL_CHECK(accept.error());
+		HEL_CHECK(recv_req.error());
+
+		auto conversation = accept.descriptor();
+		managarm::fs::CntRequest req;
+		req.ParseFromArray(recv_req.data(), recv_req.length());
+		if(req.req_type() == managarm::fs::CntReqType::DEV_SOCKET) {
+			helix::SendBuffer send_resp;
+			helix::PushDescriptor push_pt;
+
+			bool non_block = req.flags() & managarm::fs::OF_NONBLOCK;
+			helix::UniqueLane remote_lane;
+			if(req.socktype() == SOCK_STREAM
+					&& (!req.protocol() || req.protocol() == IPPROTO_TCP)) {
+				auto file = smarter::make_shared<TcpFile>(
+						std::make_shared<TcpSocket>(non_block));
+				remote_lane = TcpFile::serve(std::move(file));
+			}else if(req.socktype() == SOCK_DGRAM
+					&& (!req.protocol() || req.protocol() == IPPROTO_UDP)) {
+				auto file = smarter::make_shared<UdpFile>(non_block);
+				remote_lane = UdpFile::serve(std::move(file));
 			}else{
-				response.set_error(managarm::fs::Errors::FILE_NOT_FOUND);
+				managarm::fs::SvrResponse resp;
+				resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+
+				auto ser = resp.SerializeAsString();
+				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+						helix::action(&send_resp, ser.data(), ser.size()));
+				COFIBER_AWAIT transmit.async_wait();
+				HEL_CHECK(send_resp.error());
+				continue;
 			}
-			
-			std::string serialized;
-			response.SerializeToString(&serialized);
-			
-			printf("[libnet/src/network.cpp] recvRequest:OPEN sendStringResp \n");
-			return pipe.sendStringResp(serialized.data(), serialized.size(),
-					eventHub, msg_request, 0)
-			+ libchain::lift([=] (HelError error) { HEL_CHECK(error); });
-		});
-	
-		libchain::run(action);
-	}else if(request.req_type() == managarm::fs::CntReqType::CONNECT) {
-		auto action = libchain::compose([this, request, msg_request] () {
-			managarm::fs::SvrResponse response;
-			
-			auto file = getOpenFile(request.fd());
-			file->address = Ip4Address(192, 168, 178, 43);
-			file->port = 1234;
-			response.set_error(managarm::fs::Errors::SUCCESS);
-
-			std::string serialized;
-			response.SerializeToString(&serialized);
-			
-			printf("[libnet/src/network.cpp] recvRequest:CONNECT sendStringResp \n");
-			return pipe.sendStringResp(serialized.data(), serialized.size(),
-					eventHub, msg_request, 0)
-			+ libchain::lift([=] (HelError error) { HEL_CHECK(error); });
-		});
-
-		libchain::run(action);
-	}else if(request.req_type() == managarm::fs::CntReqType::WRITE) {
-		auto action = libchain::compose([this, request, msg_request] (std::string *buffer) {
-			buffer->resize(request.size());
-
-			return libchain::await<void(HelError, int64_t, int64_t, size_t)>([this, request, msg_request, buffer] (auto callback) {
-				HEL_CHECK(pipe.recvStringReq(&(*buffer)[0], request.size(), eventHub, msg_request, 1,
-						libchainToFrigg(callback)));
-			})
-			+ libchain::compose([this, request, msg_request, buffer] (HelError error,
-					int64_t msg_request, int64_t msg_seq, size_t length) {
-				HEL_CHECK(error);
-				assert(length == (size_t)request.size());
-
-				managarm::fs::SvrResponse response;
-			
-				auto file = getOpenFile(request.fd());
-				
-				EthernetInfo etherInfo;
-				etherInfo.sourceMac = localMac;
-				etherInfo.destMac = routerMac;
-				etherInfo.etherType = kEtherIp4;
-				
-				Ip4Info ipInfo;
-				ipInfo.sourceIp = localIp;
-				ipInfo.destIp = file->address;
-				ipInfo.protocol = kUdpProtocol;
-
-				UdpInfo udpInfo;
-				udpInfo.sourcePort = 1234;
-				udpInfo.destPort = file->port;
-				
-				sendUdpPacket(net.device, etherInfo, ipInfo, udpInfo, *buffer);
-				response.set_error(managarm::fs::Errors::SUCCESS);
-
-				std::string serialized;
-				response.SerializeToString(&serialized);
-			
-				printf("[libnet/src/network.cpp] recvRequest:WRITE sendStringResp \n");
-				return pipe.sendStringResp(serialized.data(), serialized.size(),
-						eventHub, msg_request, 0)
-				+ libchain::lift([=] (HelError error) { HEL_CHECK(error); });
-			});
-		}, std::string());
-
-		libchain::run(action);
-	}/*else if(request.req_type() == managarm::fs::CntReqType::READ) {
-		auto closure = new ReadClosure(*this, msg_request, std::move(request));
-		(*closure)();
-	}*/else{
-		fprintf(stderr, "Illegal request type\n");
-		abort();
-	}
 
-	(*this)();
-}
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+			resp.set_file_type(managarm::fs::FileType::SOCKET);
+
+			auto ser = resp.SerializeAsString();
+			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&push_pt, remote_lane));
+			COFIBER_AWAIT transmit.async_wait();
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(push_pt.error());
+		}else{
+			throw std::runtime_error("libnet: Unexpected request type in serveStack()");
+		}
+	}
+}))
 
 } // namespace libnet
-
@@ -0,0 +1,125 @@
+
+#include <algorithm>
+
+#include <arch/dma_pool.hpp>
+#include <libnet.hpp>
+
+namespace libnet {
+
+// --------------------------------------------------------
+// PacketPool
+// --------------------------------------------------------
+
+PacketPool *PacketPool::global() {
+	static arch::os::contiguous_pool dma_pool;
+	static PacketPool pool{&dma_pool};
+	return &pool;
+}
+
+PacketPool::PacketPool(arch::dma_pool *dma_pool)
+: _dmaPool{dma_pool} { }
+
+void *PacketPool::allocate() {
+	if(!_freeList.empty()) {
+		auto buffer = _freeList.back();
+		_freeList.pop_back();
+		return buffer;
+	}
+	return _dmaPool->allocate(bufferSize, 1, bufferSize);
+}
+
+void PacketPool::free(void *buffer) {
+	_freeList.push_back(buffer);
+}
+
+// --------------------------------------------------------
+// PacketBuffer
+// --------------------------------------------------------
+
+PacketBuffer::PacketBuffer()
+: _head{nullptr, 0, 0}, _checksumTail{0}, _checksumField{0},
+		_segmentSize{0}, _transportHeaderLength{0} { }
+
+PacketBuffer::PacketBuffer(size_t length)
+: _checksumTail{0}, _checksumField{0}, _segmentSize{0}, _transportHeaderLength{0} {
+	auto pool = PacketPool::global();
+
+	auto chunk = std::min(length, PacketPool::bufferSize - headroom);
+	_head = Segment{static_cast<char *>(pool->allocate()), headroom, chunk};
+	length -= chunk;
+
+	while(length) {
+		chunk = std::min(length, PacketPool::bufferSize);
+		_tail.push_back(Segment{static_cast<char *>(pool->allocate()), 0, chunk});
+		length -= chunk;
+	}
+}
+
+PacketBuffer::~PacketBuffer() {
+	if(!_head.buffer)
+		return;
+
+	auto pool = PacketPool::global();
+	pool->free(_head.buffer);
+	for(auto &segment : _tail)
+		pool->free(segment.buffer);
+}
+
+size_t PacketBuffer::size() const {
+	size_t size = _head.length;
+	for(auto &segment : _tail)
+		size += segment.length;
+	return size;
+}
+
+arch::dma_buffer_view PacketBuffer::segment(size_t n) const {
+	auto &segment = _segmentAt(n);
+	return arch::dma_buffer_view{PacketPool::global()->dmaPool(),
+			segment.buffer + segment.offset, segment.length};
+}
+
+void *PacketBuffer::prepend(size_t length) {
+	assert(_head.buffer);
+	assert(length <= _head.offset && "PacketBuffer headroom exhausted");
+	_head.offset -= length;
+	_head.length += length;
+	return _head.buffer + _head.offset;
+}
+
+void PacketBuffer::write(size_t offset, const void *data, size_t length) {
+	auto p = static_cast<const char *>(data);
+	for(size_t n = 0; n < numSegments() && length; n++) {
+		auto &segment = _segmentAt(n);
+		if(offset >= segment.length) {
+			offset -= segment.length;
+			continue;
+		}
+
+		auto chunk = std::min(length, segment.length - offset);
+		memcpy(segment.buffer + segment.offset + offset, p, chunk);
+		p += chunk;
+		length -= chunk;
+		offset = 0;
+	}
+	assert(!length && "PacketBuffer::write() exceeds packet");
+}
+
+void PacketBuffer::read(size_t offset, void *data, size_t length) const {
+	auto p = static_cast<char *>(data);
+	for(size_t n = 0; n < numSegments() && length; n++) {
+		auto &segment = _segmentAt(n);
+		if(offset >= segment.length) {
+			offset -= segment.length;
+			continue;
+		}
+
+		auto chunk = std::min(length, segment.length - offset);
+		memcpy(p, segment.buffer + segment.offset + offset, chunk);
+		p += chunk;
+		length -= chunk;
+		offset = 0;
+	}
+	assert(!length && "PacketBuffer::read() exceeds packet");
+}
+
+} // namespace libnet
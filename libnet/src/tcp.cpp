@@ -1,217 +1,1447 @@
 
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+#include <helix/ipc.hpp>
+#include <helix/await.hpp>
 #include <libnet.hpp>
 #include "tcp.hpp"
 
 namespace libnet {
 
-TcpSocket::TcpSocket() {
-	state = kStateNone;
-	ackedLocalSequence = 1000;
-}
-
-void TcpSocket::connect() {
-	state = kStateSynSent;
-
-	EthernetInfo ethernet_info;
-	ethernet_info.sourceMac = localMac;
-	ethernet_info.destMac = routerMac;
-	ethernet_info.etherType = kEtherIp4;
-
-	Ip4Info ip_info;
-	ip_info.sourceIp = localIp;
-	ip_info.destIp = Ip4Address(173, 194, 116, 210); //www.google.com
-	ip_info.protocol = kTcpProtocol;
-
-	TcpInfo tcp_info;
-	tcp_info.srcPort = 49152;
-	tcp_info.destPort = 80;
-	tcp_info.seqNumber = ackedLocalSequence;
-	tcp_info.ackNumber = 0;
-	tcp_info.ackFlag = false;
-	tcp_info.rstFlag = false;
-	tcp_info.synFlag = true;
-	tcp_info.finFlag = false;
-
-	std::string packet;
-	sendTcpPacket(*globalDevice, ethernet_info, ip_info, tcp_info, packet);
-}
-
-void sendTcpPacket(NetDevice &device, EthernetInfo link_info, Ip4Info network_info, 
-		TcpInfo transport_info, std::string payload) {
-	TcpHeader header;
-	header.srcPort = hostToNet<uint16_t>(transport_info.srcPort);
-	header.destPort = hostToNet<uint16_t>(transport_info.destPort);
-	header.seqNumber = hostToNet<uint32_t>(transport_info.seqNumber);
-	header.ackNumber = hostToNet<uint32_t>(transport_info.ackNumber);
-
-	uint16_t flags = (sizeof(TcpHeader) / 4) << 12;
-	if(transport_info.finFlag)
-		flags |= TcpFlags::kTcpFin;
-	if(transport_info.synFlag)
-		flags |= TcpFlags::kTcpSyn;
-	if(transport_info.rstFlag)
-		flags |= TcpFlags::kTcpRst;
-	if(transport_info.ackFlag)
-		flags |= TcpFlags::kTcpAck;
-	header.flags = hostToNet<uint16_t>(flags);
-
-	header.window = 0xFFFF;
-	header.checksum = 0;
-	header.urgentPointer = 0;
-
-	// calculate the TCP checksum
-	PseudoIp4Header pseudo;
-	memcpy(pseudo.sourceIp, network_info.sourceIp.octets, 4);
-	memcpy(pseudo.destIp, network_info.destIp.octets, 4);
-	pseudo.reserved = 0;
-	pseudo.protocol = kTcpProtocol;
-	pseudo.length = hostToNet<uint16_t>(sizeof(TcpHeader) + payload.length());
-
-	Checksum tcp_checksum;
-	tcp_checksum.update(&pseudo, sizeof(PseudoIp4Header));
-	tcp_checksum.update(&header, sizeof(TcpHeader));
-	tcp_checksum.update(payload.data(), payload.size());
-	header.checksum = hostToNet<uint16_t>(tcp_checksum.finish());
-
-	std::string packet(sizeof(TcpHeader) + payload.length(), 0);
-	memcpy(&packet[0], &header, sizeof(TcpHeader));
-	memcpy(&packet[sizeof(TcpHeader)], payload.data(), payload.length());
-	
-	sendIp4Packet(device, link_info, network_info, packet);
-}
-
-void receiveTcpPacket(void *buffer, size_t length) {
-	if(length < sizeof(TcpHeader)) {
-		printf("        Tcp packet is too short!\n");
-		return;
+namespace {
+	constexpr uint16_t ephemeralBase = 49152;
+
+	// MSS of Ethernet (MTU minus IP and TCP headers); used by the window heuristics.
+	constexpr size_t defaultMss = 1460;
+	// MSS that is assumed if the peer does not announce one (RFC 1122).
+	constexpr size_t minMss = 536;
+	// Upper bound on the payload of segments that are split by the device (TSO).
+	// Leaves room for the headers within the 16-bit IPv4 length field.
+	constexpr size_t maxTsoPayload = 65535 - 20 - 60 - 14;
+
+	// Smallest scale factor that allows us to announce the whole receive buffer.
+	constexpr uint8_t receiveWindowScale = 3;
+	static_assert((size_t(0xFFFF) << receiveWindowScale) >= TcpSocket::receiveCapacity,
+			"Window scale is too small for the receive buffer");
+
+	constexpr uint64_t clockGranularity = 1'000'000;
+
+	// Connections are identified by (local port, remote address, remote port).
+	using ConnectionKey = std::tuple<uint16_t, uint32_t, uint16_t>;
+
+	std::map<ConnectionKey, std::shared_ptr<TcpSocket>> tcpConnections;
+
+	// Sockets that own a local port, i.e. explicitly bound, connecting and listening sockets.
+	std::unordered_map<uint16_t, TcpSocket *> tcpBound;
+
+	// MSS that we announce: the device's MTU minus IP and TCP headers.
+	size_t localMss() {
+		return std::min(globalDevice->mtu(), size_t(0xFFFF)) - 40;
 	}
+	uint16_t nextEphemeral = ephemeralBase;
 
-	auto tcp_header = (TcpHeader *)buffer;
+	uint16_t allocatePort() {
+		for(int i = 0; i < 65536 - ephemeralBase; i++) {
+			auto port = nextEphemeral;
+			nextEphemeral = (nextEphemeral == 65535) ? ephemeralBase : nextEphemeral + 1;
+			if(tcpBound.find(port) == tcpBound.end())
+				return port;
+		}
+		return 0;
+	}
+
+	ConnectionKey connectionKey(TcpSocket *socket) {
+		return ConnectionKey{socket->localPort(), socket->remoteAddress().toWord(),
+				socket->remotePort()};
+	}
+
+	uint64_t currentTime() {
+		uint64_t now;
+		HEL_CHECK(helGetClock(&now));
+		return now;
+	}
 
-	printf("        srcPort: %d\n", netToHost<uint16_t>(tcp_header->srcPort));
-	printf("        destPort: %d\n", netToHost<uint16_t>(tcp_header->destPort));
-	printf("        seqNumber: %d\n", netToHost<uint32_t>(tcp_header->seqNumber));
-	printf("        ackNumber: %d\n", netToHost<uint32_t>(tcp_header->ackNumber));
+	// The ISN clock of RFC 793 (4 microsecond ticks) plus a pseudo-random offset.
+	uint32_t generateIss() {
+		static uint32_t salt = 0x6D2B79F5;
+		salt = salt * 1664525 + 1013904223;
+		return uint32_t(currentTime() / 4000) + salt;
+	}
 
-	printf("        flags:");
-	uint16_t flags = netToHost<uint16_t>(tcp_header->flags);
-	if(flags & TcpFlags::kTcpFin)
-		printf(" FIN");
-	if(flags & TcpFlags::kTcpSyn)
-		printf(" SYN");
-	if(flags & TcpFlags::kTcpAck)
-		printf(" ACK");
-	if(flags & TcpFlags::kTcpRst)
-		printf(" RST");
-	printf("\n");
+	// Prepends the header (and options) to a segment that already contains the payload.
+	void prependHeader(PacketBuffer &segment, uint16_t source_port, uint16_t dest_port,
+			uint32_t seq, uint32_t ack, uint16_t flags, uint16_t window,
+			const std::string &options) {
+		assert(!(options.size() % 4));
+		size_t header_length = sizeof(TcpHeader) + options.size();
 
-	printf("        dataOffset: %d\n", flags >> 12);
+		TcpHeader header;
+		header.srcPort = hostToNet<uint16_t>(source_port);
+		header.destPort = hostToNet<uint16_t>(dest_port);
+		header.seqNumber = hostToNet<uint32_t>(seq);
+		header.ackNumber = hostToNet<uint32_t>(ack);
+		header.flags = hostToNet<uint16_t>(((header_length / 4) << 12) | flags);
+		header.window = hostToNet<uint16_t>(window);
+		header.checksum = 0;
+		header.urgentPointer = 0;
 
-	void *payload_buffer = (char *)buffer + (flags >> 12) * 4;
-	size_t payload_length = length - (flags >> 12) * 4;
-		
-	if(flags & TcpFlags::kTcpRst) {
-		printf("        TCP socket is reset\n");
-		return;
+		auto buffer = static_cast<char *>(segment.prepend(header_length));
+		memcpy(buffer, &header, sizeof(TcpHeader));
+		memcpy(buffer + sizeof(TcpHeader), options.data(), options.size());
+	}
+
+	// The header must already be prepended; its checksum field is filled in here.
+	// If the device computes checksums, payload_checksum is ignored.
+	// A non-zero segment_size requests TSO.
+	void transmitSegment(Ip4Address source, Ip4Address dest, PacketBuffer segment,
+			const Checksum &payload_checksum, size_t segment_size = 0) {
+		auto header = static_cast<TcpHeader *>(segment.segment(0).data());
+		size_t header_length = (netToHost<uint16_t>(header->flags) >> 12) * 4;
+
+		PseudoIp4Header pseudo;
+		memcpy(pseudo.sourceIp, source.octets, 4);
+		memcpy(pseudo.destIp, dest.octets, 4);
+		pseudo.reserved = 0;
+		pseudo.protocol = kTcpProtocol;
+		pseudo.length = hostToNet<uint16_t>(segment.size());
+
+		Checksum tcp_checksum;
+		tcp_checksum.update(&pseudo, sizeof(PseudoIp4Header));
+		if(globalDevice->offloads() & kNetOffloadTxChecksum) {
+			// The device expects the non-inverted pseudo header sum.
+			header->checksum = hostToNet<uint16_t>(tcp_checksum.fold());
+			segment.requestChecksum(offsetof(TcpHeader, checksum));
+			if(segment_size)
+				segment.requestSegmentation(segment_size, header_length);
+		}else{
+			assert(!segment_size);
+			tcp_checksum.update(header, header_length);
+			tcp_checksum.update(payload_checksum);
+			header->checksum = hostToNet<uint16_t>(tcp_checksum.finish());
+		}
+
+		Ip4Info network_info;
+		network_info.sourceIp = source;
+		network_info.destIp = dest;
+		network_info.protocol = kTcpProtocol;
+		sendIp4Packet(network_info, std::move(segment));
 	}
 
-	if(tcpSocket.state == TcpSocket::kStateSynSent) {
-		if(!(flags & TcpFlags::kTcpSyn) || !(flags & TcpFlags::kTcpAck)) {
-			printf("        Expected SYN-ACK in SYN-SENT state\n");
+	// Answers segments that do not belong to any connection (RFC 793, "reset generation").
+	void replyReset(Ip4Info network_info, uint16_t source_port, uint16_t dest_port,
+			const TcpSegment &incoming) {
+		if(incoming.flags & kTcpRst)
 			return;
-		}else if(flags & TcpFlags::kTcpFin) {
-			printf("        FIN set in SYN-SENT state\n");
+
+		uint32_t seq = 0;
+		uint32_t ack = 0;
+		uint16_t flags = kTcpRst;
+		if(incoming.flags & kTcpAck) {
+			seq = incoming.ack;
+		}else{
+			ack = incoming.seq + incoming.seqLength();
+			flags |= kTcpAck;
+		}
+
+		PacketBuffer segment{0};
+		prependHeader(segment, dest_port, source_port, seq, ack, flags, 0, std::string());
+		transmitSegment(network_info.destIp, network_info.sourceIp, std::move(segment), Checksum{});
+	}
+}
+
+// --------------------------------------------------------
+// TcpBuffer
+// --------------------------------------------------------
+
+TcpBuffer::TcpBuffer(size_t capacity)
+: _data(capacity), _head{0}, _size{0} { }
+
+size_t TcpBuffer::push(const void *buffer, size_t length) {
+	auto chunk = std::min(length, space());
+	auto tail = (_head + _size) % _data.size();
+	auto first = std::min(chunk, _data.size() - tail);
+	memcpy(_data.data() + tail, buffer, first);
+	memcpy(_data.data(), static_cast<const char *>(buffer) + first, chunk - first);
+	_size += chunk;
+	return chunk;
+}
+
+void TcpBuffer::peek(size_t offset, void *buffer, size_t length) {
+	assert(offset + length <= _size);
+	auto start = (_head + offset) % _data.size();
+	auto first = std::min(length, _data.size() - start);
+	memcpy(buffer, _data.data() + start, first);
+	memcpy(static_cast<char *>(buffer) + first, _data.data(), length - first);
+}
+
+void TcpBuffer::peek(size_t offset, void *buffer, size_t length, Checksum &checksum) {
+	assert(offset + length <= _size);
+	auto start = (_head + offset) % _data.size();
+	auto first = std::min(length, _data.size() - start);
+	checksum.copyAndUpdate(buffer, _data.data() + start, first);
+	checksum.copyAndUpdate(static_cast<char *>(buffer) + first, _data.data(), length - first);
+}
+
+void TcpBuffer::discard(size_t length) {
+	assert(length <= _size);
+	_head = (_head + length) % _data.size();
+	_size -= length;
+}
+
+// --------------------------------------------------------
+// TcpSocket: socket API
+// --------------------------------------------------------
+
+TcpSocket::TcpSocket(bool non_block)
+: _nonBlock{non_block}, _state{kStateClosed}, _userClosed{false},
+		_error{protocols::fs::Error::none}, _reset{false},
+		_localPort{0}, _remotePort{0}, _passiveOpen{false}, _pendingChildren{0},
+		_iss{0}, _sndUna{0}, _sndNxt{0}, _sndMax{0}, _sndWnd{0}, _sndWl1{0}, _sndWl2{0},
+		_sndWscale{0}, _mss{minMss}, _windowScaling{false}, _sackEnabled{false},
+		_sendBase{0}, _sendBuffer{sendCapacity}, _finQueued{false},
+		_cwnd{0}, _ssthresh{~size_t(0)}, _bytesAcked{0}, _dupAcks{0},
+		_inRecovery{false}, _recover{0}, _holeNext{0},
+		_rttTiming{false}, _rttSeq{0}, _rttStart{0}, _haveRtt{false},
+		_srtt{0}, _rttvar{0}, _rto{initialRto}, _retries{0},
+		_irs{0}, _rcvNxt{0}, _rcvAdv{0}, _rcvWscale{0},
+		_receiveBuffer{receiveCapacity}, _finReceived{false}, _finPending{false}, _finSeq{0},
+		_lastOutOfOrder{0}, _unackedSegments{0}, _ackNow{false},
+		_retransmitDeadline{0}, _delayedAckDeadline{0}, _timeWaitDeadline{0},
+		_timerAsyncId{0}, _timerDeadline{0},
+		_currentSeq{1}, _inSeq{0}, _outSeq{0} { }
+
+protocols::fs::Error TcpSocket::bind(Ip4Address address, uint16_t port) {
+	if(_state != kStateClosed || _localPort)
+		return protocols::fs::Error::illegalArguments;
+	if(address != Ip4Address() && address != localIp)
+		return protocols::fs::Error::illegalArguments;
+
+	if(!port) {
+		port = allocatePort();
+		if(!port)
+			return protocols::fs::Error::addressInUse;
+	}else if(tcpBound.find(port) != tcpBound.end()) {
+		return protocols::fs::Error::addressInUse;
+	}
+
+	_localAddress = address;
+	_localPort = port;
+	tcpBound.insert({port, this});
+	return protocols::fs::Error::none;
+}
+
+COFIBER_ROUTINE(async::result<protocols::fs::Error>,
+TcpSocket::connect(Ip4Address address, uint16_t port), ([=] {
+	if(_state != kStateClosed || _userClosed || !port)
+		COFIBER_RETURN(protocols::fs::Error::illegalArguments);
+
+	if(!_localPort) {
+		auto error = bind(Ip4Address(), 0);
+		if(error != protocols::fs::Error::none)
+			COFIBER_RETURN(error);
+	}
+	if(_localAddress == Ip4Address())
+		_localAddress = localIp;
+	_remoteAddress = address;
+	_remotePort = port;
+
+	auto key = connectionKey(this);
+	if(tcpConnections.find(key) != tcpConnections.end())
+		COFIBER_RETURN(protocols::fs::Error::addressInUse);
+	tcpConnections.insert({key, shared_from_this()});
+
+	_iss = generateIss();
+	_sndUna = _iss;
+	_sndNxt = _iss;
+	_sndMax = _iss;
+	_sendBase = _iss + 1;
+	_recover = _iss;
+	// Offer all options; they are disabled again if the peer does not support them.
+	_windowScaling = true;
+	_sackEnabled = true;
+	_rcvWscale = receiveWindowScale;
+
+	_state = kStateSynSent;
+	_sendSyn();
+	_armRetransmit();
+
+	while(_state == kStateSynSent || _state == kStateSynReceived)
+		COFIBER_AWAIT _statusBell.async_wait();
+
+	if(_state == kStateClosed)
+		COFIBER_RETURN(_error);
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
+
+protocols::fs::Error TcpSocket::listen() {
+	if(_state == kStateListen)
+		return protocols::fs::Error::none;
+	if(_state != kStateClosed || _userClosed)
+		return protocols::fs::Error::illegalArguments;
+
+	if(!_localPort) {
+		auto error = bind(Ip4Address(), 0);
+		if(error != protocols::fs::Error::none)
+			return error;
+	}
+
+	_state = kStateListen;
+	return protocols::fs::Error::none;
+}
+
+COFIBER_ROUTINE(async::result<std::shared_ptr<TcpSocket>>, TcpSocket::accept(), ([=] {
+	while(_acceptQueue.empty()) {
+		if(_nonBlock || _state != kStateListen)
+			COFIBER_RETURN(nullptr);
+		COFIBER_AWAIT _statusBell.async_wait();
+	}
+
+	auto child = std::move(_acceptQueue.front());
+	_acceptQueue.pop_front();
+	child->_listener.reset();
+	COFIBER_RETURN(std::move(child));
+}))
+
+COFIBER_ROUTINE(async::result<protocols::fs::ReadResult>,
+TcpSocket::read(void *buffer, size_t length), ([=] {
+	while(true) {
+		if(_receiveBuffer.size()) {
+			auto chunk = std::min(length, _receiveBuffer.size());
+			_receiveBuffer.peek(0, buffer, chunk);
+			_receiveBuffer.discard(chunk);
+
+			// Send a window update once the window opened considerably (RFC 1122).
+			if(_state == kStateEstablished || _state == kStateFinWait1
+					|| _state == kStateFinWait2) {
+				auto previous = _rcvAdv;
+				auto edge = _receiveWindow();
+				if(seqLess(previous, edge) && (previous == _rcvNxt
+						|| edge - previous >= std::min(receiveCapacity / 2, 2 * defaultMss)))
+					_sendAck();
+			}
+			COFIBER_RETURN(chunk);
+		}
+
+		if(_finReceived || _reset)
+			COFIBER_RETURN(size_t(0));
+		if(_state == kStateClosed || _state == kStateListen)
+			COFIBER_RETURN(protocols::fs::Error::illegalArguments);
+		if(_nonBlock)
+			COFIBER_RETURN(protocols::fs::Error::wouldBlock);
+		COFIBER_AWAIT _statusBell.async_wait();
+	}
+}))
+
+COFIBER_ROUTINE(async::result<protocols::fs::Error>,
+TcpSocket::write(const void *buffer, size_t length), ([=] {
+	size_t written = 0;
+	while(written < length) {
+		if(_state == kStateSynSent || _state == kStateSynReceived) {
+			COFIBER_AWAIT _statusBell.async_wait();
+			continue;
+		}
+		if(_reset)
+			COFIBER_RETURN(protocols::fs::Error::connectionReset);
+		// Writing is still allowed after the peer's FIN (i.e., in CLOSE_WAIT).
+		if(_finQueued)
+			COFIBER_RETURN(protocols::fs::Error::brokenPipe);
+		if(_state != kStateEstablished && _state != kStateCloseWait)
+			COFIBER_RETURN(_finReceived ? protocols::fs::Error::brokenPipe
+					: protocols::fs::Error::notConnected);
+
+		auto chunk = _sendBuffer.push(static_cast<const char *>(buffer) + written,
+				length - written);
+		written += chunk;
+		if(chunk)
+			_output();
+
+		// Partial writes cannot be reported, hence we block even on non-blocking sockets.
+		if(written < length)
+			COFIBER_AWAIT _statusBell.async_wait();
+	}
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
+
+COFIBER_ROUTINE(async::result<protocols::fs::PollResult>,
+TcpSocket::poll(uint64_t past_seq, async::cancellation_token cancellation), ([=] {
+	assert(past_seq <= _currentSeq);
+	while(past_seq == _currentSeq && !cancellation.is_cancellation_requested())
+		COFIBER_AWAIT _statusBell.async_wait(cancellation);
+
+	int edges = 0;
+	if(_inSeq > past_seq)
+		edges |= EPOLLIN;
+	if(_outSeq > past_seq)
+		edges |= EPOLLOUT;
+
+	int events = 0;
+	if(_state == kStateListen) {
+		if(!_acceptQueue.empty())
+			events |= EPOLLIN;
+	}else{
+		if(_receiveBuffer.size() || _finReceived || _reset)
+			events |= EPOLLIN;
+		if(_finReceived)
+			events |= EPOLLRDHUP;
+		if((_state == kStateEstablished || _state == kStateCloseWait)
+				&& !_finQueued && _sendBuffer.space())
+			events |= EPOLLOUT;
+		if(_state == kStateClosed)
+			events |= EPOLLOUT | EPOLLHUP;
+		if(_reset)
+			events |= EPOLLERR;
+	}
+
+	COFIBER_RETURN(protocols::fs::PollResult(_currentSeq, edges, events));
+}))
+
+void TcpSocket::close() {
+	auto self = shared_from_this();
+	_userClosed = true;
+
+	switch(_state) {
+	case kStateClosed: {
+		auto it = tcpBound.find(_localPort);
+		if(it != tcpBound.end() && it->second == this)
+			tcpBound.erase(it);
+		break;
+	}
+	case kStateListen: {
+		auto it = tcpBound.find(_localPort);
+		if(it != tcpBound.end() && it->second == this)
+			tcpBound.erase(it);
+		_state = kStateClosed;
+
+		// Connections that are still in the handshake notice that the listener is gone.
+		for(auto &child : _acceptQueue) {
+			child->_sendReset(child->_sndNxt);
+			child->_terminate(protocols::fs::Error::none);
+		}
+		_acceptQueue.clear();
+		_notify(EPOLLIN | EPOLLOUT);
+		break;
+	}
+	case kStateSynSent:
+	case kStateSynReceived:
+		_terminate(protocols::fs::Error::none);
+		break;
+	case kStateEstablished:
+	case kStateCloseWait:
+		// Closing with unread data aborts the connection (RFC 2525, section 2.17).
+		if(_receiveBuffer.size()) {
+			_sendReset(_sndNxt);
+			_terminate(protocols::fs::Error::none);
+			break;
+		}
+		_state = (_state == kStateEstablished) ? kStateFinWait1 : kStateLastAck;
+		_finQueued = true;
+		_output();
+		break;
+	default:
+		break;
+	}
+}
+
+// --------------------------------------------------------
+// TcpSocket: receive path
+// --------------------------------------------------------
+
+void TcpSocket::handleSyn(Ip4Info network_info, uint16_t port, const TcpSegment &segment) {
+	assert(_state == kStateListen);
+	if(_pendingChildren + _acceptQueue.size() >= backlog)
+		return; // The peer retransmits its SYN.
+
+	auto child = std::make_shared<TcpSocket>(false);
+	child->_localAddress = network_info.destIp;
+	child->_localPort = _localPort;
+	child->_remoteAddress = network_info.sourceIp;
+	child->_remotePort = port;
+	child->_passiveOpen = true;
+	child->_listener = shared_from_this();
+
+	child->_irs = segment.seq;
+	child->_rcvNxt = segment.seq + 1;
+	child->_rcvAdv = child->_rcvNxt;
+
+	child->_iss = generateIss();
+	child->_sndUna = child->_iss;
+	child->_sndNxt = child->_iss;
+	child->_sndMax = child->_iss;
+	child->_sendBase = child->_iss + 1;
+	child->_recover = child->_iss;
+	child->_sndWnd = segment.window;
+	child->_sndWl1 = segment.seq;
+	child->_sndWl2 = child->_iss;
+
+	child->_mss = std::min(segment.hasMss ? std::max(size_t(segment.mss), size_t(64)) : minMss,
+			localMss());
+	if(segment.hasWindowScale) {
+		child->_windowScaling = true;
+		child->_sndWscale = std::min(segment.windowScale, uint8_t(14));
+		child->_rcvWscale = receiveWindowScale;
+	}
+	child->_sackEnabled = segment.sackPermitted;
+
+	child->_state = kStateSynReceived;
+	tcpConnections.insert({connectionKey(child.get()), child});
+	_pendingChildren++;
+
+	child->_sendSyn();
+	child->_armRetransmit();
+}
+
+void TcpSocket::handleSegment(const TcpSegment &segment) {
+	// _terminate() removes the connection table's reference.
+	auto self = shared_from_this();
+
+	if(_state == kStateSynSent) {
+		if(segment.flags & kTcpAck) {
+			if(seqLessEqual(segment.ack, _iss) || seqLess(_sndMax, segment.ack)) {
+				if(!(segment.flags & kTcpRst))
+					_sendReset(segment.ack);
+				return;
+			}
+		}
+		if(segment.flags & kTcpRst) {
+			if(segment.flags & kTcpAck) {
+				_reset = true;
+				_terminate(protocols::fs::Error::connectionRefused);
+			}
 			return;
 		}
+		if(!(segment.flags & kTcpSyn))
+			return;
+
+		_irs = segment.seq;
+		_rcvNxt = segment.seq + 1;
+		_rcvAdv = _rcvNxt;
+		_mss = std::min(segment.hasMss ? std::max(size_t(segment.mss), size_t(64)) : minMss,
+				localMss());
+		if(segment.hasWindowScale) {
+			_sndWscale = std::min(segment.windowScale, uint8_t(14));
+		}else{
+			_windowScaling = false;
+			_sndWscale = 0;
+			_rcvWscale = 0;
+		}
+		_sackEnabled = segment.sackPermitted;
+
+		if(segment.flags & kTcpAck) {
+			_sndUna = segment.ack;
+			_enterEstablished(segment);
+			_sendAck();
+		}else{
+			// Simultaneous open.
+			_state = kStateSynReceived;
+			_sndWnd = segment.window;
+			_sndWl1 = segment.seq;
+			_sendSyn();
+			_armRetransmit();
+		}
+		return;
+	}
+
+	// A retransmitted SYN means that our SYN-ACK was lost.
+	if(_state == kStateSynReceived && (segment.flags & kTcpSyn)
+			&& !(segment.flags & kTcpAck) && segment.seq == _irs) {
+		_sendSyn();
+		return;
+	}
 
-		if(payload_length != 0) {
-			printf("        SYN-ACK carries payload!\n");
+	// Step 1: check the sequence number.
+	uint32_t window = _rcvAdv - _rcvNxt;
+	uint32_t end = segment.seq + segment.seqLength();
+	bool acceptable;
+	if(!segment.seqLength() || !window) {
+		// With a zero window, we still process ACKs and RSTs.
+		acceptable = window ? (seqLessEqual(_rcvNxt, segment.seq) && seqLess(segment.seq, _rcvAdv))
+				: segment.seq == _rcvNxt;
+	}else{
+		acceptable = (seqLessEqual(_rcvNxt, segment.seq) && seqLess(segment.seq, _rcvAdv))
+				|| (seqLess(_rcvNxt, end) && seqLessEqual(end, _rcvAdv))
+				|| (seqLess(segment.seq, _rcvNxt) && seqLess(_rcvAdv, end));
+	}
+	if(!acceptable) {
+		if(!(segment.flags & kTcpRst))
+			_sendAck();
+		return;
+	}
+
+	// Step 2: check the RST bit. Only exact matches are accepted (RFC 5961).
+	if(segment.flags & kTcpRst) {
+		if(segment.seq != _rcvNxt) {
+			_sendAck();
 			return;
 		}
+		_reset = true;
+		_terminate((_state == kStateSynReceived && !_passiveOpen)
+				? protocols::fs::Error::connectionRefused : protocols::fs::Error::none);
+		return;
+	}
+
+	// Step 3: a SYN in the window is answered by a challenge ACK (RFC 5961).
+	if(segment.flags & kTcpSyn) {
+		_sendAck();
+		return;
+	}
 
-		if(netToHost<uint32_t>(tcp_header->ackNumber) != tcpSocket.ackedLocalSequence + 1) {
-			printf("        Bad ackNumber in SYN-ACK packet!\n");
+	// Step 4: check the ACK field.
+	if(!(segment.flags & kTcpAck))
+		return;
+
+	if(_state == kStateSynReceived) {
+		if(!seqLess(_sndUna, segment.ack) || !seqLessEqual(segment.ack, _sndMax)) {
+			_sendReset(segment.ack);
 			return;
 		}
-		tcpSocket.ackedLocalSequence = netToHost<uint32_t>(tcp_header->ackNumber);
-		tcpSocket.expectedRemoteSequence = netToHost<uint32_t>(tcp_header->seqNumber) + 1;
-		tcpSocket.state = TcpSocket::kStateEstablished;
-
-		EthernetInfo ethernet_info;
-		ethernet_info.sourceMac = localMac;
-		ethernet_info.destMac = routerMac;
-		ethernet_info.etherType = kEtherIp4;
-
-		Ip4Info ip_info;
-		ip_info.sourceIp = localIp;
-		ip_info.destIp = Ip4Address(173, 194, 116, 210); //www.google.com
-		ip_info.protocol = kTcpProtocol;
-
-		TcpInfo tcp_info;
-		tcp_info.srcPort = 49152;
-		tcp_info.destPort = 80;
-		tcp_info.seqNumber = tcpSocket.ackedLocalSequence;
-		tcp_info.ackNumber = tcpSocket.expectedRemoteSequence;
-		tcp_info.ackFlag = true;
-		tcp_info.rstFlag = false;
-		tcp_info.synFlag = false;
-		tcp_info.finFlag = false;
-
-		std::string packet("GET /\n");
-		sendTcpPacket(*globalDevice, ethernet_info, ip_info, tcp_info, packet);
-	}else if(tcpSocket.state == TcpSocket::kStateEstablished) {
-		if(flags & TcpFlags::kTcpSyn) {
-			printf("        SYN set in ESTABLISHED state\n");
+		_sndUna = segment.ack;
+
+		if(_passiveOpen) {
+			auto listener = _listener.lock();
+			if(!listener || listener->_state != kStateListen) {
+				_sendReset(_sndMax);
+				_terminate(protocols::fs::Error::none);
+				return;
+			}
+			listener->_pendingChildren--;
+			listener->_acceptQueue.push_back(self);
+			listener->_notify(EPOLLIN);
+		}
+		_enterEstablished(segment);
+	}else{
+		if(!_processAck(segment))
+			return;
+	}
+
+	bool fin_acked = _finQueued && !_sendBuffer.size() && _sndUna == _sendBase + 1;
+	if(_state == kStateFinWait1 && fin_acked) {
+		_state = kStateFinWait2;
+	}else if(_state == kStateClosing && fin_acked) {
+		_enterTimeWait();
+		return;
+	}else if(_state == kStateLastAck && fin_acked) {
+		_terminate(protocols::fs::Error::none);
+		return;
+	}
+
+	// Step 5: process the segment text.
+	if(segment.length && (_state == kStateEstablished || _state == kStateFinWait1
+			|| _state == kStateFinWait2)) {
+		// Nobody will ever read data that arrives after close().
+		if(_userClosed && seqLess(_rcvNxt, segment.seq + segment.length)) {
+			_sendReset(_sndNxt);
+			_terminate(protocols::fs::Error::none);
 			return;
 		}
+		_processData(segment);
+	}
+
+	// Step 6: check the FIN bit.
+	if((segment.flags & kTcpFin) && !_finReceived) {
+		auto fin_seq = segment.seq + segment.length;
+		if(fin_seq == _rcvNxt) {
+			_processFin();
+		}else if(seqLess(_rcvNxt, fin_seq) && seqLess(fin_seq, _rcvAdv)) {
+			_finPending = true;
+			_finSeq = fin_seq;
+		}
+	}
+
+	_output();
+
+	// Acknowledge every second segment immediately, others after a short delay (RFC 1122).
+	if(_ackNow || _unackedSegments >= 2) {
+		_sendAck();
+	}else if(_unackedSegments && !_delayedAckDeadline) {
+		_delayedAckDeadline = currentTime() + delayedAckTimeout;
+		_updateTimer();
+	}
+}
 
-		if(netToHost<uint32_t>(tcp_header->seqNumber) != tcpSocket.expectedRemoteSequence) {
-			printf("        Packet out-of-order!\n");
+bool TcpSocket::_processAck(const TcpSegment &segment) {
+	auto ack = segment.ack;
+	if(seqLess(_sndMax, ack)) {
+		// The peer acknowledges data that we never sent.
+		_sendAck();
+		return false;
+	}
+	if(seqLess(ack, _sndUna))
+		return true; // Old duplicate.
+
+	auto window = uint32_t(segment.window) << _sndWscale;
+	_updateScoreboard(segment);
+
+	if(seqLess(_sndUna, ack)) {
+		size_t acked = ack - _sndUna;
+
+		// Release acknowledged data. The FIN occupies one sequence number past the buffer.
+		auto data_acked = std::min(size_t(ack - _sendBase), _sendBuffer.size());
+		_sendBuffer.discard(data_acked);
+		_sendBase += data_acked;
+		_sndUna = ack;
+		if(seqLess(_sndNxt, _sndUna))
+			_sndNxt = _sndUna;
+
+		// Drop SACK blocks that are now cumulatively acknowledged.
+		while(!_scoreboard.empty() && seqLessEqual(_scoreboard.front().second, _sndUna))
+			_scoreboard.erase(_scoreboard.begin());
+		if(!_scoreboard.empty() && seqLess(_scoreboard.front().first, _sndUna))
+			_scoreboard.front().first = _sndUna;
+
+		// Karn's algorithm: only segments that were not retransmitted are timed.
+		if(_rttTiming && seqLessEqual(_rttSeq, ack)) {
+			_updateRtt(currentTime() - _rttStart);
+			_rttTiming = false;
+		}
+		_retries = 0;
+
+		if(_inRecovery) {
+			if(seqLessEqual(_recover, ack)) {
+				// Full acknowledgement: deflate the window (RFC 6582).
+				_cwnd = std::min(_ssthresh, std::max(_flightSize(), _mss) + _mss);
+				_inRecovery = false;
+				_dupAcks = 0;
+			}else{
+				// Partial acknowledgement: the next segment was lost, too.
+				_cwnd = (_cwnd > acked ? _cwnd - acked : 0) + _mss;
+				if(!_retransmitHole())
+					_retransmitFirst();
+			}
+		}else{
+			_dupAcks = 0;
+			if(_cwnd < _ssthresh) {
+				_cwnd += std::min(acked, _mss);
+			}else{
+				// Congestion avoidance: one MSS per window (RFC 5681, appropriate byte counting).
+				_bytesAcked += acked;
+				if(_bytesAcked >= _cwnd) {
+					_bytesAcked -= _cwnd;
+					_cwnd += _mss;
+				}
+			}
+		}
+		_cwnd = std::min(_cwnd, 4 * sendCapacity);
+
+		if(_flightSize()) {
+			_armRetransmit();
+		}else{
+			_retransmitDeadline = 0;
+			_rto = _haveRtt ? _rto : initialRto;
+		}
+		_notify(EPOLLOUT);
+	}else if(!segment.length && !(segment.flags & (kTcpSyn | kTcpFin))
+			&& _flightSize() && window == _sndWnd) {
+		// Duplicate ACK (RFC 5681, section 2).
+		_dupAcks++;
+		if(_inRecovery) {
+			_cwnd += _mss;
+			_retransmitHole();
+		}else if(_dupAcks == 3 && seqLess(_recover, ack)) {
+			// Fast retransmit; entering recovery again for the same window is avoided.
+			_ssthresh = std::max(_flightSize() / 2, 2 * _mss);
+			_cwnd = _ssthresh + 3 * _mss;
+			_inRecovery = true;
+			_recover = _sndMax;
+			_holeNext = _sndUna;
+			_rttTiming = false;
+			_retransmitFirst();
+		}
+	}
+
+	// Update the send window (RFC 793).
+	if(seqLess(_sndWl1, segment.seq)
+			|| (_sndWl1 == segment.seq && seqLessEqual(_sndWl2, ack))) {
+		bool opened = !_sndWnd && window;
+		_sndWnd = window;
+		_sndWl1 = segment.seq;
+		_sndWl2 = ack;
+		if(opened)
+			_notify(EPOLLOUT);
+	}
+	return true;
+}
+
+void TcpSocket::_processData(const TcpSegment &segment) {
+	uint32_t seq = segment.seq;
+	auto data = segment.payload;
+	size_t length = segment.length;
+
+	// Trim data that we already received.
+	if(seqLess(seq, _rcvNxt)) {
+		size_t skip = _rcvNxt - seq;
+		if(skip >= length) {
+			_ackNow = true;
 			return;
 		}
-		
-		if(flags & TcpFlags::kTcpAck) {
-			tcpSocket.ackedLocalSequence = netToHost<uint32_t>(tcp_header->ackNumber);
+		data += skip;
+		length -= skip;
+		seq = _rcvNxt;
+	}
+
+	// Trim data beyond the window.
+	size_t limit = seqLess(seq, _rcvAdv) ? _rcvAdv - seq : 0;
+	if(length > limit)
+		length = limit;
+	if(!length) {
+		_ackNow = true;
+		return;
+	}
+
+	if(seq != _rcvNxt) {
+		// Out-of-order data is acknowledged immediately to trigger fast retransmit.
+		_insertOutOfOrder(seq, data, length);
+		_lastOutOfOrder = seq;
+		_ackNow = true;
+		return;
+	}
+
+	_rcvNxt += _receiveBuffer.push(data, length);
+
+	if(!_reassembly.empty()) {
+		while(!_reassembly.empty()) {
+			auto &front = _reassembly.front();
+			if(seqLess(_rcvNxt, front.seq))
+				break;
+			size_t skip = _rcvNxt - front.seq;
+			if(skip < front.data.size())
+				_rcvNxt += _receiveBuffer.push(front.data.data() + skip,
+						front.data.size() - skip);
+			_reassembly.erase(_reassembly.begin());
+		}
+		// Filling a hole is acknowledged immediately (RFC 5681, section 4.2).
+		_ackNow = true;
+	}
+
+	_unackedSegments++;
+	_notify(EPOLLIN);
+
+	if(_finPending && _finSeq == _rcvNxt) {
+		_finPending = false;
+		_processFin();
+	}
+}
+
+void TcpSocket::_insertOutOfOrder(uint32_t seq, const char *data, size_t length) {
+	// Only insert the parts that are not covered by existing entries.
+	auto it = _reassembly.begin();
+	size_t progress = 0;
+	while(progress < length) {
+		auto current = seq + uint32_t(progress);
+		while(it != _reassembly.end()
+				&& seqLessEqual(it->seq + uint32_t(it->data.size()), current))
+			++it;
+
+		if(it != _reassembly.end() && seqLessEqual(it->seq, current)) {
+			size_t covered = it->seq + uint32_t(it->data.size()) - current;
+			progress += std::min(covered, length - progress);
+			continue;
 		}
 
-		size_t virtual_length = payload_length;
-		if(flags & TcpFlags::kTcpFin)
-			virtual_length++;
+		size_t piece = length - progress;
+		if(it != _reassembly.end())
+			piece = std::min(piece, size_t(it->seq - current));
+		it = _reassembly.insert(it, OutOfOrder{current, std::string(data + progress, piece)});
+		++it;
+		progress += piece;
+	}
+}
 
-		tcpSocket.expectedRemoteSequence = netToHost<uint32_t>(tcp_header->seqNumber) + virtual_length;
-		printf("        expectedRemoteSequence: %d\n", tcpSocket.expectedRemoteSequence);
+void TcpSocket::_processFin() {
+	_rcvNxt++;
+	_finReceived = true;
+	_ackNow = true;
+
+	if(_state == kStateEstablished) {
+		_state = kStateCloseWait;
+	}else if(_state == kStateFinWait1) {
+		bool fin_acked = !_sendBuffer.size() && _sndUna == _sendBase + 1;
+		if(fin_acked) {
+			_enterTimeWait();
+		}else{
+			_state = kStateClosing;
+		}
+	}else if(_state == kStateFinWait2) {
+		_enterTimeWait();
+	}
+	_notify(EPOLLIN);
+}
 
-		if(virtual_length > 0) {
-			EthernetInfo ethernet_info;
-			ethernet_info.sourceMac = localMac;
-			ethernet_info.destMac = routerMac;
-			ethernet_info.etherType = kEtherIp4;
+void TcpSocket::_updateScoreboard(const TcpSegment &segment) {
+	if(!_sackEnabled)
+		return;
 
-			Ip4Info ip_info;
-			ip_info.sourceIp = localIp;
-			ip_info.destIp = Ip4Address(173, 194, 116, 210); //www.google.com
-			ip_info.protocol = kTcpProtocol;
+	bool changed = false;
+	for(int i = 0; i < segment.numSackBlocks; i++) {
+		auto left = segment.sackBlocks[i][0];
+		auto right = segment.sackBlocks[i][1];
+		if(!seqLess(left, right) || !seqLess(_sndUna, right) || seqLess(_sndMax, right))
+			continue;
+		if(seqLess(left, _sndUna))
+			left = _sndUna;
+		_scoreboard.push_back({left, right});
+		changed = true;
+	}
+	if(!changed)
+		return;
 
-			TcpInfo tcp_info;
-			tcp_info.srcPort = 49152;
-			tcp_info.destPort = 80;
-			tcp_info.seqNumber = tcpSocket.ackedLocalSequence;
-			tcp_info.ackNumber = tcpSocket.expectedRemoteSequence;
-			tcp_info.ackFlag = true;
-			tcp_info.rstFlag = false;
-			tcp_info.synFlag = false;
-			tcp_info.finFlag = false;
+	// All entries are above _sndUna, hence the modular comparison is a strict ordering.
+	std::sort(_scoreboard.begin(), _scoreboard.end(), [] (auto &a, auto &b) {
+		return seqLess(a.first, b.first);
+	});
+	size_t n = 0;
+	for(size_t i = 1; i < _scoreboard.size(); i++) {
+		if(seqLessEqual(_scoreboard[i].first, _scoreboard[n].second)) {
+			if(seqLess(_scoreboard[n].second, _scoreboard[i].second))
+				_scoreboard[n].second = _scoreboard[i].second;
+		}else{
+			_scoreboard[++n] = _scoreboard[i];
+		}
+	}
+	_scoreboard.resize(n + 1);
+}
 
-			sendTcpPacket(*globalDevice, ethernet_info, ip_info, tcp_info, std::string());
+std::vector<std::pair<uint32_t, uint32_t>> TcpSocket::_sackBlocks() {
+	std::vector<std::pair<uint32_t, uint32_t>> blocks;
+	for(auto &entry : _reassembly) {
+		auto end = entry.seq + uint32_t(entry.data.size());
+		if(!blocks.empty() && blocks.back().second == entry.seq) {
+			blocks.back().second = end;
+		}else{
+			blocks.push_back({entry.seq, end});
 		}
+	}
+
+	// RFC 2018 requires the first block to contain the most recently received segment.
+	auto it = std::find_if(blocks.begin(), blocks.end(), [&] (auto &block) {
+		return seqLessEqual(block.first, _lastOutOfOrder) && seqLess(_lastOutOfOrder, block.second);
+	});
+	if(it != blocks.end())
+		std::rotate(blocks.begin(), it, it + 1);
+
+	if(blocks.size() > 4)
+		blocks.resize(4);
+	return blocks;
+}
+
+size_t TcpSocket::_sackOptionLength() {
+	if(!_sackEnabled || _reassembly.empty())
+		return 0;
+	return 4 + 8 * _sackBlocks().size();
+}
+
+void TcpSocket::_updateRtt(uint64_t sample) {
+	// RFC 6298, section 2.
+	if(!_haveRtt) {
+		_srtt = sample;
+		_rttvar = sample / 2;
+		_haveRtt = true;
 	}else{
-		printf("        TCP socket in illegal state\n");
+		auto delta = (_srtt > sample) ? _srtt - sample : sample - _srtt;
+		_rttvar = (3 * _rttvar + delta) / 4;
+		_srtt = (7 * _srtt + sample) / 8;
+	}
+	_rto = std::min(std::max(_srtt + std::max(clockGranularity, 4 * _rttvar), minRto), maxRto);
+}
+
+uint32_t TcpSocket::_receiveWindow() {
+	uint32_t edge = _rcvNxt + _receiveBuffer.space();
+	if(seqLessEqual(edge, _rcvAdv))
+		return _rcvAdv;
+
+	// Receiver-side silly window avoidance (RFC 1122, section 4.2.3.3).
+	if(_rcvAdv != _rcvNxt && edge - _rcvAdv < std::min(receiveCapacity / 2, defaultMss))
+		return _rcvAdv;
+	return edge;
+}
+
+void TcpSocket::_enterEstablished(const TcpSegment &segment) {
+	_state = kStateEstablished;
+	_sndWnd = uint32_t(segment.window) << ((segment.flags & kTcpSyn) ? 0 : _sndWscale);
+	_sndWl1 = segment.seq;
+	_sndWl2 = segment.ack;
+
+	// Initial window of RFC 6928.
+	_cwnd = std::min(10 * _mss, std::max(2 * _mss, size_t(14600)));
+	_retries = 0;
+	_retransmitDeadline = 0;
+	_notify(EPOLLOUT);
+}
+
+void TcpSocket::_enterTimeWait() {
+	_state = kStateTimeWait;
+	_retransmitDeadline = 0;
+	_timeWaitDeadline = currentTime() + timeWaitTimeout;
+	_updateTimer();
+	_notify(EPOLLIN | EPOLLOUT);
+}
+
+void TcpSocket::_terminate(protocols::fs::Error error) {
+	auto self = shared_from_this();
+
+	if(_state == kStateSynReceived && _passiveOpen) {
+		auto listener = _listener.lock();
+		if(listener)
+			listener->_pendingChildren--;
+	}
+
+	auto it = tcpConnections.find(connectionKey(this));
+	if(it != tcpConnections.end() && it->second.get() == this)
+		tcpConnections.erase(it);
+	auto bit = tcpBound.find(_localPort);
+	if(bit != tcpBound.end() && bit->second == this)
+		tcpBound.erase(bit);
+
+	_state = kStateClosed;
+	_error = error;
+	_scoreboard.clear();
+	_reassembly.clear();
+
+	_retransmitDeadline = 0;
+	_delayedAckDeadline = 0;
+	_timeWaitDeadline = 0;
+	if(_timerAsyncId) {
+		HEL_CHECK(helCancelAsync(helix::Dispatcher::global().acquire(), _timerAsyncId));
+		_timerAsyncId = 0;
+	}
+
+	_notify(EPOLLIN | EPOLLOUT);
+}
+
+void TcpSocket::_notify(int edges) {
+	_currentSeq++;
+	if(edges & EPOLLIN)
+		_inSeq = _currentSeq;
+	if(edges & EPOLLOUT)
+		_outSeq = _currentSeq;
+	_statusBell.ring();
+}
+
+// --------------------------------------------------------
+// TcpSocket: send path
+// --------------------------------------------------------
+
+void TcpSocket::_sendSegment(uint32_t seq, uint16_t flags, size_t offset, size_t length) {
+	std::string options;
+	if(flags & kTcpSyn) {
+		options += char(kTcpOptionMss);
+		options += char(4);
+		auto mss = localMss();
+		options += char(mss >> 8);
+		options += char(mss & 0xFF);
+		if(_windowScaling) {
+			options += char(kTcpOptionNop);
+			options += char(kTcpOptionWindowScale);
+			options += char(3);
+			options += char(_rcvWscale);
+		}
+		if(_sackEnabled) {
+			options += char(kTcpOptionNop);
+			options += char(kTcpOptionNop);
+			options += char(kTcpOptionSackPermitted);
+			options += char(2);
+		}
+	}else if((flags & kTcpAck) && _sackEnabled && !_reassembly.empty()) {
+		auto blocks = _sackBlocks();
+		options += char(kTcpOptionNop);
+		options += char(kTcpOptionNop);
+		options += char(kTcpOptionSack);
+		options += char(2 + 8 * blocks.size());
+		for(auto &block : blocks) {
+			uint32_t edges[2] = {hostToNet<uint32_t>(block.first), hostToNet<uint32_t>(block.second)};
+			options.append(reinterpret_cast<char *>(edges), sizeof(edges));
+		}
+	}
+
+	// The window field of SYN segments is never scaled (RFC 7323).
+	uint16_t window_field = 0;
+	if(!(flags & kTcpRst)) {
+		auto shift = (flags & kTcpSyn) ? 0 : _rcvWscale;
+		auto edge = _receiveWindow();
+		window_field = std::min(uint32_t(edge - _rcvNxt) >> shift, uint32_t(0xFFFF));
+		// Rounding must never shrink the window that was already announced.
+		auto announced = _rcvNxt + (uint32_t(window_field) << shift);
+		if(seqLess(_rcvAdv, announced))
+			_rcvAdv = announced;
+	}
+
+	// Copy the payload straight from the send buffer into the packet. Unless the device
+	// computes the checksum, the payload is checksummed in the same pass.
+	bool offload_checksum = globalDevice->offloads() & kNetOffloadTxChecksum;
+	PacketBuffer segment{length};
+	Checksum payload_checksum;
+	for(size_t n = 0, progress = 0; n < segment.numSegments(); n++) {
+		auto view = segment.segment(n);
+		if(offload_checksum) {
+			_sendBuffer.peek(offset + progress, view.data(), view.size());
+		}else{
+			_sendBuffer.peek(offset + progress, view.data(), view.size(), payload_checksum);
+		}
+		progress += view.size();
+	}
+
+	// _output() only sends segments that exceed the MSS if the device supports TSO.
+	size_t segment_size = _mss - options.size();
+	prependHeader(segment, _localPort, _remotePort, seq, (flags & kTcpAck) ? _rcvNxt : 0,
+			flags, window_field, options);
+	transmitSegment(_localAddress, _remoteAddress, std::move(segment), payload_checksum,
+			(length > segment_size) ? segment_size : 0);
+
+	if(flags & kTcpAck) {
+		_unackedSegments = 0;
+		_ackNow = false;
+		_delayedAckDeadline = 0;
+	}
+}
+
+void TcpSocket::_sendSyn() {
+	_sendSegment(_iss, (_state == kStateSynReceived) ? (kTcpSyn | kTcpAck) : kTcpSyn, 0, 0);
+	if(_sndNxt == _iss)
+		_sndNxt = _iss + 1;
+	if(seqLess(_sndMax, _sndNxt))
+		_sndMax = _sndNxt;
+}
+
+void TcpSocket::_sendAck() {
+	_sendSegment(_sndNxt, kTcpAck, 0, 0);
+}
+
+void TcpSocket::_sendReset(uint32_t seq) {
+	_sendSegment(seq, kTcpRst, 0, 0);
+}
+
+void TcpSocket::_output() {
+	if(_state != kStateEstablished && _state != kStateCloseWait && _state != kStateFinWait1
+			&& _state != kStateClosing && _state != kStateLastAck)
+		return;
+
+	while(true) {
+		size_t offset = _sndNxt - _sendBase;
+		if(offset > _sendBuffer.size())
+			break; // The FIN was already sent.
+		size_t available = _sendBuffer.size() - offset;
+
+		size_t window = std::min(_cwnd, size_t(_sndWnd));
+		size_t flight = _flightSize();
+		size_t usable = (window > flight) ? window - flight : 0;
+		size_t max_payload = _mss - _sackOptionLength();
+
+		// With TSO, we hand multiple segments worth of data to the device at once.
+		size_t max_length = max_payload;
+		if(globalDevice->offloads() & kNetOffloadTso)
+			max_length = (maxTsoPayload / max_payload) * max_payload;
+
+		size_t length = std::min({available, usable, max_length});
+		bool fin = _finQueued && offset + length == _sendBuffer.size();
+		if(!length && !fin)
+			break;
+		if(!length && fin && available)
+			break; // Data must be sent before the FIN.
+
+		// Nagle's algorithm (RFC 896) and sender-side silly window avoidance:
+		// hold back small segments while data is in flight.
+		if(length < max_payload && flight && !fin)
+			break;
+
+		uint16_t flags = kTcpAck;
+		if(offset + length == _sendBuffer.size() && length)
+			flags |= kTcpPsh;
+		if(fin)
+			flags |= kTcpFin;
+		_sendSegment(_sndNxt, flags, offset, length);
+
+		if(!_rttTiming && length && seqLessEqual(_sndMax, _sndNxt)) {
+			_rttTiming = true;
+			_rttSeq = _sndNxt + length;
+			_rttStart = currentTime();
+		}
+
+		_sndNxt += length + (fin ? 1 : 0);
+		if(seqLess(_sndMax, _sndNxt))
+			_sndMax = _sndNxt;
+		if(!_retransmitDeadline)
+			_armRetransmit();
+		if(fin)
+			break;
+	}
+
+	// Keep the timer running to probe zero windows.
+	if(!_retransmitDeadline && !_sndWnd && _sendBuffer.size() > size_t(_sndNxt - _sendBase))
+		_armRetransmit();
+}
+
+void TcpSocket::_retransmitFirst() {
+	size_t offset = _sndUna - _sendBase;
+	if(offset > _sendBuffer.size())
 		return;
+	size_t length = std::min(_mss - _sackOptionLength(), _sendBuffer.size() - offset);
+	bool fin = _finQueued && offset + length == _sendBuffer.size()
+			&& seqLess(_sendBase + uint32_t(_sendBuffer.size()), _sndMax);
+	if(!length && !fin)
+		return;
+
+	_sendSegment(_sndUna, kTcpAck | (fin ? kTcpFin : 0), offset, length);
+	auto end = _sndUna + uint32_t(length) + (fin ? 1 : 0);
+	if(seqLess(_holeNext, end))
+		_holeNext = end;
+	_rttTiming = false;
+}
+
+bool TcpSocket::_retransmitHole() {
+	// Data below the highest SACKed sequence number that was not SACKed is considered lost.
+	auto seq = seqLess(_holeNext, _sndUna) ? _sndUna : _holeNext;
+	for(auto &block : _scoreboard) {
+		if(seqLess(seq, block.first)) {
+			size_t offset = seq - _sendBase;
+			if(offset >= _sendBuffer.size())
+				return false;
+			size_t length = std::min({size_t(block.first - seq), _mss - _sackOptionLength(),
+					_sendBuffer.size() - offset});
+			_sendSegment(seq, kTcpAck, offset, length);
+			_holeNext = seq + uint32_t(length);
+			_rttTiming = false;
+			return true;
+		}
+		if(seqLess(seq, block.second))
+			seq = block.second;
 	}
+	return false;
+}
+
+// --------------------------------------------------------
+// TcpSocket: timers
+// --------------------------------------------------------
 
-	fwrite(payload_buffer, 1, payload_length, stdout);
+void TcpSocket::_armRetransmit() {
+	_retransmitDeadline = currentTime() + _rto;
+	_updateTimer();
 }
 
-} // namespace libnet
+void TcpSocket::_updateTimer() {
+	uint64_t deadline = 0;
+	for(auto d : {_retransmitDeadline, _delayedAckDeadline, _timeWaitDeadline})
+		if(d && (!deadline || d < deadline))
+			deadline = d;
+	if(!deadline)
+		return;
+
+	// An earlier timer recomputes the deadline when it fires.
+	if(_timerAsyncId && _timerDeadline <= deadline)
+		return;
+	if(_timerAsyncId)
+		HEL_CHECK(helCancelAsync(helix::Dispatcher::global().acquire(), _timerAsyncId));
+	_runTimer(deadline);
+}
+
+COFIBER_ROUTINE(cofiber::no_future, TcpSocket::_runTimer(uint64_t deadline), ([=] {
+	auto self = shared_from_this();
+
+	helix::AwaitClock await_clock;
+	auto &&submit = helix::submitAwaitClock(&await_clock, deadline,
+			helix::Dispatcher::global());
+	auto async_id = await_clock.asyncId();
+	_timerAsyncId = async_id;
+	_timerDeadline = deadline;
+	COFIBER_AWAIT submit.async_wait();
+	if(await_clock.error() == kHelErrCancelled)
+		COFIBER_RETURN();
+	HEL_CHECK(await_clock.error());
+
+	// The timer may have been replaced after it already completed.
+	if(_timerAsyncId != async_id)
+		COFIBER_RETURN();
+	_timerAsyncId = 0;
+
+	auto now = currentTime();
+	if(_delayedAckDeadline && _delayedAckDeadline <= now) {
+		_delayedAckDeadline = 0;
+		_sendAck();
+	}
+	if(_retransmitDeadline && _retransmitDeadline <= now) {
+		_retransmitDeadline = 0;
+		_onRetransmit();
+	}
+	if(_timeWaitDeadline && _timeWaitDeadline <= now) {
+		_timeWaitDeadline = 0;
+		_terminate(protocols::fs::Error::none);
+	}
+	_updateTimer();
+}))
+
+void TcpSocket::_onRetransmit() {
+	switch(_state) {
+	case kStateSynSent:
+	case kStateSynReceived:
+		if(++_retries > maxSynRetries) {
+			_terminate((_state == kStateSynSent || !_passiveOpen)
+					? protocols::fs::Error::connectionRefused : protocols::fs::Error::none);
+			return;
+		}
+		_rto = std::min(_rto * 2, maxRto);
+		_sendSyn();
+		_armRetransmit();
+		return;
+	case kStateEstablished:
+	case kStateCloseWait:
+	case kStateFinWait1:
+	case kStateClosing:
+	case kStateLastAck:
+		break;
+	default:
+		return;
+	}
 
+	if(!_flightSize()) {
+		// Zero window probe (RFC 1122, section 4.2.2.17).
+		size_t offset = _sndNxt - _sendBase;
+		if(!_sndWnd && offset < _sendBuffer.size()) {
+			_sendSegment(_sndNxt, kTcpAck, offset, 1);
+			_sndNxt++;
+			if(seqLess(_sndMax, _sndNxt))
+				_sndMax = _sndNxt;
+			_rto = std::min(_rto * 2, maxRto);
+			_armRetransmit();
+		}
+		return;
+	}
+
+	if(++_retries > maxRetries) {
+		printf("libnet: TCP connection timed out\n");
+		_sendReset(_sndNxt);
+		_terminate(protocols::fs::Error::connectionRefused);
+		return;
+	}
+
+	// Go back to the first unacknowledged segment and collapse the window (RFC 5681).
+	_ssthresh = std::max(_flightSize() / 2, 2 * _mss);
+	_cwnd = _mss;
+	_bytesAcked = 0;
+	_inRecovery = false;
+	_dupAcks = 0;
+	_recover = _sndMax;
+	_scoreboard.clear();
+	_rttTiming = false;
+	_sndNxt = _sndUna;
+	_holeNext = _sndUna;
+
+	_rto = std::min(_rto * 2, maxRto);
+	_retransmitDeadline = 0;
+	_output();
+	_armRetransmit();
+}
+
+// --------------------------------------------------------
+// Demultiplexing
+// --------------------------------------------------------
+
+void receiveTcpPacket(Ip4Info network_info, void *buffer, size_t length) {
+	if(length < sizeof(TcpHeader)) {
+		printf("libnet: TCP segment is too short!\n");
+		return;
+	}
+
+	if(!network_info.checksumValid) {
+		PseudoIp4Header pseudo;
+		memcpy(pseudo.sourceIp, network_info.sourceIp.octets, 4);
+		memcpy(pseudo.destIp, network_info.destIp.octets, 4);
+		pseudo.reserved = 0;
+		pseudo.protocol = kTcpProtocol;
+		pseudo.length = hostToNet<uint16_t>(length);
+
+		Checksum tcp_checksum;
+		tcp_checksum.update(&pseudo, sizeof(PseudoIp4Header));
+		tcp_checksum.update(buffer, length);
+		if(tcp_checksum.finish())
+			return;
+	}
+
+	auto header = (TcpHeader *)buffer;
+	auto flags_field = netToHost<uint16_t>(header->flags);
+	size_t header_length = (flags_field >> 12) * 4;
+	if(header_length < sizeof(TcpHeader) || header_length > length)
+		return;
+
+	TcpSegment segment;
+	segment.seq = netToHost<uint32_t>(header->seqNumber);
+	segment.ack = netToHost<uint32_t>(header->ackNumber);
+	segment.flags = flags_field & 0x3F;
+	segment.window = netToHost<uint16_t>(header->window);
+	segment.payload = (const char *)buffer + header_length;
+	segment.length = length - header_length;
+	segment.hasMss = false;
+	segment.mss = 0;
+	segment.hasWindowScale = false;
+	segment.windowScale = 0;
+	segment.sackPermitted = false;
+	segment.numSackBlocks = 0;
+
+	auto options = (const uint8_t *)buffer + sizeof(TcpHeader);
+	size_t options_length = header_length - sizeof(TcpHeader);
+	size_t offset = 0;
+	while(offset < options_length) {
+		auto kind = options[offset];
+		if(kind == kTcpOptionEnd)
+			break;
+		if(kind == kTcpOptionNop) {
+			offset++;
+			continue;
+		}
+		if(offset + 2 > options_length || options[offset + 1] < 2
+				|| offset + options[offset + 1] > options_length)
+			return;
+		auto size = options[offset + 1];
+		auto data = &options[offset + 2];
+
+		if(kind == kTcpOptionMss && size == 4) {
+			segment.hasMss = true;
+			segment.mss = (uint16_t(data[0]) << 8) | data[1];
+		}else if(kind == kTcpOptionWindowScale && size == 3) {
+			segment.hasWindowScale = true;
+			segment.windowScale = data[0];
+		}else if(kind == kTcpOptionSackPermitted && size == 2) {
+			segment.sackPermitted = true;
+		}else if(kind == kTcpOptionSack && size >= 10 && !((size - 2) % 8)) {
+			for(int i = 0; i < (size - 2) / 8 && i < 4; i++) {
+				uint32_t edges[2];
+				memcpy(edges, data + 8 * i, sizeof(edges));
+				segment.sackBlocks[i][0] = netToHost<uint32_t>(edges[0]);
+				segment.sackBlocks[i][1] = netToHost<uint32_t>(edges[1]);
+				segment.numSackBlocks = i + 1;
+			}
+		}
+		offset += size;
+	}
+
+	auto source_port = netToHost<uint16_t>(header->srcPort);
+	auto dest_port = netToHost<uint16_t>(header->destPort);
+
+	auto it = tcpConnections.find(ConnectionKey{dest_port,
+			network_info.sourceIp.toWord(), source_port});
+	if(it != tcpConnections.end()) {
+		// The map entry might be erased during processing.
+		auto socket = it->second;
+		socket->handleSegment(segment);
+		return;
+	}
+
+	auto bit = tcpBound.find(dest_port);
+	if(bit != tcpBound.end() && bit->second->state() == TcpSocket::kStateListen) {
+		if(segment.flags & kTcpRst)
+			return;
+		if(segment.flags & kTcpAck) {
+			replyReset(network_info, source_port, dest_port, segment);
+			return;
+		}
+		if(segment.flags & kTcpSyn)
+			bit->second->handleSyn(network_info, source_port, segment);
+		return;
+	}
+
+	replyReset(network_info, source_port, dest_port, segment);
+}
+
+} // namespace libnet
@@ -2,26 +2,37 @@
 #ifndef LIBNET_TCP_HPP
 #define LIBNET_TCP_HPP
 
+#include <deque>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include <async/cancellation.hpp>
+#include <async/doorbell.hpp>
+#include <async/result.hpp>
+#include <cofiber.hpp>
+#include <protocols/fs/common.hpp>
 #include "ip4.hpp"
 
 namespace libnet {
 
-struct TcpInfo {
-	uint16_t srcPort;
-	uint16_t destPort;
-	uint32_t seqNumber;
-	uint32_t ackNumber;
-	bool ackFlag, rstFlag, synFlag, finFlag;
-};
-
 enum TcpFlags {
 	kTcpFin = 1,
 	kTcpSyn = 2,
 	kTcpRst = 4,
+	kTcpPsh = 8,
 	kTcpAck = 16
 };
 
+enum TcpOptions {
+	kTcpOptionEnd = 0,
+	kTcpOptionNop = 1,
+	kTcpOptionMss = 2,
+	kTcpOptionWindowScale = 3,
+	kTcpOptionSackPermitted = 4,
+	kTcpOptionSack = 5
+};
+
 struct TcpHeader {
 	uint16_t srcPort;
 	uint16_t destPort;
@@ -32,37 +43,339 @@ struct TcpHeader {
 	uint16_t checksum;
 	uint16_t urgentPointer;
 };
+static_assert(sizeof(TcpHeader) == 20, "Bad sizeof(TcpHeader)");
+
+// Sequence number comparisons modulo 2^32.
+inline bool seqLess(uint32_t a, uint32_t b) {
+	return int32_t(a - b) < 0;
+}
+inline bool seqLessEqual(uint32_t a, uint32_t b) {
+	return int32_t(a - b) <= 0;
+}
+
+// A parsed incoming segment.
+struct TcpSegment {
+	uint32_t seq;
+	uint32_t ack;
+	uint16_t flags;
+	uint16_t window;
+	const char *payload;
+	size_t length;
+
+	// Options (only meaningful if the corresponding flag is set).
+	bool hasMss;
+	uint16_t mss;
+	bool hasWindowScale;
+	uint8_t windowScale;
+	bool sackPermitted;
+	int numSackBlocks;
+	uint32_t sackBlocks[4][2];
+
+	// Sequence space that is consumed by the segment.
+	uint32_t seqLength() const {
+		return length + ((flags & kTcpSyn) ? 1 : 0) + ((flags & kTcpFin) ? 1 : 0);
+	}
+};
+
+// Fixed-capacity byte queue that backs the send and receive buffers.
+struct TcpBuffer {
+	TcpBuffer(size_t capacity);
+
+	size_t size() {
+		return _size;
+	}
+	size_t space() {
+		return _data.size() - _size;
+	}
+	size_t capacity() {
+		return _data.size();
+	}
+
+	// Appends as many bytes as fit; returns the number of appended bytes.
+	size_t push(const void *buffer, size_t length);
 
-struct TcpSocket {
+	// Copies bytes starting at offset without removing them.
+	void peek(size_t offset, void *buffer, size_t length);
+
+	// Same as peek() but also adds the bytes to the checksum.
+	void peek(size_t offset, void *buffer, size_t length, Checksum &checksum);
+
+	void discard(size_t length);
+
+private:
+	std::vector<char> _data;
+	size_t _head;
+	size_t _size;
+};
+
+// Transmission control block of a single TCP connection (or a listening socket).
+// Implements the state machine of RFC 793, retransmission timers (RFC 6298),
+// NewReno congestion control (RFC 5681, RFC 6582) with SACK-based retransmission
+// of holes (RFC 2018), window scaling (RFC 7323) and delayed ACKs.
+struct TcpSocket : std::enable_shared_from_this<TcpSocket> {
 	enum State {
-		kStateNone,
+		kStateClosed,
+		kStateListen,
 		kStateSynSent,
-		kStateEstablished
+		kStateSynReceived,
+		kStateEstablished,
+		kStateFinWait1,
+		kStateFinWait2,
+		kStateCloseWait,
+		kStateClosing,
+		kStateLastAck,
+		kStateTimeWait
 	};
 
-	TcpSocket();
+	static constexpr size_t sendCapacity = 256 * 1024;
+	static constexpr size_t receiveCapacity = 256 * 1024;
+	static constexpr size_t backlog = 128;
 
-	void connect();
+	// Timer constants (in nanoseconds).
+	static constexpr uint64_t initialRto = 1'000'000'000;
+	static constexpr uint64_t minRto = 200'000'000;
+	static constexpr uint64_t maxRto = 60'000'000'000;
+	static constexpr uint64_t delayedAckTimeout = 40'000'000;
+	static constexpr uint64_t timeWaitTimeout = 60'000'000'000;
 
-	State state;
+	static constexpr int maxSynRetries = 6;
+	static constexpr int maxRetries = 15;
 
-	// number of the latest byte the remote end has ACKed
-	uint32_t ackedLocalSequence;
+	TcpSocket(bool non_block);
 
-	// number of byte we expect to receive next
-	uint32_t expectedRemoteSequence;
+	TcpSocket(const TcpSocket &) = delete;
 
-	//std::queue<std::string> resendQueue;
-};
+	TcpSocket &operator= (const TcpSocket &) = delete;
+
+	// ----------------------------------------------------------------------
+	// Socket API.
+	// ----------------------------------------------------------------------
+
+	// Port zero selects an ephemeral port.
+	protocols::fs::Error bind(Ip4Address address, uint16_t port);
+
+	// Active open. Completes once the handshake finished (or failed).
+	async::result<protocols::fs::Error> connect(Ip4Address address, uint16_t port);
+
+	protocols::fs::Error listen();
+
+	async::result<std::shared_ptr<TcpSocket>> accept();
+
+	// Returns zero at the end of the stream.
+	async::result<protocols::fs::ReadResult> read(void *buffer, size_t length);
+
+	// Completes once all data is in the send buffer.
+	async::result<protocols::fs::Error> write(const void *buffer, size_t length);
+
+	async::result<protocols::fs::PollResult> poll(uint64_t sequence,
+			async::cancellation_token cancellation);
+
+	// Called when the last file referring to the socket is closed.
+	void close();
+
+	State state() {
+		return _state;
+	}
+
+	Ip4Address localAddress() {
+		return _localAddress;
+	}
+	uint16_t localPort() {
+		return _localPort;
+	}
+	Ip4Address remoteAddress() {
+		return _remoteAddress;
+	}
+	uint16_t remotePort() {
+		return _remotePort;
+	}
+
+	// ----------------------------------------------------------------------
+	// Receive path.
+	// ----------------------------------------------------------------------
 
-extern TcpSocket tcpSocket;
+	// Handles a SYN that arrived at a listening socket.
+	void handleSyn(Ip4Info network_info, uint16_t port, const TcpSegment &segment);
 
-void sendTcpPacket(NetDevice &device, EthernetInfo link_info, Ip4Info network_info, 
-		TcpInfo transport_info, std::string payload);
+	void handleSegment(const TcpSegment &segment);
 
-void receiveTcpPacket(void *buffer, size_t length);
+private:
+	// Segment transmission.
+	void _sendSegment(uint32_t seq, uint16_t flags, size_t offset, size_t length);
+	void _sendSyn();
+	void _sendAck();
+	void _sendReset(uint32_t seq);
+
+	// Sends as much new (or retransmitted) data as the windows allow.
+	void _output();
+
+	// Retransmits the first unacknowledged segment (or the next SACK hole).
+	void _retransmitFirst();
+	bool _retransmitHole();
+
+	// Returns false if the segment must be dropped.
+	bool _processAck(const TcpSegment &segment);
+	void _processData(const TcpSegment &segment);
+	void _processFin();
+	void _insertOutOfOrder(uint32_t seq, const char *data, size_t length);
+
+	void _updateRtt(uint64_t sample);
+	void _updateScoreboard(const TcpSegment &segment);
+
+	// Contiguous ranges of out-of-order data, most recent one first.
+	std::vector<std::pair<uint32_t, uint32_t>> _sackBlocks();
+	size_t _sackOptionLength();
+
+	// Right edge of the receive window that we are willing to announce.
+	uint32_t _receiveWindow();
+
+	size_t _flightSize() {
+		return _sndNxt - _sndUna;
+	}
+
+	void _enterEstablished(const TcpSegment &segment);
+	void _enterTimeWait();
+
+	// Removes the connection from all tables and wakes up all waiters.
+	void _terminate(protocols::fs::Error error);
+
+	// Wakes up waiters; edges is a mask of EPOLLIN and EPOLLOUT.
+	void _notify(int edges);
+
+	// Timers.
+	void _armRetransmit();
+	void _updateTimer();
+	cofiber::no_future _runTimer(uint64_t deadline);
+	void _onRetransmit();
+
+	bool _nonBlock;
+	State _state;
+	bool _userClosed;
+
+	// Error that is reported to the user once the connection terminated.
+	protocols::fs::Error _error;
+	bool _reset;
+
+	Ip4Address _localAddress;
+	uint16_t _localPort;
+	Ip4Address _remoteAddress;
+	uint16_t _remotePort;
+
+	// Connections that were created by a listening socket refer to it until they are accepted.
+	bool _passiveOpen;
+	std::weak_ptr<TcpSocket> _listener;
+	// Listening sockets: connections that completed the handshake.
+	std::deque<std::shared_ptr<TcpSocket>> _acceptQueue;
+	size_t _pendingChildren;
+
+	// ----------------------------------------------------------------------
+	// Send sequence space.
+	// ----------------------------------------------------------------------
+
+	uint32_t _iss;
+	uint32_t _sndUna;
+	uint32_t _sndNxt;
+	// Highest sequence number that was ever sent (sndNxt is reset on timeouts).
+	uint32_t _sndMax;
+	uint32_t _sndWnd;
+	uint32_t _sndWl1;
+	uint32_t _sndWl2;
+	uint8_t _sndWscale;
+	size_t _mss;
+	// Negotiated options (offered in our SYN until the peer answers).
+	bool _windowScaling;
+	bool _sackEnabled;
+
+	// Sequence number of the first byte in _sendBuffer.
+	uint32_t _sendBase;
+	TcpBuffer _sendBuffer;
+	bool _finQueued;
+
+	// SACK scoreboard: disjoint, sorted ranges above _sndUna that the peer has received.
+	std::vector<std::pair<uint32_t, uint32_t>> _scoreboard;
+
+	// ----------------------------------------------------------------------
+	// Congestion control.
+	// ----------------------------------------------------------------------
+
+	size_t _cwnd;
+	size_t _ssthresh;
+	size_t _bytesAcked;
+	int _dupAcks;
+	bool _inRecovery;
+	uint32_t _recover;
+	// Next sequence number that may be retransmitted during recovery.
+	uint32_t _holeNext;
+
+	// ----------------------------------------------------------------------
+	// Round-trip time estimation.
+	// ----------------------------------------------------------------------
+
+	bool _rttTiming;
+	uint32_t _rttSeq;
+	uint64_t _rttStart;
+	bool _haveRtt;
+	uint64_t _srtt;
+	uint64_t _rttvar;
+	uint64_t _rto;
+	int _retries;
+
+	// ----------------------------------------------------------------------
+	// Receive sequence space.
+	// ----------------------------------------------------------------------
+
+	uint32_t _irs;
+	uint32_t _rcvNxt;
+	// Right edge of the window that we announced last.
+	uint32_t _rcvAdv;
+	uint8_t _rcvWscale;
+
+	TcpBuffer _receiveBuffer;
+	bool _finReceived;
+	// A FIN that arrived out of order; it is processed once the preceding data is complete.
+	bool _finPending;
+	uint32_t _finSeq;
+
+	// Out-of-order segments, sorted by sequence number.
+	struct OutOfOrder {
+		uint32_t seq;
+		std::string data;
+	};
+	std::vector<OutOfOrder> _reassembly;
+	// Sequence number of the most recently received out-of-order segment
+	// (it is reported in the first SACK block).
+	uint32_t _lastOutOfOrder;
+
+	// Number of data segments that were received since the last ACK.
+	int _unackedSegments;
+	// Set if the next ACK must not be delayed.
+	bool _ackNow;
+
+	// ----------------------------------------------------------------------
+	// Timers.
+	// ----------------------------------------------------------------------
+
+	// Absolute deadlines (in nanoseconds); zero if inactive.
+	uint64_t _retransmitDeadline;
+	uint64_t _delayedAckDeadline;
+	uint64_t _timeWaitDeadline;
+
+	// Currently armed clock operation.
+	uint64_t _timerAsyncId;
+	uint64_t _timerDeadline;
+
+	// ----------------------------------------------------------------------
+	// Synchronization with the user.
+	// ----------------------------------------------------------------------
+
+	uint64_t _currentSeq;
+	uint64_t _inSeq;
+	uint64_t _outSeq;
+	async::doorbell _statusBell;
+};
+
+void receiveTcpPacket(Ip4Info network_info, void *buffer, size_t length);
 
 } // namespace libnet
 
 #endif // LIBNET_TCP_HPP
-
@@ -1,16 +1,177 @@
 
+#include <sys/epoll.h>
+#include <unordered_map>
+
 #include <libnet.hpp>
+#include "dhcp.hpp"
 #include "udp.hpp"
-#include "usernet.hpp"
 
 namespace libnet {
 
-void sendUdpPacket(NetDevice &device, EthernetInfo link_info, Ip4Info network_info, 
-		UdpInfo transport_info, std::string payload) {
+namespace {
+	constexpr uint16_t ephemeralBase = 49152;
+
+	std::unordered_map<uint16_t, UdpSocket *> udpPorts;
+	uint16_t nextEphemeral = ephemeralBase;
+
+	uint16_t allocatePort() {
+		for(int i = 0; i < 65536 - ephemeralBase; i++) {
+			auto port = nextEphemeral;
+			nextEphemeral = (nextEphemeral == 65535) ? ephemeralBase : nextEphemeral + 1;
+			if(udpPorts.find(port) == udpPorts.end())
+				return port;
+		}
+		return 0;
+	}
+}
+
+UdpSocket::UdpSocket(bool non_block)
+: _nonBlock{non_block}, _localPort{0}, _connected{false}, _remotePort{0},
+		_queuedBytes{0}, _currentSeq{1}, _inSeq{0} { }
+
+protocols::fs::Error UdpSocket::bind(Ip4Address address, uint16_t port) {
+	if(_localPort)
+		return protocols::fs::Error::illegalArguments;
+	if(address != Ip4Address() && address != localIp)
+		return protocols::fs::Error::illegalArguments;
+
+	if(!port) {
+		port = allocatePort();
+		if(!port)
+			return protocols::fs::Error::addressInUse;
+	}else if(udpPorts.find(port) != udpPorts.end()) {
+		return protocols::fs::Error::addressInUse;
+	}
+
+	_localAddress = address;
+	_localPort = port;
+	udpPorts.insert({port, this});
+	return protocols::fs::Error::none;
+}
+
+protocols::fs::Error UdpSocket::connect(Ip4Address address, uint16_t port) {
+	if(!port)
+		return protocols::fs::Error::illegalArguments;
+	if(!_localPort) {
+		auto error = bind(Ip4Address(), 0);
+		if(error != protocols::fs::Error::none)
+			return error;
+	}
+
+	_connected = true;
+	_remoteAddress = address;
+	_remotePort = port;
+	return protocols::fs::Error::none;
+}
+
+COFIBER_ROUTINE(async::result<protocols::fs::ReadResult>,
+UdpSocket::read(void *buffer, size_t length), ([=] {
+	while(_queue.empty()) {
+		if(_nonBlock)
+			COFIBER_RETURN(protocols::fs::Error::wouldBlock);
+		COFIBER_AWAIT _statusBell.async_wait();
+	}
+
+	auto datagram = std::move(_queue.front());
+	_queue.pop_front();
+	_queuedBytes -= datagram.payload.size();
+
+	auto chunk = std::min(length, datagram.payload.size());
+	memcpy(buffer, datagram.payload.data(), chunk);
+	COFIBER_RETURN(chunk);
+}))
+
+protocols::fs::Error UdpSocket::write(const void *buffer, size_t length) {
+	if(!_connected)
+		return protocols::fs::Error::notConnected;
+	if(length > 65535 - sizeof(UdpHeader) - sizeof(Ip4Header))
+		return protocols::fs::Error::illegalArguments;
+
+	Ip4Info network_info;
+	network_info.sourceIp = localIp;
+	network_info.destIp = _remoteAddress;
+	network_info.protocol = kUdpProtocol;
+
+	UdpInfo transport_info;
+	transport_info.sourcePort = _localPort;
+	transport_info.destPort = _remotePort;
+
+	// Checksum the payload while it is copied into the packet
+	// (unless the device computes the checksum).
+	PacketBuffer packet{length};
+	Checksum payload_checksum;
+	if(globalDevice->offloads() & kNetOffloadTxChecksum) {
+		packet.write(0, buffer, length);
+	}else{
+		auto p = static_cast<const char *>(buffer);
+		for(size_t n = 0; n < packet.numSegments(); n++) {
+			auto view = packet.segment(n);
+			payload_checksum.copyAndUpdate(view.data(), p, view.size());
+			p += view.size();
+		}
+	}
+	sendUdpPacket(network_info, transport_info, std::move(packet), payload_checksum);
+	return protocols::fs::Error::none;
+}
+
+COFIBER_ROUTINE(async::result<protocols::fs::PollResult>,
+UdpSocket::poll(uint64_t past_seq, async::cancellation_token cancellation), ([=] {
+	assert(past_seq <= _currentSeq);
+	while(past_seq == _currentSeq && !cancellation.is_cancellation_requested())
+		COFIBER_AWAIT _statusBell.async_wait(cancellation);
+
+	// We never queue outgoing datagrams, hence the socket is always writable.
+	int edges = EPOLLOUT;
+	if(_inSeq > past_seq)
+		edges |= EPOLLIN;
+
+	int events = EPOLLOUT;
+	if(!_queue.empty())
+		events |= EPOLLIN;
+
+	COFIBER_RETURN(protocols::fs::PollResult(_currentSeq, edges, events));
+}))
+
+void UdpSocket::close() {
+	if(_localPort) {
+		udpPorts.erase(_localPort);
+		_localPort = 0;
+	}
+	_queue.clear();
+	_queuedBytes = 0;
+}
+
+void UdpSocket::deliver(Ip4Info network_info, uint16_t port,
+		const void *buffer, size_t length) {
+	if(_connected && (network_info.sourceIp != _remoteAddress || port != _remotePort))
+		return;
+	if(_queuedBytes + length > receiveCapacity)
+		return;
+
+	Datagram datagram;
+	datagram.address = network_info.sourceIp;
+	datagram.port = port;
+	datagram.payload.assign(static_cast<const char *>(buffer), length);
+	_queue.push_back(std::move(datagram));
+	_queuedBytes += length;
+
+	_inSeq = ++_currentSeq;
+	_statusBell.ring();
+}
+
+void sendUdpPacket(Ip4Info network_info, UdpInfo transport_info, PacketBuffer packet) {
+	Checksum payload_checksum;
+	if(!(globalDevice->offloads() & kNetOffloadTxChecksum))
+		payload_checksum.update(packet);
+	sendUdpPacket(network_info, transport_info, std::move(packet), payload_checksum);
+}
+
+void sendUdpPacket(Ip4Info network_info, UdpInfo transport_info, PacketBuffer packet,
+		const Checksum &payload_checksum) {
 	UdpHeader header;
 	header.source = hostToNet<uint16_t>(transport_info.sourcePort);
 	header.destination = hostToNet<uint16_t>(transport_info.destPort);
-	header.length = hostToNet<uint16_t>(sizeof(UdpHeader) + payload.length());
+	header.length = hostToNet<uint16_t>(sizeof(UdpHeader) + packet.size());
 	header.checksum = 0;
 
 	// calculate the UDP checksum
@@ -19,46 +180,72 @@ void sendUdpPacket(NetDevice &device, EthernetInfo link_info, Ip4Info network_in
 	memcpy(pseudo.destIp, network_info.destIp.octets, 4);
 	pseudo.reserved = 0;
 	pseudo.protocol = kUdpProtocol;
-	pseudo.length = hostToNet<uint16_t>(sizeof(UdpHeader) + payload.length());
+	pseudo.length = header.length;
+
+	auto udp_header = static_cast<UdpHeader *>(packet.prepend(sizeof(UdpHeader)));
+	memcpy(udp_header, &header, sizeof(UdpHeader));
 
 	Checksum udp_checksum;
 	udp_checksum.update(&pseudo, sizeof(PseudoIp4Header));
-	udp_checksum.update(&header, sizeof(UdpHeader));
-	udp_checksum.update(payload.data(), payload.size());
-	header.checksum = hostToNet<uint16_t>(udp_checksum.finish());
-
-	std::string packet(sizeof(UdpHeader) + payload.length(), 0);
-	memcpy(&packet[0], &header, sizeof(UdpHeader));
-	memcpy(&packet[sizeof(UdpHeader)], payload.data(), payload.length());
+	if(globalDevice->offloads() & kNetOffloadTxChecksum) {
+		// The device expects the non-inverted pseudo header sum.
+		udp_header->checksum = hostToNet<uint16_t>(udp_checksum.fold());
+		packet.requestChecksum(offsetof(UdpHeader, checksum));
+	}else{
+		udp_checksum.update(udp_header, sizeof(UdpHeader));
+		udp_checksum.update(payload_checksum);
+		// Zero means "no checksum" in UDP; transmit the equivalent 0xFFFF instead.
+		auto sum = udp_checksum.finish();
+		udp_header->checksum = hostToNet<uint16_t>(sum ? sum : 0xFFFF);
+	}
 
-	sendIp4Packet(device, link_info, network_info, packet);
+	sendIp4Packet(network_info, std::move(packet));
 }
 
-void receiveUdpPacket(EthernetInfo link_info, Ip4Info network_info, void *buffer, size_t length) {
+void receiveUdpPacket(Ip4Info network_info, void *buffer, size_t length) {
 	if(length < sizeof(UdpHeader)) {
 		printf("Udp packet is too short!\n");
 		return;
 	}
 
 	auto udp_header = (UdpHeader *)buffer;
-	
-	printf("        UDP header. srcPort: %d, destPort: %d\n", netToHost<uint16_t>(udp_header->source),
-			netToHost<uint16_t>(udp_header->destination));
-
-	if(netToHost<uint16_t>(udp_header->length) != length) {
+	auto udp_length = netToHost<uint16_t>(udp_header->length);
+	if(udp_length < sizeof(UdpHeader) || udp_length > length) {
 		printf("        UDP: Invalid length!\n");
 		return;
 	}
 
+	if(udp_header->checksum && !network_info.checksumValid) {
+		PseudoIp4Header pseudo;
+		memcpy(pseudo.sourceIp, network_info.sourceIp.octets, 4);
+		memcpy(pseudo.destIp, network_info.destIp.octets, 4);
+		pseudo.reserved = 0;
+		pseudo.protocol = kUdpProtocol;
+		pseudo.length = udp_header->length;
+
+		Checksum udp_checksum;
+		udp_checksum.update(&pseudo, sizeof(PseudoIp4Header));
+		udp_checksum.update(buffer, udp_length);
+		if(udp_checksum.finish()) {
+			printf("        UDP: Bad checksum!\n");
+			return;
+		}
+	}
+
 	void *payload_buffer = (char *)buffer + sizeof(UdpHeader);
-	size_t payload_length = length - sizeof(UdpHeader);
+	size_t payload_length = udp_length - sizeof(UdpHeader);
+	auto source_port = netToHost<uint16_t>(udp_header->source);
+	auto dest_port = netToHost<uint16_t>(udp_header->destination);
+
+	if(source_port == kDhcpServerPort && dest_port == kDhcpClientPort) {
+		receiveDhcpPacket(network_info, payload_buffer, payload_length);
+		return;
+	}
 
-	if(netToHost<uint16_t>(udp_header->source) == 67
-			&& netToHost<uint16_t>(udp_header->destination) == 68)
-		receivePacket(link_info, network_info, payload_buffer, payload_length);
-	if(netToHost<uint16_t>(udp_header->source) == 53)
-		receiveDnsPacket(payload_buffer, payload_length);
+	auto it = udpPorts.find(dest_port);
+	if(it == udpPorts.end())
+		return;
+	it->second->deliver(network_info, source_port, payload_buffer, payload_length);
 }
 
 } // namespace libnet
-
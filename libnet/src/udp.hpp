@@ -2,7 +2,13 @@
 #ifndef LIBNET_UDP_HPP
 #define LIBNET_UDP_HPP
 
+#include <deque>
 #include <string>
+
+#include <async/cancellation.hpp>
+#include <async/doorbell.hpp>
+#include <async/result.hpp>
+#include <protocols/fs/common.hpp>
 #include "ip4.hpp"
 
 namespace libnet {
@@ -18,13 +24,78 @@ struct UdpHeader {
 	uint16_t length;
 	uint16_t checksum;
 };
+static_assert(sizeof(UdpHeader) == 8, "Bad sizeof(UdpHeader)");
+
+struct UdpSocket {
+	// Upper bound on the payload bytes that are queued for reading.
+	static constexpr size_t receiveCapacity = 256 * 1024;
+
+	UdpSocket(bool non_block);
+
+	UdpSocket(const UdpSocket &) = delete;
+
+	UdpSocket &operator= (const UdpSocket &) = delete;
+
+	// Port zero selects an ephemeral port.
+	protocols::fs::Error bind(Ip4Address address, uint16_t port);
+
+	// Restricts the socket to datagrams from this peer and sets the destination of write().
+	protocols::fs::Error connect(Ip4Address address, uint16_t port);
+
+	// Returns a single datagram; excess bytes are discarded.
+	async::result<protocols::fs::ReadResult> read(void *buffer, size_t length);
+
+	protocols::fs::Error write(const void *buffer, size_t length);
+
+	async::result<protocols::fs::PollResult> poll(uint64_t sequence,
+			async::cancellation_token cancellation);
+
+	Ip4Address localAddress() {
+		return _localAddress;
+	}
+	uint16_t localPort() {
+		return _localPort;
+	}
+
+	void close();
+
+	// Called by the receive path.
+	void deliver(Ip4Info network_info, uint16_t port, const void *buffer, size_t length);
+
+private:
+	struct Datagram {
+		Ip4Address address;
+		uint16_t port;
+		std::string payload;
+	};
+
+	bool _nonBlock;
+
+	Ip4Address _localAddress;
+	uint16_t _localPort;
+
+	bool _connected;
+	Ip4Address _remoteAddress;
+	uint16_t _remotePort;
+
+	std::deque<Datagram> _queue;
+	size_t _queuedBytes;
+
+	uint64_t _currentSeq;
+	uint64_t _inSeq;
+	async::doorbell _statusBell;
+};
 
-void sendUdpPacket(NetDevice &device, EthernetInfo link_info, Ip4Info network_info, 
-		UdpInfo transport_info, std::string payload);
+void sendUdpPacket(Ip4Info network_info, UdpInfo transport_info, PacketBuffer packet);
 
-void receiveUdpPacket(EthernetInfo link_info, Ip4Info network_info, void *buffer, size_t length);
+// Same as above but the checksum of the payload was already computed
+// (usually while it was copied into the packet). It is ignored if the
+// device computes checksums.
+void sendUdpPacket(Ip4Info network_info, UdpInfo transport_info, PacketBuffer packet,
+		const Checksum &payload_checksum);
+
+void receiveUdpPacket(Ip4Info network_info, void *buffer, size_t length);
 
 } // namespace libnet
 
 #endif // LIBNET_UDP_HPP
-
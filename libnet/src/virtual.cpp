@@ -0,0 +1,80 @@
+
+#include <stdio.h>
+
+#include <libnet.hpp>
+#include "ethernet.hpp"
+
+namespace libnet {
+
+VirtualDevice::VirtualDevice(size_t mtu)
+: _peer{this}, _mtu{mtu}, _offloads{0}, _lossRate{0} {
+	assert(mtu >= 576 && mtu <= 65535);
+	_handler = [] (void *buffer, size_t length, unsigned int flags) {
+		onReceive(buffer, length, flags);
+	};
+	_processReceive();
+}
+
+void VirtualDevice::connect(VirtualDevice *a, VirtualDevice *b) {
+	assert(a->_mtu == b->_mtu);
+	a->_peer = b;
+	b->_peer = a;
+}
+
+void VirtualDevice::setLossRate(double rate, uint32_t seed) {
+	assert(rate >= 0 && rate < 1);
+	_lossRate = rate;
+	_random.seed(seed);
+}
+
+void VirtualDevice::sendPacket(PacketBuffer packet) {
+	auto size = packet.size();
+	if(size > sizeof(EthernetHeader) + _mtu) {
+		printf("libnet: Virtual device drops frame of %zu bytes (MTU is %zu)\n", size, _mtu);
+		_stats.oversized++;
+		return;
+	}
+
+	_stats.txFrames++;
+	_stats.txBytes += size;
+
+	if(_lossRate && std::bernoulli_distribution{_lossRate}(_random)) {
+		_stats.lost++;
+		return;
+	}
+
+	_peer->_receiveQueue.push_back(std::move(packet));
+	_peer->_receiveDoorbell.ring();
+}
+
+COFIBER_ROUTINE(cofiber::no_future, VirtualDevice::_processReceive(), ([=] {
+	while(true) {
+		if(_receiveQueue.empty()) {
+			COFIBER_AWAIT _receiveDoorbell.async_wait();
+			continue;
+		}
+
+		auto packet = std::move(_receiveQueue.front());
+		_receiveQueue.pop_front();
+
+		auto size = packet.size();
+		_stats.rxFrames++;
+		_stats.rxBytes += size;
+
+		// Checksums that the sender offloaded to us were never computed.
+		unsigned int flags = 0;
+		if(packet.needsChecksum())
+			flags |= kReceiveChecksumValid;
+
+		if(packet.numSegments() == 1) {
+			auto view = packet.segment(0);
+			_handler(view.data(), view.size(), flags);
+		}else{
+			_linearBuffer.resize(size);
+			packet.read(0, _linearBuffer.data(), size);
+			_handler(_linearBuffer.data(), size, flags);
+		}
+	}
+}))
+
+} // namespace libnet
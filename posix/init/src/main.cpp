@@ -29,6 +29,18 @@ int main() {
 		execl("/bin/runsvr", "runsvr", "/sbin/virtio-block", nullptr);
 	}else assert(virtio != -1);
 
+	// Only started once an AHCI controller (PCI class 01:06:01) shows up.
+	auto block_ahci = fork();
+	if(!block_ahci) {
+		execl("/bin/runsvr", "runsvr-pci", "010601", "/sbin/block-ahci", nullptr);
+	}else assert(block_ahci != -1);
+
+	// Only started once an NVMe controller (PCI class 01:08:02) shows up.
+	auto block_nvme = fork();
+	if(!block_nvme) {
+		execl("/bin/runsvr", "runsvr-pci", "010802", "/sbin/block-nvme", nullptr);
+	}else assert(block_nvme != -1);
+
 /*
 	auto block_ata = fork();
 	if(!block_ata) {
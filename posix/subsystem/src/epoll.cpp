@@ -18,7 +18,7 @@ struct OpenFile : File {
 	// Internal API.
 	// ------------------------------------------------------------------------
 private:
-	// Lifetime management: There are the following three state bits for each item.
+	// Lifetime management: There are the following four state bits for each item.
 	// Items are deleted once all state bits are zero.
 	// Items must only be accessed while a precondition guarantees that
 	// at least one state bit is non-zero.
@@ -26,12 +26,37 @@ private:
 	static constexpr State stateActive = 1;
 	static constexpr State statePolling = 2;
 	static constexpr State statePending = 4;
+	static constexpr State stateObserving = 8;
 
-	struct Item : boost::intrusive::list_base_hook<> {
+	// Flags that control how an item is reported (as opposed to events that are reported).
+	static constexpr int modeFlags = EPOLLET | EPOLLONESHOT;
+
+	// Items are either watched through a StatusObserver (if the file supports it)
+	// or through a poll() that is kept in flight. In the former case, no coroutine
+	// exists per item and readiness is pushed into the _pendingQueue directly.
+	struct Item final : boost::intrusive::list_base_hook<>, StatusObserver {
 		Item(smarter::shared_ptr<OpenFile> epoll, Process *process,
 				smarter::shared_ptr<File> file, int mask, uint64_t cookie)
 		: epoll{epoll}, state{stateActive}, process{process},
-				file{std::move(file)}, eventMask{mask}, cookie{cookie} { }
+				file{std::move(file)}, eventMask{mask}, cookie{cookie},
+				disabled{false}, dirty{false}, repolling{false} { }
+
+		void statusChanged(File *) override {
+			auto self = epoll.get();
+			assert(state & stateObserving);
+			if(!(state & stateActive) || disabled)
+				return;
+
+			if(state & statePending) {
+				// The item might currently be checked by waitForEvents().
+				// Make sure that it is re-checked afterwards.
+				if(!is_linked())
+					dirty = true;
+				return;
+			}
+
+			self->_makePending(this);
+		}
 
 		smarter::shared_ptr<OpenFile> epoll;
 		State state;
@@ -42,10 +67,47 @@ private:
 		int eventMask;
 		uint64_t cookie;
 
+		// Set for EPOLLONESHOT items that were already reported.
+		bool disabled;
+
+		// Set if the status changed while the item was being checked.
+		bool dirty;
+
+		// Set while the item is linked into the local repoll queue of waitForEvents()
+		// instead of the _pendingQueue.
+		bool repolling;
+
 		async::cancellation_event cancelPoll;
 		expected<PollResult> pollFuture;
 	};
 
+	static void _deleteIfDead(Item *item) {
+		if(!item->state)
+			delete item;
+	}
+
+	void _makePending(Item *item) {
+		assert(!(item->state & statePending));
+		item->state |= statePending;
+		_pendingQueue.push_back(*item);
+		_currentSeq++;
+		_statusBell.ring();
+		notifyStatusObservers();
+	}
+
+	// Starts watching an item that has no pending events.
+	static void _watchItem(Item *item, uint64_t sequence) {
+		if(item->state & (stateObserving | statePolling))
+			return;
+
+		item->state |= statePolling;
+		item->cancelPoll.reset();
+		item->pollFuture = item->file->poll(item->process, sequence, item->cancelPoll);
+		item->pollFuture.then([item] {
+			_awaitPoll(item);
+		});
+	}
+
 	static void _awaitPoll(Item *item) {
 		assert(item->state & statePolling);
 		auto self = item->epoll.get();
@@ -54,35 +116,31 @@ private:
 		assert(item->pollFuture.ready());
 		auto result_or_error = std::move(item->pollFuture.value());
 		item->pollFuture = expected<PollResult>{};
+		item->state &= ~statePolling;
 
 		// Discard non-active and closed items.
 		if(!(item->state & stateActive)) {
-			item->state &= ~statePolling;
-			// TODO: We might have polling + pending items in the future.
-			assert(!item->state);
-			delete item;
+			_deleteIfDead(item);
 			return;
 		}
 
 		auto error = std::get_if<Error>(&result_or_error);
 		if(error) {
 			assert(*error == Error::fileClosed);
-			item->state &= ~statePolling;
-			if(!item->state)
-				delete item;
 			return;
 		}
-		
-		// TODO: Ignore items that are already pending.
-		// This will happen once we implement modifyItem().
-		assert(!(item->state & statePending));
+
+		// The item might have become pending through modifyItem().
+		// In this case, waitForEvents() re-arms the poll() if necessary.
+		if((item->state & statePending) || item->disabled)
+			return;
 
 		// Note that items only become pending if there is an edge.
 		// This is the correct behavior for edge-triggered items.
 		// Level-triggered items stay pending until the event disappears.
 		auto result = std::get<PollResult>(result_or_error);
-		if((std::get<1>(result) & (item->eventMask | EPOLLHUP))
-				&& (std::get<2>(result) & (item->eventMask | EPOLLHUP))) {
+		auto mask = (item->eventMask & ~modeFlags) | EPOLLHUP | EPOLLERR;
+		if((std::get<1>(result) & mask) && (std::get<2>(result) & mask)) {
 			if(logEpoll)
 				std::cout << "posix.epoll \e[1;34m" << item->epoll->structName() << "\e[0m"
 						<< ": Item \e[1;34m" << item->file->structName()
@@ -90,12 +148,7 @@ private:
 
 			// Note that we stop watching once an item becomes pending.
 			// We do this as we have to poll() again anyway before we report the item.
-			item->state &= ~statePolling;
-			item->state |= statePending;
-
-			self->_pendingQueue.push_back(*item);
-			self->_currentSeq++;
-			self->_statusBell.ring();
+			self->_makePending(item);
 		}else{
 			// Here, we assume that the lambda does not execute on the current stack.
 			// TODO: Use some callback queueing mechanism to ensure this.
@@ -105,12 +158,7 @@ private:
 						<< "\e[0m still not pending after poll()."
 						<< " Mask is " << item->eventMask << ", while "
 						<< std::get<2>(result) << " is active" << std::endl;
-			item->cancelPoll.reset();
-			item->pollFuture = item->file->poll(item->process, std::get<0>(result),
-					item->cancelPoll);
-			item->pollFuture.then([item] {
-				_awaitPoll(item);
-			});
+			_watchItem(item, std::get<0>(result));
 		}
 	}
 
@@ -128,6 +176,12 @@ public:
 		auto item = new Item{smarter::static_pointer_cast<OpenFile>(weakFile().lock()),
 				process, std::move(file), mask, cookie};
 
+		if(item->file->hasStatusObservers()) {
+			item->state |= stateObserving;
+			item->file->attachStatusObserver(item);
+		}
+
+		// Check the item once; this picks up events that are already active.
 		item->state |= statePolling;
 		item->pollFuture = item->file->checkStatus(item->process);
 		item->pollFuture.then([item] {
@@ -136,10 +190,26 @@ public:
 
 		_fileMap.insert({item->file.get(), item});
 	}
-	
+
 	void modifyItem(File *file, int mask, uint64_t cookie) {
-		std::cout << "posix.epoll \e[1;34m" << structName() << "\e[0m: Modifying item \e[1;34m"
-				<< file->structName() << "\e[0m. New mask is " << mask << std::endl;
+		if(logEpoll)
+			std::cout << "posix.epoll \e[1;34m" << structName() << "\e[0m: Modifying item \e[1;34m"
+					<< file->structName() << "\e[0m. New mask is " << mask << std::endl;
+		auto it = _fileMap.find(file);
+		assert(it != _fileMap.end());
+		auto item = it->second;
+		assert(item->state & stateActive);
+
+		item->eventMask = mask;
+		item->cookie = cookie;
+		item->disabled = false;
+
+		// Re-check the item as the new mask might match events that are already active.
+		if(!(item->state & statePending)) {
+			_makePending(item);
+		}else if(!item->is_linked()) {
+			item->dirty = true;
+		}
 	}
 
 	void deleteItem(File *file) {
@@ -149,12 +219,8 @@ public:
 		auto it = _fileMap.find(file);
 		assert(it != _fileMap.end());
 		auto item = it->second;
-		assert(item->state & stateActive);
-
 		_fileMap.erase(it);
-		item->state &= ~stateActive;
-		if(!item->state)
-			delete item;
+		_retireItem(item);
 	}
 
 	COFIBER_ROUTINE(async::result<size_t>,
@@ -174,28 +240,35 @@ public:
 			// TODO: Stop waiting in this case.
 			assert(isOpen());
 
+			// Only the items on the _pendingQueue are inspected here;
+			// hence this loop is proportional to the number of ready items.
 			while(!_pendingQueue.empty()) {
 				auto item = &_pendingQueue.front();
 				_pendingQueue.pop_front();
 				assert(item->state & statePending);
 
-				// Discard non-alive items without returning them.
+				// Discard non-alive and disabled items without returning them.
+				if(!(item->state & stateActive) || item->disabled) {
+					item->state &= ~statePending;
+					_deleteIfDead(item);
+					continue;
+				}
+
+				item->dirty = false;
+				auto result_or_error = COFIBER_AWAIT item->file->checkStatus(item->process);
+
+				// The item might have been deleted while we were waiting.
 				if(!(item->state & stateActive)) {
 					item->state &= ~statePending;
-					if(!item->state)
-						delete item;
+					_deleteIfDead(item);
 					continue;
 				}
 
-				auto result_or_error = COFIBER_AWAIT item->file->checkStatus(item->process);	
-		
 				// Discard closed items.
 				auto error = std::get_if<Error>(&result_or_error);
 				if(error) {
 					assert(*error == Error::fileClosed);
 					item->state &= ~statePending;
-					if(!item->state)
-						delete item;
 					continue;
 				}
 
@@ -207,30 +280,38 @@ public:
 							<< " is active" << std::endl;
 
 				// Abort early (i.e before requeuing) if the item is not pending.
-				auto status = std::get<2>(result) & (item->eventMask | EPOLLHUP);
+				auto status = std::get<2>(result)
+						& ((item->eventMask & ~modeFlags) | EPOLLHUP | EPOLLERR);
 				if(!status) {
-					// TODO: Once we implement modifyItem(), items can be both
-					// polling and pending at the same time. In this case, only poll
-					// if we are not already polling.
-					assert(!(item->state & statePolling));
 					item->state &= ~statePending;
-					item->state |= statePolling;
+					if(item->dirty) {
+						_makePending(item);
+						continue;
+					}
 
 					// Once an item is not pending anymore, we continue watching it.
-					item->cancelPoll.reset();
-					item->pollFuture = item->file->poll(item->process, std::get<0>(result),
-							item->cancelPoll);
-					item->pollFuture.then([item] {
-						_awaitPoll(item);
-					});
-
+					_watchItem(item, std::get<0>(result));
 					continue;
 				}
-				
-				// We have to increment the sequence again as concurrent waiters
-				// might have seen an empty _pendingQueue.
-				// TODO: Edge-triggered watches should not be requeued here.
-				repoll_queue.push_back(*item);
+
+				if(item->eventMask & EPOLLONESHOT) {
+					// One-shot items are disabled until they are modified again.
+					item->state &= ~statePending;
+					item->disabled = true;
+				}else if(item->eventMask & EPOLLET) {
+					// Edge-triggered items are only reported again on the next edge.
+					item->state &= ~statePending;
+					if(item->dirty) {
+						_makePending(item);
+					}else{
+						_watchItem(item, std::get<0>(result));
+					}
+				}else{
+					// We have to increment the sequence again as concurrent waiters
+					// might have seen an empty _pendingQueue.
+					item->repolling = true;
+					repoll_queue.push_back(*item);
+				}
 
 				assert(k < max_events);
 				memset(events + k, 0, sizeof(struct epoll_event));
@@ -258,12 +339,27 @@ public:
 		}
 
 		// Before returning, we have to reinsert the level-triggered events that we report.
-		if(!repoll_queue.empty()) {
-			_pendingQueue.splice(_pendingQueue.end(), repoll_queue);
+		// Items that were deleted in the meantime are discarded instead (see _retireItem()).
+		bool requeued = false;
+		while(!repoll_queue.empty()) {
+			auto item = &repoll_queue.front();
+			repoll_queue.pop_front();
+			item->repolling = false;
+
+			if(!(item->state & stateActive)) {
+				item->state &= ~statePending;
+				_deleteIfDead(item);
+				continue;
+			}
+			_pendingQueue.push_back(*item);
+			requeued = true;
+		}
+		if(requeued) {
 			_currentSeq++;
 			_statusBell.ring();
+			notifyStatusObservers();
 		}
-		
+
 		if(logEpoll)
 			std::cout << "posix.epoll \e[1;34m" << structName() << "\e[0m: Return from wait"
 					" with " << k << " items" << std::endl;
@@ -279,22 +375,8 @@ public:
 		auto it = _fileMap.begin();
 		while(it != _fileMap.end()) {
 			auto item = it->second;
-			assert(item->state & stateActive);
-
 			it = _fileMap.erase(it);
-			item->state &= ~stateActive;
-
-			if(item->state & statePolling)
-				item->cancelPoll.cancel();
-
-			if(item->state & statePending) {
-				auto qit = _pendingQueue.iterator_to(*item);
-				_pendingQueue.erase(qit);
-				item->state &= ~statePending;
-			}
-
-			if(!item->state)
-				delete item;
+			_retireItem(item);
 		}
 
 		_statusBell.ring();
@@ -313,7 +395,11 @@ public:
 
 		COFIBER_RETURN(PollResult(_currentSeq, EPOLLIN, _pendingQueue.empty() ? 0 : EPOLLIN));
 	}))
-	
+
+	bool hasStatusObservers() override {
+		return true;
+	}
+
 	helix::BorrowedDescriptor getPassthroughLane() override {
 		return _passthrough;
 	}
@@ -332,6 +418,29 @@ public:
 	: File{StructName::get("epoll")}, _currentSeq{1} { }
 
 private:
+	// Stops watching an item that was removed from the _fileMap.
+	void _retireItem(Item *item) {
+		assert(item->state & stateActive);
+		item->state &= ~stateActive;
+
+		if(item->state & stateObserving) {
+			item->file->detachStatusObserver(item);
+			item->state &= ~stateObserving;
+		}
+
+		if(item->state & statePolling)
+			item->cancelPoll.cancel();
+
+		// Items that are currently being checked are not linked and items on the
+		// repoll queue are not on the _pendingQueue; waitForEvents() discards them.
+		if((item->state & statePending) && item->is_linked() && !item->repolling) {
+			_pendingQueue.erase(_pendingQueue.iterator_to(*item));
+			item->state &= ~statePending;
+		}
+
+		_deleteIfDead(item);
+	}
+
 	helix::UniqueLane _passthrough;
 	async::cancellation_event _cancelServe;
 
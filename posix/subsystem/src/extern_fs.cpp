@@ -434,6 +434,12 @@ private:
 
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+		// TODO: unlink() cannot report errors to the caller yet.
+		if(resp.error() == managarm::fs::Errors::READ_ONLY) {
+			std::cout << "\e[33m" "posix: Cannot unlink " << name
+					<< " from a read-only file system" "\e[39m" << std::endl;
+			COFIBER_RETURN();
+		}
 		assert(resp.error() == managarm::fs::Errors::SUCCESS);
 	}))
 
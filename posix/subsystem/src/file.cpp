@@ -61,12 +61,13 @@ File::ptRead(void *object, const char *credentials,
 	}
 }))
 
-async::result<void> File::ptWrite(void *object, const char *credentials,
-		const void *buffer, size_t length) {
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, File::ptWrite(void *object,
+		const char *credentials, const void *buffer, size_t length), ([=] {
 	auto self = static_cast<File *>(object);
 	auto process = findProcessWithCredentials(credentials);
-	return self->writeAll(process.get(), buffer, length);
-}
+	COFIBER_AWAIT self->writeAll(process.get(), buffer, length);
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
 
 async::result<ReadEntriesResult> File::ptReadEntries(void *object) {
 	auto self = static_cast<File *>(object);
@@ -84,6 +85,18 @@ async::result<void> File::ptAllocate(void *object,
 	return self->allocate(offset, size);
 }
 
+COFIBER_ROUTINE(async::result<protocols::fs::Error>, File::ptPunchHole(void *object,
+		int64_t offset, size_t size), ([=] {
+	auto self = static_cast<File *>(object);
+	auto error = COFIBER_AWAIT self->punchHole(offset, size);
+	if(error == Error::illegalOperationTarget) {
+		COFIBER_RETURN(protocols::fs::Error::notSupported);
+	}else{
+		assert(error == Error::success);
+		COFIBER_RETURN(protocols::fs::Error::none);
+	}
+}))
+
 async::result<int> File::ptGetOption(void *object, int option) {
 	auto self = static_cast<File *>(object);
 	return self->getOption(option);
@@ -94,19 +107,23 @@ async::result<void> File::ptSetOption(void *object, int option, int value) {
 	return self->setOption(option, value);
 }
 
-async::result<void> File::ptBind(void *object, const char *credentials,
-		const void *addr_ptr, size_t addr_length) {
+COFIBER_ROUTINE(async::result<protocols::fs::Error>,
+File::ptBind(void *object, const char *credentials,
+		const void *addr_ptr, size_t addr_length), ([=] {
 	auto self = static_cast<File *>(object);
 	auto process = findProcessWithCredentials(credentials);
-	return self->bind(process.get(), addr_ptr, addr_length);
-}
+	COFIBER_AWAIT self->bind(process.get(), addr_ptr, addr_length);
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
 
-async::result<void> File::ptConnect(void *object, const char *credentials,
-		const void *addr_ptr, size_t addr_length) {
+COFIBER_ROUTINE(async::result<protocols::fs::Error>,
+File::ptConnect(void *object, const char *credentials,
+		const void *addr_ptr, size_t addr_length), ([=] {
 	auto self = static_cast<File *>(object);
 	auto process = findProcessWithCredentials(credentials);
-	return self->connect(process.get(), addr_ptr, addr_length);
-}
+	COFIBER_AWAIT self->connect(process.get(), addr_ptr, addr_length);
+	COFIBER_RETURN(protocols::fs::Error::none);
+}))
 
 async::result<size_t> File::ptSockname(void *object, void *addr_ptr, size_t max_addr_length) {
 	auto self = static_cast<File *>(object);
@@ -184,6 +201,12 @@ async::result<void> File::allocate(int64_t, size_t) {
 	throw std::runtime_error("posix: Object has no File::allocate()");
 }
 
+async::result<Error> File::punchHole(int64_t, size_t) {
+	async::promise<Error> promise;
+	promise.set_value(Error::illegalOperationTarget);
+	return promise.async_get();
+}
+
 expected<off_t> File::seek(off_t, VfsSeek) {
 	if(_defaultOps & defaultPipeLikeSeek) {
 		async::promise<std::variant<Error, off_t>> promise;
@@ -206,6 +229,25 @@ expected<PollResult> File::checkStatus(Process *process) {
 	return poll(process, 0, async::cancellation_token{});
 }
 
+bool File::hasStatusObservers() {
+	return false;
+}
+
+void File::attachStatusObserver(StatusObserver *observer) {
+	assert(hasStatusObservers());
+	_statusObservers.push_back(*observer);
+}
+
+void File::detachStatusObserver(StatusObserver *observer) {
+	_statusObservers.erase(_statusObservers.iterator_to(*observer));
+}
+
+void File::notifyStatusObservers() {
+	// Observers must not detach themselves from within statusChanged().
+	for(auto &observer : _statusObservers)
+		observer.statusChanged(this);
+}
+
 async::result<int> File::getOption(int) {
 	std::cout << "posix \e[1;34m" << structName()
 			<< "\e[0m: Object does not implement getOption()" << std::endl;
@@ -218,7 +260,7 @@ async::result<void> File::setOption(int, int) {
 	throw std::runtime_error("posix: Object has no File::setOption()");
 }
 
-async::result<AcceptResult> File::accept(Process *) {
+expected<AcceptResult> File::accept(Process *) {
 	std::cout << "posix \e[1;34m" << structName()
 			<< "\e[0m: Object does not implement accept()" << std::endl;
 	throw std::runtime_error("posix: Object has no File::accept()");
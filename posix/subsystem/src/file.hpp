@@ -5,6 +5,7 @@
 #include <string.h> // for hel.h
 
 #include <async/result.hpp>
+#include <boost/intrusive/list.hpp>
 #include <boost/intrusive/rbtree.hpp>
 #include <cofiber.hpp>
 #include <cofiber/future.hpp>
@@ -35,7 +36,19 @@ enum class Error {
 
 	wouldBlock,
 
-	brokenPipe
+	brokenPipe,
+
+	illegalArguments,
+
+	connectionReset,
+
+	notConnected,
+
+	// Messages were dropped because the receive queue is full (ENOBUFS).
+	noBufferSpace,
+
+	// The given address range is not mapped (ENOMEM).
+	noMemory
 };
 
 // TODO: Rename this enum as is not part of the VFS.
@@ -74,6 +87,20 @@ using AcceptResult = smarter::shared_ptr<File, FileHandle>;
 
 struct DisposeFileHandle { };
 
+// Observers are notified each time the poll() status of a file might have changed.
+// This allows epoll to track readiness without keeping a poll() in flight per file.
+struct StatusObserver {
+	friend struct File;
+
+	virtual void statusChanged(File *file) = 0;
+
+protected:
+	~StatusObserver() = default;
+
+private:
+	boost::intrusive::list_member_hook<> _statusHook;
+};
+
 struct File : private smarter::crtp_counter<File, DisposeFileHandle> {
 	friend struct smarter::crtp_counter<File, DisposeFileHandle>;
 public:
@@ -94,7 +121,7 @@ public:
 	static async::result<protocols::fs::ReadResult>
 	ptRead(void *object, const char *credentials, void *buffer, size_t length);
 
-	static async::result<void>
+	static async::result<protocols::fs::Error>
 	ptWrite(void *object, const char *credentials, const void *buffer, size_t length);
 
 	static async::result<protocols::fs::ReadEntriesResult>
@@ -106,17 +133,20 @@ public:
 	static async::result<void>
 	ptAllocate(void *object, int64_t offset, size_t size);
 
+	static async::result<protocols::fs::Error>
+	ptPunchHole(void *object, int64_t offset, size_t size);
+
 	static async::result<int>
 	ptGetOption(void *object, int option);
 
 	static async::result<void>
 	ptSetOption(void *object, int option, int value);
 
-	static async::result<void>
+	static async::result<protocols::fs::Error>
 	ptBind(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 
-	static async::result<void>
+	static async::result<protocols::fs::Error>
 	ptConnect(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 
@@ -135,6 +165,7 @@ public:
 			.withReadEntries(&ptReadEntries)
 			.withTruncate(&ptTruncate)
 			.withFallocate(&ptAllocate)
+			.withPunchHole(&ptPunchHole)
 			.withGetOption(&ptGetOption)
 			.withSetOption(&ptSetOption)
 			.withBind(&ptBind)
@@ -184,6 +215,7 @@ private:
 	void dispose(DisposeFileHandle) {
 		_isOpen = false;
 		handleClose();
+		notifyStatusObservers();
 	}
 
 public:
@@ -219,6 +251,11 @@ public:
 
 	virtual async::result<void> allocate(int64_t offset, size_t size);
 
+	// Deallocates the given range (i.e. fallocate() with FALLOC_FL_PUNCH_HOLE).
+	// The range reads as zeros afterwards. Does not change the file size.
+	// Returns Error::illegalOperationTarget if the file does not support holes.
+	virtual async::result<Error> punchHole(int64_t offset, size_t size);
+
 	// poll() uses a sequence number mechansim for synchronization.
 	// Before returning, it waits until current-sequence > in-sequence.
 	// Returns (current-sequence, edges since in-sequence, current events).
@@ -230,10 +267,17 @@ public:
 	// Like poll, but only checks the current state. Does not return edges.
 	virtual expected<PollResult> checkStatus(Process *);
 
+	// Files that call notifyStatusObservers() on every change of their poll() status
+	// return true here. Other files can only be watched through poll().
+	virtual bool hasStatusObservers();
+
+	void attachStatusObserver(StatusObserver *observer);
+	void detachStatusObserver(StatusObserver *observer);
+
 	virtual async::result<int> getOption(int option);
 	virtual async::result<void> setOption(int option, int value);
 
-	virtual async::result<AcceptResult> accept(Process *process);
+	virtual expected<AcceptResult> accept(Process *process);
 
 	virtual async::result<void> bind(Process *process,
 			const void *addr_ptr, size_t addr_length);
@@ -253,6 +297,9 @@ public:
 
 	virtual helix::BorrowedDescriptor getPassthroughLane() = 0;
 
+protected:
+	void notifyStatusObservers();
+
 private:
 	smarter::weak_ptr<File> _weakPtr;
 	StructName _structName;
@@ -261,6 +308,15 @@ private:
 	DefaultOps _defaultOps;
 
 	bool _isOpen;
+
+	boost::intrusive::list<
+		StatusObserver,
+		boost::intrusive::member_hook<
+			StatusObserver,
+			boost::intrusive::list_member_hook<>,
+			&StatusObserver::_statusHook
+		>
+	> _statusObservers;
 };
 
 #endif // POSIX_SUBSYSTEM_FILE_HPP
@@ -0,0 +1,158 @@
+
+#include <string.h>
+#include <iostream>
+
+#include <cofiber.hpp>
+#include <helix/ipc.hpp>
+#include <protocols/fs/client.hpp>
+#include <protocols/mbus/client.hpp>
+#include "inet-socket.hpp"
+#include "fs.pb.h"
+
+namespace inet_socket {
+
+namespace {
+
+// Lane to the network stack (i.e., libnet's DEV_SOCKET server).
+helix::UniqueLane stackLane;
+
+Error mapSocketError(protocols::fs::Error error) {
+	switch(error) {
+	case protocols::fs::Error::wouldBlock: return Error::wouldBlock;
+	case protocols::fs::Error::illegalArguments: return Error::illegalArguments;
+	case protocols::fs::Error::notConnected: return Error::notConnected;
+	case protocols::fs::Error::brokenPipe: return Error::brokenPipe;
+	case protocols::fs::Error::connectionReset: return Error::connectionReset;
+	default:
+		throw std::runtime_error("posix: Unexpected error from the network stack");
+	}
+}
+
+// AF_INET sockets are implemented by the network stack.
+// Read, write, bind, connect and poll are handled by the passthrough lane;
+// we only translate the requests that mlibc sends to POSIX.
+struct OpenFile : File {
+public:
+	OpenFile(helix::UniqueLane lane)
+	: File{StructName::get("inet-socket")}, _file{std::move(lane)} { }
+
+	COFIBER_ROUTINE(expected<size_t>,
+	readSome(Process *, void *data, size_t max_length) override, ([=] {
+		size_t length = COFIBER_AWAIT _file.readSome(data, max_length);
+		COFIBER_RETURN(length);
+	}))
+
+	COFIBER_ROUTINE(FutureMaybe<void>,
+	writeAll(Process *, const void *data, size_t length) override, ([=] {
+		// writeAll() cannot report errors; mlibc writes through the passthrough lane anyway.
+		auto error = COFIBER_AWAIT _file.writeAll(data, length);
+		if(error != protocols::fs::Error::none)
+			std::cout << "\e[33mposix: Write to inet-socket failed\e[39m" << std::endl;
+	}))
+
+	// Only connected sockets are supported, hence addresses are ignored.
+	COFIBER_ROUTINE(expected<RecvResult>,
+	recvMsg(Process *, MsgFlags flags, void *data, size_t max_length,
+			void *, size_t, size_t) override, ([=] {
+		assert(!(flags & ~(msgNoWait | msgCloseOnExec)));
+		size_t length = COFIBER_AWAIT _file.readSome(data, max_length);
+		COFIBER_RETURN(RecvResult(length, 0, {}));
+	}))
+
+	COFIBER_ROUTINE(expected<size_t>,
+	sendMsg(Process *, MsgFlags flags, const void *data, size_t max_length,
+			const void *, size_t,
+			std::vector<smarter::shared_ptr<File, FileHandle>> files) override, ([=] {
+		assert(!(flags & ~(msgNoWait)));
+		assert(files.empty());
+		auto error = COFIBER_AWAIT _file.writeAll(data, max_length);
+		if(error != protocols::fs::Error::none)
+			COFIBER_RETURN(mapSocketError(error));
+		COFIBER_RETURN(max_length);
+	}))
+
+	COFIBER_ROUTINE(expected<AcceptResult>, accept(Process *) override, ([=] {
+		auto result = COFIBER_AWAIT _file.accept();
+		if(auto error = std::get_if<protocols::fs::Error>(&result); error)
+			COFIBER_RETURN(mapSocketError(*error));
+		auto file = smarter::make_shared<OpenFile>(
+				std::get<helix::UniqueDescriptor>(std::move(result)));
+		file->setupWeakFile(file);
+		COFIBER_RETURN(File::constructHandle(std::move(file)));
+	}))
+
+	COFIBER_ROUTINE(expected<PollResult>, poll(Process *, uint64_t sequence,
+			async::cancellation_token cancellation) override, ([=] {
+		auto result = COFIBER_AWAIT _file.poll(sequence, cancellation);
+		COFIBER_RETURN(result);
+	}))
+
+	helix::BorrowedDescriptor getPassthroughLane() override {
+		return _file.getLane();
+	}
+
+private:
+	protocols::fs::File _file;
+};
+
+} // anonymous namespace
+
+COFIBER_ROUTINE(cofiber::no_future, run(), ([] {
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("class", "netserver")
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties properties) {
+		std::cout << "POSIX: Installing network stack" << std::endl;
+		if(stackLane)
+			std::cout << "\e[33mposix: Replacing the previous network stack\e[39m" << std::endl;
+		stackLane = helix::UniqueLane(COFIBER_AWAIT entity.bind());
+	});
+
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+}))
+
+COFIBER_ROUTINE(async::result<smarter::shared_ptr<File, FileHandle>>,
+createSocketFile(int type, int protocol, bool non_block), ([=] {
+	if(!stackLane)
+		COFIBER_RETURN(smarter::shared_ptr<File, FileHandle>{});
+
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::RecvInline recv_resp;
+	helix::PullDescriptor pull_pt;
+
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::DEV_SOCKET);
+	req.set_socktype(type);
+	req.set_protocol(protocol);
+	if(non_block)
+		req.set_flags(managarm::fs::OF_NONBLOCK);
+
+	auto ser = req.SerializeAsString();
+	auto &&transmit = helix::submitAsync(stackLane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&recv_resp, kHelItemChain),
+			helix::action(&pull_pt));
+	COFIBER_AWAIT transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	// The passthrough lane is only sent on success.
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		COFIBER_RETURN(smarter::shared_ptr<File, FileHandle>{});
+	HEL_CHECK(pull_pt.error());
+
+	auto file = smarter::make_shared<OpenFile>(pull_pt.descriptor());
+	file->setupWeakFile(file);
+	COFIBER_RETURN(File::constructHandle(std::move(file)));
+}))
+
+} // namespace inet_socket
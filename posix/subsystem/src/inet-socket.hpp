@@ -0,0 +1,13 @@
+
+#include "file.hpp"
+
+namespace inet_socket {
+
+// Waits for a network stack to appear on mbus.
+cofiber::no_future run();
+
+// Returns a null handle if no network stack is available.
+async::result<smarter::shared_ptr<File, FileHandle>>
+createSocketFile(int type, int protocol, bool non_block);
+
+} // namespace inet_socket
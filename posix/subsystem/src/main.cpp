@@ -28,6 +28,7 @@
 #include "extern_fs.hpp"
 #include "devices/helout.hpp"
 #include "fifo.hpp"
+#include "inet-socket.hpp"
 #include "inotify.hpp"
 #include "pts.hpp"
 #include "signalfd.hpp"
@@ -341,181 +342,264 @@ COFIBER_ROUTINE(cofiber::no_future, serveSignals(std::shared_ptr<Process> self,
 		std::cout << "\e[33mposix: Exiting serveSignals()\e[39m" << std::endl;
 }))
 
-COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
-		std::shared_ptr<Generation> generation), ([=] {
-	async::cancellation_token cancellation = generation->cancelServe;
-
-	async::cancellation_callback cancel_callback{cancellation, [&] {
-		HEL_CHECK(helShutdownLane(generation->posixLane.getHandle()));
-	}};
+// Upper bound on the number of requests of a single process that are handled at once.
+// serveRequests() stops accepting new requests until one of them completes.
+constexpr int maxActiveRequests = 64;
 
-	while(true) {
-		helix::Accept accept;
-		helix::RecvInline recv_req;
+// Releases the request's slot in Generation::activeRequests on destruction.
+struct ActiveRequestGuard {
+	ActiveRequestGuard(Generation *generation)
+	: _generation{generation} { }
 
-		auto &&header = helix::submitAsync(generation->posixLane, helix::Dispatcher::global(),
-				helix::action(&accept));
-		COFIBER_AWAIT header.async_wait();
+	ActiveRequestGuard(const ActiveRequestGuard &) = delete;
 
-		if(accept.error() == kHelErrLaneShutdown)
-			break;
-		HEL_CHECK(accept.error());
-		auto conversation = accept.descriptor();
-
-		auto &&initiate = helix::submitAsync(conversation, helix::Dispatcher::global(),
-				helix::action(&recv_req));
-		COFIBER_AWAIT initiate.async_wait();
-		HEL_CHECK(recv_req.error());
-
-		managarm::posix::CntRequest req;
-		req.ParseFromArray(recv_req.data(), recv_req.length());
-		if(req.request_type() == managarm::posix::CntReqType::GET_PID) {
-			if(logRequests)
-				std::cout << "posix: GET_PID" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_pid(self->pid());
+	~ActiveRequestGuard() {
+		assert(_generation->activeRequests > 0);
+		_generation->activeRequests--;
+		_generation->requestBell.ring();
+	}
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::WAIT) {
-			if(logRequests)
-				std::cout << "posix: WAIT" << std::endl;
+	ActiveRequestGuard &operator= (const ActiveRequestGuard &) = delete;
+
+private:
+	Generation *_generation;
+};
+
+// Handles a single request. Each request runs in its own coroutine,
+// such that a blocking request does not stall other requests of the same process.
+COFIBER_ROUTINE(cofiber::no_future, handleRequest(std::shared_ptr<Process> self,
+		std::shared_ptr<Generation> generation, helix::UniqueLane lane),
+		([self = std::move(self), generation = std::move(generation),
+		conversation = std::move(lane)] {
+	ActiveRequestGuard active_guard{generation.get()};
+	helix::RecvInline recv_req;
+
+	auto &&initiate = helix::submitAsync(conversation, helix::Dispatcher::global(),
+			helix::action(&recv_req));
+	COFIBER_AWAIT initiate.async_wait();
+	HEL_CHECK(recv_req.error());
+
+	managarm::posix::CntRequest req;
+	req.ParseFromArray(recv_req.data(), recv_req.length());
+	if(req.request_type() == managarm::posix::CntReqType::GET_PID) {
+		if(logRequests)
+			std::cout << "posix: GET_PID" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_pid(self->pid());
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::WAIT) {
+		if(logRequests)
+			std::cout << "posix: WAIT" << std::endl;
+
+		assert(!(req.flags() & ~WNOHANG));
+
+		int signo;
+		auto pid = COFIBER_AWAIT self->wait(req.pid(), req.flags() & WNOHANG, &signo);
+
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_pid(pid);
+
+		uint32_t mode = 0x200; // 0x200 means exited.
+		if(signo >= 0)
+			mode |= 0x400 | (signo << 24);
+		resp.set_mode(mode);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::GET_RESOURCE_USAGE) {
+		if(logRequests)
+			std::cout << "posix: GET_RESOURCE_USAGE" << std::endl;
+
+		HelThreadStats stats;
+		HEL_CHECK(helQueryThreadStats(generation->threadDescriptor.getHandle(), &stats));
+
+		uint64_t user_time;
+		if(req.mode() == RUSAGE_SELF) {
+			user_time = stats.userTime;
+		}else if(req.mode() == RUSAGE_CHILDREN) {
+			user_time = self->accumulatedUsage().userTime;
+		}else{
+			std::cout << "\e[31mposix: GET_RESOURCE_USAGE mode is not supported\e[39m"
+					<< std::endl;
+			// TODO: Return an error response.
+		}
 
-			assert(!(req.flags() & ~WNOHANG));
+		helix::SendBuffer send_resp;
 
-			int signo;
-			auto pid = COFIBER_AWAIT self->wait(req.pid(), req.flags() & WNOHANG, &signo);
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_ru_user_time(stats.userTime);
 
-			helix::SendBuffer send_resp;
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::VM_MAP) {
+		if(logRequests)
+			std::cout << "posix: VM_MAP size: " << (void *)req.size() << std::endl;
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_pid(pid);
+		helix::SendBuffer send_resp;
 
-			uint32_t mode = 0x200; // 0x200 means exited.
-			if(signo >= 0)
-				mode |= 0x400 | (signo << 24);
-			resp.set_mode(mode);
+		// TODO: Validate mode and flags.
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::GET_RESOURCE_USAGE) {
-			if(logRequests)
-				std::cout << "posix: GET_RESOURCE_USAGE" << std::endl;
+		uint32_t native_flags = 0;
+		if((req.flags() & (MAP_PRIVATE | MAP_SHARED)) == MAP_PRIVATE) {
+			native_flags |= kHelMapCopyOnWrite;
+		}else if((req.flags() & (MAP_PRIVATE | MAP_SHARED)) == MAP_SHARED) {
+			native_flags |= kHelMapShareAtFork;
+		}else{
+			throw std::runtime_error("posix: Handle illegal flags in VM_MAP");
+		}
 
-			HelThreadStats stats;
-			HEL_CHECK(helQueryThreadStats(generation->threadDescriptor.getHandle(), &stats));
+		if(req.mode() & PROT_READ)
+			native_flags |= kHelMapProtRead;
+		if(req.mode() & PROT_WRITE)
+			native_flags |= kHelMapProtWrite;
+		if(req.mode() & PROT_EXEC)
+			native_flags |= kHelMapProtExecute;
 
-			uint64_t user_time;
-			if(req.mode() == RUSAGE_SELF) {
-				user_time = stats.userTime;
-			}else if(req.mode() == RUSAGE_CHILDREN) {
-				user_time = self->accumulatedUsage().userTime;
-			}else{
-				std::cout << "\e[31mposix: GET_RESOURCE_USAGE mode is not supported\e[39m"
-						<< std::endl;
-				// TODO: Return an error response.
-			}
+		void *address;
+		if(req.flags() & MAP_ANONYMOUS) {
+			assert(req.fd() == -1);
+			assert(!req.rel_offset());
 
-			helix::SendBuffer send_resp;
+			address = self->vmContext()->mapAnonymous(req.size(), native_flags);
+		}else{
+			auto file = self->fileContext()->getFile(req.fd());
+			assert(file && "Illegal FD for VM_MAP");
+			address = COFIBER_AWAIT self->vmContext()->mapFile(std::move(file),
+					req.rel_offset(), req.size(), native_flags);
+		}
 
-			managarm::posix::SvrResponse resp;
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_offset(reinterpret_cast<uintptr_t>(address));
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::VM_REMAP) {
+		if(logRequests)
+			std::cout << "posix: VM_REMAP" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto result = COFIBER_AWAIT self->vmContext()->remapFile(
+				reinterpret_cast<void *>(req.address()), req.size(), req.new_size());
+
+		managarm::posix::SvrResponse resp;
+		auto error = std::get_if<Error>(&result);
+		if(error && *error == Error::noMemory) {
+			resp.set_error(managarm::posix::Errors::NO_MEMORY);
+		}else if(error) {
+			assert(*error == Error::illegalArguments);
+			resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+		}else{
 			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_ru_user_time(stats.userTime);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::VM_MAP) {
-			if(logRequests)
-				std::cout << "posix: VM_MAP size: " << (void *)req.size() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			// TODO: Validate mode and flags.
-
-			uint32_t native_flags = 0;
-			if((req.flags() & (MAP_PRIVATE | MAP_SHARED)) == MAP_PRIVATE) {
-				native_flags |= kHelMapCopyOnWrite;
-			}else if((req.flags() & (MAP_PRIVATE | MAP_SHARED)) == MAP_SHARED) {
-				native_flags |= kHelMapShareAtFork;
-			}else{
-				throw std::runtime_error("posix: Handle illegal flags in VM_MAP");
-			}
-
-			if(req.mode() & PROT_READ)
-				native_flags |= kHelMapProtRead;
-			if(req.mode() & PROT_WRITE)
-				native_flags |= kHelMapProtWrite;
-			if(req.mode() & PROT_EXEC)
-				native_flags |= kHelMapProtExecute;
-
-			void *address;
-			if(req.flags() & MAP_ANONYMOUS) {
-				assert(req.fd() == -1);
-				assert(!req.rel_offset());
-
-				HelHandle memory;
-				HEL_CHECK(helAllocateMemory(req.size(), 0, &memory));
-
-				// Perform the actual mapping.
-				HEL_CHECK(helMapMemory(memory, self->vmContext()->getSpace().getHandle(),
-						nullptr, 0, req.size(), native_flags, &address));
-				HEL_CHECK(helCloseDescriptor(memory));
-			}else{
-				auto file = self->fileContext()->getFile(req.fd());
-				assert(file && "Illegal FD for VM_MAP");
-				address = COFIBER_AWAIT self->vmContext()->mapFile(std::move(file),
-						req.rel_offset(), req.size(), native_flags);
-			}
+			resp.set_offset(reinterpret_cast<uintptr_t>(std::get<void *>(result)));
+		}
 
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::VM_UNMAP) {
+		if(logRequests)
+			std::cout << "posix: VM_UNMAP address: " << (void *)req.address()
+					<< ", size: " << (void *)req.size() << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		self->vmContext()->unmapFile(reinterpret_cast<void *>(req.address()), req.size());
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::MOUNT) {
+		if(logRequests)
+			std::cout << "posix: MOUNT " << req.fs_type() << " on " << req.path()
+					<< " to " << req.target_path() << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto target = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.target_path());
+		if(!target.second) {
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_offset(reinterpret_cast<uintptr_t>(address));
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::VM_REMAP) {
-			if(logRequests)
-				std::cout << "posix: VM_REMAP" << std::endl;
+			COFIBER_RETURN();
+		}
 
-			helix::SendBuffer send_resp;
+		if(req.fs_type() == "sysfs") {
+			target.first->mount(target.second, getSysfs());	
+		}else if(req.fs_type() == "devtmpfs") {
+			target.first->mount(target.second, getDevtmpfs());	
+		}else if(req.fs_type() == "tmpfs") {
+			target.first->mount(target.second, tmp_fs::createRoot());	
+		}else if(req.fs_type() == "devpts") {
+			target.first->mount(target.second, pts::getFsRoot());	
+		}else{
+			assert(req.fs_type() == "ext2");
+			auto source = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+					self->fsContext()->getWorkingDirectory(), req.path());
+			assert(source.second);
+			assert(source.second->getTarget()->getType() == VfsType::blockDevice);
+			auto device = blockRegistry.get(source.second->getTarget()->readDevice());
+			auto link = COFIBER_AWAIT device->mount();
+			target.first->mount(target.second, std::move(link));	
+		}
 
-			auto address = COFIBER_AWAIT self->vmContext()->remapFile(
-					reinterpret_cast<void *>(req.address()), req.size(), req.new_size());
+		if(logRequests)
+			std::cout << "posix:     MOUNT succeeds" << std::endl;
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_offset(reinterpret_cast<uintptr_t>(address));
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::VM_UNMAP) {
-			if(logRequests)
-				std::cout << "posix: VM_UNMAP address: " << (void *)req.address()
-						<< ", size: " << (void *)req.size() << std::endl;
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::CHROOT) {
+		if(logRequests)
+			std::cout << "posix: CHROOT" << std::endl;
 
-			helix::SendBuffer send_resp;
+		helix::SendBuffer send_resp;
 
-			self->vmContext()->unmapFile(reinterpret_cast<void *>(req.address()), req.size());
+		auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(path.second) {
+			self->fsContext()->changeRoot(path);
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
@@ -525,169 +609,28 @@ COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::MOUNT) {
-			if(logRequests)
-				std::cout << "posix: MOUNT " << req.fs_type() << " on " << req.path()
-						<< " to " << req.target_path() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto target = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.target_path());
-			if(!target.second) {
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
-
-			if(req.fs_type() == "sysfs") {
-				target.first->mount(target.second, getSysfs());	
-			}else if(req.fs_type() == "devtmpfs") {
-				target.first->mount(target.second, getDevtmpfs());	
-			}else if(req.fs_type() == "tmpfs") {
-				target.first->mount(target.second, tmp_fs::createRoot());	
-			}else if(req.fs_type() == "devpts") {
-				target.first->mount(target.second, pts::getFsRoot());	
-			}else{
-				assert(req.fs_type() == "ext2");
-				auto source = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-						self->fsContext()->getWorkingDirectory(), req.path());
-				assert(source.second);
-				assert(source.second->getTarget()->getType() == VfsType::blockDevice);
-				auto device = blockRegistry.get(source.second->getTarget()->readDevice());
-				auto link = COFIBER_AWAIT device->mount();
-				target.first->mount(target.second, std::move(link));	
-			}
-
-			if(logRequests)
-				std::cout << "posix:     MOUNT succeeds" << std::endl;
-
+		}else{
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::CHROOT) {
-			if(logRequests)
-				std::cout << "posix: CHROOT" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(path.second) {
-				self->fsContext()->changeRoot(path);
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::CHDIR) {
-			if(logRequests)
-				std::cout << "posix: CHDIR" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(path.second) {
-				self->fsContext()->changeWorkingDirectory(path);
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::ACCESS) {
-			if(logRequests)
-				std::cout << "posix: ACCESS" << std::endl;
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::CHDIR) {
+		if(logRequests)
+			std::cout << "posix: CHDIR" << std::endl;
 
-			helix::SendBuffer send_resp;
+		helix::SendBuffer send_resp;
 
-			auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(path.second) {
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
+		auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(path.second) {
+			self->fsContext()->changeWorkingDirectory(path);
 
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::MKDIR) {
-			if(logRequests || logPaths)
-				std::cout << "posix: MKDIR " << req.path() << std::endl;
-
-			helix::SendBuffer send_resp;
 			managarm::posix::SvrResponse resp;
-
-			PathResolver resolver;
-			resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			COFIBER_AWAIT resolver.resolve(resolvePrefix);
-			assert(resolver.currentLink());
-
-			auto parent = resolver.currentLink()->getTarget();
-			if(COFIBER_AWAIT parent->getLink(resolver.nextComponent())) {
-				resp.set_error(managarm::posix::Errors::ALREADY_EXISTS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
-
-			COFIBER_AWAIT parent->mkdir(resolver.nextComponent());
-
 			resp.set_error(managarm::posix::Errors::SUCCESS);
 
 			auto ser = resp.SerializeAsString();
@@ -695,64 +638,26 @@ COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SYMLINK) {
-			if(logRequests || logPaths)
-				std::cout << "posix: SYMLINK " << req.path() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			PathResolver resolver;
-			resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			COFIBER_AWAIT resolver.resolve(resolvePrefix);
-			assert(resolver.currentLink());
-
-			auto parent = resolver.currentLink()->getTarget();
-			COFIBER_AWAIT parent->symlink(resolver.nextComponent(), req.target_path());
-
+		}else{
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::RENAME) {
-			if(logRequests || logPaths)
-				std::cout << "posix: RENAME " << req.path()
-						<< " to " << req.target_path() << std::endl;
-
-			helix::SendBuffer send_resp;
-			managarm::posix::SvrResponse resp;
-
-			PathResolver resolver;
-			resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			COFIBER_AWAIT resolver.resolve();
-			if(!resolver.currentLink()) {
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
-
-			PathResolver new_resolver;
-			new_resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.target_path());
-			COFIBER_AWAIT new_resolver.resolve(resolvePrefix);
-			assert(new_resolver.currentLink());
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::ACCESS) {
+		if(logRequests)
+			std::cout << "posix: ACCESS" << std::endl;
 
-			auto superblock = resolver.currentLink()->getTarget()->superblock();
-			auto directory = new_resolver.currentLink()->getTarget();
-			assert(superblock == directory->superblock());
-			COFIBER_AWAIT superblock->rename(resolver.currentLink().get(),
-					directory.get(), new_resolver.nextComponent());
+		helix::SendBuffer send_resp;
 
+		auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(path.second) {
+			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
 
 			auto ser = resp.SerializeAsString();
@@ -760,311 +665,152 @@ COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::STAT
-				|| req.request_type() == managarm::posix::CntReqType::LSTAT) {	
-			if(logRequests || logPaths)
-				std::cout << "posix: STAT path: " << req.path() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			PathResolver resolver;
-			resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(req.request_type() == managarm::posix::STAT) {
-				COFIBER_AWAIT resolver.resolve();
-			}else{
-				assert(req.request_type() == managarm::posix::LSTAT);
-				COFIBER_AWAIT resolver.resolve(resolveDontFollow);
-			}
-
-			if(resolver.currentLink()) {
-				auto stats = COFIBER_AWAIT resolver.currentLink()->getTarget()->getStats();
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-
-				DeviceId devnum;
-				switch(resolver.currentLink()->getTarget()->getType()) {
-				case VfsType::regular:
-					resp.set_file_type(managarm::posix::FT_REGULAR); break;
-				case VfsType::directory:
-					resp.set_file_type(managarm::posix::FT_DIRECTORY); break;
-				case VfsType::charDevice:
-					resp.set_file_type(managarm::posix::FT_CHAR_DEVICE);
-					devnum = resolver.currentLink()->getTarget()->readDevice();
-					resp.set_ref_devnum(makedev(devnum.first, devnum.second));
-					break;
-				case VfsType::blockDevice:
-					resp.set_file_type(managarm::posix::FT_BLOCK_DEVICE);
-					devnum = resolver.currentLink()->getTarget()->readDevice();
-					resp.set_ref_devnum(makedev(devnum.first, devnum.second));
-					break;
-				}
-
-				resp.set_fs_inode(stats.inodeNumber);
-				resp.set_mode(stats.mode);
-				resp.set_num_links(stats.numLinks);
-				resp.set_uid(stats.uid);
-				resp.set_gid(stats.gid);
-				resp.set_file_size(stats.fileSize);
-				resp.set_atime_secs(stats.atimeSecs);
-				resp.set_atime_nanos(stats.atimeNanos);
-				resp.set_mtime_secs(stats.mtimeSecs);
-				resp.set_mtime_nanos(stats.mtimeNanos);
-				resp.set_ctime_secs(stats.ctimeSecs);
-				resp.set_ctime_nanos(stats.ctimeNanos);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::READLINK) {
-			if(logRequests || logPaths)
-				std::cout << "posix: READLINK path: " << req.path() << std::endl;
-
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
-
-			auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path(), resolveDontFollow);
-			if(!path.second) {
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-						helix::action(&send_data, nullptr, 0));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
-
-			auto result = COFIBER_AWAIT path.second->getTarget()->readSymlink(path.second.get());
-			if(auto error = std::get_if<Error>(&result); error) {
-				assert(*error == Error::illegalOperationTarget);
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-						helix::action(&send_data, nullptr, 0));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				auto &target = std::get<std::string>(result);
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-						helix::action(&send_data, target.data(), target.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::OPEN) {	
-			if(logRequests || logPaths)
-				std::cout << "posix: OPEN path: " << req.path()	<< std::endl;
-
-			helix::SendBuffer send_resp;
-			managarm::posix::SvrResponse resp;
-
-			assert(!(req.flags() & ~(managarm::posix::OF_CREATE
-					| managarm::posix::OF_EXCLUSIVE
-					| managarm::posix::OF_NONBLOCK
-					| managarm::posix::OF_CLOEXEC)));
-
-			SemanticFlags semantic_flags = 0;
-			if(req.flags() & managarm::posix::OF_NONBLOCK)
-				semantic_flags |= semanticNonBlock;
-
-			smarter::shared_ptr<File, FileHandle> file;
-
-			PathResolver resolver;
-			resolver.setup(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(req.flags() & managarm::posix::OF_CREATE) {
-				COFIBER_AWAIT resolver.resolve(resolvePrefix);
-				if(!resolver.currentLink()) {
-					resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-					auto ser = resp.SerializeAsString();
-					auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-							helix::action(&send_resp, ser.data(), ser.size()));
-					COFIBER_AWAIT transmit.async_wait();
-					HEL_CHECK(send_resp.error());
-					continue;
-				}
-
-				if(logRequests)
-					std::cout << "posix: Creating file " << req.path() << std::endl;
-
-				auto directory = resolver.currentLink()->getTarget();
-				auto tail = COFIBER_AWAIT directory->getLink(resolver.nextComponent());
-				if(tail) {
-					if(req.flags() & managarm::posix::OF_EXCLUSIVE) {
-						resp.set_error(managarm::posix::Errors::ALREADY_EXISTS);
-
-						auto ser = resp.SerializeAsString();
-						auto &&transmit = helix::submitAsync(conversation,
-								helix::Dispatcher::global(),
-								helix::action(&send_resp, ser.data(), ser.size()));
-						COFIBER_AWAIT transmit.async_wait();
-						HEL_CHECK(send_resp.error());
-						continue;
-					}else{
-						file = COFIBER_AWAIT tail->getTarget()->open(std::move(tail),
-								semantic_flags);
-						assert(file);
-					}
-				}else{
-					assert(directory->superblock());
-					auto node = COFIBER_AWAIT directory->superblock()->createRegular();
-					// Due to races, link() can fail here.
-					// TODO: Implement a version of link() that eithers links the new node
-					// or returns the current node without failing.
-					auto link = COFIBER_AWAIT directory->link(resolver.nextComponent(), node);
-					file = COFIBER_AWAIT node->open(std::move(link), semantic_flags);
-					assert(file);
-				}
-			}else{
-				COFIBER_AWAIT resolver.resolve();
-
-				if(resolver.currentLink()) {
-					auto target = resolver.currentLink()->getTarget();
-					file = COFIBER_AWAIT target->open(resolver.currentLink(), semantic_flags);
-				}
-			}
-
-			if(file) {
-				int fd = self->fileContext()->attachFile(file,
-						req.flags() & managarm::posix::OF_CLOEXEC);
-
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-				resp.set_fd(fd);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				if(logRequests)
-					std::cout << "posix:     OPEN failed: file not found" << std::endl;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::CLOSE) {
-			if(logRequests)
-				std::cout << "posix: CLOSE file descriptor " << req.fd() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			self->fileContext()->closeFile(req.fd());
-
+		}else{
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::DUP) {
-			if(logRequests)
-				std::cout << "posix: DUP" << std::endl;
-
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for DUP");
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::MKDIR) {
+		if(logRequests || logPaths)
+			std::cout << "posix: MKDIR " << req.path() << std::endl;
 
-			assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+		helix::SendBuffer send_resp;
+		managarm::posix::SvrResponse resp;
 
-			int newfd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OF_CLOEXEC);
+		PathResolver resolver;
+		resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		COFIBER_AWAIT resolver.resolve(resolvePrefix);
+		assert(resolver.currentLink());
 
-			helix::SendBuffer send_resp;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(newfd);
+		auto parent = resolver.currentLink()->getTarget();
+		if(COFIBER_AWAIT parent->getLink(resolver.nextComponent())) {
+			resp.set_error(managarm::posix::Errors::ALREADY_EXISTS);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::DUP2) {
-			if(logRequests)
-				std::cout << "posix: DUP2" << std::endl;
-
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for DUP2");
-
-			assert(!req.flags());
-
-			if(req.newfd() >= 0) {
-				self->fileContext()->attachFile(req.newfd(), file);
-			}else{
-				throw std::runtime_error("DUP2 requires a file descriptor >= 0");
-			}
-
-			helix::SendBuffer send_resp;
+			COFIBER_RETURN();
+		}
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+		COFIBER_AWAIT parent->mkdir(resolver.nextComponent());
+
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SYMLINK) {
+		if(logRequests || logPaths)
+			std::cout << "posix: SYMLINK " << req.path() << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		PathResolver resolver;
+		resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		COFIBER_AWAIT resolver.resolve(resolvePrefix);
+		assert(resolver.currentLink());
+
+		auto parent = resolver.currentLink()->getTarget();
+		COFIBER_AWAIT parent->symlink(resolver.nextComponent(), req.target_path());
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::RENAME) {
+		if(logRequests || logPaths)
+			std::cout << "posix: RENAME " << req.path()
+					<< " to " << req.target_path() << std::endl;
+
+		helix::SendBuffer send_resp;
+		managarm::posix::SvrResponse resp;
+
+		PathResolver resolver;
+		resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		COFIBER_AWAIT resolver.resolve();
+		if(!resolver.currentLink()) {
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::FSTAT) {
-			if(logRequests)
-				std::cout << "posix: FSTAT" << std::endl;
+			COFIBER_RETURN();
+		}
 
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for FSTAT");
-			auto stats = COFIBER_AWAIT file->associatedLink()->getTarget()->getStats();
+		PathResolver new_resolver;
+		new_resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.target_path());
+		COFIBER_AWAIT new_resolver.resolve(resolvePrefix);
+		assert(new_resolver.currentLink());
+
+		auto superblock = resolver.currentLink()->getTarget()->superblock();
+		auto directory = new_resolver.currentLink()->getTarget();
+		assert(superblock == directory->superblock());
+		COFIBER_AWAIT superblock->rename(resolver.currentLink().get(),
+				directory.get(), new_resolver.nextComponent());
+
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::STAT
+			|| req.request_type() == managarm::posix::CntReqType::LSTAT) {	
+		if(logRequests || logPaths)
+			std::cout << "posix: STAT path: " << req.path() << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		PathResolver resolver;
+		resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(req.request_type() == managarm::posix::STAT) {
+			COFIBER_AWAIT resolver.resolve();
+		}else{
+			assert(req.request_type() == managarm::posix::LSTAT);
+			COFIBER_AWAIT resolver.resolve(resolveDontFollow);
+		}
 
-			helix::SendBuffer send_resp;
+		if(resolver.currentLink()) {
+			auto stats = COFIBER_AWAIT resolver.currentLink()->getTarget()->getStats();
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
 
 			DeviceId devnum;
-			switch(file->associatedLink()->getTarget()->getType()) {
+			switch(resolver.currentLink()->getTarget()->getType()) {
 			case VfsType::regular:
 				resp.set_file_type(managarm::posix::FT_REGULAR); break;
 			case VfsType::directory:
 				resp.set_file_type(managarm::posix::FT_DIRECTORY); break;
 			case VfsType::charDevice:
 				resp.set_file_type(managarm::posix::FT_CHAR_DEVICE);
-				devnum = file->associatedLink()->getTarget()->readDevice();
+				devnum = resolver.currentLink()->getTarget()->readDevice();
 				resp.set_ref_devnum(makedev(devnum.first, devnum.second));
 				break;
 			case VfsType::blockDevice:
 				resp.set_file_type(managarm::posix::FT_BLOCK_DEVICE);
-				devnum = file->associatedLink()->getTarget()->readDevice();
+				devnum = resolver.currentLink()->getTarget()->readDevice();
 				resp.set_ref_devnum(makedev(devnum.first, devnum.second));
 				break;
 			}
@@ -1086,676 +832,1030 @@ COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::IS_TTY) {
-			if(logRequests)
-				std::cout << "posix: IS_TTY" << std::endl;
-
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for IS_TTY");
-
-			helix::SendBuffer send_resp;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_mode(file->isTerminal());
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::TTY_NAME) {
-			if(logRequests)
-				std::cout << "posix: TTY_NAME" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			std::cout << "\e[31mposix: Fix TTY_NAME\e[39m" << std::endl;
-			managarm::posix::SvrResponse resp;
-			resp.set_path("/dev/ttyS0");
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::UNLINK) {
-			if(logRequests || logPaths)
-				std::cout << "posix: UNLINK path: " << req.path() << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
-					self->fsContext()->getWorkingDirectory(), req.path());
-			if(path.second) {
-				auto owner = path.second->getOwner();
-				COFIBER_AWAIT owner->unlink(path.second->getName());
-
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::SUCCESS);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}else{
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-			}
-		}else if(req.request_type() == managarm::posix::CntReqType::FD_GET_FLAGS) {
-			if(logRequests)
-				std::cout << "posix: FD_GET_FLAGS" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto descriptor = self->fileContext()->getDescriptor(req.fd());
-			if(!descriptor) {
-				managarm::posix::SvrResponse resp;
-				resp.set_error(managarm::posix::Errors::NO_SUCH_FD);
-
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
-
-			int flags = 0;
-			if(descriptor->closeOnExec)
-				flags |= O_CLOEXEC;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_flags(flags);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SIG_ACTION) {
-			if(logRequests)
-				std::cout << "posix: SIG_ACTION" << std::endl;
-
-			if(req.flags() & ~(SA_SIGINFO | SA_RESETHAND | SA_NODEFER | SA_RESTART)) {
-				std::cout << "\e[31mposix: Unknown SIG_ACTION flags: 0x"
-						<< std::hex << req.flags()
-						<< std::dec << "\e[39m" << std::endl;
-				assert(!"Flags not implemented");
-			}
-
-			SignalHandler saved_handler;
-			if(req.mode()) {
-				SignalHandler handler;
-				if(req.sig_handler() == uintptr_t(-2)) {
-					handler.disposition = SignalDisposition::none;
-				}else if(req.sig_handler() == uintptr_t(-3)) {
-					handler.disposition = SignalDisposition::ignore;
-				}else{
-					handler.disposition = SignalDisposition::handle;
-					handler.handlerIp = req.sig_handler();
-				}
-
-				handler.flags = 0;
-				handler.mask = req.sig_mask();
-				handler.restorerIp = req.sig_restorer();
-
-				if(req.flags() & SA_SIGINFO)
-					handler.flags |= signalInfo;
-				if(req.flags() & SA_RESETHAND)
-					handler.flags |= signalOnce;
-				if(req.flags() & SA_NODEFER)
-					handler.flags |= signalReentrant;
-				if(req.flags() & SA_RESTART)
-					std::cout << "\e[31mposix: Ignoring SA_RESTART\e[39m" << std::endl;
-
-				saved_handler = self->signalContext()->changeHandler(req.sig_number(), handler);
-			}else{
-				saved_handler = self->signalContext()->getHandler(req.sig_number());
-			}
-
-			int saved_flags = 0;
-			if(saved_handler.flags & signalInfo)
-				saved_flags |= SA_SIGINFO;
-			if(saved_handler.flags & signalOnce)
-				saved_flags |= SA_RESETHAND;
-			if(saved_handler.flags & signalReentrant)
-				saved_flags |= SA_NODEFER;
-
-			helix::SendBuffer send_resp;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_flags(saved_flags);
-			resp.set_sig_mask(saved_handler.mask);
-			if(saved_handler.disposition == SignalDisposition::handle) {
-				resp.set_sig_handler(saved_handler.handlerIp);
-				resp.set_sig_restorer(saved_handler.restorerIp);
-			}else if(saved_handler.disposition == SignalDisposition::none) {
-				resp.set_sig_handler(-2);
-			}else{
-				assert(saved_handler.disposition == SignalDisposition::ignore);
-				resp.set_sig_handler(-3);
-			}
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::PIPE_CREATE) {
-			if(logRequests)
-				std::cout << "posix: PIPE_CREATE" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto pair = fifo::createPair();
-			auto r_fd = self->fileContext()->attachFile(std::get<0>(pair));
-			auto w_fd = self->fileContext()->attachFile(std::get<1>(pair));
-
+			HEL_CHECK(send_resp.error());
+		}else{
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.mutable_fds()->Add(r_fd);
-			resp.mutable_fds()->Add(w_fd);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SOCKET) {
-			if(logRequests)
-				std::cout << "posix: SOCKET" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			assert(!(req.flags() & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)));
-
-			if(req.flags() & SOCK_NONBLOCK)
-				std::cout << "\e[31mposix: socket(SOCK_NONBLOCK)"
-						" is not implemented correctly\e[39m" << std::endl;
-
-			smarter::shared_ptr<File, FileHandle> file;
-			if(req.domain() == AF_UNIX) {
-				assert(req.socktype() == SOCK_DGRAM || req.socktype() == SOCK_STREAM
-						|| req.socktype() == SOCK_SEQPACKET);
-				assert(!req.protocol());
-
-				file = un_socket::createSocketFile();
-			}else if(req.domain() == AF_NETLINK) {
-				assert(req.socktype() == SOCK_RAW || req.socktype() == SOCK_DGRAM);
-				file = nl_socket::createSocketFile(req.protocol());
-			}else{
-				throw std::runtime_error("posix: Handle unknown protocol families");
-			}
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::READLINK) {
+		if(logRequests || logPaths)
+			std::cout << "posix: READLINK path: " << req.path() << std::endl;
 
-			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & SOCK_CLOEXEC);
+		helix::SendBuffer send_resp;
+		helix::SendBuffer send_data;
 
+		auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path(), resolveDontFollow);
+		if(!path.second) {
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&send_data, nullptr, 0));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SOCKPAIR) {
-			if(logRequests)
-				std::cout << "posix: SOCKPAIR" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			assert(!(req.flags() & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)));
-
-			if(req.flags() & SOCK_NONBLOCK)
-				std::cout << "\e[31mposix: socketpair(SOCK_NONBLOCK)"
-						" is not implemented correctly\e[39m" << std::endl;
-
-			assert(req.domain() == AF_UNIX);
-			assert(req.socktype() == SOCK_DGRAM || req.socktype() == SOCK_STREAM
-					|| req.socktype() == SOCK_SEQPACKET);
-			assert(!req.protocol());
+			COFIBER_RETURN();
+		}
 
-			auto pair = un_socket::createSocketPair(self.get());
-			auto fd0 = self->fileContext()->attachFile(std::get<0>(pair),
-					req.flags() & SOCK_CLOEXEC);
-			auto fd1 = self->fileContext()->attachFile(std::get<1>(pair),
-					req.flags() & SOCK_CLOEXEC);
+		auto result = COFIBER_AWAIT path.second->getTarget()->readSymlink(path.second.get());
+		if(auto error = std::get_if<Error>(&result); error) {
+			assert(*error == Error::illegalOperationTarget);
 
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.mutable_fds()->Add(fd0);
-			resp.mutable_fds()->Add(fd1);
+			resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&send_data, nullptr, 0));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::ACCEPT) {
-			if(logRequests)
-				std::cout << "posix: ACCEPT" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto sockfile = self->fileContext()->getFile(req.fd());
-			assert(sockfile && "Illegal FD for ACCEPT");
-
-			auto newfile = COFIBER_AWAIT sockfile->accept(self.get());
-			auto fd = self->fileContext()->attachFile(std::move(newfile));
+		}else{
+			auto &target = std::get<std::string>(result);
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&send_data, target.data(), target.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SENDMSG) {
-			if(logRequests)
-				std::cout << "posix: SENDMSG" << std::endl;
-
-			helix::RecvInline recv_data;
-			helix::RecvInline recv_addr;
-			helix::SendBuffer send_resp;
-
-			auto &&submit_data = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&recv_data, kHelItemChain),
-					helix::action(&recv_addr));
-			COFIBER_AWAIT submit_data.async_wait();
-			HEL_CHECK(recv_data.error());
-
-			auto sockfile = self->fileContext()->getFile(req.fd());
-			assert(sockfile && "Illegal FD for SENDMSG");
-
-			MsgFlags flags = 0;
-			if(req.flags() & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC | MSG_NOSIGNAL)) {
-				std::cout << "\e[31mposix: Unknown SENDMSG flags: 0x" << std::hex << req.flags()
-						<< std::dec << "\e[39m" << std::endl;
-				assert(!"Flags not implemented");
-			}
-			if(req.flags() & MSG_DONTWAIT)
-				flags |= msgNoWait;
-			if(req.flags() & MSG_CMSG_CLOEXEC)
-				flags |= msgCloseOnExec;
-			if(req.flags() & MSG_NOSIGNAL) {
-				static bool warned = false;
-				if(!warned)
-					std::cout << "\e[35mposix: Ignoring MSG_NOSIGNAL\e[39m" << std::endl;
-				warned = true;
-			}
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::OPEN) {	
+		if(logRequests || logPaths)
+			std::cout << "posix: OPEN path: " << req.path()	<< std::endl;
 
-			std::vector<smarter::shared_ptr<File, FileHandle>> files;
-			for(int i = 0; i < req.fds_size(); i++) {
-				auto file = self->fileContext()->getFile(req.fds(i));
-				assert(sockfile && "Illegal FD for SENDMSG cmsg");
-				files.push_back(std::move(file));
-			}
+		helix::SendBuffer send_resp;
+		managarm::posix::SvrResponse resp;
 
-			auto result_or_error = COFIBER_AWAIT sockfile->sendMsg(self.get(), flags,
-					recv_data.data(), recv_data.length(),
-					recv_addr.data(), recv_addr.length(),
-					std::move(files));
+		assert(!(req.flags() & ~(managarm::posix::OF_CREATE
+				| managarm::posix::OF_EXCLUSIVE
+				| managarm::posix::OF_NONBLOCK
+				| managarm::posix::OF_CLOEXEC)));
 
-			managarm::posix::SvrResponse resp;
+		SemanticFlags semantic_flags = 0;
+		if(req.flags() & managarm::posix::OF_NONBLOCK)
+			semantic_flags |= semanticNonBlock;
 
-			auto error = std::get_if<Error>(&result_or_error);
-			if(error && *error == Error::brokenPipe) {
-				resp.set_error(managarm::posix::Errors::BROKEN_PIPE);
+		smarter::shared_ptr<File, FileHandle> file;
+
+		PathResolver resolver;
+		resolver.setup(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(req.flags() & managarm::posix::OF_CREATE) {
+			COFIBER_AWAIT resolver.resolve(resolvePrefix);
+			if(!resolver.currentLink()) {
+				resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 				auto ser = resp.SerializeAsString();
 				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 						helix::action(&send_resp, ser.data(), ser.size()));
 				COFIBER_AWAIT transmit.async_wait();
 				HEL_CHECK(send_resp.error());
-				continue;
+				COFIBER_RETURN();
+			}
+
+			if(logRequests)
+				std::cout << "posix: Creating file " << req.path() << std::endl;
+
+			auto directory = resolver.currentLink()->getTarget();
+			auto tail = COFIBER_AWAIT directory->getLink(resolver.nextComponent());
+			if(tail) {
+				if(req.flags() & managarm::posix::OF_EXCLUSIVE) {
+					resp.set_error(managarm::posix::Errors::ALREADY_EXISTS);
+
+					auto ser = resp.SerializeAsString();
+					auto &&transmit = helix::submitAsync(conversation,
+							helix::Dispatcher::global(),
+							helix::action(&send_resp, ser.data(), ser.size()));
+					COFIBER_AWAIT transmit.async_wait();
+					HEL_CHECK(send_resp.error());
+					COFIBER_RETURN();
+				}else{
+					file = COFIBER_AWAIT tail->getTarget()->open(std::move(tail),
+							semantic_flags);
+					assert(file);
+				}
+			}else{
+				assert(directory->superblock());
+				auto node = COFIBER_AWAIT directory->superblock()->createRegular();
+				// Due to races, link() can fail here.
+				// TODO: Implement a version of link() that eithers links the new node
+				// or returns the current node without failing.
+				auto link = COFIBER_AWAIT directory->link(resolver.nextComponent(), node);
+				file = COFIBER_AWAIT node->open(std::move(link), semantic_flags);
+				assert(file);
+			}
+		}else{
+			COFIBER_AWAIT resolver.resolve();
+
+			if(resolver.currentLink()) {
+				auto target = resolver.currentLink()->getTarget();
+				file = COFIBER_AWAIT target->open(resolver.currentLink(), semantic_flags);
 			}
+		}
+
+		if(file) {
+			int fd = self->fileContext()->attachFile(file,
+					req.flags() & managarm::posix::OF_CLOEXEC);
 
 			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_size(std::get<size_t>(result_or_error));
+			resp.set_fd(fd);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::RECVMSG) {
+		}else{
 			if(logRequests)
-				std::cout << "posix: RECVMSG" << std::endl;
+				std::cout << "posix:     OPEN failed: file not found" << std::endl;
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
-			helix::SendBuffer send_addr;
-			helix::SendBuffer send_ctrl;
+			auto ser = resp.SerializeAsString();
+			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+					helix::action(&send_resp, ser.data(), ser.size()));
+			COFIBER_AWAIT transmit.async_wait();
+			HEL_CHECK(send_resp.error());
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::CLOSE) {
+		if(logRequests)
+			std::cout << "posix: CLOSE file descriptor " << req.fd() << std::endl;
 
-			auto sockfile = self->fileContext()->getFile(req.fd());
-			assert(sockfile && "Illegal FD for SENDMSG");
+		helix::SendBuffer send_resp;
 
-			MsgFlags flags = 0;
-			if(req.flags() & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) {
-				std::cout << "\e[31mposix: Unknown RECVMSG flags: 0x" << std::hex << req.flags()
-						<< std::dec << "\e[39m" << std::endl;
-				assert(!"Flags not implemented");
-			}
-			if(req.flags() & MSG_DONTWAIT)
-				flags |= msgNoWait;
-			if(req.flags() & MSG_CMSG_CLOEXEC)
-				flags |= msgCloseOnExec;
-
-			std::vector<char> buffer;
-			std::vector<char> address;
-			buffer.resize(req.size());
-			address.resize(req.addr_size());
-			auto result_or_error = COFIBER_AWAIT sockfile->recvMsg(self.get(), flags,
-					buffer.data(), req.size(),
-					address.data(), req.addr_size(), req.ctrl_size());
+		self->fileContext()->closeFile(req.fd());
 
-			managarm::posix::SvrResponse resp;
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
 
-			auto error = std::get_if<Error>(&result_or_error);
-			if(error && *error == Error::wouldBlock) {
-				resp.set_error(managarm::posix::Errors::WOULD_BLOCK);
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::DUP) {
+		if(logRequests)
+			std::cout << "posix: DUP" << std::endl;
 
-				auto ser = resp.SerializeAsString();
-				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-						helix::action(&send_resp, ser.data(), ser.size()));
-				COFIBER_AWAIT transmit.async_wait();
-				HEL_CHECK(send_resp.error());
-				continue;
-			}
+		auto file = self->fileContext()->getFile(req.fd());
+		assert(file && "Illegal FD for DUP");
 
-			auto result = std::get<RecvResult>(result_or_error);
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+		assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-					helix::action(&send_addr, address.data(), std::get<1>(result), kHelItemChain),
-					helix::action(&send_data, buffer.data(), std::get<0>(result), kHelItemChain),
-					helix::action(&send_ctrl, std::get<2>(result).data(),
-							std::get<2>(result).size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_CALL) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_CALL" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto epfile = epoll::createFile();
-			assert(req.fds_size() == req.events_size());
-			for(int i = 0; i < req.fds_size(); i++) {
-				auto file = self->fileContext()->getFile(req.fds(i));
-				assert(file && "Illegal FD for EPOLL_ADD item");
-				auto locked = file->weakFile().lock();
-				assert(locked);
-				epoll::addItem(epfile.get(), self.get(), std::move(locked),
-						req.events(i), i);
-			}
+		int newfd = self->fileContext()->attachFile(file,
+				req.flags() & managarm::posix::OF_CLOEXEC);
 
-			if(req.timeout() > 0)
-				std::cout << "posix: Ignoring non-zero EPOLL_WAIT timeout" << std::endl;
+		helix::SendBuffer send_resp;
 
-			struct epoll_event events[16];
-			size_t k;
-			if(req.timeout() == -1 || req.timeout() > 0) {
-				k = COFIBER_AWAIT epoll::wait(epfile.get(), events, 16);
-			}else if(req.timeout() == 0) {
-				// Do not bother to set up a timer for zero timeouts.
-				async::cancellation_event cancel_wait;
-				cancel_wait.cancel();
-				k = COFIBER_AWAIT epoll::wait(epfile.get(), events, 16, cancel_wait);
-			}else{
-				assert(!"posix: Implement real epoll timeouts");
-				__builtin_unreachable();
-			}
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(newfd);
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::DUP2) {
+		if(logRequests)
+			std::cout << "posix: DUP2" << std::endl;
 
-			for(int i = 0; i < req.fds_size(); i++)
-				resp.add_events(0);
-			for(size_t m = 0; m < k; m++)
-				resp.set_events(events[m].data.u32, events[m].events);
+		auto file = self->fileContext()->getFile(req.fd());
+		assert(file && "Illegal FD for DUP2");
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_CREATE) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_CREATE" << std::endl;
+		assert(!req.flags());
 
-			helix::SendBuffer send_resp;
+		if(req.newfd() >= 0) {
+			self->fileContext()->attachFile(req.newfd(), file);
+		}else{
+			throw std::runtime_error("DUP2 requires a file descriptor >= 0");
+		}
 
-			assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::FSTAT) {
+		if(logRequests)
+			std::cout << "posix: FSTAT" << std::endl;
+
+		auto file = self->fileContext()->getFile(req.fd());
+		assert(file && "Illegal FD for FSTAT");
+		auto stats = COFIBER_AWAIT file->associatedLink()->getTarget()->getStats();
+
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		DeviceId devnum;
+		switch(file->associatedLink()->getTarget()->getType()) {
+		case VfsType::regular:
+			resp.set_file_type(managarm::posix::FT_REGULAR); break;
+		case VfsType::directory:
+			resp.set_file_type(managarm::posix::FT_DIRECTORY); break;
+		case VfsType::charDevice:
+			resp.set_file_type(managarm::posix::FT_CHAR_DEVICE);
+			devnum = file->associatedLink()->getTarget()->readDevice();
+			resp.set_ref_devnum(makedev(devnum.first, devnum.second));
+			break;
+		case VfsType::blockDevice:
+			resp.set_file_type(managarm::posix::FT_BLOCK_DEVICE);
+			devnum = file->associatedLink()->getTarget()->readDevice();
+			resp.set_ref_devnum(makedev(devnum.first, devnum.second));
+			break;
+		}
 
-			auto file = epoll::createFile();
-			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OF_CLOEXEC);
+		resp.set_fs_inode(stats.inodeNumber);
+		resp.set_mode(stats.mode);
+		resp.set_num_links(stats.numLinks);
+		resp.set_uid(stats.uid);
+		resp.set_gid(stats.gid);
+		resp.set_file_size(stats.fileSize);
+		resp.set_atime_secs(stats.atimeSecs);
+		resp.set_atime_nanos(stats.atimeNanos);
+		resp.set_mtime_secs(stats.mtimeSecs);
+		resp.set_mtime_nanos(stats.mtimeNanos);
+		resp.set_ctime_secs(stats.ctimeSecs);
+		resp.set_ctime_nanos(stats.ctimeNanos);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::IS_TTY) {
+		if(logRequests)
+			std::cout << "posix: IS_TTY" << std::endl;
+
+		auto file = self->fileContext()->getFile(req.fd());
+		assert(file && "Illegal FD for IS_TTY");
+
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_mode(file->isTerminal());
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::TTY_NAME) {
+		if(logRequests)
+			std::cout << "posix: TTY_NAME" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		std::cout << "\e[31mposix: Fix TTY_NAME\e[39m" << std::endl;
+		managarm::posix::SvrResponse resp;
+		resp.set_path("/dev/ttyS0");
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::UNLINK) {
+		if(logRequests || logPaths)
+			std::cout << "posix: UNLINK path: " << req.path() << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto path = COFIBER_AWAIT resolve(self->fsContext()->getRoot(),
+				self->fsContext()->getWorkingDirectory(), req.path());
+		if(path.second) {
+			auto owner = path.second->getOwner();
+			COFIBER_AWAIT owner->unlink(path.second->getName());
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_ADD) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_ADD" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			assert(epfile && "Illegal FD for EPOLL_ADD");
-			assert(file && "Illegal FD for EPOLL_ADD item");
-
-			auto locked = file->weakFile().lock();
-			assert(locked);
-			epoll::addItem(epfile.get(), self.get(), std::move(locked),
-					req.flags(), req.cookie());
-
+		}else{
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_error(managarm::posix::Errors::FILE_NOT_FOUND);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_MODIFY) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_MODIFY" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			assert(epfile && "Illegal FD for EPOLL_MODIFY");
-			assert(file && "Illegal FD for EPOLL_MODIFY item");
+		}
+	}else if(req.request_type() == managarm::posix::CntReqType::FD_GET_FLAGS) {
+		if(logRequests)
+			std::cout << "posix: FD_GET_FLAGS" << std::endl;
 
-			epoll::modifyItem(epfile.get(), file.get(), req.flags(), req.cookie());
+		helix::SendBuffer send_resp;
 
+		auto descriptor = self->fileContext()->getDescriptor(req.fd());
+		if(!descriptor) {
 			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_error(managarm::posix::Errors::NO_SUCH_FD);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_DELETE) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_DELETE" << std::endl;
+			COFIBER_RETURN();
+		}
 
-			helix::SendBuffer send_resp;
+		int flags = 0;
+		if(descriptor->closeOnExec)
+			flags |= O_CLOEXEC;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_flags(flags);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SIG_ACTION) {
+		if(logRequests)
+			std::cout << "posix: SIG_ACTION" << std::endl;
+
+		if(req.flags() & ~(SA_SIGINFO | SA_RESETHAND | SA_NODEFER | SA_RESTART)) {
+			std::cout << "\e[31mposix: Unknown SIG_ACTION flags: 0x"
+					<< std::hex << req.flags()
+					<< std::dec << "\e[39m" << std::endl;
+			assert(!"Flags not implemented");
+		}
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			assert(epfile && "Illegal FD for EPOLL_DELETE");
-			assert(file && "Illegal FD for EPOLL_DELETE item");
+		SignalHandler saved_handler;
+		if(req.mode()) {
+			SignalHandler handler;
+			if(req.sig_handler() == uintptr_t(-2)) {
+				handler.disposition = SignalDisposition::none;
+			}else if(req.sig_handler() == uintptr_t(-3)) {
+				handler.disposition = SignalDisposition::ignore;
+			}else{
+				handler.disposition = SignalDisposition::handle;
+				handler.handlerIp = req.sig_handler();
+			}
 
-			epoll::deleteItem(epfile.get(), file.get(), req.flags());
+			handler.flags = 0;
+			handler.mask = req.sig_mask();
+			handler.restorerIp = req.sig_restorer();
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			if(req.flags() & SA_SIGINFO)
+				handler.flags |= signalInfo;
+			if(req.flags() & SA_RESETHAND)
+				handler.flags |= signalOnce;
+			if(req.flags() & SA_NODEFER)
+				handler.flags |= signalReentrant;
+			if(req.flags() & SA_RESTART)
+				std::cout << "\e[31mposix: Ignoring SA_RESTART\e[39m" << std::endl;
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_WAIT) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_WAIT request" << std::endl;
+			saved_handler = self->signalContext()->changeHandler(req.sig_number(), handler);
+		}else{
+			saved_handler = self->signalContext()->getHandler(req.sig_number());
+		}
 
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
+		int saved_flags = 0;
+		if(saved_handler.flags & signalInfo)
+			saved_flags |= SA_SIGINFO;
+		if(saved_handler.flags & signalOnce)
+			saved_flags |= SA_RESETHAND;
+		if(saved_handler.flags & signalReentrant)
+			saved_flags |= SA_NODEFER;
+
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_flags(saved_flags);
+		resp.set_sig_mask(saved_handler.mask);
+		if(saved_handler.disposition == SignalDisposition::handle) {
+			resp.set_sig_handler(saved_handler.handlerIp);
+			resp.set_sig_restorer(saved_handler.restorerIp);
+		}else if(saved_handler.disposition == SignalDisposition::none) {
+			resp.set_sig_handler(-2);
+		}else{
+			assert(saved_handler.disposition == SignalDisposition::ignore);
+			resp.set_sig_handler(-3);
+		}
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			assert(epfile && "Illegal FD for EPOLL_WAIT");
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::PIPE_CREATE) {
+		if(logRequests)
+			std::cout << "posix: PIPE_CREATE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto pair = fifo::createPair();
+		auto r_fd = self->fileContext()->attachFile(std::get<0>(pair));
+		auto w_fd = self->fileContext()->attachFile(std::get<1>(pair));
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.mutable_fds()->Add(r_fd);
+		resp.mutable_fds()->Add(w_fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SOCKET) {
+		if(logRequests)
+			std::cout << "posix: SOCKET" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		assert(!(req.flags() & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)));
+
+		if(req.flags() & SOCK_NONBLOCK)
+			std::cout << "\e[31mposix: socket(SOCK_NONBLOCK)"
+					" is not implemented correctly\e[39m" << std::endl;
+
+		smarter::shared_ptr<File, FileHandle> file;
+		if(req.domain() == AF_UNIX) {
+			assert(req.socktype() == SOCK_DGRAM || req.socktype() == SOCK_STREAM
+					|| req.socktype() == SOCK_SEQPACKET);
+			assert(!req.protocol());
 
-			if(req.timeout() > 0)
-				std::cout << "posix: Ignoring non-zero EPOLL_WAIT timeout" << std::endl;
+			file = un_socket::createSocketFile(req.socktype());
+		}else if(req.domain() == AF_NETLINK) {
+			assert(req.socktype() == SOCK_RAW || req.socktype() == SOCK_DGRAM);
+			file = nl_socket::createSocketFile(req.protocol());
+		}else if(req.domain() == AF_INET) {
+			// Non-blocking sockets are not forwarded as our client cannot report EAGAIN yet.
+			file = COFIBER_AWAIT inet_socket::createSocketFile(req.socktype(),
+					req.protocol(), false);
+			if(!file) {
+				managarm::posix::SvrResponse resp;
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 
-			struct epoll_event events[16];
-			size_t k;
-			if(req.timeout() == -1 || req.timeout() > 0) {
-				k = COFIBER_AWAIT epoll::wait(epfile.get(), events,
-						std::min(req.size(), uint32_t(16)));
-			}else if(req.timeout() == 0) {
-				// Do not bother to set up a timer for zero timeouts.
-				async::cancellation_event cancel_wait;
-				cancel_wait.cancel();
-				k = COFIBER_AWAIT epoll::wait(epfile.get(), events,
-						std::min(req.size(), uint32_t(16)), cancel_wait);
-			}else{
-				assert(!"posix: Implement real epoll timeouts");
-				__builtin_unreachable();
+				auto ser = resp.SerializeAsString();
+				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+						helix::action(&send_resp, ser.data(), ser.size()));
+				COFIBER_AWAIT transmit.async_wait();
+				HEL_CHECK(send_resp.error());
+				COFIBER_RETURN();
 			}
+		}else{
+			throw std::runtime_error("posix: Handle unknown protocol families");
+		}
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+		auto fd = self->fileContext()->attachFile(file,
+				req.flags() & SOCK_CLOEXEC);
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-					helix::action(&send_data, events, k * sizeof(struct epoll_event)));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_CREATE) {
-			if(logRequests)
-				std::cout << "posix: TIMERFD_CREATE" << std::endl;
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
 
-			helix::SendBuffer send_resp;
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SOCKPAIR) {
+		if(logRequests)
+			std::cout << "posix: SOCKPAIR" << std::endl;
 
-			assert(!(req.flags() & ~(TFD_CLOEXEC | TFD_NONBLOCK)));
+		helix::SendBuffer send_resp;
 
-			auto file = timerfd::createFile(req.flags() & TFD_NONBLOCK);
-			auto fd = self->fileContext()->attachFile(file, req.flags() & TFD_CLOEXEC);
+		assert(!(req.flags() & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)));
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
+		if(req.flags() & SOCK_NONBLOCK)
+			std::cout << "\e[31mposix: socketpair(SOCK_NONBLOCK)"
+					" is not implemented correctly\e[39m" << std::endl;
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			COFIBER_AWAIT transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_SETTIME) {
-			if(logRequests)
-				std::cout << "posix: TIMERFD_SETTIME" << std::endl;
+		assert(req.domain() == AF_UNIX);
+		assert(req.socktype() == SOCK_DGRAM || req.socktype() == SOCK_STREAM
+				|| req.socktype() == SOCK_SEQPACKET);
+		assert(!req.protocol());
 
-			helix::SendBuffer send_resp;
+		auto pair = un_socket::createSocketPair(self.get(), req.socktype());
+		auto fd0 = self->fileContext()->attachFile(std::get<0>(pair),
+				req.flags() & SOCK_CLOEXEC);
+		auto fd1 = self->fileContext()->attachFile(std::get<1>(pair),
+				req.flags() & SOCK_CLOEXEC);
 
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for TIMERFD_SETTIME");
-			timerfd::setTime(file.get(), {req.time_secs(), req.time_nanos()},
-					{req.interval_secs(), req.interval_nanos()});
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.mutable_fds()->Add(fd0);
+		resp.mutable_fds()->Add(fd1);
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::ACCEPT) {
+		if(logRequests)
+			std::cout << "posix: ACCEPT" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto sockfile = self->fileContext()->getFile(req.fd());
+		assert(sockfile && "Illegal FD for ACCEPT");
+
+		auto result = COFIBER_AWAIT sockfile->accept(self.get());
+
+		managarm::posix::SvrResponse resp;
+
+		auto error = std::get_if<Error>(&result);
+		if(error) {
+			if(*error == Error::wouldBlock) {
+				resp.set_error(managarm::posix::Errors::WOULD_BLOCK);
+			}else if(*error == Error::illegalArguments) {
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+			}else{
+				throw std::runtime_error("posix: Unexpected error from accept()");
+			}
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SIGNALFD_CREATE) {
-			if(logRequests)
-				std::cout << "posix: SIGNALFD_CREATE" << std::endl;
+			COFIBER_RETURN();
+		}
 
-			helix::SendBuffer send_resp;
+		auto fd = self->fileContext()->attachFile(std::get<AcceptResult>(std::move(result)));
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SENDMSG) {
+		if(logRequests)
+			std::cout << "posix: SENDMSG" << std::endl;
+
+		helix::RecvInline recv_data;
+		helix::RecvInline recv_addr;
+		helix::SendBuffer send_resp;
+
+		auto &&submit_data = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&recv_data, kHelItemChain),
+				helix::action(&recv_addr));
+		COFIBER_AWAIT submit_data.async_wait();
+		HEL_CHECK(recv_data.error());
+
+		auto sockfile = self->fileContext()->getFile(req.fd());
+		assert(sockfile && "Illegal FD for SENDMSG");
+
+		MsgFlags flags = 0;
+		if(req.flags() & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC | MSG_NOSIGNAL)) {
+			std::cout << "\e[31mposix: Unknown SENDMSG flags: 0x" << std::hex << req.flags()
+					<< std::dec << "\e[39m" << std::endl;
+			assert(!"Flags not implemented");
+		}
+		if(req.flags() & MSG_DONTWAIT)
+			flags |= msgNoWait;
+		if(req.flags() & MSG_CMSG_CLOEXEC)
+			flags |= msgCloseOnExec;
+		if(req.flags() & MSG_NOSIGNAL) {
+			static bool warned = false;
+			if(!warned)
+				std::cout << "\e[35mposix: Ignoring MSG_NOSIGNAL\e[39m" << std::endl;
+			warned = true;
+		}
 
-			assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+		std::vector<smarter::shared_ptr<File, FileHandle>> files;
+		for(int i = 0; i < req.fds_size(); i++) {
+			auto file = self->fileContext()->getFile(req.fds(i));
+			assert(sockfile && "Illegal FD for SENDMSG cmsg");
+			files.push_back(std::move(file));
+		}
 
-			auto file = createSignalFile(req.sigset());
-			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OF_CLOEXEC);
+		auto result_or_error = COFIBER_AWAIT sockfile->sendMsg(self.get(), flags,
+				recv_data.data(), recv_data.length(),
+				recv_addr.data(), recv_addr.length(),
+				std::move(files));
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
+		managarm::posix::SvrResponse resp;
+
+		auto error = std::get_if<Error>(&result_or_error);
+		if(error) {
+			if(*error == Error::brokenPipe) {
+				resp.set_error(managarm::posix::Errors::BROKEN_PIPE);
+			}else if(*error == Error::connectionReset) {
+				resp.set_error(managarm::posix::Errors::CONNECTION_RESET);
+			}else if(*error == Error::notConnected) {
+				resp.set_error(managarm::posix::Errors::NOT_CONNECTED);
+			}else if(*error == Error::illegalArguments) {
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+			}else if(*error == Error::wouldBlock) {
+				resp.set_error(managarm::posix::Errors::WOULD_BLOCK);
+			}else{
+				throw std::runtime_error("posix: Unexpected error from sendMsg()");
+			}
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::INOTIFY_CREATE) {
-			if(logRequests)
-				std::cout << "posix: INOTIFY_CREATE" << std::endl;
+			COFIBER_RETURN();
+		}
 
-			helix::SendBuffer send_resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_size(std::get<size_t>(result_or_error));
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::RECVMSG) {
+		if(logRequests)
+			std::cout << "posix: RECVMSG" << std::endl;
+
+		helix::SendBuffer send_resp;
+		helix::SendBuffer send_data;
+		helix::SendBuffer send_addr;
+		helix::SendBuffer send_ctrl;
+
+		auto sockfile = self->fileContext()->getFile(req.fd());
+		assert(sockfile && "Illegal FD for SENDMSG");
+
+		MsgFlags flags = 0;
+		if(req.flags() & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) {
+			std::cout << "\e[31mposix: Unknown RECVMSG flags: 0x" << std::hex << req.flags()
+					<< std::dec << "\e[39m" << std::endl;
+			assert(!"Flags not implemented");
+		}
+		if(req.flags() & MSG_DONTWAIT)
+			flags |= msgNoWait;
+		if(req.flags() & MSG_CMSG_CLOEXEC)
+			flags |= msgCloseOnExec;
 
-			assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+		std::vector<char> buffer;
+		std::vector<char> address;
+		buffer.resize(req.size());
+		address.resize(req.addr_size());
+		auto result_or_error = COFIBER_AWAIT sockfile->recvMsg(self.get(), flags,
+				buffer.data(), req.size(),
+				address.data(), req.addr_size(), req.ctrl_size());
 
-			auto file = inotify::createFile();
-			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OF_CLOEXEC);
+		managarm::posix::SvrResponse resp;
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
+		auto error = std::get_if<Error>(&result_or_error);
+		if(error && *error == Error::wouldBlock) {
+			resp.set_error(managarm::posix::Errors::WOULD_BLOCK);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else{
-			std::cout << "posix: Illegal request" << std::endl;
-			helix::SendBuffer send_resp;
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::ILLEGAL_REQUEST);
+			COFIBER_RETURN();
+		}else if(error && *error == Error::noBufferSpace) {
+			resp.set_error(managarm::posix::Errors::NO_BUFFER_SPACE);
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size()));
 			COFIBER_AWAIT transmit.async_wait();
 			HEL_CHECK(send_resp.error());
+			COFIBER_RETURN();
+		}
+
+		auto result = std::get<RecvResult>(result_or_error);
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+				helix::action(&send_addr, address.data(), std::get<1>(result), kHelItemChain),
+				helix::action(&send_data, buffer.data(), std::get<0>(result), kHelItemChain),
+				helix::action(&send_ctrl, std::get<2>(result).data(),
+						std::get<2>(result).size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_CALL) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_CALL" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto epfile = epoll::createFile();
+		assert(req.fds_size() == req.events_size());
+		for(int i = 0; i < req.fds_size(); i++) {
+			auto file = self->fileContext()->getFile(req.fds(i));
+			assert(file && "Illegal FD for EPOLL_ADD item");
+			auto locked = file->weakFile().lock();
+			assert(locked);
+			epoll::addItem(epfile.get(), self.get(), std::move(locked),
+					req.events(i), i);
 		}
+
+		if(req.timeout() > 0)
+			std::cout << "posix: Ignoring non-zero EPOLL_WAIT timeout" << std::endl;
+
+		struct epoll_event events[16];
+		size_t k;
+		if(req.timeout() == -1 || req.timeout() > 0) {
+			k = COFIBER_AWAIT epoll::wait(epfile.get(), events, 16);
+		}else if(req.timeout() == 0) {
+			// Do not bother to set up a timer for zero timeouts.
+			async::cancellation_event cancel_wait;
+			cancel_wait.cancel();
+			k = COFIBER_AWAIT epoll::wait(epfile.get(), events, 16, cancel_wait);
+		}else{
+			assert(!"posix: Implement real epoll timeouts");
+			__builtin_unreachable();
+		}
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		for(int i = 0; i < req.fds_size(); i++)
+			resp.add_events(0);
+		for(size_t m = 0; m < k; m++)
+			resp.set_events(events[m].data.u32, events[m].events);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_CREATE) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_CREATE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+
+		auto file = epoll::createFile();
+		auto fd = self->fileContext()->attachFile(file,
+				req.flags() & managarm::posix::OF_CLOEXEC);
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_ADD) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_ADD" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto epfile = self->fileContext()->getFile(req.fd());
+		auto file = self->fileContext()->getFile(req.newfd());
+		assert(epfile && "Illegal FD for EPOLL_ADD");
+		assert(file && "Illegal FD for EPOLL_ADD item");
+
+		auto locked = file->weakFile().lock();
+		assert(locked);
+		epoll::addItem(epfile.get(), self.get(), std::move(locked),
+				req.flags(), req.cookie());
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_MODIFY) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_MODIFY" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto epfile = self->fileContext()->getFile(req.fd());
+		auto file = self->fileContext()->getFile(req.newfd());
+		assert(epfile && "Illegal FD for EPOLL_MODIFY");
+		assert(file && "Illegal FD for EPOLL_MODIFY item");
+
+		epoll::modifyItem(epfile.get(), file.get(), req.flags(), req.cookie());
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_DELETE) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_DELETE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto epfile = self->fileContext()->getFile(req.fd());
+		auto file = self->fileContext()->getFile(req.newfd());
+		assert(epfile && "Illegal FD for EPOLL_DELETE");
+		assert(file && "Illegal FD for EPOLL_DELETE item");
+
+		epoll::deleteItem(epfile.get(), file.get(), req.flags());
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_WAIT) {
+		if(logRequests)
+			std::cout << "posix: EPOLL_WAIT request" << std::endl;
+
+		helix::SendBuffer send_resp;
+		helix::SendBuffer send_data;
+
+		auto epfile = self->fileContext()->getFile(req.fd());
+		assert(epfile && "Illegal FD for EPOLL_WAIT");
+
+		if(req.timeout() > 0)
+			std::cout << "posix: Ignoring non-zero EPOLL_WAIT timeout" << std::endl;
+
+		struct epoll_event events[16];
+		size_t k;
+		if(req.timeout() == -1 || req.timeout() > 0) {
+			k = COFIBER_AWAIT epoll::wait(epfile.get(), events,
+					std::min(req.size(), uint32_t(16)));
+		}else if(req.timeout() == 0) {
+			// Do not bother to set up a timer for zero timeouts.
+			async::cancellation_event cancel_wait;
+			cancel_wait.cancel();
+			k = COFIBER_AWAIT epoll::wait(epfile.get(), events,
+					std::min(req.size(), uint32_t(16)), cancel_wait);
+		}else{
+			assert(!"posix: Implement real epoll timeouts");
+			__builtin_unreachable();
+		}
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+				helix::action(&send_data, events, k * sizeof(struct epoll_event)));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_CREATE) {
+		if(logRequests)
+			std::cout << "posix: TIMERFD_CREATE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		assert(!(req.flags() & ~(TFD_CLOEXEC | TFD_NONBLOCK)));
+
+		auto file = timerfd::createFile(req.flags() & TFD_NONBLOCK);
+		auto fd = self->fileContext()->attachFile(file, req.flags() & TFD_CLOEXEC);
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_SETTIME) {
+		if(logRequests)
+			std::cout << "posix: TIMERFD_SETTIME" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		auto file = self->fileContext()->getFile(req.fd());
+		assert(file && "Illegal FD for TIMERFD_SETTIME");
+		timerfd::setTime(file.get(), {req.time_secs(), req.time_nanos()},
+				{req.interval_secs(), req.interval_nanos()});
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::SIGNALFD_CREATE) {
+		if(logRequests)
+			std::cout << "posix: SIGNALFD_CREATE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+
+		auto file = createSignalFile(req.sigset());
+		auto fd = self->fileContext()->attachFile(file,
+				req.flags() & managarm::posix::OF_CLOEXEC);
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.request_type() == managarm::posix::CntReqType::INOTIFY_CREATE) {
+		if(logRequests)
+			std::cout << "posix: INOTIFY_CREATE" << std::endl;
+
+		helix::SendBuffer send_resp;
+
+		assert(!(req.flags() & ~(managarm::posix::OF_CLOEXEC)));
+
+		auto file = inotify::createFile();
+		auto fd = self->fileContext()->attachFile(file,
+				req.flags() & managarm::posix::OF_CLOEXEC);
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::SUCCESS);
+		resp.set_fd(fd);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else{
+		std::cout << "posix: Illegal request" << std::endl;
+		helix::SendBuffer send_resp;
+
+		managarm::posix::SvrResponse resp;
+		resp.set_error(managarm::posix::Errors::ILLEGAL_REQUEST);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}
+}))
+
+COFIBER_ROUTINE(cofiber::no_future, serveRequests(std::shared_ptr<Process> self,
+		std::shared_ptr<Generation> generation), ([=] {
+	async::cancellation_token cancellation = generation->cancelServe;
+
+	async::cancellation_callback cancel_callback{cancellation, [&] {
+		HEL_CHECK(helShutdownLane(generation->posixLane.getHandle()));
+	}};
+
+	while(true) {
+		// Apply back-pressure if the process has too many requests in flight.
+		while(generation->activeRequests >= maxActiveRequests
+				&& !cancellation.is_cancellation_requested())
+			COFIBER_AWAIT generation->requestBell.async_wait(cancellation);
+		if(cancellation.is_cancellation_requested())
+			break;
+
+		helix::Accept accept;
+
+		auto &&header = helix::submitAsync(generation->posixLane, helix::Dispatcher::global(),
+				helix::action(&accept));
+		COFIBER_AWAIT header.async_wait();
+
+		if(accept.error() == kHelErrLaneShutdown)
+			break;
+		HEL_CHECK(accept.error());
+
+		// Do not wait for the request to complete before accepting the next one.
+		generation->activeRequests++;
+		handleRequest(self, generation, accept.descriptor());
 	}
 
 	if(logCleanup)
@@ -1800,6 +1900,7 @@ int main() {
 		block_subsystem::run();
 		drm_subsystem::run();
 		input_subsystem::run();
+		inet_socket::run();
 
 		runInit();
 	}
@@ -3,8 +3,10 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <memory>
 
 #include <async/doorbell.hpp>
 #include <cofiber.hpp>
@@ -25,6 +27,8 @@ std::map<std::pair<int, int>, std::unique_ptr<Group>> globalGroupMap;
 int nextPort = -1;
 std::map<int, OpenFile *> globalPortMap;
 
+// Packets are immutable once they are sent. Multicasts are serialized once and
+// the same buffer is queued on all subscribed sockets.
 struct Packet {
 	// Sender netlink socket information.
 	int senderPort;
@@ -34,9 +38,11 @@ struct Packet {
 	int senderPid;
 
 	// The actual octet data that the packet consists of.
-	std::vector<char> buffer;
+	std::string buffer;
 };
 
+using SharedPacket = std::shared_ptr<const Packet>;
+
 struct OpenFile : File {
 public:
 	static void serve(smarter::shared_ptr<OpenFile> file) {
@@ -48,16 +54,33 @@ public:
 				file, &File::fileOperations));
 	}
 
+	// Like Linux' default SO_RCVBUF. Packets that do not fit are dropped
+	// and the next recvmsg() reports ENOBUFS.
+	static constexpr size_t receiveCapacity = 208 * 1024;
+
 	OpenFile(int protocol)
 	: File{StructName::get("nl-socket")}, _protocol{protocol},
-			_currentSeq{1}, _inSeq{0}, _socketPort{0}, _passCreds{false} { }
+			_currentSeq{1}, _inSeq{0}, _socketPort{0}, _recvQueueBytes{0},
+			_overflow{false}, _passCreds{false} { }
+
+	void deliver(SharedPacket packet) {
+		if(_recvQueueBytes + packet->buffer.size() > receiveCapacity) {
+			if(!_overflow)
+				std::cout << "\e[33mposix: Receive queue of netlink socket "
+						<< _socketPort << " overflows\e[39m" << std::endl;
+			_overflow = true;
+			return;
+		}
 
-	void deliver(Packet packet) {
+		_recvQueueBytes += packet->buffer.size();
 		_recvQueue.push_back(std::move(packet));
 		_inSeq = ++_currentSeq;
 		_statusBell.ring();
+		notifyStatusObservers();
 	}
 
+	void handleClose() override;
+
 public:
 	COFIBER_ROUTINE(expected<size_t>,
 	readSome(Process *, void *data, size_t max_length) override, ([=] {
@@ -66,13 +89,11 @@ public:
 
 		while(_recvQueue.empty())
 			COFIBER_AWAIT _statusBell.async_wait();
-		
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
-		auto packet = &_recvQueue.front();
-		auto size = packet->buffer.size();
-		assert(max_length >= size);
+
+		// Datagrams are truncated to the size of the buffer.
+		auto packet = _popPacket();
+		auto size = std::min(packet->buffer.size(), max_length);
 		memcpy(data, packet->buffer.data(), size);
-		_recvQueue.pop_front();
 		COFIBER_RETURN(size);
 	}))
 	
@@ -101,14 +122,18 @@ public:
 		assert(!flags);
 		assert(max_addr_length >= sizeof(struct sockaddr_nl));
 
+		// Report dropped packets once; the queued packets are received afterwards.
+		if(_overflow) {
+			_overflow = false;
+			COFIBER_RETURN(Error::noBufferSpace);
+		}
+
 		while(_recvQueue.empty())
 			COFIBER_AWAIT _statusBell.async_wait();
-		
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
-		auto packet = &_recvQueue.front();
-		
-		auto size = packet->buffer.size();
-		assert(max_length >= size);
+
+		// Datagrams are truncated to the size of the buffer.
+		auto packet = _popPacket();
+		auto size = std::min(packet->buffer.size(), max_length);
 		memcpy(data, packet->buffer.data(), size);
 
 		struct sockaddr_nl sa;
@@ -130,7 +155,6 @@ public:
 			ctrl.write<struct ucred>(creds);
 		}
 
-		_recvQueue.pop_front();
 		COFIBER_RETURN(RecvResult(size, sizeof(struct sockaddr_nl), ctrl.buffer()));
 	}))
 	
@@ -160,7 +184,7 @@ public:
 			edges |= EPOLLIN;
 
 		int events = EPOLLOUT;
-		if(!_recvQueue.empty())
+		if(!_recvQueue.empty() || _overflow)
 			events |= EPOLLIN;
 		
 //		std::cout << "posix: poll(" << past_seq << ") on \e[1;34m" << structName() << "\e[0m"
@@ -169,6 +193,10 @@ public:
 	
 		COFIBER_RETURN(PollResult(_currentSeq, edges, events));
 	}))
+
+	bool hasStatusObservers() override {
+		return true;
+	}
 	
 	async::result<void> bind(Process *, const void *, size_t) override;
 	
@@ -179,6 +207,13 @@ public:
 	}
 
 private:
+	SharedPacket _popPacket() {
+		auto packet = std::move(_recvQueue.front());
+		_recvQueue.pop_front();
+		_recvQueueBytes -= packet->buffer.size();
+		return packet;
+	}
+
 	void _associatePort() {
 		assert(!_socketPort);
 		_socketPort = nextPort--;
@@ -196,8 +231,14 @@ private:
 
 	int _socketPort;
 	
+	// Multicast groups that this socket joined.
+	std::vector<Group *> _groups;
+
 	// The actual receive queue of the socket.
-	std::deque<Packet> _recvQueue;
+	std::deque<SharedPacket> _recvQueue;
+	size_t _recvQueueBytes;
+	// Set if packets were dropped since the last recvmsg().
+	bool _overflow;
 
 	// Socket options.
 	bool _passCreds;
@@ -206,8 +247,12 @@ private:
 struct Group {
 	friend struct OpenFile;
 
-	// Sends a copy of the given message to this group.
-	void carbonCopy(const Packet &packet);
+	bool empty() {
+		return _subscriptions.empty();
+	}
+
+	// Queues the given message on all sockets that joined this group.
+	void carbonCopy(const SharedPacket &packet);
 
 private:
 	std::vector<OpenFile *> _subscriptions;
@@ -240,12 +285,11 @@ OpenFile::sendMsg(Process *process, MsgFlags flags, const void *data, size_t max
 	// TODO: Associate port otherwise.
 	assert(_socketPort);
 
-	Packet packet;
-	packet.senderPid = process->pid();
-	packet.senderPort = _socketPort;
-	packet.group = grp_idx;
-	packet.buffer.resize(max_length);
-	memcpy(packet.buffer.data(), data, max_length);
+	auto packet = std::make_shared<Packet>();
+	packet->senderPid = process->pid();
+	packet->senderPort = _socketPort;
+	packet->group = grp_idx;
+	packet->buffer.assign(static_cast<const char *>(data), max_length);
 
 	// Carbon-copy to the message to a group.
 	if(grp_idx) {
@@ -289,7 +333,10 @@ OpenFile::bind(Process *, const void *addr_ptr, size_t addr_length), ([=] {
 			auto it = globalGroupMap.find({_protocol, i + 1});
 			assert(it != globalGroupMap.end());
 			auto group = it->second.get();
+			if(std::find(_groups.begin(), _groups.end(), group) != _groups.end())
+				continue;
 			group->_subscriptions.push_back(this);
+			_groups.push_back(group);
 		}
 	}
 
@@ -297,6 +344,19 @@ OpenFile::bind(Process *, const void *addr_ptr, size_t addr_length), ([=] {
 	COFIBER_RETURN();
 }))
 
+void OpenFile::handleClose() {
+	for(auto group : _groups) {
+		auto &subscriptions = group->_subscriptions;
+		subscriptions.erase(std::find(subscriptions.begin(), subscriptions.end(), this));
+	}
+	_groups.clear();
+
+	if(_socketPort)
+		globalPortMap.erase(_socketPort);
+	_recvQueue.clear();
+	_recvQueueBytes = 0;
+}
+
 COFIBER_ROUTINE(async::result<size_t>,
 OpenFile::sockname(void *addr_ptr, size_t max_addr_length), ([=] {
 	assert(_socketPort);
@@ -315,7 +375,7 @@ OpenFile::sockname(void *addr_ptr, size_t max_addr_length), ([=] {
 // Group implementation.
 // ----------------------------------------------------------------------------
 
-void Group::carbonCopy(const Packet &packet) {
+void Group::carbonCopy(const SharedPacket &packet) {
 	for(auto socket : _subscriptions)
 		socket->deliver(packet);
 }
@@ -333,16 +393,17 @@ void configure(int protocol, int num_groups) {
 }
 
 void broadcast(int proto_idx, int grp_idx, std::string buffer) {
-	Packet packet;
-	packet.senderPid = 0;
-	packet.senderPort = 0;
-	packet.group = grp_idx;
-	packet.buffer.resize(buffer.size());
-	memcpy(packet.buffer.data(), buffer.data(), buffer.size());
-
 	auto it = globalGroupMap.find({proto_idx, grp_idx});
 	assert(it != globalGroupMap.end());
 	auto group = it->second.get();
+	if(group->empty())
+		return;
+
+	auto packet = std::make_shared<Packet>();
+	packet->senderPid = 0;
+	packet->senderPort = 0;
+	packet->group = grp_idx;
+	packet->buffer = std::move(buffer);
 	group->carbonCopy(packet);
 }
 
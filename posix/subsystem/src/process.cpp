@@ -24,6 +24,7 @@ std::shared_ptr<VmContext> VmContext::create() {
 	HelHandle space;
 	HEL_CHECK(helCreateSpace(&space));
 	context->_space = helix::UniqueDescriptor(space);
+	context->_areaTree = std::make_shared<AreaTree>();
 
 	return context;
 }
@@ -34,11 +35,30 @@ std::shared_ptr<VmContext> VmContext::clone(std::shared_ptr<VmContext> original)
 	HelHandle space;
 	HEL_CHECK(helForkSpace(original->_space.getHandle(), &space));
 	context->_space = helix::UniqueDescriptor(space);
-	context->_areaTree = original->_areaTree; // Copy construction is sufficient here.
+	context->_areaTree = original->_areaTree; // Copied on the next modification.
 
 	return context;
 }
 
+VmContext::AreaTree &VmContext::_ownAreas() {
+	if(_areaTree.use_count() > 1)
+		_areaTree = std::make_shared<AreaTree>(*_areaTree);
+	return *_areaTree;
+}
+
+void VmContext::_insertArea(uintptr_t address, Area area) {
+	auto &areas = _ownAreas();
+
+	// Perform some sanity checking.
+	auto succ = areas.lower_bound(address + area.areaSize);
+	if(succ != areas.begin()) {
+		auto pred = std::prev(succ);
+		assert(pred->first + pred->second.areaSize <= address);
+	}
+
+	areas.insert(succ, {address, std::move(area)});
+}
+
 COFIBER_ROUTINE(async::result<void *>,
 VmContext::mapFile(smarter::shared_ptr<File, FileHandle> file,
 		intptr_t offset, size_t size, uint32_t native_flags), ([=] {
@@ -53,64 +73,86 @@ VmContext::mapFile(smarter::shared_ptr<File, FileHandle> file,
 			nullptr, 0 /*offset*/, aligned_size, native_flags, &pointer));
 //	std::cout << "posix: VM_MAP returns " << pointer << std::endl;
 
-	// Perform some sanity checking.
-	auto address = reinterpret_cast<uintptr_t>(pointer);
-	auto succ = _areaTree.lower_bound(address + aligned_size);
-	if(succ != _areaTree.begin()) {
-		auto pred = std::prev(succ);
-		assert(pred->first + pred->second.areaSize <= address);
-	}
-
 	// Construct the new area.
 	Area area;
 	area.areaSize = aligned_size;
 	area.nativeFlags = native_flags;
 	area.file = std::move(file);
 	area.offset = offset;
-	_areaTree.insert({address, std::move(area)});
+	_insertArea(reinterpret_cast<uintptr_t>(pointer), std::move(area));
 
 	COFIBER_RETURN(pointer);
 }))
 
-COFIBER_ROUTINE(async::result<void *>, VmContext::remapFile(void *old_pointer,
+void *VmContext::mapAnonymous(size_t size, uint32_t native_flags) {
+	size_t aligned_size = (size + 0xFFF) & ~size_t(0xFFF);
+
+	// Anonymous memory is populated on demand.
+	HelHandle memory;
+	void *pointer;
+	HEL_CHECK(helAllocateMemory(aligned_size, kHelAllocOnDemand, &memory));
+	HEL_CHECK(helMapMemory(memory, _space.getHandle(),
+			nullptr, 0, aligned_size, native_flags, &pointer));
+	HEL_CHECK(helCloseDescriptor(memory));
+
+	Area area;
+	area.areaSize = aligned_size;
+	area.nativeFlags = native_flags;
+	area.offset = 0;
+	_insertArea(reinterpret_cast<uintptr_t>(pointer), std::move(area));
+
+	return pointer;
+}
+
+COFIBER_ROUTINE(expected<void *>, VmContext::remapFile(void *old_pointer,
 		size_t old_size, size_t new_size), ([=] {
 	size_t aligned_old_size = (old_size + 0xFFF) & ~size_t(0xFFF);
 	size_t aligned_new_size = (new_size + 0xFFF) & ~size_t(0xFFF);
 
 //	std::cout << "posix: Remapping " << old_pointer << std::endl;
-	auto it = _areaTree.find(reinterpret_cast<uintptr_t>(old_pointer));
-	assert(it != _areaTree.end());
-	assert(it->second.areaSize == aligned_old_size);
+	auto address = reinterpret_cast<uintptr_t>(old_pointer);
+	Area area;
+	{
+		auto it = _areaTree->find(address);
+		if(it == _areaTree->end())
+			COFIBER_RETURN(Error::noMemory);
+		if(it->second.areaSize != aligned_old_size || !aligned_new_size)
+			COFIBER_RETURN(Error::illegalArguments);
+		if(!it->second.file) {
+			std::cout << "\e[31mposix: Remapping of anonymous memory is not supported\e[39m"
+					<< std::endl;
+			COFIBER_RETURN(Error::illegalArguments);
+		}
+		area = it->second;
+	}
+
+	// Note that we must not keep iterators across this point: other requests
+	// can modify (or un-share) the area tree while we wait.
+	auto memory = COFIBER_AWAIT area.file->accessMemory(area.offset);
 
-	auto memory = COFIBER_AWAIT it->second.file->accessMemory(it->second.offset);
+	// The area might have been unmapped (or replaced) in the meantime.
+	// From here on, we do not await anymore until the tree is updated.
+	auto &areas = _ownAreas();
+	auto it = areas.find(address);
+	if(it == areas.end() || it->second.areaSize != aligned_old_size
+			|| it->second.file.get() != area.file.get())
+		COFIBER_RETURN(Error::noMemory);
 
 	// Perform the actual mapping.
 	// POSIX specifies that non-page-size mappings are rounded up and filled with zeros.
 	void *pointer;
 	HEL_CHECK(helMapMemory(memory.getHandle(), _space.getHandle(),
-			nullptr, 0 /*offset*/, aligned_new_size, it->second.nativeFlags, &pointer));
+			nullptr, 0 /*offset*/, aligned_new_size, area.nativeFlags, &pointer));
 //	std::cout << "posix: VM_REMAP returns " << pointer << std::endl;
 
 	// Unmap the old area.
 	HEL_CHECK(helUnmapMemory(_space.getHandle(), old_pointer, aligned_old_size));
 
 	// Construct the new area from the old one.
-	Area area;
-	area.areaSize = aligned_new_size;
-	area.nativeFlags = it->second.nativeFlags;
-	area.file = std::move(it->second.file);
-	area.offset = it->second.offset;
-	_areaTree.erase(it);
+	areas.erase(it);
 
-	// Perform some sanity checking.
-	auto address = reinterpret_cast<uintptr_t>(pointer);
-	auto succ = _areaTree.lower_bound(address + aligned_new_size);
-	if(succ != _areaTree.begin()) {
-		auto pred = std::prev(succ);
-		assert(pred->first + pred->second.areaSize <= address);
-	}
-
-	_areaTree.insert({address, std::move(area)});
+	area.areaSize = aligned_new_size;
+	_insertArea(reinterpret_cast<uintptr_t>(pointer), std::move(area));
 
 	COFIBER_RETURN(pointer);
 }))
@@ -118,14 +160,15 @@ COFIBER_ROUTINE(async::result<void *>, VmContext::remapFile(void *old_pointer,
 void VmContext::unmapFile(void *pointer, size_t size) {
 	size_t aligned_size = (size + 0xFFF) & ~size_t(0xFFF);
 
-	auto it = _areaTree.find(reinterpret_cast<uintptr_t>(pointer));
-	assert(it != _areaTree.end());
+	auto &areas = _ownAreas();
+	auto it = areas.find(reinterpret_cast<uintptr_t>(pointer));
+	assert(it != areas.end());
 	assert(it->second.areaSize == aligned_size);
 
 	HEL_CHECK(helUnmapMemory(_space.getHandle(), pointer, aligned_size));
 
 	// Update our idea of the process' VM space.
-	_areaTree.erase(it);
+	areas.erase(it);
 }
 
 // ----------------------------------------------------------------------------
@@ -170,6 +213,60 @@ void FsContext::changeWorkingDirectory(ViewPath workdir) {
 // FileContext.
 // ----------------------------------------------------------------------------
 
+FileTable::FileTable()
+: _usedWords(numWords, 0), _cloexecWords(numWords, 0), _fullSummary(numWords / 64, 0) { }
+
+int FileTable::findFree(int start) {
+	if(start >= maxDescriptors)
+		return -1;
+
+	// Check the word that contains start.
+	auto sw = start >> 6;
+	auto partial = ~_usedWords[sw] & (~uint64_t(0) << (start & 63));
+	if(partial)
+		return (sw << 6) + __builtin_ctzll(partial);
+
+	// Find the next word that is not completely used.
+	auto w = sw + 1;
+	while(w < numWords) {
+		auto free_words = ~_fullSummary[w >> 6] & (~uint64_t(0) << (w & 63));
+		if(free_words) {
+			auto fw = ((w >> 6) << 6) + __builtin_ctzll(free_words);
+			return (fw << 6) + __builtin_ctzll(~_usedWords[fw]);
+		}
+		w = ((w >> 6) + 1) << 6;
+	}
+	return -1;
+}
+
+void FileTable::insert(int fd, FileDescriptor descriptor) {
+	assert(fd >= 0 && fd < maxDescriptors);
+	if(static_cast<size_t>(fd) >= _entries.size())
+		_entries.resize(std::max(static_cast<size_t>(fd) + 1, 2 * _entries.size()));
+
+	auto w = fd >> 6;
+	auto bit = uint64_t(1) << (fd & 63);
+	_usedWords[w] |= bit;
+	if(descriptor.closeOnExec) {
+		_cloexecWords[w] |= bit;
+	}else{
+		_cloexecWords[w] &= ~bit;
+	}
+	if(!~_usedWords[w])
+		_fullSummary[w >> 6] |= uint64_t(1) << (w & 63);
+	_entries[fd] = std::move(descriptor);
+}
+
+void FileTable::erase(int fd) {
+	assert(isUsed(fd));
+	auto w = fd >> 6;
+	auto bit = uint64_t(1) << (fd & 63);
+	_usedWords[w] &= ~bit;
+	_cloexecWords[w] &= ~bit;
+	_fullSummary[w >> 6] &= ~(uint64_t(1) << (w & 63));
+	_entries[fd] = FileDescriptor{};
+}
+
 std::shared_ptr<FileContext> FileContext::create() {
 	auto context = std::make_shared<FileContext>();
 
@@ -177,11 +274,14 @@ std::shared_ptr<FileContext> FileContext::create() {
 	HEL_CHECK(helCreateUniverse(&universe));
 	context->_universe = helix::UniqueDescriptor(universe);
 
+	context->_fileTable = std::make_shared<FileTable>();
+
+	// The memory is allocated on demand. Only pages that cover used FDs are backed.
 	HelHandle memory;
 	void *window;
-	HEL_CHECK(helAllocateMemory(0x1000, 0, &memory));
+	HEL_CHECK(helAllocateMemory(fileTableMemorySize, kHelAllocOnDemand, &memory));
 	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
-			0, 0x1000, kHelMapProtRead | kHelMapProtWrite, &window));
+			0, fileTableMemorySize, kHelMapProtRead | kHelMapProtWrite, &window));
 	context->_fileTableMemory = helix::UniqueDescriptor(memory);
 	context->_fileTableWindow = reinterpret_cast<HelHandle *>(window);
 
@@ -201,18 +301,30 @@ std::shared_ptr<FileContext> FileContext::clone(std::shared_ptr<FileContext> ori
 	HEL_CHECK(helCreateUniverse(&universe));
 	context->_universe = helix::UniqueDescriptor(universe);
 
+	// The table itself is shared until one of the contexts modifies it.
+	context->_fileTable = original->_fileTable;
+
 	HelHandle memory;
 	void *window;
-	HEL_CHECK(helAllocateMemory(0x1000, 0, &memory));
+	HEL_CHECK(helAllocateMemory(fileTableMemorySize, kHelAllocOnDemand, &memory));
 	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
-			0, 0x1000, kHelMapProtRead | kHelMapProtWrite, &window));
+			0, fileTableMemorySize, kHelMapProtRead | kHelMapProtWrite, &window));
 	context->_fileTableMemory = helix::UniqueDescriptor(memory);
 	context->_fileTableWindow = reinterpret_cast<HelHandle *>(window);
 
-	for(auto entry : original->_fileTable) {
-		//std::cout << "Clone FD " << entry.first << std::endl;
-		context->attachFile(entry.first, entry.second.file, entry.second.closeOnExec);
-	}
+	// The handles are specific to each universe and need to be transferred.
+	// This is done by a single syscall, no matter how many FDs are open.
+	std::vector<int> fds;
+	std::vector<HelHandle> handles;
+	context->_fileTable->forEach([&] (int fd, const FileDescriptor &descriptor) {
+		fds.push_back(fd);
+		handles.push_back(descriptor.file->getPassthroughLane().getHandle());
+	});
+	if(!handles.empty())
+		HEL_CHECK(helTransferDescriptors(handles.data(), handles.size(),
+				context->_universe.getHandle(), handles.data()));
+	for(size_t i = 0; i < fds.size(); i++)
+		context->_fileTableWindow[fds[i]] = handles[i];
 
 	unsigned long mbus_upstream;
 	if(peekauxval(AT_MBUS_SERVER, &mbus_upstream))
@@ -228,27 +340,37 @@ FileContext::~FileContext() {
 		std::cout << "\e[33mposix: FileContext is destructed\e[39m" << std::endl;
 }
 
+FileTable &FileContext::_ownTable() {
+	if(_fileTable.use_count() > 1)
+		_fileTable = std::make_shared<FileTable>(*_fileTable);
+	return *_fileTable;
+}
+
 int FileContext::attachFile(smarter::shared_ptr<File, FileHandle> file,
 		bool close_on_exec) {
+	auto &table = _ownTable();
+	int fd = table.findFree();
+	if(fd < 0)
+		throw std::runtime_error("posix: File table is full");
+
 	HelHandle handle;
 	HEL_CHECK(helTransferDescriptor(file->getPassthroughLane().getHandle(),
 			_universe.getHandle(), &handle));
 
-	for(int fd = 0; ; fd++) {
-		if(_fileTable.find(fd) != _fileTable.end())
-			continue;
-
-		if(logFileAttach)
-			std::cout << "posix: Attaching FD " << fd << std::endl;
+	if(logFileAttach)
+		std::cout << "posix: Attaching FD " << fd << std::endl;
 
-		_fileTable.insert({fd, {std::move(file), close_on_exec}});
-		_fileTableWindow[fd] = handle;
-		return fd;
-	}
+	table.insert(fd, {std::move(file), close_on_exec});
+	_fileTableWindow[fd] = handle;
+	return fd;
 }
 
 void FileContext::attachFile(int fd, smarter::shared_ptr<File, FileHandle> file,
 		bool close_on_exec) {
+	assert(fd >= 0);
+	if(fd >= FileTable::maxDescriptors)
+		throw std::runtime_error("posix: FD exceeds the size of the file table");
+
 	HelHandle handle;
 	HEL_CHECK(helTransferDescriptor(file->getPassthroughLane().getHandle(),
 			_universe.getHandle(), &handle));
@@ -256,53 +378,69 @@ void FileContext::attachFile(int fd, smarter::shared_ptr<File, FileHandle> file,
 	if(logFileAttach)
 		std::cout << "posix: Attaching fixed FD " << fd << std::endl;
 
-	auto it = _fileTable.find(fd);
-	if(it != _fileTable.end()) {
-		it->second = {std::move(file), close_on_exec};
-	}else{
-		_fileTable.insert({fd, {std::move(file), close_on_exec}});
-	}
+	_ownTable().insert(fd, {std::move(file), close_on_exec});
 	_fileTableWindow[fd] = handle;
 }
 
+std::vector<int> FileContext::attachFiles(std::vector<smarter::shared_ptr<File, FileHandle>> files,
+		bool close_on_exec) {
+	auto &table = _ownTable();
+
+	// Allocate all FDs before transferring any handles.
+	std::vector<int> fds;
+	std::vector<HelHandle> handles;
+	int fd = -1;
+	for(auto &file : files) {
+		fd = table.findFree(fd + 1);
+		if(fd < 0)
+			throw std::runtime_error("posix: File table is full");
+		fds.push_back(fd);
+		handles.push_back(file->getPassthroughLane().getHandle());
+	}
+	if(handles.empty())
+		return fds;
+
+	HEL_CHECK(helTransferDescriptors(handles.data(), handles.size(),
+			_universe.getHandle(), handles.data()));
+
+	for(size_t i = 0; i < files.size(); i++) {
+		if(logFileAttach)
+			std::cout << "posix: Attaching FD " << fds[i] << std::endl;
+		table.insert(fds[i], {std::move(files[i]), close_on_exec});
+		_fileTableWindow[fds[i]] = handles[i];
+	}
+	return fds;
+}
+
 std::optional<FileDescriptor> FileContext::getDescriptor(int fd) {
-	auto file = _fileTable.find(fd);
-	if(file == _fileTable.end())
+	if(fd < 0 || fd >= FileTable::maxDescriptors || !_fileTable->isUsed(fd))
 		return std::nullopt;
-	return file->second;
+	return _fileTable->at(fd);
 }
 
 smarter::shared_ptr<File, FileHandle> FileContext::getFile(int fd) {
-	auto file = _fileTable.find(fd);
-	if(file == _fileTable.end())
+	if(fd < 0 || fd >= FileTable::maxDescriptors || !_fileTable->isUsed(fd))
 		return smarter::shared_ptr<File, FileHandle>{};
-	return file->second.file;
+	return _fileTable->at(fd).file;
 }
 
 void FileContext::closeFile(int fd) {
 	if(logFileAttach)
 		std::cout << "posix: Closing FD " << fd << std::endl;
-	auto it = _fileTable.find(fd);
-	if(it == _fileTable.end()) {
+	if(fd < 0 || fd >= FileTable::maxDescriptors || !_fileTable->isUsed(fd)) {
 		std::cout << "\e[31m" "posix: Trying to close non-existant FD "
 				<< fd << "\e[39m" << std::endl;
 		return;
 	}
 
 	_fileTableWindow[fd] = 0;
-	_fileTable.erase(it);
+	_ownTable().erase(fd);
 }
 
 void FileContext::closeOnExec() {
-	auto it = _fileTable.begin();
-	while(it != _fileTable.end()) {
-		if(it->second.closeOnExec) {
-			_fileTableWindow[it->first] = 0;
-			it = _fileTable.erase(it);
-		}else{
-			it++;
-		}
-	}
+	_ownTable().eraseCloseOnExec([&] (int fd) {
+		_fileTableWindow[fd] = 0;
+	});
 }
 
 // ----------------------------------------------------------------------------
@@ -568,7 +706,8 @@ COFIBER_ROUTINE(async::result<std::shared_ptr<Process>>, Process::init(std::stri
 
 	HEL_CHECK(helMapMemory(process->_fileContext->fileTableMemory().getHandle(),
 			process->_vmContext->getSpace().getHandle(),
-			nullptr, 0, 0x1000, kHelMapProtRead | kHelMapDropAtFork,
+			nullptr, 0, FileContext::fileTableMemorySize,
+			kHelMapProtRead | kHelMapDropAtFork,
 			&process->_clientFileTable));
 	HEL_CHECK(helMapMemory(clk::trackerPageMemory().getHandle(),
 			process->_vmContext->getSpace().getHandle(),
@@ -617,7 +756,8 @@ std::shared_ptr<Process> Process::fork(std::shared_ptr<Process> original) {
 
 	HEL_CHECK(helMapMemory(process->_fileContext->fileTableMemory().getHandle(),
 			process->_vmContext->getSpace().getHandle(),
-			nullptr, 0, 0x1000, kHelMapProtRead | kHelMapDropAtFork,
+			nullptr, 0, FileContext::fileTableMemorySize,
+			kHelMapProtRead | kHelMapDropAtFork,
 			&process->_clientFileTable));
 	HEL_CHECK(helMapMemory(clk::trackerPageMemory().getHandle(),
 			process->_vmContext->getSpace().getHandle(),
@@ -662,7 +802,8 @@ COFIBER_ROUTINE(async::result<Error>, Process::exec(std::shared_ptr<Process> pro
 			&exec_clk_tracker_page));
 	HEL_CHECK(helMapMemory(process->_fileContext->fileTableMemory().getHandle(),
 			exec_vm_context->getSpace().getHandle(),
-			nullptr, 0, 0x1000, kHelMapProtRead | kHelMapDropAtFork,
+			nullptr, 0, FileContext::fileTableMemorySize,
+			kHelMapProtRead | kHelMapDropAtFork,
 			&exec_client_table));
 
 	// TODO: We should only do this if the execute succeeds.
@@ -4,6 +4,7 @@
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include <async/result.hpp>
 #include <async/doorbell.hpp>
@@ -30,7 +31,9 @@ struct VmContext {
 	async::result<void *> mapFile(smarter::shared_ptr<File, FileHandle> file,
 			intptr_t offset, size_t size, uint32_t native_flags);
 
-	async::result<void *> remapFile(void *old_pointer, size_t old_size, size_t new_size);
+	void *mapAnonymous(size_t size, uint32_t native_flags);
+
+	expected<void *> remapFile(void *old_pointer, size_t old_size, size_t new_size);
 
 	void unmapFile(void *pointer, size_t size);
 
@@ -38,13 +41,24 @@ private:
 	struct Area {
 		size_t areaSize;
 		uint32_t nativeFlags;
+
+		// This is null for anonymous areas.
 		smarter::shared_ptr<File, FileHandle> file;
 		intptr_t offset;
 	};
 
+	using AreaTree = std::map<uintptr_t, Area>;
+
+	// Makes sure that _areaTree is not shared with other VmContexts.
+	AreaTree &_ownAreas();
+
+	void _insertArea(uintptr_t address, Area area);
+
 	helix::UniqueDescriptor _space;
 
-	std::map<uintptr_t, Area> _areaTree;
+	// The area tree is shared between VmContexts after fork().
+	// It is copied once one of the VmContexts modifies it.
+	std::shared_ptr<AreaTree> _areaTree;
 };
 
 struct FsContext {
@@ -67,8 +81,75 @@ struct FileDescriptor {
 	bool closeOnExec;
 };
 
+// Dense table of file descriptors. Two bitmaps track which FDs are in use
+// and which are marked close-on-exec. A summary bitmap of full words allows us
+// to find the lowest free FD in a constant number of bit scans.
+// FileContexts share tables after fork(); tables are copied on first write.
+struct FileTable {
+	static constexpr int maxDescriptors = 1 << 16;
+
+	FileTable();
+
+	bool isUsed(int fd) {
+		return _usedWords[fd >> 6] & (uint64_t(1) << (fd & 63));
+	}
+
+	const FileDescriptor &at(int fd) {
+		assert(isUsed(fd));
+		return _entries[fd];
+	}
+
+	// Returns the lowest unused FD that is >= start or -1 if the table is full.
+	int findFree(int start = 0);
+
+	void insert(int fd, FileDescriptor descriptor);
+	void erase(int fd);
+
+	// Calls f(fd, descriptor) for all FDs that are in use, in ascending order.
+	template<typename F>
+	void forEach(F f) {
+		for(size_t w = 0; w < _usedWords.size(); w++) {
+			auto word = _usedWords[w];
+			while(word) {
+				int fd = (w << 6) + __builtin_ctzll(word);
+				f(fd, _entries[fd]);
+				word &= word - 1;
+			}
+		}
+	}
+
+	// Removes all close-on-exec FDs. Calls f(fd) for each removed FD.
+	template<typename F>
+	void eraseCloseOnExec(F f) {
+		for(size_t w = 0; w < _cloexecWords.size(); w++) {
+			auto word = _cloexecWords[w];
+			while(word) {
+				int fd = (w << 6) + __builtin_ctzll(word);
+				erase(fd);
+				f(fd);
+				word &= word - 1;
+			}
+		}
+	}
+
+private:
+	static constexpr int numWords = maxDescriptors / 64;
+
+	// Grown on demand; FDs beyond the end are not in use.
+	std::vector<FileDescriptor> _entries;
+
+	std::vector<uint64_t> _usedWords;
+	std::vector<uint64_t> _cloexecWords;
+
+	// Bit i is set if _usedWords[i] is completely used.
+	std::vector<uint64_t> _fullSummary;
+};
+
 struct FileContext {
 public:
+	// Size of the memory that exposes our HelHandles to the process.
+	static constexpr size_t fileTableMemorySize = FileTable::maxDescriptors * sizeof(HelHandle);
+
 	static std::shared_ptr<FileContext> create();
 	static std::shared_ptr<FileContext> clone(std::shared_ptr<FileContext> original);
 
@@ -86,6 +167,10 @@ public:
 
 	void attachFile(int fd, smarter::shared_ptr<File, FileHandle> file, bool close_on_exec = false);
 
+	// Attaches multiple files using a single descriptor transfer. Returns the new FDs.
+	std::vector<int> attachFiles(std::vector<smarter::shared_ptr<File, FileHandle>> files,
+			bool close_on_exec = false);
+
 	std::optional<FileDescriptor> getDescriptor(int fd);
 
 	smarter::shared_ptr<File, FileHandle> getFile(int fd);
@@ -101,8 +186,10 @@ public:
 private:
 	helix::UniqueDescriptor _universe;
 
-	// TODO: replace this by a tree that remembers gaps between keys.
-	std::unordered_map<int, FileDescriptor> _fileTable;
+	// Makes sure that _fileTable is not shared with other FileContexts.
+	FileTable &_ownTable();
+
+	std::shared_ptr<FileTable> _fileTable;
 
 	helix::UniqueDescriptor _fileTableMemory;
 
@@ -210,6 +297,10 @@ struct Generation {
 	helix::UniqueLane posixLane;
 	helix::UniqueDescriptor threadDescriptor;
 	async::cancellation_event cancelServe;
+
+	// Number of requests that are currently handled. Rings requestBell when decremented.
+	int activeRequests = 0;
+	async::doorbell requestBell;
 };
 
 struct Process : std::enable_shared_from_this<Process> {
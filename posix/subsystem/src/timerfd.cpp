@@ -41,6 +41,7 @@ private:
 				_expirations++;
 				_theSeq++;
 				_seqBell.ring();
+				notifyStatusObservers();
 			}else{
 				delete timer;
 				COFIBER_RETURN();
@@ -68,6 +69,7 @@ private:
 				_expirations++;
 				_theSeq++;
 				_seqBell.ring();
+				notifyStatusObservers();
 			}else{
 				delete timer;
 				COFIBER_RETURN();
@@ -123,6 +125,10 @@ public:
 		COFIBER_RETURN(PollResult(_theSeq, EPOLLIN, _expirations ? EPOLLIN : 0));
 	}))
 
+	bool hasStatusObservers() override {
+		return true;
+	}
+
 	helix::BorrowedDescriptor getPassthroughLane() override {
 		return _passthrough;
 	}
@@ -1,7 +1,9 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <map>
 #include <set>
+#include <unordered_map>
 
 #include <helix/memory.hpp>
 #include <protocols/fs/client.hpp>
@@ -267,6 +269,8 @@ public:
 
 	FutureMaybe<void> allocate(int64_t offset, size_t size) override;
 
+	async::result<Error> punchHole(int64_t offset, size_t size) override;
+
 	FutureMaybe<helix::UniqueDescriptor> accessMemory(off_t);
 
 	helix::BorrowedDescriptor getPassthroughLane() override {
@@ -299,10 +303,20 @@ struct MemoryNode : Node {
 	}))
 
 private:
-	void _resizeFile(size_t new_size) {
-		_fileSize = new_size;
-
-		size_t aligned_size = (new_size + 0xFFF) & ~size_t(0xFFF);
+	// Until the file is mmap()ed, its data is stored in a sparse set of pages.
+	// Pages that were never written (or that became holes again) are not stored
+	// at all and read as zeros.
+	// Once the file is mmap()ed, the data moves to a single on-demand memory
+	// object that is shared with all mappings. This object is accessed through
+	// fixed-size windows; growing the file never remaps windows that already exist.
+	static constexpr size_t pageShift = 12;
+	static constexpr size_t pageSize = size_t(1) << pageShift;
+	static constexpr size_t windowShift = 21;
+	static constexpr size_t windowSize = size_t(1) << windowShift;
+
+	// Grows the memory object such that it covers at least the given size.
+	void _ensureBacking(size_t size) {
+		size_t aligned_size = (size + (windowSize - 1)) & ~(windowSize - 1);
 		if(aligned_size <= _areaSize)
 			return;
 
@@ -310,18 +324,146 @@ private:
 			HEL_CHECK(helResizeMemory(_memory.getHandle(), aligned_size));
 		}else{
 			HelHandle handle;
-			HEL_CHECK(helAllocateMemory(aligned_size, 0, &handle));
+			HEL_CHECK(helAllocateMemory(aligned_size, kHelAllocOnDemand, &handle));
 			_memory = helix::UniqueDescriptor{handle};
 		}
-
-		_mapping = helix::Mapping{_memory, 0, aligned_size};
 		_areaSize = aligned_size;
 	}
 
+	helix::Mapping *_getWindow(size_t index) {
+		auto it = _windows.find(index);
+		if(it != _windows.end())
+			return &it->second;
+
+		_ensureBacking((index + 1) << windowShift);
+		auto res = _windows.emplace(index, helix::Mapping{_memory,
+				static_cast<ptrdiff_t>(index << windowShift), windowSize});
+		assert(res.second);
+		return &res.first->second;
+	}
+
+	// Moves the data to the memory object. Called before the object is handed out.
+	void _share() {
+		if(_sharedMapping)
+			return;
+		_sharedMapping = true;
+
+		_ensureBacking(std::max(_fileSize, pageSize));
+		for(auto &entry : _pages) {
+			auto offset = entry.first << pageShift;
+			auto window = _getWindow(offset >> windowShift);
+			memcpy(reinterpret_cast<char *>(window->get()) + (offset & (windowSize - 1)),
+					entry.second.get(), pageSize);
+		}
+		_pages.clear();
+	}
+
+	void _readData(size_t offset, void *buffer, size_t length) {
+		auto p = reinterpret_cast<char *>(buffer);
+		size_t progress = 0;
+		while(progress < length) {
+			if(_sharedMapping) {
+				auto window_disp = (offset + progress) & (windowSize - 1);
+				auto chunk = std::min(windowSize - window_disp, length - progress);
+				auto window = _getWindow((offset + progress) >> windowShift);
+				memcpy(p + progress, reinterpret_cast<char *>(window->get()) + window_disp,
+						chunk);
+				progress += chunk;
+				continue;
+			}
+
+			auto disp = (offset + progress) & (pageSize - 1);
+			auto chunk = std::min(pageSize - disp, length - progress);
+			auto it = _pages.find((offset + progress) >> pageShift);
+			if(it != _pages.end()) {
+				memcpy(p + progress, it->second.get() + disp, chunk);
+			}else{
+				memset(p + progress, 0, chunk);
+			}
+			progress += chunk;
+		}
+	}
+
+	void _writeData(size_t offset, const void *buffer, size_t length) {
+		auto p = reinterpret_cast<const char *>(buffer);
+		size_t progress = 0;
+		while(progress < length) {
+			if(_sharedMapping) {
+				auto window_disp = (offset + progress) & (windowSize - 1);
+				auto chunk = std::min(windowSize - window_disp, length - progress);
+				auto window = _getWindow((offset + progress) >> windowShift);
+				memcpy(reinterpret_cast<char *>(window->get()) + window_disp,
+						p + progress, chunk);
+				progress += chunk;
+				continue;
+			}
+
+			auto disp = (offset + progress) & (pageSize - 1);
+			auto chunk = std::min(pageSize - disp, length - progress);
+			auto &page = _pages[(offset + progress) >> pageShift];
+			if(!page)
+				page = std::make_unique<char[]>(pageSize); // Zero-initialized.
+			memcpy(page.get() + disp, p + progress, chunk);
+			progress += chunk;
+		}
+	}
+
+	// Turns the given range into a hole. Pages that are completely covered are
+	// dropped; partially covered pages are zeroed.
+	void _punchHole(size_t offset, size_t length) {
+		if(!length)
+			return;
+
+		if(_sharedMapping) {
+			// The kernel cannot decommit pages of a memory object; zero them instead.
+			// This keeps holes consistent for mmap()ed views of the file.
+			size_t progress = 0;
+			while(progress < length) {
+				auto window_disp = (offset + progress) & (windowSize - 1);
+				auto chunk = std::min(windowSize - window_disp, length - progress);
+				auto window = _getWindow((offset + progress) >> windowShift);
+				memset(reinterpret_cast<char *>(window->get()) + window_disp, 0, chunk);
+				progress += chunk;
+			}
+			return;
+		}
+
+		auto end = offset + length;
+		auto it = _pages.lower_bound(offset >> pageShift);
+		while(it != _pages.end() && (it->first << pageShift) < end) {
+			auto pg_start = it->first << pageShift;
+			auto disp = std::max(pg_start, offset) - pg_start;
+			auto limit = std::min(pg_start + pageSize, end) - pg_start;
+			if(!disp && limit == pageSize) {
+				it = _pages.erase(it);
+			}else{
+				memset(it->second.get() + disp, 0, limit - disp);
+				++it;
+			}
+		}
+	}
+
+	void _resizeFile(size_t new_size) {
+		if(new_size < _fileSize)
+			_punchHole(new_size, _fileSize - new_size);
+		_fileSize = new_size;
+
+		// As long as the file is not mmap()ed, there is no need to back holes.
+		if(_sharedMapping)
+			_ensureBacking(new_size);
+	}
+
 	helix::UniqueDescriptor _memory;
-	helix::Mapping _mapping;
 	size_t _areaSize;
 	size_t _fileSize;
+
+	// Maps page indices to page contents. Only used before the file is mmap()ed.
+	std::map<size_t, std::unique_ptr<char[]>> _pages;
+
+	std::unordered_map<size_t, helix::Mapping> _windows;
+
+	// Set once the memory object is handed out for mmap().
+	bool _sharedMapping;
 };
 
 struct Superblock : FsSuperblock {
@@ -365,7 +507,7 @@ private:
 // ----------------------------------------------------------------------------
 
 MemoryNode::MemoryNode(Superblock *superblock)
-: Node{superblock}, _areaSize{0}, _fileSize{0} { }
+: Node{superblock}, _areaSize{0}, _fileSize{0}, _sharedMapping{false} { }
 
 void MemoryFile::handleClose() {
 	_cancelServe.cancel();
@@ -386,11 +528,11 @@ COFIBER_ROUTINE(expected<size_t>,
 MemoryFile::readSome(Process *, void *buffer, size_t max_length), ([=] {
 	auto node = static_cast<MemoryNode *>(associatedLink()->getTarget().get());
 
-	// TODO: Return end-of-file otherwise.
-	assert(_offset <= node->_fileSize);
+	if(_offset >= node->_fileSize)
+		COFIBER_RETURN(0);
 	auto chunk = std::min(node->_fileSize - _offset, max_length);
 
-	memcpy(buffer, reinterpret_cast<char *>(node->_mapping.get()) + _offset, chunk);
+	node->_readData(_offset, buffer, chunk);
 	_offset += chunk;
 
 	COFIBER_RETURN(chunk);
@@ -403,7 +545,7 @@ MemoryFile::writeAll(Process *, const void *buffer, size_t length), ([=] {
 	if(_offset + length > node->_fileSize)
 		node->_resizeFile(_offset + length);
 
-	memcpy(reinterpret_cast<char *>(node->_mapping.get()) + _offset, buffer, length);
+	node->_writeData(_offset, buffer, length);
 	_offset += length;
 
 	COFIBER_RETURN();
@@ -420,10 +562,11 @@ MemoryFile::truncate(size_t size), ([=] {
 
 COFIBER_ROUTINE(async::result<void>,
 MemoryFile::allocate(int64_t offset, size_t size), ([=] {
-	assert(!offset);
+	assert(offset >= 0);
 
 	auto node = static_cast<MemoryNode *>(associatedLink()->getTarget().get());
 
+	// Pages are allocated on demand; we only need to extend the file.
 	// TODO: Careful about overflow.
 	if(offset + size <= node->_fileSize)
 		COFIBER_RETURN();
@@ -432,11 +575,28 @@ MemoryFile::allocate(int64_t offset, size_t size), ([=] {
 	COFIBER_RETURN();
 }))
 
+COFIBER_ROUTINE(async::result<Error>,
+MemoryFile::punchHole(int64_t offset, size_t size), ([=] {
+	assert(offset >= 0);
+
+	auto node = static_cast<MemoryNode *>(associatedLink()->getTarget().get());
+
+	// Punching a hole never changes the file size.
+	if(static_cast<size_t>(offset) >= node->_fileSize)
+		COFIBER_RETURN(Error::success);
+	node->_punchHole(offset, std::min(size, node->_fileSize - offset));
+
+	COFIBER_RETURN(Error::success);
+}))
+
 COFIBER_ROUTINE(FutureMaybe<helix::UniqueDescriptor>,
 MemoryFile::accessMemory(off_t offset),
 		([=] {
 	assert(!offset);
 	auto node = static_cast<MemoryNode *>(associatedLink()->getTarget().get());
+
+	// mmap() shares the pages of the memory object directly.
+	node->_share();
 	COFIBER_RETURN(node->_memory.dup());
 }))
 
@@ -3,6 +3,7 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <algorithm>
 #include <iostream>
 
 #include <async/doorbell.hpp>
@@ -24,16 +25,82 @@ struct OpenFile;
 std::map<std::weak_ptr<FsNode>, OpenFile *,
 		std::owner_less<std::weak_ptr<FsNode>>> globalBindMap;
 
+// Receive buffer of a socket. The data of all queued packets is stored back-to-back
+// in a circular buffer; hence, sending a packet does not allocate memory.
+// The buffer grows on demand (sends never block) but it is never shrunk.
+struct RingBuffer {
+	static constexpr size_t initialCapacity = 16 * 1024;
+
+	RingBuffer()
+	: _head{0}, _tail{0} { }
+
+	size_t size() {
+		return _tail - _head;
+	}
+
+	void write(const void *data, size_t length) {
+		if(_tail - _head + length > _buffer.size())
+			_grow(_tail - _head + length);
+
+		auto p = static_cast<const char *>(data);
+		while(length) {
+			auto offset = _tail & (_buffer.size() - 1);
+			auto chunk = std::min(length, _buffer.size() - offset);
+			memcpy(_buffer.data() + offset, p, chunk);
+			p += chunk;
+			length -= chunk;
+			_tail += chunk;
+		}
+	}
+
+	void read(void *data, size_t length) {
+		assert(length <= _tail - _head);
+		auto p = static_cast<char *>(data);
+		while(length) {
+			auto offset = _head & (_buffer.size() - 1);
+			auto chunk = std::min(length, _buffer.size() - offset);
+			memcpy(p, _buffer.data() + offset, chunk);
+			p += chunk;
+			length -= chunk;
+			_head += chunk;
+		}
+	}
+
+	void discard(size_t length) {
+		assert(length <= _tail - _head);
+		_head += length;
+	}
+
+private:
+	void _grow(size_t required) {
+		auto capacity = std::max(_buffer.size(), initialCapacity);
+		while(capacity < required)
+			capacity *= 2;
+
+		std::vector<char> buffer(capacity);
+		auto size = _tail - _head;
+		read(buffer.data(), size);
+		_buffer = std::move(buffer);
+		_head = 0;
+		_tail = size;
+	}
+
+	// Capacity is always a power of two. _head and _tail only increase.
+	std::vector<char> _buffer;
+	uint64_t _head;
+	uint64_t _tail;
+};
+
+// Describes a packet in the RingBuffer. Packet boundaries are preserved for
+// SOCK_SEQPACKET and SOCK_DGRAM; SOCK_STREAM only respects them for ancillary data.
 struct Packet {
 	// Sender process information.
 	int senderPid;
 
-	// The actual octet data that the packet consists of.
-	std::vector<char> buffer;
+	// Number of bytes of the packet that were not received yet.
+	size_t length;
 
 	std::vector<smarter::shared_ptr<File, FileHandle>> files;
-
-	size_t offset = 0;
 };
 
 struct OpenFile : File {
@@ -66,8 +133,8 @@ public:
 				smarter::shared_ptr<File>{file}, &File::fileOperations, file->_cancelServe));
 	}
 
-	OpenFile(Process *process = nullptr)
-	: File{StructName::get("un-socket")}, _currentState{State::null},
+	OpenFile(int type, Process *process = nullptr)
+	: File{StructName::get("un-socket")}, _type{type}, _currentState{State::null},
 			_currentSeq{1}, _inSeq{0}, _ownerPid{0},
 			_remote{nullptr}, _passCreds{false} {
 		if(process)
@@ -80,6 +147,7 @@ public:
 			rf->_currentState = State::remoteShutDown;
 			rf->_stateSeq = ++rf->_currentSeq;
 			rf->_stateBell.ring();
+			rf->notifyStatusObservers();
 			rf->_remote = nullptr;
 			_remote = nullptr;
 		}
@@ -92,22 +160,19 @@ public:
 public:
 	COFIBER_ROUTINE(expected<size_t>,
 	readSome(Process *, void *data, size_t max_length) override, ([=] {
-		assert(_currentState == State::connected);
 		if(logSockets)
 			std::cout << "posix: Read from socket " << this << std::endl;
 
-		while(_recvQueue.empty())
+		while(_recvQueue.empty()) {
+			if(_currentState == State::remoteShutDown)
+				COFIBER_RETURN(0);
+			assert(_currentState == State::connected);
 			COFIBER_AWAIT _statusBell.async_wait();
+		}
 
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
-		auto packet = &_recvQueue.front();
-		assert(!packet->offset);
-		assert(packet->files.empty());
-		auto size = packet->buffer.size();
-		assert(max_length >= size);
-		memcpy(data, packet->buffer.data(), size);
-		_recvQueue.pop_front();
-		COFIBER_RETURN(size);
+		// Like on Linux, files that are not received via recvmsg() are discarded.
+		_recvQueue.front().files.clear();
+		COFIBER_RETURN(_receiveData(data, max_length));
 	}))
 
 	COFIBER_ROUTINE(FutureMaybe<void>,
@@ -117,16 +182,7 @@ public:
 		if(logSockets)
 			std::cout << "posix: Write to socket " << this << std::endl;
 
-		Packet packet;
-		packet.senderPid = process->pid();
-		packet.buffer.resize(length);
-		memcpy(packet.buffer.data(), data, length);
-		packet.offset = 0;
-
-		_remote->_recvQueue.push_back(std::move(packet));
-		_remote->_inSeq = ++_remote->_currentSeq;
-		_remote->_statusBell.ring();
-
+		_remote->_deliver(process->pid(), data, length, {});
 		COFIBER_RETURN();
 	}))
 
@@ -135,10 +191,11 @@ public:
 			void *, size_t, size_t max_ctrl_length) override, ([=] {
 		assert(!(flags & ~(msgNoWait | msgCloseOnExec)));
 
-		if(_currentState == State::remoteShutDown)
+		// Data that was sent before the remote end was closed can still be received.
+		if(_currentState == State::remoteShutDown && _recvQueue.empty())
 			COFIBER_RETURN(RecvResult(0, 0, {}));
 
-		assert(_currentState == State::connected);
+		assert(_currentState == State::connected || _currentState == State::remoteShutDown);
 		if(logSockets)
 			std::cout << "posix: Recv from socket \e[1;34m" << structName() << "\e[0m" << std::endl;
 
@@ -148,8 +205,11 @@ public:
 			COFIBER_RETURN(Error::wouldBlock);
 		}
 
-		while(_recvQueue.empty())
+		while(_recvQueue.empty()) {
+			if(_currentState == State::remoteShutDown)
+				COFIBER_RETURN(RecvResult(0, 0, {}));
 			COFIBER_AWAIT _statusBell.async_wait();
+		}
 
 		auto packet = &_recvQueue.front();
 
@@ -167,9 +227,10 @@ public:
 
 		if(!packet->files.empty()) {
 			if(ctrl.message(SOL_SOCKET, SCM_RIGHTS, sizeof(int) * packet->files.size())) {
-				for(auto &file : packet->files)
-					ctrl.write<int>(process->fileContext()->attachFile(std::move(file),
-							flags & msgCloseOnExec));
+				auto fds = process->fileContext()->attachFiles(std::move(packet->files),
+						flags & msgCloseOnExec);
+				for(auto fd : fds)
+					ctrl.write<int>(fd);
 			}else{
 				throw std::runtime_error("posix: CMSG truncation is not implemented");
 			}
@@ -177,14 +238,8 @@ public:
 			packet->files.clear();
 		}
 
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
-		auto chunk = std::min(packet->buffer.size() - packet->offset, max_length);
-		memcpy(data, packet->buffer.data() + packet->offset, chunk);
-		packet->offset += chunk;
-
-		if(packet->offset == packet->buffer.size())
-			_recvQueue.pop_front();
-		COFIBER_RETURN(RecvResult(chunk, 0, ctrl.buffer()));
+		auto size = _receiveData(data, max_length);
+		COFIBER_RETURN(RecvResult(size, 0, ctrl.buffer()));
 	}))
 
 	COFIBER_ROUTINE(expected<size_t>,
@@ -201,18 +256,7 @@ public:
 			std::cout << "posix: Send to socket \e[1;34m" << structName() << "\e[0m" << std::endl;
 
 		// We ignore msgNoWait here as we never block anyway.
-
-		Packet packet;
-		packet.senderPid = process->pid();
-		packet.buffer.resize(max_length);
-		memcpy(packet.buffer.data(), data, max_length);
-		packet.files = std::move(files);
-		packet.offset = 0;
-
-		_remote->_recvQueue.push_back(std::move(packet));
-		_remote->_inSeq = ++_remote->_currentSeq;
-		_remote->_statusBell.ring();
-
+		_remote->_deliver(process->pid(), data, max_length, std::move(files));
 		COFIBER_RETURN(max_length);
 	}))
 
@@ -228,14 +272,14 @@ public:
 		COFIBER_RETURN();
 	}));
 
-	COFIBER_ROUTINE(async::result<AcceptResult>, accept(Process *process) override, ([=] {
+	COFIBER_ROUTINE(expected<AcceptResult>, accept(Process *process) override, ([=] {
 		assert(!_acceptQueue.empty());
 
 		auto remote = std::move(_acceptQueue.front());
 		_acceptQueue.pop_front();
 
 		// Create a new socket and connect it to the queued one.
-		auto local = smarter::make_shared<OpenFile>(process);
+		auto local = smarter::make_shared<OpenFile>(_type, process);
 		local->setupWeakFile(local);
 		OpenFile::serve(local);
 		connectPair(remote, local.get());
@@ -274,6 +318,10 @@ public:
 		COFIBER_RETURN(PollResult(_currentSeq, edges, events));
 	}))
 
+	bool hasStatusObservers() override {
+		return true;
+	}
+
 	COFIBER_ROUTINE(async::result<void>,
 	bind(Process *process, const void *addr_ptr, size_t addr_length) override, ([=] {
 		// Create a new socket node in the FS.
@@ -328,6 +376,7 @@ public:
 		server->_acceptQueue.push_back(this);
 		server->_inSeq = ++server->_currentSeq;
 		server->_statusBell.ring();
+		server->notifyStatusObservers();
 
 		while(_currentState == State::null)
 			COFIBER_AWAIT _stateBell.async_wait();
@@ -341,6 +390,54 @@ public:
 	}
 
 private:
+	// Appends a packet to the receive queue of this socket.
+	void _deliver(int sender_pid, const void *data, size_t length,
+			std::vector<smarter::shared_ptr<File, FileHandle>> files) {
+		// Empty writes to streams are no-ops but empty datagrams are not.
+		if(_type == SOCK_STREAM && !length && files.empty())
+			return;
+
+		_recvRing.write(data, length);
+		_recvQueue.push_back(Packet{sender_pid, length, std::move(files)});
+		_inSeq = ++_currentSeq;
+		_statusBell.ring();
+		notifyStatusObservers();
+	}
+
+	// Copies data from the receive queue. Streams merge consecutive packets unless
+	// that would mix their ancillary data. Other sockets return exactly one packet;
+	// bytes that do not fit into the buffer are discarded.
+	size_t _receiveData(void *data, size_t max_length) {
+		assert(!_recvQueue.empty());
+		auto sender_pid = _recvQueue.front().senderPid;
+
+		size_t progress = 0;
+		while(!_recvQueue.empty()) {
+			auto packet = &_recvQueue.front();
+			if(progress && (!packet->files.empty()
+					|| (_passCreds && packet->senderPid != sender_pid)))
+				break;
+
+			auto chunk = std::min(packet->length, max_length - progress);
+			_recvRing.read(static_cast<char *>(data) + progress, chunk);
+			packet->length -= chunk;
+			progress += chunk;
+
+			if(_type != SOCK_STREAM) {
+				_recvRing.discard(packet->length);
+				_recvQueue.pop_front();
+				break;
+			}
+			if(packet->length)
+				break;
+			_recvQueue.pop_front();
+		}
+		return progress;
+	}
+
+	// SOCK_STREAM, SOCK_SEQPACKET or SOCK_DGRAM.
+	int _type;
+
 	helix::UniqueLane _passthrough;
 	async::cancellation_event _cancelServe;
 
@@ -358,6 +455,7 @@ private:
 
 	// The actual receive queue of the socket.
 	std::deque<Packet> _recvQueue;
+	RingBuffer _recvRing;
 
 	int _ownerPid;
 
@@ -368,16 +466,17 @@ private:
 	bool _passCreds;
 };
 
-smarter::shared_ptr<File, FileHandle> createSocketFile() {
-	auto file = smarter::make_shared<OpenFile>();
+smarter::shared_ptr<File, FileHandle> createSocketFile(int type) {
+	auto file = smarter::make_shared<OpenFile>(type);
 	file->setupWeakFile(file);
 	OpenFile::serve(file);
 	return File::constructHandle(std::move(file));
 }
 
-std::array<smarter::shared_ptr<File, FileHandle>, 2> createSocketPair(Process *process) {
-	auto file0 = smarter::make_shared<OpenFile>(process);
-	auto file1 = smarter::make_shared<OpenFile>(process);
+std::array<smarter::shared_ptr<File, FileHandle>, 2> createSocketPair(Process *process,
+		int type) {
+	auto file0 = smarter::make_shared<OpenFile>(type, process);
+	auto file1 = smarter::make_shared<OpenFile>(type, process);
 	file0->setupWeakFile(file0);
 	file1->setupWeakFile(file1);
 	OpenFile::serve(file0);
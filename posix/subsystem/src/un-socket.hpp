@@ -3,8 +3,10 @@
 
 namespace un_socket {
 
-smarter::shared_ptr<File, FileHandle> createSocketFile();
-std::array<smarter::shared_ptr<File, FileHandle>, 2> createSocketPair(Process *process);
+// type is one of SOCK_STREAM, SOCK_SEQPACKET and SOCK_DGRAM.
+smarter::shared_ptr<File, FileHandle> createSocketFile(int type);
+std::array<smarter::shared_ptr<File, FileHandle>, 2> createSocketPair(Process *process,
+		int type);
 
 } // namespace un_socket
 
@@ -21,6 +21,9 @@ namespace fs {
 namespace _detail {
 
 struct File {
+	// Returns the passthrough lane of the accepted socket.
+	using AcceptResult = std::variant<Error, helix::UniqueDescriptor>;
+
 	File(helix::UniqueDescriptor lane);
 
 	helix::BorrowedDescriptor getLane() {
@@ -31,10 +34,14 @@ struct File {
 
 	async::result<size_t> readSome(void *data, size_t max_length);
 
+	async::result<Error> writeAll(const void *data, size_t length);
+
 	async::result<PollResult> poll(uint64_t sequence, async::cancellation_token cancellation);
 
 	async::result<helix::UniqueDescriptor> accessMemory(off_t offset);
 
+	async::result<AcceptResult> accept();
+
 private:
 	helix::UniqueDescriptor _lane;
 };
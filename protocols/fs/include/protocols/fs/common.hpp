@@ -11,7 +11,15 @@ enum class Error {
 	none,
 	wouldBlock,
 	illegalArguments,
-	seekOnPipe
+	seekOnPipe,
+	readOnly,
+	noSpaceLeft,
+	addressInUse,
+	connectionRefused,
+	notConnected,
+	brokenPipe,
+	connectionReset,
+	notSupported
 };
 
 using ReadResult = std::variant<Error, size_t>;
@@ -47,13 +47,17 @@ using GetLinkResult = std::tuple<std::shared_ptr<void>, int64_t, FileType>;
 
 using OpenResult = std::pair<helix::UniqueLane, helix::UniqueLane>;
 
+// Returns the passthrough lane of the accepted socket.
+using AcceptResult = std::variant<Error, helix::UniqueLane>;
+
 struct FileOperations {
 	constexpr FileOperations()
 	: seekAbs{nullptr}, seekRel{nullptr}, seekEof{nullptr},
 			read{nullptr}, write{nullptr}, readEntries{nullptr},
-			accessMemory{nullptr}, truncate{nullptr}, fallocate{nullptr},
+			accessMemory{nullptr}, truncate{nullptr}, fallocate{nullptr}, punchHole{nullptr},
 			ioctl{nullptr}, getOption{nullptr}, setOption{nullptr}, poll{nullptr},
-			bind{nullptr}, listen{nullptr}, connect{nullptr}, sockname{nullptr} { }
+			bind{nullptr}, listen{nullptr}, connect{nullptr}, sockname{nullptr},
+			accept{nullptr} { }
 
 	constexpr FileOperations &withSeekAbs(async::result<SeekResult> (*f)(void *object,
 			int64_t offset)) {
@@ -75,7 +79,7 @@ struct FileOperations {
 		read = f;
 		return *this;
 	}
-	constexpr FileOperations &withWrite(async::result<void> (*f)(void *object,
+	constexpr FileOperations &withWrite(async::result<Error> (*f)(void *object,
 			const char *, const void *buffer, size_t length)) {
 		write = f;
 		return *this;
@@ -99,6 +103,11 @@ struct FileOperations {
 		fallocate = f;
 		return *this;
 	}
+	constexpr FileOperations &withPunchHole(async::result<Error> (*f)(void *object,
+			int64_t offset, size_t size)) {
+		punchHole = f;
+		return *this;
+	}
 	constexpr FileOperations &withIoctl(async::result<void> (*f)(void *object,
 			managarm::fs::CntRequest req, helix::UniqueLane conversation)) {
 		ioctl = f;
@@ -119,12 +128,16 @@ struct FileOperations {
 		poll = f;
 		return *this;
 	}
-	constexpr FileOperations &withBind(async::result<void> (*f)(void *object,
+	constexpr FileOperations &withBind(async::result<Error> (*f)(void *object,
 			const char *, const void *addr_ptr, size_t addr_length)) {
 		bind = f;
 		return *this;
 	}
-	constexpr FileOperations &withConnect(async::result<void> (*f)(void *object,
+	constexpr FileOperations &withListen(async::result<Error> (*f)(void *object)) {
+		listen = f;
+		return *this;
+	}
+	constexpr FileOperations &withConnect(async::result<Error> (*f)(void *object,
 			const char *, const void *addr_ptr, size_t addr_length)) {
 		connect = f;
 		return *this;
@@ -134,31 +147,37 @@ struct FileOperations {
 		sockname = f;
 		return *this;
 	}
+	constexpr FileOperations &withAccept(async::result<AcceptResult> (*f)(void *object)) {
+		accept = f;
+		return *this;
+	}
 
 	async::result<SeekResult> (*seekAbs)(void *object, int64_t offset);
 	async::result<SeekResult> (*seekRel)(void *object, int64_t offset);
 	async::result<SeekResult> (*seekEof)(void *object, int64_t offset);
 	async::result<ReadResult> (*read)(void *object, const char *credentials,
 			void *buffer, size_t length);
-	async::result<void> (*write)(void *object, const char *credentials,
+	async::result<Error> (*write)(void *object, const char *credentials,
 			const void *buffer, size_t length);
 	async::result<ReadEntriesResult> (*readEntries)(void *object);
 	async::result<AccessMemoryResult>(*accessMemory)(void *object,
 			uint64_t offset, size_t size);
 	async::result<void> (*truncate)(void *object, size_t size);
 	async::result<void> (*fallocate)(void *object, int64_t offset, size_t size);
+	async::result<Error> (*punchHole)(void *object, int64_t offset, size_t size);
 	async::result<void> (*ioctl)(void *object, managarm::fs::CntRequest req,
 			helix::UniqueLane conversation);
 	async::result<int> (*getOption)(void *object, int option);
 	async::result<void> (*setOption)(void *object, int option, int value);
 	async::result<PollResult> (*poll)(void *object, uint64_t sequence,
 			async::cancellation_token cancellation);
-	async::result<void> (*bind)(void *object, const char *credentials,
+	async::result<Error> (*bind)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
-	async::result<void> (*listen)(void *object);
-	async::result<void> (*connect)(void *object, const char *credentials,
+	async::result<Error> (*listen)(void *object);
+	async::result<Error> (*connect)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 	async::result<size_t> (*sockname)(void *object, void *addr_ptr, size_t max_addr_length);
+	async::result<AcceptResult> (*accept)(void *object);
 };
 
 struct StatusPageProvider {
@@ -184,7 +203,7 @@ struct NodeOperations {
 	async::result<GetLinkResult> (*link)(std::shared_ptr<void> object,
 			std::string name, int64_t ino);
 
-	async::result<void> (*unlink)(std::shared_ptr<void> object,
+	async::result<Error> (*unlink)(std::shared_ptr<void> object,
 			std::string name);
 
 	async::result<OpenResult> (*open)(std::shared_ptr<void> object);
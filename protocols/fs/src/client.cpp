@@ -8,6 +8,28 @@
 namespace protocols {
 namespace fs {
 
+namespace {
+
+Error mapError(managarm::fs::Errors error) {
+	switch(error) {
+	case managarm::fs::Errors::SUCCESS: return Error::none;
+	case managarm::fs::Errors::WOULD_BLOCK: return Error::wouldBlock;
+	case managarm::fs::Errors::ILLEGAL_ARGUMENT: return Error::illegalArguments;
+	case managarm::fs::Errors::ADDRESS_IN_USE: return Error::addressInUse;
+	case managarm::fs::Errors::CONNECTION_REFUSED: return Error::connectionRefused;
+	case managarm::fs::Errors::NOT_CONNECTED: return Error::notConnected;
+	case managarm::fs::Errors::BROKEN_PIPE: return Error::brokenPipe;
+	case managarm::fs::Errors::CONNECTION_RESET: return Error::connectionReset;
+	case managarm::fs::Errors::READ_ONLY: return Error::readOnly;
+	case managarm::fs::Errors::NO_SPACE_LEFT: return Error::noSpaceLeft;
+	case managarm::fs::Errors::NOT_SUPPORTED: return Error::notSupported;
+	default:
+		throw std::runtime_error("libfs_protocol: Unexpected error");
+	}
+}
+
+} // anonymous namespace
+
 File::File(helix::UniqueDescriptor lane)
 : _lane(std::move(lane)) { }
 
@@ -72,6 +94,37 @@ COFIBER_ROUTINE(async::result<size_t>, File::readSome(void *data, size_t max_len
 	COFIBER_RETURN(recv_data.actualLength());
 }))	
 
+COFIBER_ROUTINE(async::result<Error>, File::writeAll(const void *data, size_t length), ([=] {
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::ImbueCredentials imbue_creds;
+	helix::SendBuffer send_data;
+	helix::RecvBuffer recv_resp;
+
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::WRITE);
+	req.set_size(length);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+	auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&imbue_creds, kHelItemChain),
+			helix::action(&send_data, data, length, kHelItemChain),
+			helix::action(&recv_resp, buffer, 128));
+	COFIBER_AWAIT transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(send_data.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	COFIBER_RETURN(mapError(resp.error()));
+}))
+
 COFIBER_ROUTINE(async::result<PollResult>, File::poll(uint64_t sequence,
 		async::cancellation_token cancellation), ([=] {
 	helix::Offer offer;
@@ -142,5 +195,36 @@ COFIBER_ROUTINE(async::result<helix::UniqueDescriptor>, File::accessMemory(off_t
 	COFIBER_RETURN(recv_memory.descriptor());
 }))
 
+COFIBER_ROUTINE(async::result<File::AcceptResult>, File::accept(), ([=] {
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::RecvBuffer recv_resp;
+	helix::PullDescriptor pull_pt;
+
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_ACCEPT);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+	auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&recv_resp, buffer, 128, kHelItemChain),
+			helix::action(&pull_pt));
+	COFIBER_AWAIT transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	// The server only pushes the lane on success; otherwise, it closes the
+	// conversation and the pull fails.
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		COFIBER_RETURN(mapError(resp.error()));
+	HEL_CHECK(pull_pt.error());
+	COFIBER_RETURN(pull_pt.descriptor());
+}))
+
 } } // namespace protocol::fs
 
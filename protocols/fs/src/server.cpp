@@ -15,6 +15,25 @@ namespace fs {
 
 namespace {
 
+managarm::fs::Errors mapError(Error error) {
+	switch(error) {
+	case Error::none: return managarm::fs::Errors::SUCCESS;
+	case Error::wouldBlock: return managarm::fs::Errors::WOULD_BLOCK;
+	case Error::illegalArguments: return managarm::fs::Errors::ILLEGAL_ARGUMENT;
+	case Error::seekOnPipe: return managarm::fs::Errors::SEEK_ON_PIPE;
+	case Error::readOnly: return managarm::fs::Errors::READ_ONLY;
+	case Error::noSpaceLeft: return managarm::fs::Errors::NO_SPACE_LEFT;
+	case Error::addressInUse: return managarm::fs::Errors::ADDRESS_IN_USE;
+	case Error::connectionRefused: return managarm::fs::Errors::CONNECTION_REFUSED;
+	case Error::notConnected: return managarm::fs::Errors::NOT_CONNECTED;
+	case Error::brokenPipe: return managarm::fs::Errors::BROKEN_PIPE;
+	case Error::connectionReset: return managarm::fs::Errors::CONNECTION_RESET;
+	case Error::notSupported: return managarm::fs::Errors::NOT_SUPPORTED;
+	default:
+		throw std::runtime_error("libfs_protocol: Unexpected error");
+	}
+}
+
 COFIBER_ROUTINE(cofiber::no_future, handlePassthrough(smarter::shared_ptr<void> file,
 		const FileOperations *file_ops,
 		managarm::fs::CntRequest req, helix::UniqueLane conversation),
@@ -127,12 +146,12 @@ COFIBER_ROUTINE(cofiber::no_future, handlePassthrough(smarter::shared_ptr<void>
 		HEL_CHECK(recv_buffer.error());
 
 		assert(file_ops->write);
-		COFIBER_AWAIT(file_ops->write(file.get(), extract_creds.credentials(),
+		auto error = COFIBER_AWAIT(file_ops->write(file.get(), extract_creds.credentials(),
 				recv_buffer.data(), recv_buffer.length()));
 
 		helix::SendBuffer send_resp;
 		managarm::fs::SvrResponse resp;
-		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_error(mapError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
@@ -195,11 +214,21 @@ COFIBER_ROUTINE(cofiber::no_future, handlePassthrough(smarter::shared_ptr<void>
 	}else if(req.req_type() == managarm::fs::CntReqType::PT_FALLOCATE) {
 		helix::SendBuffer send_resp;
 
-		assert(file_ops->fallocate);
-		COFIBER_AWAIT file_ops->fallocate(file.get(), req.rel_offset(), req.size());
+		auto error = Error::none;
+		if(req.flags() & managarm::fs::FA_PUNCH_HOLE) {
+			if(file_ops->punchHole) {
+				error = COFIBER_AWAIT file_ops->punchHole(file.get(),
+						req.rel_offset(), req.size());
+			}else{
+				error = Error::notSupported;
+			}
+		}else{
+			assert(file_ops->fallocate);
+			COFIBER_AWAIT file_ops->fallocate(file.get(), req.rel_offset(), req.size());
+		}
 
 		managarm::fs::SvrResponse resp;
-		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_error(mapError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
@@ -273,12 +302,12 @@ COFIBER_ROUTINE(cofiber::no_future, handlePassthrough(smarter::shared_ptr<void>
 		HEL_CHECK(recv_addr.error());
 
 		assert(file_ops->bind);
-		COFIBER_AWAIT(file_ops->bind(file.get(), extract_creds.credentials(),
+		auto error = COFIBER_AWAIT(file_ops->bind(file.get(), extract_creds.credentials(),
 				recv_addr.data(), recv_addr.length()));
 
 		helix::SendBuffer send_resp;
 		managarm::fs::SvrResponse resp;
-		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_error(mapError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
@@ -296,18 +325,60 @@ COFIBER_ROUTINE(cofiber::no_future, handlePassthrough(smarter::shared_ptr<void>
 		HEL_CHECK(recv_addr.error());
 
 		assert(file_ops->connect);
-		COFIBER_AWAIT(file_ops->connect(file.get(), extract_creds.credentials(),
+		auto error = COFIBER_AWAIT(file_ops->connect(file.get(), extract_creds.credentials(),
 				recv_addr.data(), recv_addr.length()));
 
 		helix::SendBuffer send_resp;
 		managarm::fs::SvrResponse resp;
-		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_error(mapError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 				helix::action(&send_resp, ser.data(), ser.size()));
 		COFIBER_AWAIT transmit.async_wait();
 		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_LISTEN) {
+		helix::SendBuffer send_resp;
+
+		assert(file_ops->listen);
+		auto error = COFIBER_AWAIT(file_ops->listen(file.get()));
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(mapError(error));
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		COFIBER_AWAIT transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_ACCEPT) {
+		helix::SendBuffer send_resp;
+		helix::PushDescriptor push_pt;
+
+		assert(file_ops->accept);
+		auto result = COFIBER_AWAIT(file_ops->accept(file.get()));
+
+		managarm::fs::SvrResponse resp;
+		auto error = std::get_if<Error>(&result);
+		if(error) {
+			resp.set_error(mapError(*error));
+
+			auto ser = resp.SerializeAsString();
+			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+					helix::action(&send_resp, ser.data(), ser.size()));
+			COFIBER_AWAIT transmit.async_wait();
+			HEL_CHECK(send_resp.error());
+		}else{
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+
+			auto ser = resp.SerializeAsString();
+			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&push_pt, std::get<helix::UniqueLane>(result)));
+			COFIBER_AWAIT transmit.async_wait();
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(push_pt.error());
+		}
 	}else if(req.req_type() == managarm::fs::CntReqType::PT_SOCKNAME) {
 		helix::SendBuffer send_resp;
 		helix::SendBuffer send_data;
@@ -550,10 +621,10 @@ COFIBER_ROUTINE(cofiber::no_future, serveNode(helix::UniqueLane p, std::shared_p
 		}else if(req.req_type() == managarm::fs::CntReqType::NODE_UNLINK) {
 			helix::SendBuffer send_resp;
 
-			COFIBER_AWAIT node_ops->unlink(node, req.path());
+			auto error = COFIBER_AWAIT node_ops->unlink(node, req.path());
 
 			managarm::fs::SvrResponse resp;
-			resp.set_error(managarm::fs::Errors::SUCCESS);
+			resp.set_error(mapError(error));
 
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
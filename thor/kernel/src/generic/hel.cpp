@@ -203,6 +203,61 @@ HelError helTransferDescriptor(HelHandle handle, HelHandle universe_handle,
 	return kHelErrNone;
 }
 
+HelError helTransferDescriptors(const HelHandle *handles, size_t count,
+		HelHandle universe_handle, HelHandle *out_handles) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	// Bounds the kernel memory that a single call can allocate.
+	if(count > (1 << 16))
+		return kHelErrIllegalArgs;
+
+	// Copy the handles first; we cannot fault while holding the universe locks.
+	frigg::Vector<HelHandle, KernelAlloc> handle_array{*kernelAlloc};
+	handle_array.resize(count);
+	readUserArray(handles, handle_array.data(), count);
+
+	frigg::Vector<AnyDescriptor, KernelAlloc> descriptors{*kernelAlloc};
+	descriptors.resize(count);
+	frigg::SharedPtr<Universe> universe;
+	{
+		auto irq_lock = frigg::guard(&irqMutex());
+		Universe::Guard lock(&this_universe->lock);
+
+		for(size_t i = 0; i < count; i++) {
+			auto descriptor_it = this_universe->getDescriptor(lock, handle_array[i]);
+			if(!descriptor_it)
+				return kHelErrNoDescriptor;
+			descriptors[i] = *descriptor_it;
+		}
+
+		if(universe_handle == kHelThisUniverse) {
+			universe = this_universe.toShared();
+		}else{
+			auto universe_it = this_universe->getDescriptor(lock, universe_handle);
+			if(!universe_it)
+				return kHelErrNoDescriptor;
+			if(!universe_it->is<UniverseDescriptor>())
+				return kHelErrBadDescriptor;
+			universe = universe_it->get<UniverseDescriptor>().universe;
+		}
+	}
+
+	// TODO: make sure the descriptors are copyable.
+
+	// All descriptors are attached while the target universe is locked only once.
+	{
+		auto irq_lock = frigg::guard(&irqMutex());
+		Universe::Guard lock(&universe->lock);
+
+		for(size_t i = 0; i < count; i++)
+			handle_array[i] = universe->attachDescriptor(lock, frigg::move(descriptors[i]));
+	}
+
+	writeUserArray(out_handles, handle_array.data(), count);
+	return kHelErrNone;
+}
+
 HelError helDescriptorInfo(HelHandle handle, HelDescriptorInfo *info) {
 	auto this_thread = getCurrentThread();
 	auto this_universe = this_thread->getUniverse();
@@ -521,6 +521,10 @@ void handleSyscall(SyscallImageAccessor image) {
 				&out_handle);
 		*image.out0() = out_handle;
 	} break;
+	case kHelCallTransferDescriptors: {
+		*image.error() = helTransferDescriptors((const HelHandle *)arg0, (size_t)arg1,
+				(HelHandle)arg2, (HelHandle *)arg3);
+	} break;
 	case kHelCallDescriptorInfo: {
 		*image.error() = helDescriptorInfo((HelHandle)arg0, (HelDescriptorInfo *)arg1);
 	} break;
@@ -0,0 +1,292 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Measures the throughput of the block device stack through a file on a disk-backed
+// file system. Results are printed as key=value pairs so that they can be compared
+// across drivers (ata, ahci, nvme, virtio-blk) and across changes to libblockfs.
+//
+// File pages are cached by the POSIX subsystem; thus, reads only hit the device if
+// the file was not accessed since boot. Write the file once (e.g. with seq-write),
+// reboot and then run the read tests. Writes are only timed until close() returns;
+// they can still be in the page cache at that point.
+//
+// For the random tests, -q emulates the queue depth: that many processes
+// each keep one synchronous request in flight.
+
+namespace {
+
+struct Options {
+	size_t blockSize = 64 * 1024;
+	size_t fileSize = 64 * 1024 * 1024;
+	size_t count = 4096;
+	size_t depth = 1;
+};
+
+Options options;
+
+uint64_t now() {
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts))
+		abort();
+	return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+[[noreturn]] void fail(const char *what) {
+	fprintf(stderr, "blockbench: %s failed: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+void writeAll(int fd, const void *buffer, size_t size) {
+	auto p = static_cast<const char *>(buffer);
+	while(size) {
+		auto chunk = write(fd, p, size);
+		if(chunk < 0) {
+			if(errno == EINTR)
+				continue;
+			fail("write()");
+		}
+		p += chunk;
+		size -= chunk;
+	}
+}
+
+// Returns false on EOF.
+bool readAll(int fd, void *buffer, size_t size) {
+	auto p = static_cast<char *>(buffer);
+	while(size) {
+		auto chunk = read(fd, p, size);
+		if(chunk < 0) {
+			if(errno == EINTR)
+				continue;
+			fail("read()");
+		}
+		if(!chunk)
+			return false;
+		p += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+void report(const char *name, size_t bytes, uint64_t elapsed_ns, size_t operations) {
+	auto seconds = elapsed_ns / 1e9;
+	printf("%s: block=%zu bytes=%zu seconds=%.3f throughput_mib=%.1f iops=%.0f\n",
+			name, options.blockSize, bytes, seconds,
+			bytes / seconds / (1024 * 1024), operations / seconds);
+}
+
+void sequentialWrite(const char *path) {
+	auto fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		fail("open()");
+
+	std::vector<char> buffer(options.blockSize);
+	for(size_t i = 0; i < buffer.size(); i++)
+		buffer[i] = i * 7;
+
+	auto start = now();
+	size_t operations = 0;
+	for(size_t offset = 0; offset < options.fileSize; offset += options.blockSize) {
+		auto chunk = std::min(options.blockSize, options.fileSize - offset);
+		auto written = pwrite(fd, buffer.data(), chunk, offset);
+		if(written < 0)
+			fail("pwrite()");
+		if(size_t(written) != chunk) {
+			fprintf(stderr, "blockbench: Short write\n");
+			exit(1);
+		}
+		operations++;
+	}
+	if(close(fd))
+		fail("close()");
+	report("seq-write", options.fileSize, now() - start, operations);
+}
+
+void sequentialRead(const char *path) {
+	auto fd = open(path, O_RDONLY);
+	if(fd < 0)
+		fail("open()");
+
+	std::vector<char> buffer(options.blockSize);
+	auto start = now();
+	size_t bytes = 0;
+	size_t operations = 0;
+	while(true) {
+		auto chunk = pread(fd, buffer.data(), buffer.size(), bytes);
+		if(chunk < 0)
+			fail("pread()");
+		if(!chunk)
+			break;
+		bytes += chunk;
+		operations++;
+	}
+	auto elapsed = now() - start;
+	close(fd);
+	report("seq-read", bytes, elapsed, operations);
+}
+
+// Performs count accesses at random (block aligned) offsets of a file.
+// Writes the latency of each access to result_fd.
+void randomWorker(bool write, const char *path, size_t num_blocks, size_t count,
+		uint64_t seed, int result_fd) {
+	auto fd = open(path, write ? O_WRONLY : O_RDONLY);
+	if(fd < 0)
+		fail("open()");
+
+	std::vector<char> buffer(options.blockSize, 'x');
+	std::vector<uint64_t> samples;
+	samples.reserve(count);
+	uint64_t state = seed;
+	for(size_t i = 0; i < count; i++) {
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		auto offset = (state % num_blocks) * options.blockSize;
+
+		auto op_start = now();
+		auto chunk = write ? pwrite(fd, buffer.data(), buffer.size(), offset)
+				: pread(fd, buffer.data(), buffer.size(), offset);
+		if(chunk < 0)
+			fail(write ? "pwrite()" : "pread()");
+		samples.push_back(now() - op_start);
+	}
+	if(close(fd))
+		fail("close()");
+
+	writeAll(result_fd, samples.data(), samples.size() * sizeof(uint64_t));
+}
+
+// Runs options.depth worker processes that each keep one request in flight.
+// Fixed seeds make runs comparable.
+void randomAccess(const char *name, bool write, const char *path) {
+	auto fd = open(path, O_RDONLY);
+	if(fd < 0)
+		fail("open()");
+	auto size = lseek(fd, 0, SEEK_END);
+	if(size < 0)
+		fail("lseek()");
+	close(fd);
+	size_t num_blocks = size / options.blockSize;
+	if(!num_blocks) {
+		fprintf(stderr, "blockbench: File is smaller than one block\n");
+		exit(1);
+	}
+
+	// Workers start once the write end of this pipe is closed.
+	int start_pipe[2];
+	if(pipe(start_pipe))
+		fail("pipe()");
+
+	std::vector<pid_t> pids;
+	std::vector<int> result_fds;
+	for(size_t i = 0; i < options.depth; i++) {
+		auto count = options.count / options.depth
+				+ (i < options.count % options.depth ? 1 : 0);
+
+		int result_pipe[2];
+		if(pipe(result_pipe))
+			fail("pipe()");
+		auto pid = fork();
+		if(pid < 0)
+			fail("fork()");
+		if(!pid) {
+			close(start_pipe[1]);
+			close(result_pipe[0]);
+			char dummy;
+			if(read(start_pipe[0], &dummy, 1) < 0)
+				fail("read()");
+			randomWorker(write, path, num_blocks, count,
+					0x9E3779B97F4A7C15 * (i + 1), result_pipe[1]);
+			_exit(0);
+		}
+		close(result_pipe[1]);
+		pids.push_back(pid);
+		result_fds.push_back(result_pipe[0]);
+	}
+	close(start_pipe[0]);
+
+	auto start = now();
+	close(start_pipe[1]);
+
+	std::vector<uint64_t> samples;
+	for(auto result_fd : result_fds) {
+		uint64_t sample;
+		while(readAll(result_fd, &sample, sizeof(uint64_t)))
+			samples.push_back(sample);
+		close(result_fd);
+	}
+	for(auto pid : pids) {
+		int status;
+		if(waitpid(pid, &status, 0) < 0)
+			fail("waitpid()");
+		if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "blockbench: Worker process failed\n");
+			exit(1);
+		}
+	}
+	auto elapsed = now() - start;
+
+	if(samples.size() != options.count) {
+		fprintf(stderr, "blockbench: Missing results from workers\n");
+		exit(1);
+	}
+	report(name, options.count * options.blockSize, elapsed, options.count);
+	std::sort(samples.begin(), samples.end());
+	uint64_t sum = 0;
+	for(auto sample : samples)
+		sum += sample;
+	printf("%s: depth=%zu avg_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+			name, options.depth, sum / 1e3 / samples.size(),
+			samples[samples.size() / 2] / 1e3,
+			samples[samples.size() * 99 / 100] / 1e3, samples.back() / 1e3);
+}
+
+void usage() {
+	fprintf(stderr, "Usage: blockbench [-b block-size] [-S file-size] [-n count] [-q depth]"
+			" seq-write|seq-read|rand-write|rand-read <path>\n");
+	exit(2);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+	int opt;
+	while((opt = getopt(argc, argv, "b:S:n:q:")) != -1) {
+		switch(opt) {
+		case 'b': options.blockSize = strtoul(optarg, nullptr, 10); break;
+		case 'S': options.fileSize = strtoull(optarg, nullptr, 10); break;
+		case 'n': options.count = strtoul(optarg, nullptr, 10); break;
+		case 'q': options.depth = strtoul(optarg, nullptr, 10); break;
+		default: usage();
+		}
+	}
+	if(optind + 2 != argc || !options.blockSize || !options.count || !options.depth)
+		usage();
+
+	std::string test = argv[optind];
+	auto path = argv[optind + 1];
+	if(test == "seq-write") {
+		sequentialWrite(path);
+	}else if(test == "seq-read") {
+		sequentialRead(path);
+	}else if(test == "rand-write") {
+		randomAccess("rand-write", true, path);
+	}else if(test == "rand-read") {
+		randomAccess("rand-read", false, path);
+	}else{
+		usage();
+	}
+	return 0;
+}
@@ -0,0 +1,492 @@
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Measures TCP and UDP throughput and latency over 127.0.0.1.
+// The server side runs in a forked child; sockets are set up before fork() so that
+// no handshake between the processes is necessary.
+//
+// On managarm, run this against drivers/netloop, which serves AF_INET on a loopback
+// device with configurable MTU and loss injection. Results are printed as key=value
+// pairs so that they can be compared across changes to libnet and the socket layer.
+
+namespace {
+
+struct Options {
+	size_t size = 0;
+	size_t count = 0;
+	double duration = 5;
+	uint16_t port = 5201;
+};
+
+Options options;
+
+// Used to recognize retransmissions of UDP control datagrams.
+enum : uint32_t {
+	kUdpData = 1,
+	kUdpEnd = 2,
+	kUdpReport = 3,
+	kUdpPing = 4
+};
+
+struct UdpHeader {
+	uint32_t type;
+	uint32_t seq;
+	uint64_t value;
+};
+
+uint64_t now() {
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts))
+		abort();
+	return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+[[noreturn]] void fail(const char *what) {
+	fprintf(stderr, "netbench: %s failed: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+sockaddr_in loopbackAddress(uint16_t port) {
+	sockaddr_in sa;
+	memset(&sa, 0, sizeof(sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return sa;
+}
+
+void bindTo(int fd, uint16_t port) {
+	auto sa = loopbackAddress(port);
+	if(bind(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sockaddr_in)))
+		fail("bind()");
+}
+
+void connectTo(int fd, uint16_t port) {
+	auto sa = loopbackAddress(port);
+	if(connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sockaddr_in)))
+		fail("connect()");
+}
+
+void writeAll(int fd, const void *buffer, size_t size) {
+	auto p = static_cast<const char *>(buffer);
+	while(size) {
+		auto chunk = write(fd, p, size);
+		if(chunk < 0) {
+			if(errno == EINTR)
+				continue;
+			fail("write()");
+		}
+		p += chunk;
+		size -= chunk;
+	}
+}
+
+// Returns false on EOF.
+bool readAll(int fd, void *buffer, size_t size) {
+	auto p = static_cast<char *>(buffer);
+	while(size) {
+		auto chunk = read(fd, p, size);
+		if(chunk < 0) {
+			if(errno == EINTR)
+				continue;
+			fail("read()");
+		}
+		if(!chunk)
+			return false;
+		p += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+// Waits until fd becomes readable. Returns false on timeout.
+bool waitReadable(int fd, int timeout_ms) {
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	while(true) {
+		auto n = poll(&pfd, 1, timeout_ms);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			fail("poll()");
+		}
+		return n;
+	}
+}
+
+// Runs the server in a child process. The child inherits (and closes) both sockets.
+template<typename F>
+pid_t spawnServer(F server) {
+	auto pid = fork();
+	if(pid < 0)
+		fail("fork()");
+	if(!pid) {
+		server();
+		_exit(0);
+	}
+	return pid;
+}
+
+void joinServer(pid_t pid) {
+	int status;
+	if(waitpid(pid, &status, 0) < 0)
+		fail("waitpid()");
+	if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "netbench: Server process failed\n");
+		exit(1);
+	}
+}
+
+void printLatencies(const char *name, std::vector<uint64_t> &samples, size_t lost) {
+	if(samples.empty()) {
+		printf("%s: size=%zu samples=0 lost=%zu\n", name, options.size, lost);
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	uint64_t total = 0;
+	for(auto sample : samples)
+		total += sample;
+	auto percentile = [&] (size_t p) {
+		return samples[std::min(samples.size() - 1, samples.size() * p / 100)] / 1000.0;
+	};
+	printf("%s: size=%zu samples=%zu lost=%zu min_us=%.1f avg_us=%.1f"
+			" p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+			name, options.size, samples.size(), lost, samples.front() / 1000.0,
+			total / 1000.0 / samples.size(), percentile(50), percentile(99),
+			samples.back() / 1000.0);
+}
+
+// ----------------------------------------------------------------------------
+// TCP tests.
+// ----------------------------------------------------------------------------
+
+// Returns a connected pair of sockets; the server socket is the accepted one.
+std::pair<int, int> tcpPair() {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(listener < 0)
+		fail("socket()");
+	bindTo(listener, options.port);
+	if(listen(listener, 1))
+		fail("listen()");
+
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	if(client < 0)
+		fail("socket()");
+	connectTo(client, options.port);
+
+	int server = accept(listener, nullptr, nullptr);
+	if(server < 0)
+		fail("accept()");
+	close(listener);
+	return {client, server};
+}
+
+// The client streams for the given duration (or count writes of size bytes).
+// Data is sent in rounds of known length; the server acknowledges each round.
+void tcpStream() {
+	size_t size = options.size ? options.size : 64 * 1024;
+	auto fds = tcpPair();
+
+	auto pid = spawnServer([&] {
+		close(fds.first);
+		std::vector<char> buffer(size);
+		uint64_t round_bytes;
+		while(readAll(fds.second, &round_bytes, sizeof(uint64_t))) {
+			uint64_t received = 0;
+			while(received < round_bytes) {
+				auto chunk = read(fds.second, buffer.data(),
+						std::min(uint64_t(size), round_bytes - received));
+				if(chunk < 0 && errno == EINTR)
+					continue;
+				if(chunk <= 0)
+					exit(1);
+				received += chunk;
+			}
+			writeAll(fds.second, &received, sizeof(uint64_t));
+		}
+		close(fds.second);
+	});
+	close(fds.second);
+
+	std::vector<char> buffer(size, 'x');
+	uint64_t limit = options.count * size;
+	auto start = now();
+	auto deadline = start + uint64_t(options.duration * 1e9);
+	uint64_t total = 0;
+	while(limit ? total < limit : now() < deadline) {
+		uint64_t round_bytes = 256 * size;
+		if(limit)
+			round_bytes = std::min(round_bytes, limit - total);
+		writeAll(fds.first, &round_bytes, sizeof(uint64_t));
+		for(uint64_t sent = 0; sent < round_bytes; sent += size)
+			writeAll(fds.first, buffer.data(), std::min(uint64_t(size), round_bytes - sent));
+
+		uint64_t acked;
+		if(!readAll(fds.first, &acked, sizeof(uint64_t)) || acked != round_bytes) {
+			fprintf(stderr, "netbench: Server did not acknowledge the round\n");
+			exit(1);
+		}
+		total += round_bytes;
+	}
+	auto elapsed = (now() - start) / 1e9;
+	close(fds.first);
+	joinServer(pid);
+
+	printf("tcp-stream: size=%zu bytes=%llu seconds=%.3f throughput_mbit=%.1f\n",
+			size, (unsigned long long)total, elapsed, total * 8 / elapsed / 1e6);
+}
+
+// Ping-pong of size bytes; measures the round trip time.
+void tcpRequestResponse() {
+	size_t size = options.size ? options.size : 1;
+	size_t iterations = options.count ? options.count : 10000;
+	auto fds = tcpPair();
+
+	auto pid = spawnServer([&] {
+		close(fds.first);
+		std::vector<char> buffer(size);
+		while(readAll(fds.second, buffer.data(), size))
+			writeAll(fds.second, buffer.data(), size);
+		close(fds.second);
+	});
+	close(fds.second);
+
+	std::vector<char> buffer(size, 'x');
+	std::vector<uint64_t> samples;
+	samples.reserve(iterations);
+	for(size_t i = 0; i < iterations; i++) {
+		auto start = now();
+		writeAll(fds.first, buffer.data(), size);
+		if(!readAll(fds.first, buffer.data(), size)) {
+			fprintf(stderr, "netbench: Server closed the connection\n");
+			exit(1);
+		}
+		samples.push_back(now() - start);
+	}
+	close(fds.first);
+	joinServer(pid);
+
+	options.size = size;
+	printLatencies("tcp-rr", samples, 0);
+}
+
+// ----------------------------------------------------------------------------
+// UDP tests.
+// ----------------------------------------------------------------------------
+
+// Returns two UDP sockets that are connected to each other.
+std::pair<int, int> udpPair() {
+	int client = socket(AF_INET, SOCK_DGRAM, 0);
+	int server = socket(AF_INET, SOCK_DGRAM, 0);
+	if(client < 0 || server < 0)
+		fail("socket()");
+	bindTo(client, options.port + 1);
+	bindTo(server, options.port);
+	connectTo(client, options.port);
+	connectTo(server, options.port + 1);
+	return {client, server};
+}
+
+// The client sends datagrams as fast as possible; the server counts them.
+// Datagrams are dropped by the loss injection of the device and by full socket buffers.
+void udpStream() {
+	size_t size = std::max(options.size ? options.size : 1024, sizeof(UdpHeader));
+	auto fds = udpPair();
+
+	auto pid = spawnServer([&] {
+		close(fds.first);
+		std::vector<char> buffer(std::max(size, size_t(65536)));
+		uint64_t received = 0;
+		uint64_t reordered = 0;
+		uint32_t highest = 0;
+		while(true) {
+			auto chunk = read(fds.second, buffer.data(), buffer.size());
+			if(chunk < 0 && errno == EINTR)
+				continue;
+			if(chunk < ssize_t(sizeof(UdpHeader)))
+				exit(1);
+			UdpHeader header;
+			memcpy(&header, buffer.data(), sizeof(UdpHeader));
+			if(header.type == kUdpData) {
+				received++;
+				if(header.seq < highest)
+					reordered++;
+				highest = std::max(highest, header.seq);
+			}else if(header.type == kUdpEnd) {
+				break;
+			}
+		}
+
+		// The client retransmits kUdpEnd until it sees the report. Once the client
+		// closed its socket, writes and reads may fail with ECONNREFUSED.
+		UdpHeader report{kUdpReport, uint32_t(reordered), received};
+		do {
+			if(write(fds.second, &report, sizeof(UdpHeader)) < 0)
+				break;
+		} while(waitReadable(fds.second, 1000) && read(fds.second, buffer.data(), buffer.size()) >= 0);
+		close(fds.second);
+	});
+	close(fds.second);
+
+	std::vector<char> buffer(size, 'x');
+	auto start = now();
+	auto deadline = start + uint64_t(options.duration * 1e9);
+	uint32_t sent = 0;
+	while(options.count ? sent < options.count : now() < deadline) {
+		UdpHeader header{kUdpData, sent, 0};
+		memcpy(buffer.data(), &header, sizeof(UdpHeader));
+		if(write(fds.first, buffer.data(), size) < 0) {
+			// Some stacks report full buffers instead of dropping silently.
+			if(errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+				continue;
+			fail("write()");
+		}
+		sent++;
+	}
+	auto elapsed = (now() - start) / 1e9;
+
+	UdpHeader report;
+	while(true) {
+		UdpHeader end{kUdpEnd, sent, 0};
+		writeAll(fds.first, &end, sizeof(UdpHeader));
+		if(!waitReadable(fds.first, 100))
+			continue;
+		if(read(fds.first, &report, sizeof(UdpHeader)) == sizeof(UdpHeader)
+				&& report.type == kUdpReport)
+			break;
+	}
+	close(fds.first);
+	joinServer(pid);
+
+	printf("udp-stream: size=%zu sent=%u received=%llu reordered=%u loss_pct=%.2f"
+			" seconds=%.3f send_mbit=%.1f receive_mbit=%.1f\n",
+			size, sent, (unsigned long long)report.value, report.seq,
+			sent ? 100.0 * (sent - report.value) / sent : 0.0,
+			elapsed, sent * size * 8 / elapsed / 1e6,
+			report.value * size * 8 / elapsed / 1e6);
+}
+
+// Ping-pong of datagrams; lost datagrams are detected by a timeout.
+void udpRequestResponse() {
+	size_t size = std::max(options.size ? options.size : sizeof(UdpHeader), sizeof(UdpHeader));
+	size_t iterations = options.count ? options.count : 10000;
+	auto fds = udpPair();
+
+	auto pid = spawnServer([&] {
+		close(fds.first);
+		std::vector<char> buffer(std::max(size, size_t(65536)));
+		while(true) {
+			auto chunk = read(fds.second, buffer.data(), buffer.size());
+			if(chunk < 0 && errno == EINTR)
+				continue;
+			if(chunk < ssize_t(sizeof(UdpHeader)))
+				exit(1);
+			UdpHeader header;
+			memcpy(&header, buffer.data(), sizeof(UdpHeader));
+			if(header.type == kUdpEnd)
+				break;
+			writeAll(fds.second, buffer.data(), chunk);
+		}
+		close(fds.second);
+	});
+	close(fds.second);
+
+	std::vector<char> buffer(size, 'x');
+	std::vector<uint64_t> samples;
+	samples.reserve(iterations);
+	size_t lost = 0;
+	for(uint32_t seq = 0; seq < iterations; seq++) {
+		UdpHeader header{kUdpPing, seq, 0};
+		memcpy(buffer.data(), &header, sizeof(UdpHeader));
+		auto start = now();
+		writeAll(fds.first, buffer.data(), size);
+
+		// Discard late replies to earlier pings.
+		while(true) {
+			if(!waitReadable(fds.first, 200)) {
+				lost++;
+				break;
+			}
+			if(read(fds.first, buffer.data(), size) < ssize_t(sizeof(UdpHeader)))
+				fail("read()");
+			memcpy(&header, buffer.data(), sizeof(UdpHeader));
+			if(header.seq == seq) {
+				samples.push_back(now() - start);
+				break;
+			}
+		}
+	}
+
+	// Datagrams can be lost; the server stops after the first kUdpEnd it sees.
+	for(int i = 0; i < 10; i++) {
+		UdpHeader end{kUdpEnd, 0, 0};
+		if(write(fds.first, &end, sizeof(UdpHeader)) < 0)
+			break;
+	}
+	close(fds.first);
+	joinServer(pid);
+
+	options.size = size;
+	printLatencies("udp-rr", samples, lost);
+}
+
+void usage() {
+	fprintf(stderr, "Usage: netbench [-s size] [-n count] [-t seconds] [-p port]"
+			" tcp-stream|tcp-rr|udp-stream|udp-rr|all\n");
+	exit(2);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+	int opt;
+	while((opt = getopt(argc, argv, "s:n:t:p:")) != -1) {
+		switch(opt) {
+		case 's': options.size = strtoul(optarg, nullptr, 10); break;
+		case 'n': options.count = strtoul(optarg, nullptr, 10); break;
+		case 't': options.duration = strtod(optarg, nullptr); break;
+		case 'p': options.port = strtoul(optarg, nullptr, 10); break;
+		default: usage();
+		}
+	}
+	if(optind + 1 != argc)
+		usage();
+
+	std::string test = argv[optind];
+	auto saved = options;
+	auto run = [&] (const char *name, void (*function)()) {
+		if(test != name && test != "all")
+			return false;
+		options = saved;
+		function();
+		// Use fresh ports for each test; TCP ports may linger in TIME-WAIT.
+		saved.port += 2;
+		return true;
+	};
+
+	bool found = false;
+	found |= run("tcp-stream", &tcpStream);
+	found |= run("tcp-rr", &tcpRequestResponse);
+	found |= run("udp-stream", &udpStream);
+	found |= run("udp-rr", &udpRequestResponse);
+	if(!found)
+		usage();
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <iostream>
+#include <string>
 
 #include <async/jump.hpp>
 #include <helix/memory.hpp>
@@ -114,6 +115,35 @@ COFIBER_ROUTINE(async::result<void>, uploadFile(const char *name), ([=] {
 	COFIBER_RETURN();
 }))
 
+// ----------------------------------------------------------------
+// Device discovery.
+// ----------------------------------------------------------------
+
+async::jump foundDevice;
+
+// Waits until a PCI device of the given class ("ccssii", in hex) appears on mbus.
+COFIBER_ROUTINE(async::result<void>, waitForPciDevice(std::string code), ([=] {
+	if(code.size() != 6)
+		throw std::runtime_error("Expected a PCI class code of the form ccssii");
+
+	auto root = COFIBER_AWAIT mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-class", code.substr(0, 2)),
+		mbus::EqualsFilter("pci-subclass", code.substr(2, 2)),
+		mbus::EqualsFilter("pci-interface", code.substr(4, 2))
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity, mbus::Properties) {
+		foundDevice.trigger();
+	});
+
+	COFIBER_AWAIT root.linkObserver(std::move(filter), std::move(handler));
+	COFIBER_AWAIT foundDevice.async_wait();
+	COFIBER_RETURN();
+}))
+
 // ----------------------------------------------------------------
 // Freestanding mbus functions.
 // ----------------------------------------------------------------
@@ -129,6 +159,17 @@ COFIBER_ROUTINE(cofiber::no_future, asyncMain(const char **args), ([=] {
 
 		COFIBER_AWAIT runServer(args[1]);
 		exit(0);
+	}else if(!strcmp(args[0], "runsvr-pci")) {
+		if(!args[1] || !args[2])
+			throw std::runtime_error("Expected a PCI class code and a server");
+
+		// Drivers are only started if there is hardware for them.
+		COFIBER_AWAIT waitForPciDevice(args[1]);
+		std::cout << "svrctl: Found PCI device " << args[1]
+				<< ", running " << args[2] << std::endl;
+
+		COFIBER_AWAIT runServer(args[2]);
+		exit(0);
 	}else if(!strcmp(args[0], "upload")) {
 		if(!args[1])
 			throw std::runtime_error("Expected at least one argument");